@@ -0,0 +1,143 @@
+/*
+* arena.h - written by ale in milano on 19oct2026
+* per-message bump-pointer allocator
+
+Copyright (C) 2026 Alessandro Vesely
+
+This file is part of zdkimfilter
+
+zdkimfilter is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+zdkimfilter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License version 3
+along with zdkimfilter.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPLv3 section 7:
+
+If you modify zdkimfilter, or any covered part of it, by linking or combining
+it with OpenSSL, OpenDKIM, Sendmail, or any software developed by The Trusted
+Domain Project or Sendmail Inc., containing parts covered by the applicable
+licence, the licensor of zdkimfilter grants you additional permission to convey
+the resulting work.
+*/
+
+#if !defined ARENA_H_INCLUDED
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/*
+* Memory is carved from a chain of blocks and never freed one piece at a
+* time.  arena_reset() rewinds to the first block in O(1), keeping the
+* chain for the next message; arena_clean() frees it.
+*/
+
+typedef union arena_align
+{
+	long double ld;
+	long long ll;
+	void *p;
+} arena_align;
+
+typedef struct arena_block
+{
+	struct arena_block *next;
+	size_t size;
+	arena_align data[];
+} arena_block;
+
+typedef struct arena
+{
+	arena_block *first, *cur;
+	char *p, *end;
+} arena;
+
+#define ARENA_BLOCK 8192
+#define ARENA_ALIGN (sizeof(arena_align))
+
+static inline void *arena_alloc(arena *a, size_t n)
+// aligned like malloc, return NULL on memory fault
+{
+	assert(a);
+
+	n = (n + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	if (a->p == NULL || (size_t)(a->end - a->p) < n)
+	{
+		arena_block *b = a->cur? a->cur->next: a->first;
+		while (b && b->size < n) // skip blocks too small
+			b = b->next;
+		if (b == NULL)
+		{
+			size_t const size = n > ARENA_BLOCK? n: ARENA_BLOCK;
+			if ((b = malloc(sizeof *b + size)) == NULL)
+				return NULL;
+
+			b->size = size;
+			if (a->cur)
+			{
+				b->next = a->cur->next;
+				a->cur->next = b;
+			}
+			else
+			{
+				b->next = a->first;
+				a->first = b;
+			}
+		}
+
+		a->cur = b;
+		a->p = (char*)b->data;
+		a->end = a->p + b->size;
+	}
+
+	void *const r = a->p;
+	a->p += n;
+	return r;
+}
+
+static inline void *arena_calloc(arena *a, size_t n)
+{
+	void *const r = arena_alloc(a, n);
+	if (r)
+		memset(r, 0, n);
+	return r;
+}
+
+static inline char *arena_strdup(arena *a, char const *s)
+{
+	size_t const n = strlen(s) + 1;
+	char *const r = arena_alloc(a, n);
+	if (r)
+		memcpy(r, s, n);
+	return r;
+}
+
+static inline void arena_reset(arena *a)
+{
+	assert(a);
+	a->cur = NULL;
+	a->p = a->end = NULL;
+}
+
+static inline void arena_clean(arena *a)
+{
+	assert(a);
+	while (a->first)
+	{
+		arena_block *const next = a->first->next;
+		free(a->first);
+		a->first = next;
+	}
+	arena_reset(a);
+}
+
+#define ARENA_H_INCLUDED
+#endif
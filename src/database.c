@@ -44,10 +44,13 @@ the resulting work.
 #include <syslog.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/mman.h>
 #if defined HAVE_OPENDBX
 #include <opendbx/api.h>
 #endif // HAVE_OPENDBX
 #include "database.h"
+#include "util.h"
+#include "shmlock.h"
 #include <assert.h>
 
 #if defined TEST_MAIN || defined TEST_ZAG
@@ -61,6 +64,7 @@ static logfun_t do_report = &syslog;
 #if CONSOLE_DEBUG
 static int verbose = 0;
 static int dry_run = 0;
+static unsigned long query_count = 0;
 void set_database_verbose(int v, int d)
 {
 	verbose = v;
@@ -68,6 +72,54 @@ void set_database_verbose(int v, int d)
 }
 #endif
 
+#if defined TEST_MAIN
+#include <sys/stat.h>
+#include "store.h"
+#include "snapshot.h"
+
+static int store_args(int argc, char *argv[], int i, char const *config_file,
+	char const *store, char **dir, time_t *from, time_t *to)
+/*
+* Parse the optional from and to arguments of --store-dump/--store-load,
+* in seconds since the epoch, and get stats_store unless given by --store.
+* return 0 if ok, 1 on error.
+*/
+{
+	*from = 0;
+	*to = time(NULL) + 1;
+	for (int j = 0; j < 2 && i + j < argc && argv[i + j][0] != '-'; ++j)
+	{
+		char *t = NULL;
+		long l = strtol(argv[i + j], &t, 0);
+		if (t == NULL || *t != 0 || l < 0)
+		{
+			printf("Invalid store time %s\n", argv[i + j]);
+			return 1;
+		}
+		if (j)
+			*to = l;
+		else
+			*from = l;
+	}
+
+	if (store)
+		*dir = strdup(store);
+	else
+	{
+		char const *names[1] = {"stats_store"};
+		*dir = NULL;
+		if (*config_file)
+			read_single_values(config_file, 1, names, dir);
+	}
+	if (*dir == NULL)
+	{
+		printf("No stats_store in %s\n", *config_file? config_file: "(none)");
+		return 1;
+	}
+	return 0;
+}
+#endif // TEST_MAIN
+
 #if defined HAVE_OPENDBX
 /*
 * Statements also need to be defined in db_parm_t
@@ -300,6 +352,176 @@ static stmt_compose *stmt_alloc(flags_var *flags, char *src)
 	return stmt;
 }
 
+/*
+* Statements are composed into buffers that grow as needed and are kept
+* across executions.  Escaped values are cached per variable, since the same
+* value is used by several statements of a message.  The cache depends on
+* the connection, whose character set drives escaping.
+*/
+typedef struct sql_buf
+{
+	char *sql;
+	size_t length, alloc;
+} sql_buf;
+
+typedef struct esc_cache
+{
+	char *src, *esc; // a copy of the value, and its escaped form
+	size_t src_len, esc_len, alloc;
+} esc_cache;
+
+/*
+* A db_sql_batch_* statement is a single row INSERT.  Its VALUES tuple is
+* repeated for each row, while head and tail, which cannot use variables,
+* are written once.  Batches are run in enum order, so that rows can refer
+* to rows inserted by earlier batches, using natural keys.
+*/
+#define FIRST_BATCH db_sql_batch_message
+#define TOTAL_BATCHES (total_statements - FIRST_BATCH)
+#define BATCH_MAX_SIZE (512*1024)
+
+typedef int compile_time_check_that_batches_are_last
+	[db_sql_batch_target_ref == total_statements - 1? 1: -1];
+
+typedef struct batch_buf
+{
+	char *head, *tail;
+	sql_buf q; // head and rows so far
+	unsigned rows;
+} batch_buf;
+
+static int batch_split(char const *src, char **head, char **row, char **tail)
+/*
+* Find the tuple following VALUES in src, and split around it.
+* Return 0 and three malloc'ed strings, or -1.
+*/
+{
+	char const *values = NULL, *open = NULL, *close = NULL;
+	int quote = 0, depth = 0;
+	for (char const *p = src; *p; ++p)
+	{
+		int const ch = *(unsigned char const*)p;
+		if (quote)
+		{
+			if (ch == quote)
+				quote = 0;
+			else if (ch == '\\' && p[1])
+				++p;
+		}
+		else if (ch == '\'' || ch == '"' || ch == '`')
+			quote = ch;
+		else if (open)
+		{
+			if (ch == '(')
+				++depth;
+			else if (ch == ')' && --depth == 0)
+			{
+				close = p + 1;
+				break;
+			}
+		}
+		else if (values)
+		{
+			if (ch == '(')
+			{
+				open = p;
+				depth = 1;
+			}
+			else if (!isspace(ch))
+				values = NULL;
+		}
+		else if (strincmp(p, "values", 6) == 0 &&
+			(p == src || !(isalnum((unsigned char)p[-1]) || p[-1] == '_')) &&
+			!(isalnum((unsigned char)p[6]) || p[6] == '_'))
+		{
+			values = p;
+			p += 5;
+		}
+	}
+
+	if (close == NULL ||
+		strstr(close, "$(") != NULL ||
+		memchr(src, '$', open - src) != NULL)
+			return -1;
+
+	*head = strndup(src, open - src);
+	*row = strndup(open, close - open);
+	*tail = strdup(close);
+	if (*head && *row && *tail)
+		return 0;
+
+	free(*head);
+	free(*row);
+	free(*tail);
+	return -1;
+}
+
+/*
+* References of incoming and target domains are cached by name, so that known
+* domains skip db_sql_select_*.  If db_sql_update_*_count is defined, their
+* updates are coalesced as well, and written every db_ref_cache_flush seconds.
+* Entries expire after db_ref_cache_ttl seconds.  The table has a power of two
+* slots; a name can be in any of REF_PROBE slots after its hash, and the least
+* recently used of them is evicted.
+*/
+#define REF_PROBE 8
+
+enum ref_which { ref_domain, ref_target, ref_total };
+
+static const struct ref_stmt
+{
+	stmt_id select, insert, update, count, link;
+	char const *name;
+} ref_stmt[ref_total] =
+{
+	{db_sql_select_domain, db_sql_insert_domain, db_sql_update_domain,
+		db_sql_update_domain_count, db_sql_insert_msg_ref, "domain"},
+	{db_sql_select_target, db_sql_insert_target, db_sql_update_target,
+		db_sql_update_target_count, db_sql_insert_target_ref, "target"}
+};
+
+typedef struct ref_entry
+{
+	char *name, *ref; // a single allocation, ref follows name
+	time_t expire, last_seen;
+	unsigned long used; // clock value at last use
+	unsigned pending; // count not written yet
+} ref_entry;
+
+typedef struct ref_cache
+{
+	ref_entry *slot;
+	size_t mask, entries;
+	unsigned long clock, hits, misses, evictions, invalidations;
+	time_t flush_due; // 0 if no count is pending
+} ref_cache;
+
+/*
+* Per-statement counters live in a shared anonymous mapping, so that the
+* statements run by the children and by the stats writer are all accounted
+* in the parent, which logs them on SIGUSR1.  Latency is bucketed at powers
+* of 4 milliseconds.
+*/
+#define STMT_HIST_SIZE 7
+
+static const unsigned long stmt_hist_bound[STMT_HIST_SIZE - 1] = // usecs
+	{1000, 4000, 16000, 64000, 256000, 1000000};
+static char const * const stmt_hist_name[STMT_HIST_SIZE] =
+	{"1ms", "4ms", "16ms", "64ms", "256ms", "1s", "more"};
+
+typedef struct stmt_counter
+{
+	unsigned long calls, rows, errors;
+	unsigned long long total_us, max_us;
+	unsigned long hist[STMT_HIST_SIZE];
+} stmt_counter;
+
+typedef struct stmt_stats
+{
+	shm_lock lock;
+	stmt_counter c[total_statements];
+} stmt_stats;
+
 //////////////////////////////////////////////////////////////
 // typedef'd in .h
 struct db_work_area
@@ -316,16 +538,46 @@ struct db_work_area
 	char pending_result_msg;
 
 	char is_test;
+	char is_broken; // fatal error, reconnect before next query
+	char stats_lost; // is_broken while running db_set_stats_info
+
+	sql_buf q;
+	esc_cache esc[DB_SQL_VAR_SIZE];
+
+	batch_buf batch[TOTAL_BATCHES];
+	time_t batch_start;
+	unsigned batch_rows; // max rows in any batch
+
+	ref_cache ref[ref_total];
+
+	stmt_stats *stats; // shared, NULL if mmap failed
+	db_redact_fn redact;
+	char const *redact_key;
 };
 
 db_parm_t* db_parm_addr(db_work_area *dwa) { return dwa? &dwa->z: NULL; }
 
+static void esc_clear(db_work_area *dwa)
+{
+	for (int i = 0; i < DB_SQL_VAR_SIZE; ++i)
+	{
+		free(dwa->esc[i].src);
+		memset(&dwa->esc[i], 0, sizeof dwa->esc[i]);
+	}
+}
+
+static void ref_flush(db_work_area *dwa, int force);
+
 void db_clear(db_work_area* dwa)
 {
 	if (dwa)
 	{
 		if (dwa->handle)
 		{
+			if (dwa->batch_rows)
+				db_batch_flush(dwa);
+			ref_flush(dwa, 1);
+
 			int err = odbx_unbind(dwa->handle);
 			if (err)
 				(*do_report)(LOG_ERR, "Error unbinding odbx handle: %s",
@@ -336,10 +588,31 @@ void db_clear(db_work_area* dwa)
 				(*do_report)(LOG_ERR, "Error closing odbx handle: %s",
 					odbx_error(dwa->handle, err));
 		}
+		else if (dwa->is_test)
+			ref_flush(dwa, 1);
+
 		for (int i = 0; i < DB_SQL_VAR_SIZE; ++i)
 			free(dwa->var[i]);
 		for (int i = 0; i < total_statements; ++i)
 			free(dwa->stmt[i]);
+		for (int i = 0; i < TOTAL_BATCHES; ++i)
+		{
+			free(dwa->batch[i].head);
+			free(dwa->batch[i].tail);
+			free(dwa->batch[i].q.sql);
+		}
+		for (int i = 0; i < ref_total; ++i)
+		{
+			ref_cache *const c = &dwa->ref[i];
+			if (c->slot)
+				for (size_t j = 0; j <= c->mask; ++j)
+					free(c->slot[j].name);
+			free(c->slot);
+		}
+		if (dwa->stats)
+			munmap(dwa->stats, sizeof *dwa->stats);
+		esc_clear(dwa);
+		free(dwa->q.sql);
 		free(dwa->user_domain);
 		free(dwa);
 	}
@@ -362,6 +635,17 @@ db_work_area *db_init(void)
 	// options not set will be left alone
 	dwa->z.db_opt_compress = dwa->z.db_opt_multi_statements = -1;
 	dwa->z.db_opt_paged_results = -1;
+	dwa->z.db_slow_query = -1;
+
+	void *const p = mmap(NULL, sizeof *dwa->stats, PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (p != MAP_FAILED)
+	{
+		if (shm_lock_init(&((stmt_stats*)p)->lock) == 0)
+			dwa->stats = p;
+		else
+			munmap(p, sizeof *dwa->stats);
+	}
 	return dwa;
 }
 
@@ -374,6 +658,22 @@ db_work_area *db_init(void)
 					fatal = -1; \
 		} else (void)0
 
+#define BATCH_ALLOC(STMT, BITFLAG) \
+		if (dwa->z.STMT && *dwa->z.STMT) { ++count; \
+			flags_var flags; \
+			set_var_allowed(&flags, BITFLAG, STMT); \
+			batch_buf *const b = &dwa->batch[STMT - FIRST_BATCH]; \
+			char *row = NULL; \
+			if (batch_split(dwa->z.STMT, &b->head, &row, &b->tail)) { \
+				(*do_report)(LOG_ERR, \
+					"%s must be INSERT ... VALUES (...), " \
+					"with variables in the parentheses only", #STMT); \
+				fatal = -1; } \
+			else if ((dwa->stmt[STMT] = stmt_alloc(&flags, row)) == NULL) \
+				fatal = -1; \
+			free(row); \
+		} else (void)0
+
 
 int db_config_wrapup(db_work_area *dwa, int *in, int *out)
 /*
@@ -394,6 +694,10 @@ int db_config_wrapup(db_work_area *dwa, int *in, int *out)
 		STMT_ALLOC(db_sql_domain_flags, org_domain_mask_bit |
 			domain_mask_bit | ip_mask_bit);
 
+		STMT_ALLOC(db_sql_domain_flags_snapshot, snapshot_mark_mask_bit);
+		if (dwa->z.db_flags_snapshot_refresh <= 0)
+			dwa->z.db_flags_snapshot_refresh = 60;
+
 		const var_flag_t common_variables =
 			ino_mask_bit | mtime_mask_bit | pid_mask_bit |
 			date_mask_bit |message_id_mask_bit | subject_mask_bit |
@@ -404,7 +708,7 @@ int db_config_wrapup(db_work_area *dwa, int *in, int *out)
 
 		const var_flag_t message_variables = common_variables |
 			received_count_mask_bit | signatures_count_mask_bit |
-			message_status_mask_bit | adsp_flags_mask_bit |
+			skipped_body_mask_bit | message_status_mask_bit | adsp_flags_mask_bit |
 			dmarc_dkim_mask_bit | dmarc_spf_mask_bit |
 			dmarc_reason_mask_bit | dmarc_dispo_mask_bit;
 
@@ -425,9 +729,20 @@ int db_config_wrapup(db_work_area *dwa, int *in, int *out)
 		STMT_ALLOC(db_sql_update_domain, domain_variables);
 		// domain_ref_variable used to be allowed until v1.2
 
+		// coalesced updates of cached references
+		const var_flag_t count_variables = domain_mask_bit |
+			domain_ref_mask_bit | seen_count_mask_bit | last_seen_mask_bit;
+
+		STMT_ALLOC(db_sql_update_domain_count, count_variables);
+
 		STMT_ALLOC(db_sql_insert_msg_ref, domain_variables |
 			domain_ref_mask_bit | message_ref_mask_bit);
 
+		// batches use natural keys instead of references
+		BATCH_ALLOC(db_sql_batch_message, message_variables);
+		BATCH_ALLOC(db_sql_batch_domain, domain_variables);
+		BATCH_ALLOC(db_sql_batch_msg_ref, domain_variables);
+
 		if (in)
 			*in = count;
 		count = 0;
@@ -456,15 +771,45 @@ int db_config_wrapup(db_work_area *dwa, int *in, int *out)
 			domain_ref_mask_bit;
 
 		STMT_ALLOC(db_sql_update_target, target_dom_variables);
+		STMT_ALLOC(db_sql_update_target_count, count_variables);
 
 		STMT_ALLOC(db_sql_insert_target_ref, target_dom_variables);
 
+		BATCH_ALLOC(db_sql_batch_message_out, outgoing_user_variables);
+		BATCH_ALLOC(db_sql_batch_target, outgoing_variables);
+		BATCH_ALLOC(db_sql_batch_target_ref, outgoing_variables);
+
 		if (out)
 			*out = count;
 		count = 0;
 
 		if (dwa->z.db_timeout <= 0)
 			dwa->z.db_timeout = 2;
+
+		if (dwa->z.db_ref_cache_size > 0)
+		{
+			if (dwa->z.db_ref_cache_ttl <= 0)
+				dwa->z.db_ref_cache_ttl = 3600;
+			if (dwa->z.db_ref_cache_flush <= 0)
+				dwa->z.db_ref_cache_flush = 60;
+
+			size_t size = REF_PROBE;
+			while (size < (size_t)dwa->z.db_ref_cache_size && size < 1U << 24)
+				size <<= 1;
+			for (int i = 0; i < ref_total; ++i)
+			{
+				ref_cache *const c = &dwa->ref[i];
+				if (c->slot)
+					continue;
+				if ((c->slot = calloc(size, sizeof(ref_entry))) == NULL)
+				{
+					(*do_report)(LOG_ALERT, "MEMORY FAULT");
+					fatal = -1;
+					break;
+				}
+				c->mask = size - 1;
+			}
+		}
 	}
 	return fatal;
 }
@@ -498,6 +843,37 @@ int db_zag_wrapup(db_work_area *dwa, int *zag)
 	return fatal;
 }
 
+int db_purge_wrapup(db_work_area *dwa, int *purge)
+{
+	int fatal = -1;
+	if (dwa)
+	{
+		int count = 0;
+		fatal = 0;
+
+		STMT_ALLOC(db_sql_purge_keep, period_end_mask_bit);
+
+		STMT_ALLOC(db_sql_purge_rotate, purge_before_mask_bit);
+
+		const var_flag_t batch_variables =
+			purge_before_mask_bit | purge_batch_mask_bit | purge_after_mask_bit;
+
+		STMT_ALLOC(db_sql_purge_select_in, batch_variables);
+		STMT_ALLOC(db_sql_purge_in, batch_variables | purge_upto_mask_bit);
+		STMT_ALLOC(db_sql_purge_select_out, batch_variables);
+		STMT_ALLOC(db_sql_purge_out, batch_variables | purge_upto_mask_bit);
+
+		if (purge)
+			*purge = count;
+
+		if (dwa->z.db_purge_batch <= 0)
+			dwa->z.db_purge_batch = 1000;
+		if (dwa->z.db_purge_pause <= 0)
+			dwa->z.db_purge_pause = 100;
+	}
+	return fatal;
+}
+
 #undef STMT_ALLOC
 
 static int clear_pending_result(db_work_area* dwa)
@@ -550,6 +926,135 @@ static int clear_pending_result(db_work_area* dwa)
 static const char database_dump[] = "database_dump";
 #endif
 
+void db_set_redact(db_work_area *dwa, db_redact_fn redact, char const *key)
+/*
+* Set the function used to redact personal data in the slow statement log.
+* The key must stay valid as long as dwa.
+*/
+{
+	assert(dwa);
+	dwa->redact = redact;
+	dwa->redact_key = key;
+}
+
+static int stmt_lock(stmt_stats *stats)
+/*
+* Return 0 when locked, -1 on error.  If the holder died, the counters of
+* one call may be half updated, which is good enough for statistics.
+*/
+{
+	return shm_lock_acquire(&stats->lock) < 0? -1: 0;
+}
+
+static void stmt_log_slow(db_work_area *dwa, stmt_id sid,
+	unsigned long long us, unsigned long rows, var_flag_t bitflag)
+/*
+* Log the statement name, the variables it used, and the elapsed time.
+* Personal data is redacted, or omitted if there is no way to redact it.
+*/
+{
+	var_flag_t const personal = local_part_mask_bit | envelope_sender_mask_bit |
+		from_mask_bit | subject_mask_bit | message_id_mask_bit;
+	stmt_compose const *const stmt = dwa->stmt[sid];
+	char buf[1024];
+	size_t len = 0;
+	buf[0] = 0;
+
+	variable_id id = 0;
+	var_flag_t mask = 1, bit;
+	for (bit = bitflag; bit && len < sizeof buf; bit &= ~mask, mask <<= 1, ++id)
+	{
+		char const *var = dwa->var[id];
+		if ((bitflag & mask) == 0 || var == NULL ||
+			stmt == NULL || !var_is_used(&stmt->flags, id))
+				continue;
+
+		char *r = NULL;
+		if (personal & mask)
+		{
+			if (dwa->redact && dwa->redact_key)
+				r = (*dwa->redact)(dwa->redact_key, var);
+			var = r? r: "(redacted)";
+		}
+		len += snprintf(buf + len, sizeof buf - len, "%s%s=%.64s",
+			len? ", ": "", variable_name[id], var);
+		free(r);
+	}
+
+	(*do_report)(LOG_WARNING,
+		"slow statement %s: %.3f secs, %lu rows%s%s%s",
+		stmt_name[sid], us / 1.0e6, rows,
+		len? " (": "", buf, len? ")": "");
+}
+
+static void stmt_account(db_work_area *dwa, stmt_id sid,
+	struct timespec const *start, unsigned long rows, int failed,
+	var_flag_t bitflag)
+/*
+* Update the counters of sid with the time elapsed since start.
+*/
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long long const elapsed = (now.tv_sec - start->tv_sec) * 1000000LL +
+		(now.tv_nsec - start->tv_nsec) / 1000;
+	unsigned long long const us = elapsed > 0? elapsed: 0;
+
+	stmt_stats *const stats = dwa->stats;
+	if (stats && stmt_lock(stats) == 0)
+	{
+		int h = 0;
+		while (h < STMT_HIST_SIZE - 1 && us >= stmt_hist_bound[h])
+			++h;
+
+		stmt_counter *const c = &stats->c[sid];
+		c->calls += 1;
+		c->rows += rows;
+		c->errors += failed != 0;
+		c->total_us += us;
+		if (us > c->max_us)
+			c->max_us = us;
+		c->hist[h] += 1;
+		shm_lock_release(&stats->lock);
+	}
+
+	if (dwa->z.db_slow_query >= 0 &&
+		us >= dwa->z.db_slow_query * 1000ULL)
+			stmt_log_slow(dwa, sid, us, rows, bitflag);
+}
+
+void db_stmt_stats_report(db_work_area *dwa)
+/*
+* Log the counters of the statements that ran at least once;
+* racy reads are good enough here.
+*/
+{
+	assert(dwa);
+
+	stmt_stats const *const stats = dwa->stats;
+	if (stats == NULL)
+		return;
+
+	for (int i = 0; i < total_statements; ++i)
+	{
+		stmt_counter const *const c = &stats->c[i];
+		if (c->calls == 0)
+			continue;
+
+		char hist[STMT_HIST_SIZE * 24];
+		size_t len = 0;
+		for (int h = 0; h < STMT_HIST_SIZE; ++h)
+			len += snprintf(hist + len, sizeof hist - len, " %s:%lu",
+				stmt_hist_name[h], c->hist[h]);
+
+		(*do_report)(LOG_INFO,
+			"%s: %lu calls, %lu rows, %lu errors, "
+			"avg %.3f ms, max %.3f ms, latency%s",
+			stmt_name[i], c->calls, c->rows, c->errors,
+			c->total_us / 1000.0 / c->calls, c->max_us / 1000.0, hist);
+	}
+}
+
 static int dump_vars(db_work_area* dwa, stmt_id sid, var_flag_t bitflag)
 {
 	assert(dwa);
@@ -559,6 +1064,8 @@ static int dump_vars(db_work_area* dwa, stmt_id sid, var_flag_t bitflag)
 	if (stmt == NULL) // db_check_user doesn't check this
 		return 0;
 
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
 #if defined TEST_MAIN
 	FILE *fp = stdout;
 #else
@@ -585,6 +1092,152 @@ static int dump_vars(db_work_area* dwa, stmt_id sid, var_flag_t bitflag)
 		fclose(fp);
 #endif
 	}
+	stmt_account(dwa, sid, &start, 0, 0, bitflag);
+	return 0;
+}
+
+static int sql_reserve(sql_buf *q, size_t more)
+/*
+* Make room for more bytes after length.  return 0, or OTHER_ERROR.
+*/
+{
+	size_t const need = q->length + more;
+	if (need > q->alloc)
+	{
+		size_t alloc = q->alloc? q->alloc: 1024;
+		while (alloc < need)
+			alloc *= 2;
+		char *sql = realloc(q->sql, alloc);
+		if (sql == NULL)
+		{
+			(*do_report)(LOG_ALERT, "MEMORY FAULT");
+			return OTHER_ERROR;
+		}
+		q->sql = sql;
+		q->alloc = alloc;
+	}
+	return 0;
+}
+
+static char const *
+var_escaped(db_work_area *dwa, variable_id id, size_t *len)
+/*
+* Return the escaped value of variable id, and set its length, or return NULL
+* (error logged).  The escaped value remains valid until the variable changes.
+*/
+{
+	esc_cache *const e = &dwa->esc[id];
+	char const *const var = dwa->var[id];
+	size_t const src_len = strlen(var);
+
+	if (e->src && e->src_len == src_len && memcmp(e->src, var, src_len) == 0)
+	{
+		*len = e->esc_len;
+		return e->esc;
+	}
+
+	size_t const need = 3 * src_len + 2;
+	if (need > e->alloc)
+	{
+		char *src = realloc(e->src, need);
+		if (src == NULL)
+		{
+			(*do_report)(LOG_ALERT, "MEMORY FAULT");
+			return NULL;
+		}
+		e->src = src;
+		e->alloc = need;
+	}
+
+	memcpy(e->src, var, src_len);
+	e->src[src_len] = 0;
+	e->esc = e->src + src_len + 1;
+
+	size_t l = 2 * src_len + 1;
+	int err = odbx_escape(dwa->handle, var, src_len, e->esc, &l);
+	if (err || l > 2 * src_len)
+	{
+		(*do_report)(LOG_WARNING,
+			"Bad %s name %.63s (length=%zu) cannot be queried: %s",
+				variable_name[id], var, src_len,
+					err? odbx_error(dwa->handle, err): "escape space exhausted");
+		e->src_len = (size_t)-1; // never matches
+		return NULL;
+	}
+
+	e->esc[l] = 0;
+	e->src_len = src_len;
+	*len = e->esc_len = l;
+	return e->esc;
+}
+
+static void sql_release(db_work_area *dwa, sql_buf *q)
+{
+	if (dwa->q.sql == NULL)
+		dwa->q = *q;
+	else
+		free(q->sql);
+}
+
+static int
+stmt_compose_sql(db_work_area* dwa, stmt_compose const *stmt,
+	var_flag_t bitflag, sql_buf *q, size_t reserve)
+/*
+* Append snippets and escaped variables to q, leaving room for reserve more
+* bytes.  The result is 0-terminated, but q->length doesn't count the 0.
+* return 0, or OTHER_ERROR (error logged).
+*/
+{
+	assert(dwa);
+	assert(dwa->handle);
+	assert(stmt);
+	assert(q);
+
+	char const *arg[DB_SQL_VAR_SIZE];
+	size_t arglen[DB_SQL_VAR_SIZE];
+	memset(arg, 0, sizeof arg);
+
+	size_t length = stmt->length;
+	variable_id id = 0;
+	var_flag_t mask = 1, bit;
+	for (bit = bitflag; bit; bit &= ~mask, mask <<= 1, ++id)
+	{
+		// arg[id] remains NULL for variables that are not actually given,
+		// albeit allowed and used.  They are replaced with an empty string.
+		if ((bitflag & mask) && dwa->var[id] && *dwa->var[id])
+		{
+			int const use = var_is_used(&stmt->flags, id);
+			if (use)
+			{
+				if ((arg[id] = var_escaped(dwa, id, &arglen[id])) == NULL)
+					return OTHER_ERROR;
+
+				length += use * arglen[id];
+			}
+		}
+	}
+
+	if (sql_reserve(q, length + reserve + 1))
+		return OTHER_ERROR;
+
+	char *p = q->sql + q->length;
+	for (uint32_t i = 0; i < stmt->count; ++i)
+	{
+		stmt_part const * const part = &stmt->part[i];
+
+		memcpy(p, part->snippet, part->length);
+		p += part->length;
+
+		variable_id const id = part->id;
+		if (id && arg[id]) // not_used_variable or empty strings don't play
+		{
+			memcpy(p, arg[id], arglen[id]);
+			p += arglen[id];
+		}
+	}
+
+	*p = 0;
+	q->length = p - q->sql;
 	return 0;
 }
 
@@ -636,101 +1289,44 @@ static int stmt_run_n(db_work_area* dwa, stmt_id sid, var_flag_t bitflag,
 		return OTHER_ERROR;
 	}
 
-	size_t arglen[DB_SQL_VAR_SIZE];
-	memset(arglen, 0, sizeof arglen);
+	/*
+	* Take the buffer, as callbacks can run queries.  It is given back at
+	* the end, unless a reentrant call already did so.
+	*/
+	sql_buf q = dwa->q;
+	memset(&dwa->q, 0, sizeof dwa->q);
+	q.length = 0;
 
-	size_t length = 0;
-	variable_id id = 0;
-	var_flag_t mask = 1, bit;
-	for (bit = bitflag; bit; bit &= ~mask, mask <<= 1, ++id)
+	if (stmt_compose_sql(dwa, stmt, bitflag, &q, 0))
 	{
-		if (dwa->var[id] == NULL)
-			bitflag &= ~mask;
-
-		// arglen[id] remains 0 for variables that are not actually given,
-		// albeit allowed and used.  They are replaced with an empty string.
-		else if (bitflag & mask)
-		{
-			int const use = var_is_used(&stmt->flags, id);
-			if (use)
-				length += 2 * use * (arglen[id] = strlen(dwa->var[id]));
-		}
-	}
-
-	size_t alloc = stmt->length + length + 1;
-	char *sql = malloc(alloc), *p = sql, *ep = sql + alloc;
-
-	if (sql == NULL)
-	{
-		(*do_report)(LOG_ALERT, "MEMORY FAULT");
+		sql_release(dwa, &q);
 		return OTHER_ERROR;
 	}
 
-	variable_id last_id = 0;
-	uint32_t i;
-	for (i = 0; i < stmt->count; ++i)
-	{
-		stmt_part const * const part = &stmt->part[i];
-
-		if (part->length)
-		{
-			char *next = p + part->length;
-			if (next >= ep)
-			{
-				(*do_report)(last_id? LOG_WARNING: LOG_CRIT,
-					"Escape space exhausted at step %d, after $(%s)",
-						i, last_id? variable_name[last_id]: "<internal error>");
-				break;
-			}
-
-			memcpy(p, part->snippet, part->length);
-			p = next;
-		}
-
-		variable_id const id = part->id;
-		if (id && arglen[id]) // not_used_variable or empty strings don't play
-		{
-			size_t l = ep - p;
-			int err = odbx_escape(handle, dwa->var[id], arglen[id], p, &l);
-			char *next = p + l;
-			if (err || next >= ep)
-			{
-				(*do_report)(LOG_WARNING,
-					"Bad %s name %.63s (length=%zu) cannot be queried: %s",
-						variable_name[id], dwa->var[id], arglen[id],
-							err? odbx_error(handle, err): "escape space exhausted");
-				break;
-			}
-
-			last_id = id;
-			p = next;
-		}
-	}
-
-	if (i < stmt->count) // error during the loop
-	{
-		free(sql);
-		return OTHER_ERROR;
-	}
-
-	*p = 0;
+	char const *const sql = q.sql;
 
 #if CONSOLE_DEBUG
+	++query_count;
 	if (verbose >= 1)
 		(*do_report)(LOG_DEBUG, "query: %s", sql);
 	if (dry_run)
 	{
-		free(sql);
+		sql_release(dwa, &q);
 		return 0;
 	}
 #endif
 
-	int err = odbx_query(handle, sql, p - sql);
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int err = odbx_query(handle, sql, q.length);
 	if (err != ODBX_ERR_SUCCESS)
 	{
 		(*do_report)(LOG_ERR, "DB error: %s (query: %s)",
 			odbx_error(handle, err), sql);
-		free(sql);
+		if (odbx_error_type(handle, err) < 0)
+			dwa->is_broken = 1;
+		stmt_account(dwa, sid, &start, 0, 1, bitflag);
+		sql_release(dwa, &q);
 		return OTHER_ERROR;
 	}
 
@@ -739,7 +1335,8 @@ static int stmt_run_n(db_work_area* dwa, stmt_id sid, var_flag_t bitflag,
 	* string fields.  We match the columns with the variable arguments.
 	*/
 
-	unsigned long seen = 0;
+	unsigned long seen = 0, affected = 0;
+	int failed = 0;
 	va_list ap;
 	va_start(ap, count);
 
@@ -785,6 +1382,7 @@ static int stmt_run_n(db_work_area* dwa, stmt_id sid, var_flag_t bitflag,
 		if (err == ODBX_RES_NOROWS)
 		{
 			uint64_t rows = odbx_rows_affected(result);
+			affected += rows;
 #if CONSOLE_DEBUG
 			if (verbose >= 2)
 				(*do_report)(rows > 1? LOG_WARNING: LOG_DEBUG,
@@ -912,6 +1510,7 @@ static int stmt_run_n(db_work_area* dwa, stmt_id sid, var_flag_t bitflag,
 		{
 			(*do_report)(LOG_ERR, "DB error: %s (err: %d, %s, part #%d, query: %s)",
 				odbx_error(handle, err), err, stmt_name[sid], r_set, sql);
+			failed = 1;
 			if (result)
 				odbx_result_finish(result);
 			break;
@@ -925,6 +1524,7 @@ static int stmt_run_n(db_work_area* dwa, stmt_id sid, var_flag_t bitflag,
 			dwa->pending_result = time(0);
 			dwa->pending_result_msg = 0;
 			err =  OTHER_ERROR;
+			failed = 1;
 			if (result)
 				odbx_result_finish(result);
 			break;
@@ -935,6 +1535,7 @@ static int stmt_run_n(db_work_area* dwa, stmt_id sid, var_flag_t bitflag,
 			(*do_report)(LOG_CRIT,
 				"Internal error: unexpected rc=%d in part #%d of query %s",
 				err, r_set, stmt_name[sid]);
+			failed = 1;
 			if (result)
 				odbx_result_finish(result);
 			break;
@@ -942,7 +1543,8 @@ static int stmt_run_n(db_work_area* dwa, stmt_id sid, var_flag_t bitflag,
 	}
 
 	va_end(ap);
-	free(sql);
+	stmt_account(dwa, sid, &start, seen + affected, failed, bitflag);
+	sql_release(dwa, &q);
 	return got_result;
 }
 
@@ -1040,6 +1642,820 @@ static inline int stmt_run(db_work_area* dwa, stmt_id sid, var_flag_t bitflag,
 	return stmt_run_n(dwa, sid, bitflag, count, passed);
 }
 
+static int test_purge_keep(db_work_area *dwa, char **keep)
+{
+	// db_sql_purge_keep <SPACE> time, or NULL, or none (no rows), or error
+	char const *const h = dwa->z.db_sql_purge_keep;
+	if (strcmp(h, "error") == 0)
+	{
+		(*do_report)(LOG_ERR, "DB error: test (query: %s)", h);
+		return OTHER_ERROR;
+	}
+
+	if (strcmp(h, "none") == 0)
+		return 0;
+
+	if (strcmp(h, "NULL") != 0)
+		*keep = strdup(h);
+	return 1;
+}
+
+static int test_flags_snapshot(db_work_area *dwa, db_query_cb cb, void *cb_arg)
+{
+	/*
+	* db_sql_domain_flags_snapshot <SPACE> example.com:0:1:1:7 ... | ...;
+	* the n-th run reads the n-th |-separated group, as if the table changed
+	* in between, and returns the rows whose mark is >= snapshot_mark.
+	* error fails.
+	*/
+	static int run;
+	char const *h = dwa->z.db_sql_domain_flags_snapshot;
+	if (strcmp(h, "error") == 0)
+	{
+		(*do_report)(LOG_ERR, "DB error: test (query: %s)", h);
+		return OTHER_ERROR;
+	}
+
+	for (int n = run++; n > 0 && h; --n)
+		if ((h = strchr(h, '|')) != NULL)
+			++h;
+
+	unsigned long long const after =
+		strtoull(dwa->var[snapshot_mark_variable], NULL, 10);
+	int rows = 0;
+	while (h)
+	{
+		while (isspace(*(unsigned char const*)h))
+			++h;
+		size_t const len = strcspn(h, " \t|");
+		if (len == 0)
+			break;
+
+		char row[256];
+		char const *field[5];
+		int ncols = 0;
+		snprintf(row, sizeof row, "%.*s", (int)len, h);
+		for (char *f = row; f && ncols < 5; ++ncols)
+		{
+			field[ncols] = f;
+			if ((f = strchr(f, ':')) != NULL)
+				*f++ = 0;
+		}
+		h += len;
+
+		if (ncols > 4 && strtoull(field[4], NULL, 10) < after)
+			continue;
+
+		int const rc = (*cb)(ncols, field, cb_arg);
+		if (rc)
+			return rc;
+		++rows;
+	}
+
+	return rows;
+}
+
+static int test_purge_select(db_work_area *dwa, stmt_id select,
+	char **upto, char **n)
+{
+	/*
+	* db_sql_purge_select_in <SPACE> key:time key:time ..., in key order;
+	* the batch is the keys after purge_after whose time is before
+	* purge_before.  error fails.
+	*/
+	char const *h = select == db_sql_purge_select_in?
+		dwa->z.db_sql_purge_select_in: dwa->z.db_sql_purge_select_out;
+	if (strcmp(h, "error") == 0)
+	{
+		(*do_report)(LOG_ERR, "DB error: test (query: %s)", h);
+		return OTHER_ERROR;
+	}
+
+	unsigned long const before =
+		strtoul(dwa->var[purge_before_variable], NULL, 10);
+	unsigned long const batch =
+		strtoul(dwa->var[purge_batch_variable], NULL, 10);
+	unsigned long const after =
+		strtoul(dwa->var[purge_after_variable], NULL, 10);
+	unsigned long last = 0, count = 0;
+	while (*h && count < batch)
+	{
+		char *t;
+		unsigned long const key = strtoul(h, &t, 10);
+		if (t == h || *t != ':')
+			break;
+
+		unsigned long const time = strtoul(t + 1, &t, 10);
+		if (key > after && time < before)
+		{
+			last = key;
+			++count;
+		}
+		for (h = t; isspace(*(unsigned char const*)h); ++h)
+			continue;
+	}
+
+	if (count == 0)
+		return 0;
+
+	char buf[MAX_DECIMAL_DIG(sizeof last)];
+	sprintf(buf, "%lu", last);
+	*upto = strdup(buf);
+	sprintf(buf, "%lu", count);
+	*n = strdup(buf);
+	return 2;
+}
+
+static int purge_batches(db_work_area *dwa, stmt_id select, stmt_id del,
+	unsigned long *rows)
+/*
+* Delete old rows in batches of keys.  The select statement returns the last
+* key of the next batch, and optionally its number of rows; the delete
+* statement removes the keys in (purge_after, purge_upto].  Between batches,
+* pause db_purge_pause milliseconds, or as long as the last batch took, so
+* that the filter's inserts are not stalled.
+* return the number of batches, or OTHER_ERROR.
+*/
+{
+	if (dwa->stmt[select] == NULL || dwa->stmt[del] == NULL)
+		return 0;
+
+	var_flag_t const bitflag =
+		purge_before_mask_bit | purge_batch_mask_bit | purge_after_mask_bit;
+	char *after = strdup("0");
+	long pause = 0;
+	int batches = 0;
+
+	while (after)
+	{
+		if (pause)
+		{
+			struct timespec ts;
+			ts.tv_sec = pause / 1000;
+			ts.tv_nsec = pause % 1000 * 1000000;
+			nanosleep(&ts, NULL);
+		}
+
+		char *upto = NULL, *n = NULL;
+		dwa->var[purge_after_variable] = after;
+		int rc;
+		if (dwa->is_test) // need our own rtc for testsuite
+		{
+			dump_vars(dwa, select, bitflag);
+			rc = test_purge_select(dwa, select, &upto, &n);
+		}
+		else
+			rc = stmt_run_n(dwa, select, bitflag, 2, &upto, &n);
+		if (rc < 0 || upto == NULL || *upto == 0 || strcmp(upto, after) == 0)
+		{
+			if (rc < 0)
+				batches = OTHER_ERROR;
+			free(upto);
+			free(n);
+			break;
+		}
+
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		dwa->var[purge_upto_variable] = upto;
+		rc = stmt_run_n(dwa, del, bitflag | purge_upto_mask_bit, 0, NULL);
+		dwa->var[purge_upto_variable] = NULL;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		if (rc < 0)
+		{
+			batches = OTHER_ERROR;
+			free(upto);
+			free(n);
+			break;
+		}
+
+		++batches;
+		if (n)
+		{
+			*rows += strtoul(n, NULL, 10);
+			free(n);
+		}
+		free(after);
+		after = upto;
+
+		pause = (end.tv_sec - start.tv_sec) * 1000 +
+			(end.tv_nsec - start.tv_nsec) / 1000000;
+		if (pause < dwa->z.db_purge_pause)
+			pause = dwa->z.db_purge_pause;
+	}
+
+	dwa->var[purge_after_variable] = NULL;
+	free(after);
+	return batches;
+}
+
+int db_purge(db_work_area *dwa, time_t now)
+/*
+* Delete stats older than db_purge_retention days, except those that
+* db_sql_purge_keep says zaggregate still needs.  Run db_sql_purge_rotate
+* once, then the incoming and outgoing batches.
+* return 0 if ok, OTHER_ERROR otherwise.
+*/
+{
+	assert(dwa);
+
+	if (dwa->z.db_purge_retention <= 0)
+	{
+		(*do_report)(LOG_ERR, "db_purge_retention is not set");
+		return OTHER_ERROR;
+	}
+
+	time_t before = now - (time_t)dwa->z.db_purge_retention * 86400;
+	char buf[MAX_DECIMAL_DIG(sizeof now)];
+
+	if (dwa->stmt[db_sql_purge_keep])
+	{
+		/*
+		* zaggregate rounds period_end down and may run later than
+		* this, so allow a day.
+		*/
+		char *keep = NULL;
+		sprintf(buf, "%ld", (long)(now - 86400));
+		dwa->var[period_end_variable] = buf;
+		int rc;
+		if (dwa->is_test) // need our own rtc for testsuite
+		{
+			dump_vars(dwa, db_sql_purge_keep, period_end_mask_bit);
+			rc = test_purge_keep(dwa, &keep);
+		}
+		else
+			rc = stmt_run(dwa, db_sql_purge_keep, period_end_mask_bit,
+				&keep, NULL);
+		dwa->var[period_end_variable] = NULL;
+		if (rc <= 0)
+		{
+			// a NULL row keeps nothing, but no row at all is a failure
+			if (rc == 0)
+				(*do_report)(LOG_ERR,
+					"db_sql_purge_keep returned no rows, nothing purged");
+			free(keep);
+			return OTHER_ERROR;
+		}
+
+		if (keep && *keep)
+		{
+			char *t = NULL;
+			long long k = strtoll(keep, &t, 10);
+			if (t == NULL || *t != 0 || k < 0)
+			{
+				(*do_report)(LOG_ERR,
+					"db_sql_purge_keep returned %s, not a time", keep);
+				free(keep);
+				return OTHER_ERROR;
+			}
+			if (k < before)
+				before = k;
+		}
+		free(keep);
+	}
+
+	sprintf(buf, "%ld", (long)before);
+	dwa->var[purge_before_variable] = buf;
+	char batch[MAX_DECIMAL_DIG(sizeof dwa->z.db_purge_batch)];
+	sprintf(batch, "%d", dwa->z.db_purge_batch);
+	dwa->var[purge_batch_variable] = batch;
+
+	int rtc = 0;
+	if (stmt_run_n(dwa, db_sql_purge_rotate, purge_before_mask_bit, 0, NULL) < 0)
+		rtc = OTHER_ERROR;
+
+	unsigned long rows_in = 0, rows_out = 0;
+	int const in = purge_batches(dwa,
+		db_sql_purge_select_in, db_sql_purge_in, &rows_in);
+	int const out = in < 0? 0: purge_batches(dwa,
+		db_sql_purge_select_out, db_sql_purge_out, &rows_out);
+	if (in < 0 || out < 0)
+		rtc = OTHER_ERROR;
+
+	dwa->var[purge_before_variable] = dwa->var[purge_batch_variable] = NULL;
+
+	(*do_report)(rtc? LOG_ERR: LOG_INFO,
+		"purge before %ld: %d incoming batch(es), %lu row(s), "
+		"%d outgoing batch(es), %lu row(s)%s",
+			(long)before, in < 0? 0: in, rows_in, out < 0? 0: out, rows_out,
+			rtc? ", stopped on error": "");
+	return rtc;
+}
+
+static size_t ref_hash(char const *name)
+{
+	uint32_t h = 2166136261U; // FNV-1a
+	for (unsigned char const *p = (unsigned char const*)name; *p; ++p)
+		h = (h ^ *p) * 16777619U;
+	return h;
+}
+
+static ref_entry *ref_find(ref_cache *c, char const *name)
+{
+	if (c->slot == NULL)
+		return NULL;
+
+	size_t const h = ref_hash(name);
+	for (int i = 0; i < REF_PROBE; ++i)
+	{
+		ref_entry *const e = &c->slot[(h + i) & c->mask];
+		if (e->name && strcmp(e->name, name) == 0)
+			return e;
+	}
+	return NULL;
+}
+
+static void ref_flush_entry(db_work_area *dwa, int which, ref_entry *e)
+/*
+* Write the pending count of e.  The variables it uses are restored after.
+*/
+{
+	assert(e->pending);
+
+	char count_buf[MAX_DECIMAL_DIG(sizeof e->pending)];
+	char seen_buf[MAX_DECIMAL_DIG(sizeof e->last_seen)];
+	sprintf(count_buf, "%u", e->pending);
+	sprintf(seen_buf, "%ld", (long)e->last_seen);
+
+	variable_id const id[4] = {domain_variable, domain_ref_variable,
+		seen_count_variable, last_seen_variable};
+	char *const value[4] = {e->name, e->ref, count_buf, seen_buf};
+	char *save[4];
+	for (int i = 0; i < 4; ++i)
+	{
+		save[i] = dwa->var[id[i]];
+		dwa->var[id[i]] = value[i];
+	}
+
+	int const rc = stmt_run(dwa, ref_stmt[which].count,
+		domain_mask_bit | domain_ref_mask_bit |
+		seen_count_mask_bit | last_seen_mask_bit, NULL, NULL);
+
+	for (int i = 0; i < 4; ++i)
+		dwa->var[id[i]] = save[i];
+
+	// keep the count for after reconnecting
+	if (rc >= 0 || !dwa->is_broken)
+		e->pending = 0;
+}
+
+static void ref_drop(db_work_area *dwa, int which, ref_entry *e)
+{
+	if (e->pending && (dwa->handle || dwa->is_test) && !dwa->is_broken)
+		ref_flush_entry(dwa, which, e);
+	free(e->name);
+	memset(e, 0, sizeof *e);
+	dwa->ref[which].entries -= 1;
+}
+
+static void ref_flush(db_work_area *dwa, int force)
+/*
+* Write pending counts, if due or if force.
+*/
+{
+	time_t const now = time(NULL);
+	for (int i = 0; i < ref_total; ++i)
+	{
+		ref_cache *const c = &dwa->ref[i];
+		if (c->flush_due == 0 || (!force && now < c->flush_due))
+			continue;
+
+		for (size_t j = 0; j <= c->mask; ++j)
+		{
+			if ((dwa->handle == NULL && !dwa->is_test) || dwa->is_broken)
+				return;
+			if (c->slot[j].pending)
+				ref_flush_entry(dwa, i, &c->slot[j]);
+		}
+		c->flush_due = 0;
+	}
+}
+
+static void ref_store(db_work_area *dwa, int which,
+	char const *name, char const *ref)
+/*
+* Cache a reference, evicting the least recently used entry in its window.
+*/
+{
+	ref_cache *const c = &dwa->ref[which];
+	if (c->slot == NULL)
+		return;
+
+	size_t const h = ref_hash(name);
+	ref_entry *e = NULL;
+	for (int i = 0; i < REF_PROBE; ++i)
+	{
+		ref_entry *const f = &c->slot[(h + i) & c->mask];
+		if (f->name == NULL)
+		{
+			e = f;
+			break;
+		}
+		if (e == NULL || f->used < e->used)
+			e = f;
+	}
+
+	if (e->name)
+	{
+		ref_drop(dwa, which, e);
+		c->evictions += 1;
+	}
+
+	size_t const name_len = strlen(name) + 1, ref_len = strlen(ref) + 1;
+	if ((e->name = malloc(name_len + ref_len)) == NULL)
+		return; // not cached
+
+	memcpy(e->name, name, name_len);
+	e->ref = e->name + name_len;
+	memcpy(e->ref, ref, ref_len);
+	e->expire = time(NULL) + dwa->z.db_ref_cache_ttl;
+	e->used = ++c->clock;
+	c->entries += 1;
+}
+
+static void ref_invalidate(db_work_area *dwa, int which)
+/*
+* Forget the reference of the domain variable.  The row may have been deleted.
+*/
+{
+	ref_cache *const c = &dwa->ref[which];
+	ref_entry *const e = ref_find(c, dwa->var[domain_variable]);
+	if (e)
+	{
+		if (e->pending) // the caller counts it again
+			e->pending -= 1;
+		ref_drop(dwa, which, e);
+		c->invalidations += 1;
+	}
+}
+
+static int test_select_ref(db_work_area *dwa, int which, char **ref)
+{
+	/*
+	* db_sql_select_domain <SPACE> example.com:17 example.org:18 ...;
+	* the reference of the domain variable, if listed.  Same for targets.
+	*/
+	char const *h = which == ref_domain?
+		dwa->z.db_sql_select_domain: dwa->z.db_sql_select_target;
+	char const *const name = dwa->var[domain_variable];
+	size_t const len = strlen(name);
+	while (*h)
+	{
+		size_t const tok = strcspn(h, " \t");
+		if (tok > len && h[len] == ':' && strncmp(h, name, len) == 0)
+		{
+			*ref = strndup(h + len + 1, tok - len - 1);
+			return 1;
+		}
+		h += tok;
+		while (isspace(*(unsigned char const*)h))
+			++h;
+	}
+	return 0;
+}
+
+static int select_ref(db_work_area *dwa, int which, var_flag_t bitflag,
+	char **ref)
+{
+	stmt_id const select = ref_stmt[which].select;
+	if (dwa->is_test && dwa->stmt[select]) // need our own rtc for testsuite
+	{
+		dump_vars(dwa, select, bitflag);
+		return test_select_ref(dwa, which, ref);
+	}
+	return stmt_run(dwa, select, bitflag, ref, NULL);
+}
+
+static int get_ref(db_work_area *dwa, int which, var_flag_t *bitflag)
+/*
+* Set domain_ref for the domain variable.  If cached, just update the domain,
+* possibly by coalescing the count.  Otherwise query it.  If not found,
+* insert it, and possibly query it again so as to have a reference.  If
+* found, update it.
+*
+* return 1 if the reference was cached, 0 if not, or OTHER_ERROR.
+*/
+{
+	assert(dwa);
+	assert(dwa->var[domain_variable]);
+
+	struct ref_stmt const *const s = &ref_stmt[which];
+	ref_cache *const c = &dwa->ref[which];
+	char const *const name = dwa->var[domain_variable];
+	*bitflag &= ~domain_ref_mask_bit;
+
+	ref_entry *e = ref_find(c, name);
+	if (e && e->expire <= time(NULL))
+	{
+		ref_drop(dwa, which, e);
+		e = NULL;
+	}
+
+	if (e)
+	{
+		char *domain_ref = strdup(e->ref);
+		if (domain_ref == NULL)
+		{
+			(*do_report)(LOG_ALERT, "MEMORY FAULT");
+			return OTHER_ERROR;
+		}
+
+		c->hits += 1;
+		e->used = ++c->clock;
+		free(dwa->var[domain_ref_variable]);
+		dwa->var[domain_ref_variable] = domain_ref;
+		*bitflag |= domain_ref_mask_bit;
+
+		if (dwa->stmt[s->count])
+		{
+			time_t const now = time(NULL);
+			e->last_seen = now;
+			e->pending += 1;
+			if (c->flush_due == 0)
+				c->flush_due = now + dwa->z.db_ref_cache_flush;
+		}
+		else
+			stmt_run(dwa, s->update, *bitflag, NULL, NULL);
+		return 1;
+	}
+
+	if (c->slot)
+		c->misses += 1;
+
+	int selected = 1;
+	char *domain_ref = NULL;
+	int rc = select_ref(dwa, which, *bitflag, &domain_ref);
+	if (rc < 0)
+		return rc;
+
+	if (domain_ref == NULL)
+	{
+		selected = 0;
+		rc = stmt_run(dwa, s->insert, *bitflag, &domain_ref, NULL);
+		if (rc < 0)
+			return rc;
+
+		if (domain_ref == NULL)
+			select_ref(dwa, which, *bitflag, &domain_ref);
+	}
+
+	if (domain_ref)
+	{
+		free(dwa->var[domain_ref_variable]);
+		dwa->var[domain_ref_variable] = domain_ref;
+		*bitflag |= domain_ref_mask_bit;
+		ref_store(dwa, which, name, domain_ref);
+	}
+
+	if (selected)
+		stmt_run(dwa, s->update, *bitflag, NULL, NULL);
+
+	return 0;
+}
+
+static void link_ref(db_work_area *dwa, int which, var_flag_t bitflag)
+/*
+* Get the reference and run the linking statement.  A cached reference whose
+* link fails is invalidated and tried once more.
+*/
+{
+	int const cached = get_ref(dwa, which, &bitflag);
+	if (cached < 0)
+		return;
+
+	stmt_id const link = ref_stmt[which].link;
+	if (stmt_run(dwa, link, bitflag, NULL, NULL) < 0 &&
+		cached && !dwa->is_broken)
+	{
+		ref_invalidate(dwa, which);
+		if (get_ref(dwa, which, &bitflag) >= 0)
+			stmt_run(dwa, link, bitflag, NULL, NULL);
+	}
+}
+
+void db_ref_cache_report(db_work_area *dwa)
+/*
+* Log usage and hit rate of the reference caches, if enabled.
+*/
+{
+	assert(dwa);
+
+	for (int i = 0; i < ref_total; ++i)
+	{
+		ref_cache const *const c = &dwa->ref[i];
+		if (c->slot == NULL)
+			continue;
+
+		unsigned long const lookups = c->hits + c->misses;
+		(*do_report)(LOG_INFO,
+			"%s ref cache: %zu/%zu entries, %lu hits, %lu misses "
+			"(%.1f%% hit rate), %lu evictions, %lu invalidations",
+			ref_stmt[i].name, c->entries, c->mask + 1, c->hits, c->misses,
+			lookups? 100.0 * c->hits / lookups: 0.0,
+			c->evictions, c->invalidations);
+	}
+}
+
+static int batch_add(db_work_area* dwa, stmt_id sid, var_flag_t bitflag)
+/*
+* Append a row to the batch of sid.  Rows are run by db_batch_flush().
+* return 0, or OTHER_ERROR.
+*/
+{
+	assert(dwa);
+	assert(sid >= FIRST_BATCH && sid < total_statements);
+
+	stmt_compose const *const stmt = dwa->stmt[sid];
+	if (stmt == NULL)
+		return 0;
+
+	if (dwa->is_test)
+		return dump_vars(dwa, sid, bitflag);
+
+	if (dwa->handle == NULL)
+	{
+		(*do_report)(LOG_CRIT, "Internal error: not connected");
+		return OTHER_ERROR;
+	}
+
+	batch_buf *const b = &dwa->batch[sid - FIRST_BATCH];
+	size_t const length = b->q.length;
+	if (b->rows == 0)
+	{
+		size_t const head = strlen(b->head);
+		b->q.length = 0;
+		if (sql_reserve(&b->q, head))
+			return OTHER_ERROR;
+		memcpy(b->q.sql, b->head, head);
+		b->q.length = head;
+	}
+	else
+	{
+		if (sql_reserve(&b->q, 1))
+			return OTHER_ERROR;
+		b->q.sql[b->q.length++] = ',';
+	}
+
+	if (stmt_compose_sql(dwa, stmt, bitflag, &b->q, strlen(b->tail)))
+	{
+		b->q.length = length; // drop this row
+		return OTHER_ERROR;
+	}
+
+	if (dwa->batch_rows == 0)
+		dwa->batch_start = time(NULL);
+	if (++b->rows > dwa->batch_rows)
+		dwa->batch_rows = b->rows;
+	return 0;
+}
+
+static int discard_results(db_work_area *dwa)
+/*
+* Consume the results of a batch.  return 0, or OTHER_ERROR.
+*/
+{
+	for (;;)
+	{
+		odbx_result_t *result = NULL;
+		struct timeval timeout;
+		timeout.tv_sec = dwa->z.db_timeout;
+		timeout.tv_usec = 0;
+
+		int err = odbx_result(dwa->handle, &result, &timeout, 0 /* chunk */);
+		if (result)
+			odbx_result_finish(result);
+
+		if (err == ODBX_RES_DONE)
+			return 0;
+
+		if (err == ODBX_RES_TIMEOUT)
+		{
+			(*do_report)(LOG_ERR,
+				"DB timeout: %d secs is too low? (batch)", dwa->z.db_timeout);
+			dwa->pending_result = time(0);
+			dwa->pending_result_msg = 0;
+			return OTHER_ERROR;
+		}
+
+		if (err < 0)
+		{
+			(*do_report)(LOG_ERR, "DB error: %s (batch)",
+				odbx_error(dwa->handle, err));
+			if (odbx_error_type(dwa->handle, err) < 0)
+				dwa->is_broken = 1;
+			return OTHER_ERROR;
+		}
+	}
+}
+
+int db_batch_flush(db_work_area *dwa)
+/*
+* Run pending batches, in order.  If the connection broke, rows are kept for
+* the next attempt, otherwise rows that failed are dropped.
+* return the number of rows not written.
+*/
+{
+	assert(dwa);
+
+	int failed = 0;
+	for (int i = 0; i < TOTAL_BATCHES; ++i)
+	{
+		batch_buf *const b = &dwa->batch[i];
+		if (b->rows == 0)
+			continue;
+
+		if (failed == 0 && dwa->handle && !dwa->is_broken &&
+			clear_pending_result(dwa) == 0)
+		{
+			strcpy(b->q.sql + b->q.length, b->tail);
+			size_t const len = b->q.length + strlen(b->tail);
+#if CONSOLE_DEBUG
+			++query_count;
+			if (verbose >= 1)
+				(*do_report)(LOG_DEBUG, "query: %s", b->q.sql);
+			if (dry_run)
+			{
+				b->rows = 0;
+				continue;
+			}
+#endif
+			struct timespec start;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			int err = odbx_query(dwa->handle, b->q.sql, len);
+			if (err == ODBX_ERR_SUCCESS)
+				err = discard_results(dwa);
+			else
+			{
+				(*do_report)(LOG_ERR, "DB error: %s (%s, %u rows)",
+					odbx_error(dwa->handle, err), stmt_name[FIRST_BATCH + i],
+					b->rows);
+				if (odbx_error_type(dwa->handle, err) < 0)
+					dwa->is_broken = 1;
+			}
+			stmt_account(dwa, FIRST_BATCH + i, &start, b->rows,
+				err != ODBX_ERR_SUCCESS, 0);
+
+			if (err == ODBX_ERR_SUCCESS)
+			{
+				b->rows = 0;
+				continue;
+			}
+		}
+
+		failed += b->rows;
+		if (!dwa->is_broken)
+		{
+			(*do_report)(LOG_ERR, "%u rows of %s not written",
+				b->rows, stmt_name[FIRST_BATCH + i]);
+			b->rows = 0;
+		}
+	}
+
+	dwa->batch_rows = 0;
+	for (int i = 0; i < TOTAL_BATCHES; ++i)
+		if (dwa->batch[i].rows > dwa->batch_rows)
+			dwa->batch_rows = dwa->batch[i].rows;
+
+	ref_flush(dwa, 0);
+	return failed;
+}
+
+int db_batch_due(db_work_area *dwa)
+/*
+* return the number of seconds before pending batches or coalesced counts
+* should be flushed, 0 if they should be flushed now, or -1 if there is
+* nothing pending.
+*/
+{
+	assert(dwa);
+
+	time_t const now = time(NULL);
+	int due = -1;
+	for (int i = 0; i < ref_total; ++i)
+		if (dwa->ref[i].flush_due)
+		{
+			int const left = dwa->ref[i].flush_due > now?
+				(int)(dwa->ref[i].flush_due - now): 0;
+			if (due < 0 || left < due)
+				due = left;
+		}
+
+	if (dwa->batch_rows == 0)
+		return due;
+
+	if (dwa->z.db_batch_rows > 0 && dwa->batch_rows >= (unsigned)dwa->z.db_batch_rows)
+		return 0;
+
+	for (int i = 0; i < TOTAL_BATCHES; ++i)
+		if (dwa->batch[i].q.length > BATCH_MAX_SIZE)
+			return 0;
+
+	time_t const elapsed = now - dwa->batch_start;
+	int const left = elapsed >= dwa->z.db_batch_window? 0:
+		(int)(dwa->z.db_batch_window - elapsed);
+	return due >= 0 && due < left? due: left;
+}
+
 static inline int do_set_option(odbx_t *handle,
 	int code, int value, char const *opt, char const *opt_name)
 /*
@@ -1376,6 +2792,9 @@ char *db_check_user(db_work_area* dwa)
 	if (dwa == NULL || dwa->var[local_part_variable] == NULL)
 		return NULL;
 
+	if (dwa->batch_rows) // check the current message too
+		db_batch_flush(dwa);
+
 	var_flag_t bitflag = local_part_mask_bit;
 	if (dwa->user_domain)
 	{
@@ -1552,26 +2971,11 @@ static char*date_convert(char const *date)
 	char buf[80];
 	sprintf(buf, "%04d-%02d-%02d %02d:%02d:%02d",
 		tm.tm_year + 1900, tm.tm_mday, tm.tm_mon + 1,
-		tm.tm_hour, tm.tm_min, tm.tm_sec);
-	return strdup(buf);
-}
-#endif
-
-
-static char *get_spf_result(spf_result r)
-{
-	switch (r)
-	{
-		default:
-		case spf_none: return "none";
-		case spf_fail: return "fail";
-		case spf_permerror: return "permerror";
-		case spf_temperror: return "temperror";
-		case spf_neutral: return "neutral";
-		case spf_softfail: return "softfail";
-		case spf_pass: return "pass";
-	}
+		tm.tm_hour, tm.tm_min, tm.tm_sec);
+	return strdup(buf);
 }
+#endif
+
 
 static void comma_copy(char *buf, char const *value, int *comma)
 {
@@ -1638,8 +3042,13 @@ in_stmt_run(db_work_area* dwa, var_flag_t bitflag, stats_info *info)
 
 #undef CONST_STRING
 
+	int const batch = dwa->stmt[db_sql_batch_message] != NULL ||
+		dwa->stmt[db_sql_batch_domain] != NULL ||
+		dwa->stmt[db_sql_batch_msg_ref] != NULL;
+
 	char *var = NULL;
-	int rc = stmt_run(dwa, db_sql_insert_message, bitflag, &var, NULL);
+	int rc = batch? batch_add(dwa, db_sql_batch_message, bitflag):
+		stmt_run(dwa, db_sql_insert_message, bitflag, &var, NULL);
 
 	if ((dwa->var[message_ref_variable] = var) != NULL)
 		bitflag |= message_ref_mask_bit;
@@ -1744,7 +3153,8 @@ in_stmt_run(db_work_area* dwa, var_flag_t bitflag, stats_info *info)
 			else if (info->pst)
 			// get prefix_len of non-aligned domains, just for info
 			{
-				char *od = org_domain(info->pst, dps->name);
+				char buf[256];
+				char *od = org_domain_buf(info->pst, dps->name, buf, sizeof buf);
 				if (od)
 				{
 					size_t sublen = strlen(dps->name),
@@ -1754,7 +3164,6 @@ in_stmt_run(db_work_area* dwa, var_flag_t bitflag, stats_info *info)
 						sprintf(prefix_len_buf, "%zu", sublen - od_len);
 						bitflag |= prefix_len_mask_bit;
 					}
-					free(od);
 				}
 			}
 #endif
@@ -1787,34 +3196,14 @@ in_stmt_run(db_work_area* dwa, var_flag_t bitflag, stats_info *info)
 			dwa->var[domain_variable] = dps->name;
 			bitflag &= ~domain_ref_mask_bit;
 
-			int selected = 1;
-			char *domain_ref = NULL;
-			rc = stmt_run(dwa, db_sql_select_domain, bitflag, &domain_ref, NULL);
-			if (rc < 0)
-				continue;
-
-			if (domain_ref == NULL)
+			if (batch)
 			{
-				selected = 0;
-				rc = stmt_run(dwa, db_sql_insert_domain, bitflag, &domain_ref, NULL);
-				if (rc < 0)
-					continue;
-
-				if (domain_ref == NULL)
-					stmt_run(dwa, db_sql_select_domain, bitflag, &domain_ref, NULL);
-			}
-
-			if (domain_ref)
-			{
-				free(dwa->var[domain_ref_variable]);
-				dwa->var[domain_ref_variable] = domain_ref;
-				bitflag |= domain_ref_mask_bit;
+				batch_add(dwa, db_sql_batch_domain, bitflag);
+				batch_add(dwa, db_sql_batch_msg_ref, bitflag);
+				continue;
 			}
 
-			if (selected)
-				stmt_run(dwa, db_sql_update_domain, bitflag, NULL, NULL);
-
-			stmt_run(dwa, db_sql_insert_msg_ref, bitflag, NULL, NULL);
+			link_ref(dwa, ref_domain, bitflag);
 		}
 	}
 	return zeroflag;
@@ -1830,6 +3219,25 @@ out_stmt_run(db_work_area* dwa, var_flag_t bitflag, stats_info *info)
 
 	bitflag |= local_part_mask_bit | domain_mask_bit;
 	dwa->var[domain_variable] = dwa->user_domain;
+
+	if (dwa->stmt[db_sql_batch_message_out] != NULL ||
+		dwa->stmt[db_sql_batch_target] != NULL ||
+		dwa->stmt[db_sql_batch_target_ref] != NULL)
+	{
+		if (batch_add(dwa, db_sql_batch_message_out, bitflag) == 0)
+		{
+			bitflag &= ~local_part_mask_bit;
+			for (domain_prescreen *dps = info->domain_head;
+				dps != NULL; dps = dps->next)
+			{
+				dwa->var[domain_variable] = dps->name;
+				batch_add(dwa, db_sql_batch_target, bitflag);
+				batch_add(dwa, db_sql_batch_target_ref, bitflag);
+			}
+		}
+		return zeroflag;
+	}
+
 	char *user_ref = NULL, *message_ref = NULL;
 	stmt_run_n(dwa, db_sql_select_user, bitflag, 2, &user_ref, &message_ref);
 
@@ -1850,37 +3258,7 @@ out_stmt_run(db_work_area* dwa, var_flag_t bitflag, stats_info *info)
 			dps != NULL; dps = dps->next)
 		{
 			dwa->var[domain_variable] = dps->name;
-			bitflag &= ~domain_ref_mask_bit;
-
-			int selected = 1;
-			char *domain_ref = NULL;
-			int rc =
-				stmt_run(dwa, db_sql_select_target, bitflag, &domain_ref, NULL);
-			if (rc < 0)
-				continue;
-
-			if (domain_ref == NULL)
-			{
-				selected = 0;
-				rc = stmt_run(dwa, db_sql_insert_target, bitflag, &domain_ref, NULL);
-				if (rc < 0)
-					continue;
-
-				if (domain_ref == NULL)
-					stmt_run(dwa, db_sql_select_target, bitflag, &domain_ref, NULL);
-			}
-
-			if (domain_ref)
-			{
-				free(dwa->var[domain_ref_variable]);
-				dwa->var[domain_ref_variable] = domain_ref;
-				bitflag |= domain_ref_mask_bit;
-			}
-
-			if (selected)
-				stmt_run(dwa, db_sql_update_target, bitflag, NULL, NULL);
-
-			stmt_run(dwa, db_sql_insert_target_ref, bitflag, NULL, NULL);
+			link_ref(dwa, ref_target, bitflag);
 		}
 	}
 
@@ -1975,7 +3353,7 @@ void db_set_stats_info(db_work_area* dwa, stats_info *info)
 	// we assume no number takes more than 10 chars to print.
 	// safe_stop accounts for "discardable,fail,whitelisted"
 	//                         123456789012345678901234567890
-	char buf[80], *p = buf, *safe_stop = &buf[sizeof buf - 30];
+	char buf[96], *p = buf, *safe_stop = &buf[sizeof buf - 30];
 #define SET_NUMBER(N) \
 	if (p < safe_stop) { \
 		p += 1 + sprintf(dwa->var[N##_variable] = p, "%u", info->N); \
@@ -1985,6 +3363,7 @@ void db_set_stats_info(db_work_area* dwa, stats_info *info)
 	{
 		SET_NUMBER(received_count);
 		SET_NUMBER(signatures_count);
+		SET_NUMBER(skipped_body);
 
 		if (p < safe_stop)
 		{
@@ -2025,15 +3404,358 @@ void db_set_stats_info(db_work_area* dwa, stats_info *info)
 		zeroflag |= in_stmt_run(dwa, bitflag, info);
 	else
 		zeroflag |= out_stmt_run(dwa, bitflag, info);
+	dwa->stats_lost = dwa->is_broken;
 
 	variable_id id = 0;
 	var_flag_t mask = 1;
 	for (; zeroflag; zeroflag &= ~mask, mask <<= 1, ++id)
 		if (zeroflag & mask)
 			dwa->var[id] = NULL;
+
+	if (db_batch_due(dwa) == 0)
+		db_batch_flush(dwa);
+}
+
+/*
+* A stats writer process (dbwriter.c) runs the statements on behalf of
+* children which didn't connect.  A child serializes its stats_info, the
+* domain list, and the variables already set in dwa.  The writer decodes
+* them into its own dwa, runs db_set_stats_info, and clears the variables.
+*/
+
+int db_check_user_defined(db_work_area *dwa)
+{
+	return dwa && dwa->stmt[db_sql_check_user] != NULL;
+}
+
+int db_flags_snapshot_defined(db_work_area *dwa)
+{
+	return dwa && dwa->stmt[db_sql_domain_flags_snapshot] != NULL;
+}
+
+int db_run_flags_snapshot(db_work_area *dwa, char const *mark,
+	db_query_cb cb, void *cb_arg)
+/*
+* Run db_sql_domain_flags_snapshot, passing each row to cb.  mark is the
+* greatest change mark seen so far, "0" for a full load.
+*/
+{
+	assert(dwa);
+	assert(mark);
+	assert(cb);
+
+	dwa->var[snapshot_mark_variable] = (char*)mark;
+	int rtc;
+	if (dwa->is_test && dwa->stmt[db_sql_domain_flags_snapshot])
+	{
+		dump_vars(dwa, db_sql_domain_flags_snapshot, snapshot_mark_mask_bit);
+		rtc = test_flags_snapshot(dwa, cb, cb_arg);
+	}
+	else
+		rtc = stmt_run_n(dwa, db_sql_domain_flags_snapshot,
+			snapshot_mark_mask_bit, 0, cb, cb_arg);
+	dwa->var[snapshot_mark_variable] = NULL;
+	return rtc;
+}
+
+int db_stats_lost(db_work_area *dwa)
+/*
+* return 1 if the connection broke during the last db_set_stats_info(),
+* so that the stats may have been partly or not at all written.  Batched
+* rows are not lost, as they are kept for the next flush.
+*/
+{
+	return dwa && dwa->stats_lost;
+}
+
+int db_domain_flags_defined(db_work_area *dwa)
+{
+	return dwa && (dwa->stmt[db_sql_domain_flags] != NULL ||
+		dwa->stmt[db_sql_whitelisted] != NULL);
+}
+
+void db_clear_vars(db_work_area *dwa)
+{
+	assert(dwa);
+	for (int i = 0; i < DB_SQL_VAR_SIZE; ++i)
+	{
+		free(dwa->var[i]);
+		dwa->var[i] = NULL;
+	}
+	free(dwa->user_domain);
+	dwa->user_domain = NULL;
+}
+
+int db_check_connection(db_work_area *dwa)
+/*
+* Drop a connection that had a fatal error, and connect if not connected.
+* return 0 if connected.
+*/
+{
+	assert(dwa);
+	if (dwa->is_test)
+		return 0;
+
+	if (dwa->handle && (dwa->is_broken || clear_pending_result(dwa)))
+	{
+		odbx_unbind(dwa->handle);
+		odbx_finish(dwa->handle);
+		dwa->handle = NULL;
+		dwa->pending_result = 0;
+		esc_clear(dwa);
+		(*do_report)(LOG_NOTICE, "DB connection dropped, reconnecting");
+	}
+
+	dwa->is_broken = 0;
+	dwa->pending_result_msg = 0;
+	return dwa->handle? 0: db_connect(dwa);
+}
+
+#define STATS_STRINGS \
+	X(content_type) X(content_encoding) X(date) X(message_id) X(from) \
+	X(subject) X(envelope_sender) X(vbr_result_resp) X(dmarc_record) \
+	X(dmarc_rua) X(ino_mtime_pid)
+
+#define STATS_NUMBERS \
+	X(rcpt_count) X(complaint_flag) X(received_count) X(signatures_count) \
+	X(skipped_body) X(dmarc_ri) X(original_ri) X(nxdomain) X(adsp_any) \
+	X(adsp_found) X(adsp_unknown) X(adsp_all) X(adsp_discardable) \
+	X(adsp_fail) X(dmarc_found) X(dmarc_dkim) X(dmarc_spf) X(dkim_any) \
+	X(spf_any) X(dmarc_dispo) X(dmarc_reason) X(dmarc_subdomain) \
+	X(dmarc_fail) X(policy_overridden) X(mailing_list) X(reject) X(drop) \
+	X(outgoing) X(scope)
+
+#define DPS_NUMBERS \
+	X(sigval) X(nsigs) X(start_ndx) X(first_good) X(whitelisted) X(u.all) \
+	X(reputation) X(dkim_order) X(spf) X(dkim) X(dnswl_value) X(domain_val)
+
+#define STATS_MAGIC 0x7a730001U // "zs", version 1
+
+typedef struct ser_buf
+{
+	char *p, *end;
+	size_t size; // total, may exceed the buffer
+} ser_buf;
+
+static void put_bytes(ser_buf *b, void const *v, size_t len)
+{
+	if (b->p && (size_t)(b->end - b->p) >= len)
+	{
+		memcpy(b->p, v, len);
+		b->p += len;
+	}
+	else
+		b->p = NULL;
+	b->size += len;
+}
+
+static void put_u32(ser_buf *b, uint32_t u)
+{
+	put_bytes(b, &u, sizeof u);
+}
+
+static void put_str(ser_buf *b, char const *s)
+// length + 1, 0 for NULL
+{
+	size_t const len = s? strlen(s): 0;
+	put_u32(b, s? len + 1: 0);
+	if (s)
+		put_bytes(b, s, len);
+}
+
+size_t db_stats_serialize(db_work_area *dwa, stats_info const *info,
+	char *buf, size_t size)
+/*
+* return the size needed; the buffer is filled only if that is <= size.
+*/
+{
+	assert(dwa);
+	assert(info);
+
+	ser_buf b;
+	b.p = buf;
+	b.end = buf + size;
+	b.size = 0;
+
+	put_u32(&b, STATS_MAGIC);
+	put_str(&b, dwa->var[ip_variable]);
+	put_str(&b, dwa->var[local_part_variable]);
+	put_str(&b, dwa->user_domain);
+	put_str(&b, dwa->var[org_domain_variable]);
+
+#define X(N) put_str(&b, info->N);
+	STATS_STRINGS
+#undef X
+#define X(N) put_u32(&b, info->N);
+	STATS_NUMBERS
+#undef X
+
+	for (domain_prescreen const *dps = info->domain_head; dps; dps = dps->next)
+	{
+		put_str(&b, dps->name);
+		put_str(&b, dps->vbr_mv);
+#define X(N) put_u32(&b, dps->N);
+		DPS_NUMBERS
+#undef X
+	}
+	put_str(&b, NULL);
+
+	return b.size;
+}
+
+typedef struct de_buf
+{
+	char const *p, *end;
+	int bad;
+} de_buf;
+
+static uint32_t get_u32(de_buf *b)
+{
+	uint32_t u = 0;
+	if (b->end - b->p >= (ptrdiff_t)sizeof u)
+		memcpy(&u, b->p, sizeof u);
+	else
+		b->bad = 1;
+	b->p += sizeof u;
+	return u;
+}
+
+static char *get_str(de_buf *b)
+{
+	uint32_t const len = get_u32(b);
+	if (len == 0 || b->bad)
+		return NULL;
+
+	if ((size_t)(b->end - b->p) < len - 1)
+	{
+		b->bad = 1;
+		return NULL;
+	}
+
+	char *s = malloc(len);
+	if (s)
+	{
+		memcpy(s, b->p, len - 1);
+		s[len - 1] = 0;
+	}
+	else
+		b->bad = 1;
+	b->p += len - 1;
+	return s;
+}
+
+int db_set_stats_serialized(db_work_area *dwa, char const *buf, size_t len,
+	publicsuffix_trie *pst)
+/*
+* Decode what db_stats_serialize wrote, and run the statements.
+* return 0, or -1 if the record is malformed.
+*/
+{
+	assert(dwa);
+	assert(buf);
+
+	de_buf b;
+	b.p = buf;
+	b.end = buf + len;
+	b.bad = get_u32(&b) != STATS_MAGIC;
+
+	stats_info info;
+	memset(&info, 0, sizeof info);
+	info.pst = pst;
+
+	db_clear_vars(dwa);
+	dwa->var[ip_variable] = get_str(&b);
+	dwa->var[local_part_variable] = get_str(&b);
+	dwa->user_domain = get_str(&b);
+	dwa->var[org_domain_variable] = get_str(&b);
+
+#define X(N) info.N = get_str(&b);
+	STATS_STRINGS
+#undef X
+#define X(N) info.N = get_u32(&b);
+	STATS_NUMBERS
+#undef X
+
+	domain_prescreen **tail = &info.domain_head;
+	char *name;
+	while (b.bad == 0 && (name = get_str(&b)) != NULL)
+	{
+		size_t const l = strlen(name) + 1;
+		domain_prescreen *dps = calloc(1, sizeof *dps + l);
+		if (dps == NULL)
+		{
+			free(name);
+			b.bad = 1;
+			break;
+		}
+		memcpy(dps->name, name, l);
+		free(name);
+		dps->vbr_mv = get_str(&b);
+#define X(N) dps->N = get_u32(&b);
+		DPS_NUMBERS
+#undef X
+		*tail = dps;
+		tail = &dps->next;
+	}
+
+	int rtc = -1;
+	if (b.bad == 0 && b.p == b.end)
+	{
+		db_set_stats_info(dwa, &info);
+		rtc = 0;
+	}
+
+#define X(N) free(info.N);
+	STATS_STRINGS
+#undef X
+	for (domain_prescreen *dps = info.domain_head; dps;)
+	{
+		domain_prescreen *const next = dps->next;
+		free(dps->vbr_mv);
+		free(dps);
+		dps = next;
+	}
+	db_clear_vars(dwa);
+
+	return rtc;
 }
 
 #if defined TEST_MAIN
+static int store_load_msg(store_msg *msg, void *vdwa)
+// like the filter does after the message is accepted
+{
+	db_work_area *const dwa = vdwa;
+	stats_info *const info = &msg->info;
+
+	db_clear_vars(dwa);
+	if (msg->ip)
+		dwa->var[ip_variable] = strdup(msg->ip);
+	if (msg->user)
+	{
+		char const *const at = strchr(msg->user, '@');
+		size_t const l = at? (size_t)(at - msg->user): strlen(msg->user);
+		char *const lp = malloc(l + 1);
+		if (lp)
+		{
+			memcpy(lp, msg->user, l);
+			lp[l] = 0;
+		}
+		dwa->var[local_part_variable] = lp;
+		dwa->user_domain = at? strdup(at + 1): NULL;
+	}
+	for (domain_prescreen const *dps = info->domain_head; dps; dps = dps->next)
+		if (dps->u.f.is_org_domain)
+		{
+			dwa->var[org_domain_variable] = strdup(dps->name);
+			break;
+		}
+
+	info->pst = NULL;
+	if (info->domain_head)
+		db_set_stats_info(dwa, info);
+	db_clear_vars(dwa);
+	return 0;
+}
 
 // the probability that rand() > RAND_MAX/2 is 50%, etcetera.
 #define PERC_50 (RAND_MAX/2)
@@ -2206,14 +3928,58 @@ static dmarc_reason o_l_m_t_s_f_n_result(char const *s)
 	return dmarc_reason_none;
 }
 
+static int snapshot_run(db_work_area *dwa, int argc, char *argv[], int i)
+/*
+* Refresh the snapshot file argv[i] argv[i+1] times, mapping it and looking
+* the following domains up after each refresh.  return 0 if ok, 1 on error.
+*/
+{
+	char *t = NULL;
+	unsigned long const n = i + 1 < argc? strtoul(argv[i + 1], &t, 0): 0;
+	if (t == NULL || *t != 0 || n == 0)
+	{
+		printf("--snapshot needs a file name and a refresh count\n");
+		return 1;
+	}
+
+	char const *const path = argv[i];
+	for (unsigned long k = 1; k <= n; ++k)
+	{
+		struct stat before, after;
+		int const existed = stat(path, &before) == 0;
+		if (snapshot_refresh(path, dwa, 60, verbose, &stderrlog) ||
+			stat(path, &after) || snapshot_map(path, &stderrlog))
+		{
+			printf("refresh %lu failed\n", k);
+			return 1;
+		}
+
+		printf("refresh %lu: snapshot %s\n", k,
+			existed && before.st_ino == after.st_ino? "touched": "written");
+		for (int j = i + 2; j < argc && argv[j][0] != '-'; ++j)
+		{
+			int w = 0, d = 0, a = 0;
+			if (snapshot_lookup(argv[j], &w, &d, &a) == 3)
+				printf("%s: %d %d %d\n", argv[j], w, d, a);
+			else
+				printf("%s: not found\n", argv[j]);
+		}
+	}
+
+	return 0;
+}
+
 int main(int argc, char*argv[])
 {
 	size_t maxarglen = strlen(argv[0]);
 	int rtc = 0, errs = 0, config = 0, force_test = 0,
 		query[2] = {argc, argc},
 		set_stats = argc,
-		set_stats_domain = argc;
-	char const *config_file = NULL;
+		set_stats_domain = argc,
+		store_dump_arg = 0, store_load_arg = 0, snapshot_arg = 0;
+	unsigned long bench = 1;
+	int stmt_report = 0, purge = 0;
+	char const *config_file = NULL, *store = NULL;
 
 	for (int i = 1; i < argc; ++i)
 	{
@@ -2272,11 +4038,20 @@ int main(int argc, char*argv[])
 			"  --help                               print this and exit\n"
 			"  --version                            print version string and exit\n"
 			"  --dry-run                            don't actually run queries\n"
+			"  --bench-compose n                    compose set-stats n times, report rate\n"
+			"  --stmt-stats                         report statement counters at exit\n"
+			"  --purge                              delete old stats (see man page)\n"
 			"  --test                               force the \"test\" backend\n"
 			"  --db-sql-whitelisted domain ...      query domains\n"
 			"  --db-sql-domain_flags [org=domain] domain ...\n"
 			"  --set-stats <d> [msg-data]           insert new data (see below)\n"
 			" [--set-stats-domain] domain[,tok] ... domains related to the message\n"
+			"  --store dir                          override stats_store\n"
+			"  --store-dump [from [to]]             print the stats store\n"
+			"  --store-load [from [to]]             insert the stats store\n"
+			"  --snapshot file n domain ...         refresh a flags snapshot n times\n"
+			"\n"
+			"For the stats store, from and to are seconds since the epoch.\n"
 			"\n"
 			"For set-stats, the <d> (direction) must be either I (incoming) or\n"
 			"O (outgoing).  The following arguments are one or more msg-data, if\n"
@@ -2300,6 +4075,26 @@ int main(int argc, char*argv[])
 		{
 			dry_run = 1;
 		}
+		else if (strcmp(arg, "--bench-compose") == 0)
+		{
+			dry_run = 1; // composition only, the server is not measured
+			char *t = NULL;
+			if (++i < argc)
+				bench = strtoul(argv[i], &t, 0);
+			if (t == NULL || *t != 0 || bench == 0)
+			{
+				printf("Invalid bench count %s\n", i < argc? argv[i]: "(missing)");
+				++errs;
+			}
+		}
+		else if (strcmp(arg, "--stmt-stats") == 0)
+		{
+			stmt_report = 1;
+		}
+		else if (strcmp(arg, "--purge") == 0)
+		{
+			purge = 1;
+		}
 		else if (strcmp(arg, "--test") == 0)
 		{
 			force_test = 1;
@@ -2320,6 +4115,22 @@ int main(int argc, char*argv[])
 		{
 			set_stats_domain = i + 1;
 		}
+		else if (strcmp(arg, "--store") == 0)
+		{
+			store = ++i < argc ? argv[i] : NULL;
+		}
+		else if (strcmp(arg, "--store-dump") == 0)
+		{
+			store_dump_arg = i + 1;
+		}
+		else if (strcmp(arg, "--store-load") == 0)
+		{
+			store_load_arg = i + 1;
+		}
+		else if (strcmp(arg, "--snapshot") == 0)
+		{
+			snapshot_arg = i + 1;
+		}
 		else
 		{
 			printf("Invalid option %s\n", arg);
@@ -2329,14 +4140,27 @@ int main(int argc, char*argv[])
 	if (errs)
 		return 1;
 
+	if (config_file == NULL)
+		config_file = default_config_file;
+
 	set_parm_logfun(&stderrlog);
+	if (store_dump_arg)
+	{
+		char *dir;
+		time_t from, to;
+		if (store_args(argc, argv, store_dump_arg, config_file, store,
+			&dir, &from, &to))
+				return 1;
+
+		rtc = store_dump(dir, from, to, stdout, &stderrlog) != 0;
+		free(dir);
+		return rtc;
+	}
+
 	db_work_area *dwa = db_init();
 	if (dwa == NULL)
 		return 1;
 
-	if (config_file == NULL)
-		config_file = default_config_file;
-
 	void *parm_target[PARM_TARGET_SIZE];
 	parm_target[parm_t_id] = NULL;
 	parm_target[db_parm_t_id] = db_parm_addr(dwa);
@@ -2354,17 +4178,55 @@ int main(int argc, char*argv[])
 		dwa->z.db_backend = strdup("test");
 	}
 
+	if (bench > 1 &&
+		(dwa->z.db_backend == NULL || strcmp(dwa->z.db_backend, "test") == 0))
+	{
+		printf("--bench-compose needs an OpenDBX backend to escape values\n");
+		clear_parm(parm_target);
+		db_clear(dwa);
+		return 1;
+	}
+
 	db_config_wrapup(dwa, NULL, NULL);
+	if (purge && db_purge_wrapup(dwa, NULL))
+	{
+		clear_parm(parm_target);
+		db_clear(dwa);
+		return 1;
+	}
 
 	if (config)
 		print_parm(parm_target);
 
 	if (db_connect(dwa) == 0)
 	{
+		if (purge && db_purge(dwa, time(NULL)))
+			rtc = 1;
+
 		int set_client_ip = 0;
 		stats_info stats;
 		memset(&stats, 0, sizeof stats);
 
+		if (store_load_arg)
+		{
+			char *dir;
+			time_t from, to;
+			if (store_args(argc, argv, store_load_arg, config_file, store,
+				&dir, &from, &to) == 0)
+			{
+				if (store_scan(dir, from, to, &store_load_msg, dwa, &stderrlog))
+					rtc = 1;
+				if (db_batch_flush(dwa))
+					rtc = 1;
+				free(dir);
+			}
+			else
+				rtc = 1;
+		}
+
+		if (snapshot_arg && snapshot_run(dwa, argc, argv, snapshot_arg))
+			rtc = 1;
+
 		if (set_stats < argc)
 		{
 			unsigned ndomains = 0;
@@ -2666,7 +4528,44 @@ int main(int argc, char*argv[])
 				}
 			}
 
-			db_set_stats_info(dwa, &stats);
+			if (bench > 1)
+			{
+				/*
+				* db_set_stats_info takes the strings from stats, so each
+				* message is replayed from a serialized copy.
+				*/
+				size_t const len = db_stats_serialize(dwa, &stats, NULL, 0);
+				char *rec = len? malloc(len): NULL;
+				if (rec)
+				{
+					struct timespec t0, t1;
+					db_stats_serialize(dwa, &stats, rec, len);
+					clock_gettime(CLOCK_MONOTONIC, &t0);
+					for (unsigned long b = 0; b < bench; ++b)
+						db_set_stats_serialized(dwa, rec, len, NULL);
+					db_batch_flush(dwa);
+					clock_gettime(CLOCK_MONOTONIC, &t1);
+					double const secs = (t1.tv_sec - t0.tv_sec) +
+						(t1.tv_nsec - t0.tv_nsec) / 1.0e9;
+					printf("%lu messages, %lu queries composed (not run) "
+						"in %.3f secs: %.0f queries/sec\n",
+						bench, query_count, secs,
+						secs > 0? query_count / secs: 0.0);
+					db_ref_cache_report(dwa);
+					free(rec);
+				}
+				else
+				{
+					printf("cannot serialize stats\n");
+					rtc = 1;
+				}
+			}
+			else
+			{
+				db_set_stats_info(dwa, &stats);
+				db_batch_flush(dwa);
+			}
+
 			if (stats.outgoing)
 			{
 				char *s = db_check_user(dwa);
@@ -2721,6 +4620,9 @@ int main(int argc, char*argv[])
 			}
 	}
 
+	if (stmt_report)
+		db_stmt_stats_report(dwa);
+
 	clear_parm(parm_target);
 	db_clear(dwa);
 
@@ -2731,6 +4633,8 @@ int main(int argc, char*argv[])
 // dummy functions.  Warnings that they don't use arguments are appreciated...
 db_work_area *db_init(void) {return NULL;}
 void db_clear(db_work_area* dwa) {}
+void db_set_redact(db_work_area *dwa, db_redact_fn redact, char const *key) {}
+void db_stmt_stats_report(db_work_area *dwa) {}
 db_parm_t* db_parm_addr(db_work_area *dwa) {return NULL;}
 int db_config_wrapup(db_work_area* dwa, int *in, int *out)
 {
@@ -2750,11 +4654,62 @@ void db_set_authenticated_user(db_work_area *dwa,
 void db_set_client_ip(db_work_area *dwa, char const *ip) {}
 void db_set_stats_info(db_work_area* dwa, stats_info *info) {}
 void db_set_org_domain(db_work_area *dwa, char *org_domain) {}
+int db_check_user_defined(db_work_area *dwa) {return 0;}
+int db_batch_flush(db_work_area *dwa) {return 0;}
+int db_batch_due(db_work_area *dwa) {return -1;}
+int db_domain_flags_defined(db_work_area *dwa) {return 0;}
+int db_flags_snapshot_defined(db_work_area *dwa) {return 0;}
+int db_run_flags_snapshot(db_work_area *dwa, char const *mark,
+	db_query_cb cb, void *cb_arg) {return 0;}
+int db_stats_lost(db_work_area *dwa) {return 0;}
+void db_ref_cache_report(db_work_area *dwa) {}
+void db_clear_vars(db_work_area *dwa) {}
+int db_check_connection(db_work_area *dwa) {return -1;}
+size_t db_stats_serialize(db_work_area *dwa, stats_info const *info,
+	char *buf, size_t size) {return 0;}
+int db_set_stats_serialized(db_work_area *dwa, char const *buf, size_t len,
+	publicsuffix_trie *pst) {return -1;}
+int db_zag_wrapup(db_work_area* dwa, int *zag) {return -1;}
+int db_run_dmarc_agg_domain(db_work_area *dwa, time_t period_start,
+	time_t period_end, db_query_cb cb, void *cb_arg) {return -1;}
+int db_run_dmarc_agg_record(db_work_area *dwa, dmarc_agg_record *dar,
+	db_query_cb cb, void *cb_arg) {return -1;}
+int db_set_dmarc_agg(db_work_area *dwa, dmarc_agg_record *dar) {return -1;}
+int db_purge_wrapup(db_work_area *dwa, int *purge) {return -1;}
+int db_purge(db_work_area *dwa, time_t now) {return -1;}
 #if defined TEST_MAIN
-int main()
+int main(int argc, char*argv[])
+// the stats store can be dumped without a database
 {
-	puts("This program does nothing!\nPlease install OpenDBX then reconfigure");
-	return 0;
+	char const *config_file = default_config_file, *store = NULL;
+	int store_dump_arg = 0;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+			config_file = argv[++i];
+		else if (strcmp(argv[i], "--store") == 0 && i + 1 < argc)
+			store = argv[++i];
+		else if (strcmp(argv[i], "--store-dump") == 0)
+			store_dump_arg = i + 1;
+	}
+
+	if (store_dump_arg == 0)
+	{
+		puts("This program does nothing!\nPlease install OpenDBX then reconfigure");
+		return 0;
+	}
+
+	char *dir;
+	time_t from, to;
+	if (store_args(argc, argv, store_dump_arg, config_file, store,
+		&dir, &from, &to))
+			return 1;
+
+	set_parm_logfun(&stderrlog);
+	int rtc = store_dump(dir, from, to, stdout, &stderrlog) != 0;
+	free(dir);
+	return rtc;
 }
 #endif // TEST_MAIN
 #endif // HAVE_OPENDBX
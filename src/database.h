@@ -53,6 +53,11 @@ typedef struct dmarc_agg_record
 int db_run_dmarc_agg_domain(db_work_area*, time_t, time_t, db_query_cb, void*);
 int db_run_dmarc_agg_record(db_work_area*, dmarc_agg_record*, db_query_cb, void*);
 int db_set_dmarc_agg(db_work_area*, dmarc_agg_record*);
+
+// zfilter_db --purge
+int db_purge_wrapup(db_work_area *dwa, int *purge);
+int db_purge(db_work_area *dwa, time_t now);
+
 #if defined TEST_ZAG
 void set_database_verbose(int v, int d);
 #endif
@@ -69,6 +74,10 @@ void db_set_authenticated_user(db_work_area *dwa,
 void db_set_client_ip(db_work_area *dwa, char const *ip);
 void db_set_org_domain(db_work_area *dwa, char *org_domain);
 
+typedef char *(*db_redact_fn)(char const *key, char const *value);
+void db_set_redact(db_work_area *dwa, db_redact_fn redact, char const *key);
+void db_stmt_stats_report(db_work_area *dwa);
+
 typedef enum spf_result
 {
 	spf_none,
@@ -80,6 +89,21 @@ typedef enum spf_result
 	spf_pass
 } spf_result;
 
+static inline char *get_spf_result(spf_result r)
+{
+	switch (r)
+	{
+		default:
+		case spf_none: return "none";
+		case spf_fail: return "fail";
+		case spf_permerror: return "permerror";
+		case spf_temperror: return "temperror";
+		case spf_neutral: return "neutral";
+		case spf_softfail: return "softfail";
+		case spf_pass: return "pass";
+	}
+}
+
 typedef enum dkim_result
 {
 	dkim_none,
@@ -190,6 +214,7 @@ typedef struct stats_info
 	// incoming messages only (except outgoing flag)
 	unsigned received_count;
 	unsigned signatures_count;
+	unsigned skipped_body; // bytes not read after early reject
 
 	uint32_t dmarc_ri, original_ri; // report interval
 
@@ -222,6 +247,23 @@ typedef struct stats_info
 } stats_info;
 
 void db_set_stats_info(db_work_area* dwa, stats_info *info);
+int db_batch_flush(db_work_area *dwa);
+int db_batch_due(db_work_area *dwa);
+
+// for the stats writer
+int db_check_user_defined(db_work_area *dwa);
+int db_domain_flags_defined(db_work_area *dwa);
+int db_flags_snapshot_defined(db_work_area *dwa);
+int db_run_flags_snapshot(db_work_area *dwa, char const *mark,
+	db_query_cb cb, void *cb_arg);
+int db_stats_lost(db_work_area *dwa);
+void db_ref_cache_report(db_work_area *dwa);
+void db_clear_vars(db_work_area *dwa);
+int db_check_connection(db_work_area *dwa);
+size_t db_stats_serialize(db_work_area *dwa, stats_info const *info,
+	char *buf, size_t size);
+int db_set_stats_serialized(db_work_area *dwa, char const *buf, size_t len,
+	publicsuffix_trie *pst);
 
 #define DATABASE_H_INCLUDED
 #endif
@@ -34,18 +34,33 @@ the resulting work.
 
 DATABASE_STATEMENT(db_sql_whitelisted)
 DATABASE_STATEMENT(db_sql_domain_flags)
+DATABASE_STATEMENT(db_sql_domain_flags_snapshot)
 DATABASE_STATEMENT(db_sql_select_domain)
 DATABASE_STATEMENT(db_sql_update_domain)
+DATABASE_STATEMENT(db_sql_update_domain_count)
 DATABASE_STATEMENT(db_sql_insert_domain)
 DATABASE_STATEMENT(db_sql_insert_msg_ref)
 DATABASE_STATEMENT(db_sql_insert_message)
 DATABASE_STATEMENT(db_sql_select_user)
 DATABASE_STATEMENT(db_sql_select_target)
 DATABASE_STATEMENT(db_sql_update_target)
+DATABASE_STATEMENT(db_sql_update_target_count)
 DATABASE_STATEMENT(db_sql_insert_target)
 DATABASE_STATEMENT(db_sql_insert_target_ref)
 DATABASE_STATEMENT(db_sql_check_user)
 DATABASE_STATEMENT(db_sql_dmarc_agg_domain)
 DATABASE_STATEMENT(db_sql_dmarc_agg_record)
 DATABASE_STATEMENT(db_sql_set_dmarc_agg)
+DATABASE_STATEMENT(db_sql_purge_keep)
+DATABASE_STATEMENT(db_sql_purge_rotate)
+DATABASE_STATEMENT(db_sql_purge_select_in)
+DATABASE_STATEMENT(db_sql_purge_in)
+DATABASE_STATEMENT(db_sql_purge_select_out)
+DATABASE_STATEMENT(db_sql_purge_out)
+DATABASE_STATEMENT(db_sql_batch_message)
+DATABASE_STATEMENT(db_sql_batch_domain)
+DATABASE_STATEMENT(db_sql_batch_msg_ref)
+DATABASE_STATEMENT(db_sql_batch_message_out)
+DATABASE_STATEMENT(db_sql_batch_target)
+DATABASE_STATEMENT(db_sql_batch_target_ref)
 
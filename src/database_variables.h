@@ -51,6 +51,7 @@ DATABASE_VARIABLE(content_type)
 DATABASE_VARIABLE(content_encoding)
 DATABASE_VARIABLE(received_count)
 DATABASE_VARIABLE(signatures_count)
+DATABASE_VARIABLE(skipped_body)
 DATABASE_VARIABLE(rcpt_count)
 DATABASE_VARIABLE(mailing_list)
 DATABASE_VARIABLE(prefix_len)
@@ -75,5 +76,12 @@ DATABASE_VARIABLE(complaint_flag)
 DATABASE_VARIABLE(period_start)
 DATABASE_VARIABLE(period_end)
 DATABASE_VARIABLE(period)
+DATABASE_VARIABLE(seen_count)
+DATABASE_VARIABLE(last_seen)
+DATABASE_VARIABLE(snapshot_mark)
+DATABASE_VARIABLE(purge_before)
+DATABASE_VARIABLE(purge_batch)
+DATABASE_VARIABLE(purge_after)
+DATABASE_VARIABLE(purge_upto)
 
 
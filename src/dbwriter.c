@@ -0,0 +1,511 @@
+/*
+** dbwriter.c - written in milano by vesely on 19oct2026
+** long-lived process writing stats to the database
+*/
+/*
+* zdkimfilter - Sign outgoing, verify incoming mail messages
+
+Copyright (C) 2026 Alessandro Vesely
+
+This file is part of zdkimfilter
+
+zdkimfilter is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+zdkimfilter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License version 3
+along with zdkimfilter.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPLv3 section 7:
+
+If you modify zdkimfilter, or any covered work, by linking or combining it
+with software developed by The OpenDKIM Project and its contributors,
+containing parts covered by the applicable licence, the licensor or
+zdkimfilter grants you additional permission to convey the resulting work.
+*/
+#include <config.h>
+#if !ZDKIMFILTER_DEBUG
+#define NDEBUG
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "dbwriter.h"
+#include "spool.h"
+#include "snapshot.h"
+#include <assert.h>
+
+/*
+* Without the writer, each child connects to the database after filtering,
+* runs the stats statements, and disconnects.  With it, children serialize
+* their stats (db_stats_serialize) and send them as one record on a
+* SOCK_SEQPACKET socketpair.  The writer keeps a connection open and runs
+* the records in arrival order.
+*
+* Children never block:  if the queue is full, or the writer is down, send
+* fails and they write directly.  While the writer cannot connect, it stops
+* reading, so that the queue fills up and children take over.
+*
+* With db_sql_batch_* statements, rows from several records are written
+* together, after db_batch_rows rows or db_batch_window seconds.
+*
+* With a stats_spool, records that could not be written are appended to it,
+* by the writer or by children that could not connect.  The writer replays
+* the spool while connected, a chunk at a time, between queued records.  In
+* that case the writer runs even if stats_writer_queue is 0; children then
+* don't use the queue.
+*
+* With a domain_flags_snapshot, the writer also refreshes the domain flags
+* snapshot every db_flags_snapshot_refresh seconds (see snapshot.c), and runs
+* for that purpose too.
+*
+* The writer is double forked, so that the filter's child count is not
+* affected.  It holds the write end of a lifeline pipe; the parent sees EOF
+* on the read end when it exits, respawns it in dbw_check(), and waits for
+* it to drain in dbw_stop().  The writer exits when recv() returns 0, that
+* is after the parent and all children closed their sending end.
+*/
+
+#define DBW_MAX_RECORD 65536
+#define DBW_MAX_BACKOFF 64
+#define DBW_RETRY_SPAWN 60
+#define DBW_STOP_WAIT 30
+#define DBW_SPOOL_CHECK 10
+#define DBW_REPLAY_CHUNK 256
+
+static void (*dbw_log)(int, char const*, ...) = &syslog;
+static int dbw_sock = -1; // sending end, inherited by children
+static int dbw_life = -1; // read end of the lifeline
+static pid_t dbw_pid;
+static time_t dbw_failed;
+static int dbw_verbose;
+static volatile sig_atomic_t dbw_usr1;
+
+static void writer_usr1(int sig)
+{
+	dbw_usr1 = sig;
+}
+
+static void run_writer(int sock, int life,
+	db_work_area *dwa, publicsuffix_trie *pst, parm_t const *z)
+{
+	char const *const spool = z->stats_spool;
+	char const *const snapshot =
+		db_flags_snapshot_defined(dwa)? z->domain_flags_snapshot: NULL;
+	int const refresh = db_parm_addr(dwa)->db_flags_snapshot_refresh;
+
+	struct sigaction act;
+	memset(&act, 0, sizeof act);
+	sigemptyset(&act.sa_mask);
+	act.sa_handler = SIG_IGN;
+	sigaction(SIGHUP, &act, NULL);
+	sigaction(SIGINT, &act, NULL);
+	sigaction(SIGUSR2, &act, NULL);
+	sigaction(SIGPIPE, &act, NULL);
+	act.sa_handler = SIG_DFL;
+	sigaction(SIGTERM, &act, NULL);
+	sigaction(SIGALRM, &act, NULL);
+	sigaction(SIGCHLD, &act, NULL);
+	act.sa_handler = writer_usr1;
+	act.sa_flags = SA_RESTART; // only poll() is interrupted
+	sigaction(SIGUSR1, &act, NULL);
+	sigprocmask(SIG_SETMASK, &act.sa_mask, NULL);
+
+	/*
+	* The parent may hold the connection of the message being accepted, and
+	* Courier waits for it to be closed.  Keep stderr for logging, and drop
+	* any other descriptor, including syslog's.
+	*/
+	closelog();
+	long open_max = sysconf(_SC_OPEN_MAX);
+	if (open_max < 0 || open_max > 65536)
+		open_max = 65536;
+	for (int fd = 3; fd < open_max; ++fd)
+		if (fd != sock && fd != life)
+			close(fd);
+
+	int fd = open("/dev/null", O_RDWR);
+	if (fd >= 0)
+	{
+		dup2(fd, 0);
+		dup2(fd, 1);
+		if (fd > 1)
+			close(fd);
+	}
+
+	pid_t const pid = getpid();
+	if (write(life, &pid, sizeof pid) != sizeof pid)
+		_exit(1);
+
+	char *buf = malloc(DBW_MAX_RECORD);
+	if (buf == NULL)
+	{
+		(*dbw_log)(LOG_ALERT, "MEMORY FAULT");
+		_exit(1);
+	}
+
+	unsigned backoff = 0;
+	unsigned long count = 0;
+	time_t next_check = 0, next_snapshot = 0;
+	int replay_more = 0;
+	for (;;)
+	{
+		if (dbw_usr1)
+		{
+			dbw_usr1 = 0;
+			db_ref_cache_report(dwa);
+		}
+
+		if (db_check_connection(dwa))
+		{
+			if (backoff == 0)
+				(*dbw_log)(LOG_ERR, "stats writer cannot connect, will retry");
+			backoff = backoff? 2*backoff: 1;
+			if (backoff > DBW_MAX_BACKOFF)
+				backoff = DBW_MAX_BACKOFF;
+
+			// don't read, but quit if all senders are gone
+			struct pollfd pfd;
+			pfd.fd = sock;
+			pfd.events = 0;
+			if (poll(&pfd, 1, backoff * 1000) > 0 && (pfd.revents & POLLHUP))
+			{
+				ssize_t n;
+				while (spool && (n = recv(sock, buf, DBW_MAX_RECORD,
+					MSG_TRUNC | MSG_DONTWAIT)) > 0)
+						if (n <= DBW_MAX_RECORD &&
+							spool_append(spool, buf, n, dbw_log) == 0)
+								++count;
+				break;
+			}
+			continue;
+		}
+		else if (backoff)
+		{
+			(*dbw_log)(LOG_NOTICE, "stats writer connected");
+			backoff = 0;
+		}
+
+		time_t const now = time(NULL);
+		if (spool && (replay_more || now >= next_check))
+		{
+			int const rc =
+				spool_replay(spool, dwa, pst, DBW_REPLAY_CHUNK, dbw_log);
+			replay_more = rc > 0;
+			next_check = now + DBW_SPOOL_CHECK;
+			if (rc < 0)
+				continue;
+		}
+
+		if (snapshot && now >= next_snapshot)
+		{
+			snapshot_refresh(snapshot, dwa, refresh, dbw_verbose, dbw_log);
+			next_snapshot = now + refresh;
+		}
+
+		// batched rows wait for more records, up to db_batch_window
+		int const due = db_batch_due(dwa);
+		if (due == 0)
+		{
+			db_batch_flush(dwa);
+			continue;
+		}
+
+		int timeout = due > 0? due * 1000: -1;
+		if (replay_more)
+			timeout = 0;
+		else if (spool && (timeout < 0 || timeout > DBW_SPOOL_CHECK * 1000))
+			timeout = DBW_SPOOL_CHECK * 1000;
+		if (snapshot && !replay_more)
+		{
+			time_t const left = next_snapshot > now? next_snapshot - now: 0;
+			if (timeout < 0 || timeout > left * 1000)
+				timeout = left * 1000;
+		}
+
+		struct pollfd pfd;
+		pfd.fd = sock;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, timeout) <= 0)
+			continue;
+
+		ssize_t n = recv(sock, buf, DBW_MAX_RECORD, MSG_TRUNC);
+		if (n == 0)
+			break;
+
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			(*dbw_log)(LOG_CRIT, "stats writer recv: %s", strerror(errno));
+			break;
+		}
+
+		if (n > DBW_MAX_RECORD ||
+			db_set_stats_serialized(dwa, buf, n, pst) != 0)
+				(*dbw_log)(LOG_CRIT,
+					"stats writer: bad record of %zd bytes", n);
+		else
+		{
+			++count;
+			if (db_stats_lost(dwa) && spool)
+				spool_append(spool, buf, n, dbw_log);
+		}
+	}
+
+	if (dbw_verbose >= 3)
+	{
+		(*dbw_log)(LOG_INFO, "stats writer exiting after %lu record(s)", count);
+		db_ref_cache_report(dwa);
+	}
+
+	free(buf);
+	db_clear(dwa);
+	_exit(0);
+}
+
+static void close_ends(void)
+{
+	if (dbw_sock >= 0)
+	{
+		close(dbw_sock);
+		dbw_sock = -1;
+	}
+	if (dbw_life >= 0)
+	{
+		close(dbw_life);
+		dbw_life = -1;
+	}
+	dbw_pid = 0;
+}
+
+static int spawn_writer(db_work_area *dwa, publicsuffix_trie *pst,
+	parm_t const *z)
+{
+	int const queue_kb = z->stats_writer_queue;
+	int sv[2], lp[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv))
+	{
+		(*dbw_log)(LOG_ERR, "stats writer socketpair: %s", strerror(errno));
+		return -1;
+	}
+
+	if (pipe(lp))
+	{
+		(*dbw_log)(LOG_ERR, "stats writer pipe: %s", strerror(errno));
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+
+	int sndbuf = queue_kb * 1024;
+	if (queue_kb > 0 &&
+		setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof sndbuf))
+		(*dbw_log)(LOG_WARNING, "cannot set stats writer queue to %dKB: %s",
+			queue_kb, strerror(errno));
+
+	sigset_t chld, old;
+	sigemptyset(&chld);
+	sigaddset(&chld, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &chld, &old);
+
+	pid_t const middle = fork();
+	if (middle == 0)
+	{
+		close(sv[0]);
+		close(lp[0]);
+		pid_t const writer = fork();
+		if (writer == 0)
+			run_writer(sv[1], lp[1], dwa, pst, z);
+		_exit(writer < 0);
+	}
+
+	close(sv[1]);
+	close(lp[1]);
+
+	int status = 1;
+	if (middle > 0)
+		while (waitpid(middle, &status, 0) < 0 && errno == EINTR)
+			continue;
+	sigprocmask(SIG_SETMASK, &old, NULL);
+
+	pid_t writer = 0;
+	ssize_t n = -1;
+	if (middle > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0)
+		while ((n = read(lp[0], &writer, sizeof writer)) < 0 && errno == EINTR)
+			continue;
+
+	if (n != sizeof writer)
+	{
+		if (middle < 0)
+			(*dbw_log)(LOG_ERR, "cannot fork stats writer: %s", strerror(errno));
+		else
+			(*dbw_log)(LOG_ERR, "stats writer did not start");
+		close(sv[0]);
+		close(lp[0]);
+		return -1;
+	}
+
+	fcntl(lp[0], F_SETFL, O_NONBLOCK);
+	dbw_sock = sv[0];
+	dbw_life = lp[0];
+	dbw_pid = writer;
+	if (dbw_verbose >= 3)
+		(*dbw_log)(LOG_INFO, "stats writer %d started, queue %dKB",
+			(int)writer, queue_kb);
+	return 0;
+}
+
+int dbw_check(db_work_area *dwa, publicsuffix_trie *pst, parm_t const *z,
+	void (*log)(int, char const*, ...))
+/*
+* Called by the parent before forking children.  Start the writer if it
+* is not running, or respawn it if it died.  Failed starts are retried
+* after DBW_RETRY_SPAWN seconds.
+*
+* return 0 if the writer is running.
+*/
+{
+	assert(z);
+
+	if (log)
+		dbw_log = log;
+	dbw_verbose = z->verbose;
+
+	if (dwa == NULL || (z->stats_writer_queue <= 0 && z->stats_spool == NULL &&
+		(z->domain_flags_snapshot == NULL || !db_flags_snapshot_defined(dwa))))
+			return -1;
+
+	if (dbw_life >= 0)
+	{
+		char c;
+		ssize_t const n = read(dbw_life, &c, 1);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			return 0;
+
+		(*dbw_log)(LOG_ERR, "stats writer %d died", (int)dbw_pid);
+		close_ends();
+	}
+
+	time_t const now = time(NULL);
+	if (dbw_failed && now - dbw_failed < DBW_RETRY_SPAWN)
+		return -1;
+
+	if (spawn_writer(dwa, pst, z))
+	{
+		dbw_failed = now;
+		return -1;
+	}
+
+	dbw_failed = 0;
+	return 0;
+}
+
+int dbw_send(db_work_area *dwa, stats_info const *info)
+/*
+* Called by a child.  Queue the stats for the writer without blocking.
+* return 0 if sent, -1 if the caller has to write them itself.
+*/
+{
+	assert(dwa);
+	assert(info);
+
+	if (dbw_sock < 0)
+		return -1;
+
+	char small[4096], *buf = small;
+	size_t const len = db_stats_serialize(dwa, info, buf, sizeof small);
+	if (len > DBW_MAX_RECORD)
+		return -1;
+
+	if (len > sizeof small)
+	{
+		if ((buf = malloc(len)) == NULL)
+			return -1;
+		db_stats_serialize(dwa, info, buf, len);
+	}
+
+	ssize_t const n = send(dbw_sock, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+	int const err = errno;
+	if (buf != small)
+		free(buf);
+
+	if (n == (ssize_t)len)
+		return 0;
+
+	if (dbw_verbose >= 6)
+		(*dbw_log)(LOG_INFO, "stats writer queue: %s, writing directly",
+			strerror(err));
+	return -1;
+}
+
+void dbw_report(void)
+/*
+* Called by the parent on SIGUSR1.  Have the writer log its cache usage.
+*/
+{
+	if (dbw_sock >= 0 && dbw_pid > 0)
+		kill(dbw_pid, SIGUSR1);
+}
+
+void dbw_stop(int wait)
+/*
+* Called by the parent, at exit or before a reload.  Close the sending end,
+* so that the writer exits after the children did.  If wait, give it some
+* time to drain the queue, then terminate it.
+*/
+{
+	if (dbw_sock < 0)
+		return;
+
+	close(dbw_sock);
+	dbw_sock = -1;
+
+	if (wait)
+	{
+		struct pollfd pfd;
+		pfd.fd = dbw_life;
+		pfd.events = POLLIN;
+		time_t const deadline = time(NULL) + DBW_STOP_WAIT;
+		for (;;)
+		{
+			time_t const now = time(NULL);
+			int const rc = now < deadline?
+				poll(&pfd, 1, (deadline - now) * 1000): 0;
+			if (rc < 0 && errno == EINTR)
+				continue;
+
+			char c;
+			if (rc > 0 && read(dbw_life, &c, 1) != 0)
+				continue;
+
+			if (rc <= 0)
+			{
+				(*dbw_log)(LOG_WARNING,
+					"stats writer %d not done after %d secs, terminating",
+					(int)dbw_pid, DBW_STOP_WAIT);
+				kill(dbw_pid, SIGTERM);
+			}
+			break;
+		}
+	}
+
+	close_ends();
+}
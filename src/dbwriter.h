@@ -0,0 +1,17 @@
+/*
+** dbwriter.h - written in milano by vesely on 19oct2026
+** long-lived process writing stats to the database
+*/
+
+#if !defined DBWRITER_H_INCLUDED
+
+#include "database.h"
+
+int dbw_check(db_work_area *dwa, publicsuffix_trie *pst, parm_t const *z,
+	void (*log)(int, char const*, ...));
+int dbw_send(db_work_area *dwa, stats_info const *info);
+void dbw_report(void);
+void dbw_stop(int wait);
+
+#define DBWRITER_H_INCLUDED
+#endif
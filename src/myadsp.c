@@ -53,9 +53,12 @@ zdkimfilter grants you additional permission to convey the resulting work.
 #include <resolv.h>
 
 #include "myadsp.h"
+#include "mydns.h"
 #include "util.h"
 #if defined TEST_MAIN
 #include <unistd.h> // isatty
+#include <stdarg.h>
+#include <time.h>
 #endif
 #include <assert.h>
 
@@ -99,7 +102,7 @@ return 0; (void)query, (void)len_d, (void)len_sub, (void)parse_fn, (void)parse_a
 	// res_query returns -1 for NXDOMAIN
 	unsigned int qtype;
 	char *query_cmp = query;
-	int rc = res_query(query, 1 /* Internet */, qtype = 16 /* TXT */,
+	int rc = my_res_query(query, 1 /* Internet */, qtype = 16 /* TXT */,
 		buf.answer, sizeof buf.answer);
 
 	if (rc < 0)
@@ -124,7 +127,7 @@ return 0; (void)query, (void)len_d, (void)len_sub, (void)parse_fn, (void)parse_a
 		};
 		for (size_t t = 0; t < sizeof try_qtype/ sizeof try_qtype[0]; ++t)
 		{
-			rc = res_query(query_cmp, 1 /* Internet */, qtype = try_qtype[t],
+			rc = my_res_query(query_cmp, 1 /* Internet */, qtype = try_qtype[t],
 				buf.answer, sizeof buf.answer);
 			if (rc >= 0)
 				break;
@@ -234,6 +237,8 @@ return 0; (void)query, (void)len_d, (void)len_sub, (void)parse_fn, (void)parse_a
 static int (*txt_query)(char*, size_t, size_t, int (*)(char*, void*), void*) =
 	&do_txt_query;
 
+static bool dmarc_prefetch; // see set_dmarc_prefetch()
+
 static char *skip_fws(char *s)
 {
 	if (s)
@@ -931,6 +936,30 @@ int verify_dmarc_addr(char const *poldo, char const *rcptdo,
 	return rtc;
 }
 
+static int prefetch_txt(char const *subdomain, char const *domain)
+// start the query that do_txt_query() will need, return as dns_prefetch()
+{
+#if defined NO_DNS_QUERY
+return 1; (void)subdomain, (void)domain;
+#else
+	if (txt_query != &do_txt_query || domain == NULL || *domain == 0)
+		return 1;
+
+	char query[NS_BUFFER_SIZE];
+	if ((size_t)snprintf(query, sizeof query, "%s%s", subdomain, domain) >=
+		sizeof query)
+			return -1;
+
+	return dns_prefetch(query, 16 /* TXT */);
+#endif
+}
+
+void set_dmarc_prefetch(int on)
+// with dns_prefetch, get_dmarc() queries both domains at once
+{
+	dmarc_prefetch = on != 0;
+}
+
 int get_dmarc(char const *domain, char const *org_domain, dmarc_rec *dmarc)
 // run query and return:
 //   0  and a response if found
@@ -962,6 +991,16 @@ int get_dmarc(char const *domain, char const *org_domain, dmarc_rec *dmarc)
 	strcat(&query[len_sub], domain);
 
 	int found_at_org = 0;
+	bool const try_org =
+		org_domain && *org_domain && strcmp(domain, org_domain);
+
+	/*
+	* With dns_prefetch, if the organizational domain may have to be queried,
+	* send both queries at once.  Precedence is applied below, as if
+	* sequential.
+	*/
+	if (dmarc_prefetch && try_org && prefetch_txt(subdomain, domain) == 0)
+		prefetch_txt(subdomain, org_domain);
 
 	int rtc = (*txt_query)(query, len_d, len_sub, parse_dmarc, dmarc);
 	/*
@@ -974,7 +1013,7 @@ int get_dmarc(char const *domain, char const *org_domain, dmarc_rec *dmarc)
        records is returned.	
 	*/
 
-	if (rtc != 1 && org_domain && *org_domain && strcmp(domain, org_domain))
+	if (rtc != 1 && try_org)
 	{
 		found_at_org = 1;
 		len_d = strlen(org_domain) + len_sub;
@@ -1000,6 +1039,16 @@ int get_dmarc(char const *domain, char const *org_domain, dmarc_rec *dmarc)
 	return rtc == -4? 3: rtc >= 0? rtc != 1: rtc;
 }
 
+int prefetch_dmarc(char const *domain, char const *org_domain)
+// start the queries get_dmarc() is going to do
+{
+	int rtc = prefetch_txt("_dmarc.", domain);
+	if (rtc >= 0 && org_domain && *org_domain && domain &&
+		strcmp(domain, org_domain))
+			rtc = prefetch_txt("_dmarc.", org_domain);
+	return rtc;
+}
+
 char const *presult_explain(int rtc)
 {
 	if (rtc == 0) return "found";
@@ -1036,6 +1085,16 @@ static void disp_dmarc(dmarc_rec *dmarc)
 	free(rua2);
 }
 
+static void printlog(int severity, char const *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	putchar('\n');
+	(void)severity;
+}
+
 int main(int argc, char *argv[])
 {
 	if (argc >= 2)
@@ -1061,6 +1120,7 @@ int main(int argc, char *argv[])
 		}
 		else for (int i = 1; i < argc; ++i)
 		{
+			static char const *org_domain;
 			int policy = 0;
 			char *a = argv[i];
 			if (a[0] == '-' && strchr("rkp", a[1]) && a[2] == 0)
@@ -1068,9 +1128,40 @@ int main(int argc, char *argv[])
 				set_adsp_query_faked(a[1]);
 				continue;
 			}
+			if (strcmp(a, "-z") == 0 && i + 1 < argc)
+			{
+				int bad_line = 0;
+				char const *fname = argv[++i];
+				if (dns_zone_load(fname, &bad_line) < 0)
+					printf("cannot load %s (line %d)\n", fname, bad_line);
+				set_adsp_query_faked('r');
+				continue;
+			}
+			if (strcmp(a, "-b") == 0 && i + 1 < argc)
+			{
+				dns_health_init(2, 1, atoi(argv[++i]), 0, &printlog);
+				continue;
+			}
+			if (strcmp(a, "-o") == 0 && i + 1 < argc)
+			{
+				org_domain = argv[++i];
+				continue;
+			}
+			if (strcmp(a, "-P") == 0)
+			{
+				set_dmarc_prefetch(1);
+				continue;
+			}
 			dmarc_rec dmarc;
 			memset(&dmarc, 0, sizeof dmarc);
-			int rtc = get_dmarc(a, NULL, &dmarc);
+			struct timespec start, end;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			int rtc = get_dmarc(a, org_domain, &dmarc);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			if (org_domain)
+				printf("dmarc lookup took %ld ms\n",
+					(long)((end.tv_sec - start.tv_sec) * 1000 +
+					(end.tv_nsec - start.tv_nsec) / 1000000));
 			printf("rtc = %d %s\n", rtc, presult_explain(rtc));
 			if (rtc == 0)
 				disp_dmarc(&dmarc);
@@ -1078,9 +1169,11 @@ int main(int argc, char *argv[])
 			printf("rtc = %d %s, policy = %d\n\n",
 				rtc, presult_explain(rtc), policy);
 		}
+		dns_health_report();
 	}
 	else
-		printf("Usage:\n\t%s domain...\nor\n\t%s --parse dmarc-record...\n",
+		printf("Usage:\n\t%s [-r|-k|-p|-z zonefile|-b failures|-o org|-P] domain...\n"
+			"or\n\t%s --parse dmarc-record...\n",
 			argv[0], argv[0]);
 	return 0;
 }
@@ -67,7 +67,9 @@ typedef struct dmarc_rec
 
 int set_adsp_query_faked(int mode);
 int my_get_adsp(char const *domain, int *policy);
+void set_dmarc_prefetch(int on);
 int get_dmarc(char const *domain, char const *org_domain, dmarc_rec *dmarc);
+int prefetch_dmarc(char const *domain, char const *org_domain);
 int verify_dmarc_addr(char const *poldo, char const *rcptdo,
 	char **override, char **badout);
 char* write_dmarc_rec(dmarc_rec const *dmarc);
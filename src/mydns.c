@@ -0,0 +1,1447 @@
+/*
+** mydns.c - written in milano by vesely on 19oct2026
+** dns query front end with asynchronous prefetch
+*/
+/*
+* zdkimfilter - Sign outgoing, verify incoming mail messages
+
+Copyright (C) 2026 Alessandro Vesely
+
+This file is part of zdkimfilter
+
+zdkimfilter is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+zdkimfilter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License version 3
+along with zdkimfilter.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPLv3 section 7:
+
+If you modify zdkimfilter, or any covered work, by linking or combining it
+with software developed by The OpenDKIM Project and its contributors,
+containing parts covered by the applicable licence, the licensor or
+zdkimfilter grants you additional permission to convey the resulting work.
+*/
+#include <config.h>
+#if !ZDKIMFILTER_DEBUG
+#define NDEBUG
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#if defined HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+#include <sys/socket.h>
+#if defined HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+#include <arpa/inet.h>
+#if defined HAVE_ARPA_NAMESER_H
+#include <arpa/nameser.h>
+#endif
+#if defined HAVE_NETDB_H
+#include <netdb.h>
+#endif
+#include <resolv.h>
+
+#include "mydns.h"
+#include "shmlock.h"
+#include <assert.h>
+
+/*
+* Prefetched queries are sent over UDP to the first configured name server
+* as soon as the caller knows what it will ask.  Answers are collected by
+* my_res_query(), which the query modules call instead of res_query().  An
+* answer that was not received in time, or carries a server failure, is not
+* used, and the regular resolver is called as usual.  A truncated answer is
+* asked again over TCP.
+*
+* Prefetches are meant to live for the duration of a message:  call
+* dns_prefetch_clear() when done.  An answer is used once, and entries older
+* than PREFETCH_STALE seconds are recycled.
+*
+* For testing, a zone file can be loaded with dns_zone_load().  Thereafter,
+* all queries are answered from that file, simulating network behavior.
+*
+* After dns_health_init(), queries are timed and their outcome is recorded
+* per zone in a table shared among forked processes.  Timeouts then adapt to
+* the latency observed for each zone, and a circuit breaker can stop
+* querying zones that keep failing.
+*/
+
+#define NS_BUFFER_SIZE 1536
+#define PREFETCH_MAX 32
+#define PREFETCH_STALE 60
+
+typedef enum prefetch_state
+{
+	pf_unused,
+	pf_pending,
+	pf_answered,
+	pf_truncated,
+	pf_failed,
+	pf_expired
+} prefetch_state;
+
+typedef struct prefetch_entry
+{
+	unsigned char *answer; // malloc'd if pf_answered
+	struct timespec sent;
+	long delay;            // ms after sent, for simulated answers
+	long rtt;              // ms, if pf_answered
+	int len;
+	int qtype;
+	unsigned short id;
+	unsigned char state;
+	char name[NS_MAXDNAME];
+} prefetch_entry;
+
+static prefetch_entry pf_table[PREFETCH_MAX];
+static int pf_count;
+static int pf_sock = -1;
+
+/*
+* Zone file.  Besides standard $ORIGIN and $TTL (default 3600), the following
+* directives control the simulation:
+*
+*   $LATENCY ms [name]   delay answers for name and its subdomains,
+*                        or for any name if none is given;
+*   $LOSS percent [name] drop that many queries, deterministically;
+*   $SERVFAIL name       answer SERVFAIL for name and its subdomains;
+*   $TIMEOUT ms          time spent on a lost query, default 5000.
+*
+* A and TXT records are served.  Other types make their name exist, for
+* NODATA answers.  Names not in the zone, nor having subdomains in it, get
+* NXDOMAIN.
+*/
+
+typedef struct zone_rr
+{
+	struct zone_rr *next;
+	int type;
+	unsigned long ttl;
+	size_t rdlength;
+	unsigned char rdata[];
+} zone_rr;
+
+typedef struct zone_name
+{
+	struct zone_name *next;
+	zone_rr *rr;
+	long latency;      // ms, if has_latency
+	unsigned queries;  // counted for loss
+	int loss;          // percent, if has_loss
+	unsigned int in_zone:1;  // has records, possibly of other types
+	unsigned int has_latency:1;
+	unsigned int has_loss:1;
+	unsigned int servfail:1;
+	char name[];
+} zone_name;
+
+static struct zone_data
+{
+	zone_name *head;
+	long latency, timeout;
+	unsigned long ttl;
+	unsigned queries;
+	int loss;
+	bool loaded;
+} zone = {NULL, 0, 5000, 3600, 0, 0, false};
+
+static void zone_clear(void)
+{
+	zone_name *zn = zone.head;
+	while (zn)
+	{
+		zone_name *const next = zn->next;
+		zone_rr *rr = zn->rr;
+		while (rr)
+		{
+			zone_rr *const rnext = rr->next;
+			free(rr);
+			rr = rnext;
+		}
+		free(zn);
+		zn = next;
+	}
+	memset(&zone, 0, sizeof zone);
+	zone.timeout = 5000;
+	zone.ttl = 3600;
+}
+
+static char *zone_normalize(char *name)
+// lower case, no trailing dot
+{
+	char *s = name;
+	for (; *s; ++s)
+		*s = tolower(*(unsigned char*)s);
+	if (s > name && s[-1] == '.')
+		s[-1] = 0;
+	return name;
+}
+
+static zone_name *zone_find(char const *name, bool create)
+{
+	for (zone_name *zn = zone.head; zn; zn = zn->next)
+		if (strcmp(zn->name, name) == 0)
+			return zn;
+
+	if (!create)
+		return NULL;
+
+	size_t const len = strlen(name);
+	zone_name *const zn = calloc(1, sizeof *zn + len + 1);
+	if (zn)
+	{
+		memcpy(zn->name, name, len + 1);
+		zn->next = zone.head;
+		zone.head = zn;
+	}
+	return zn;
+}
+
+static bool is_subdomain(char const *sub, size_t len_sub,
+	char const *name, size_t len_name)
+// true if sub is name or a subdomain of name
+{
+	return len_sub >= len_name &&
+		strcmp(sub + len_sub - len_name, name) == 0 &&
+		(len_sub == len_name || sub[len_sub - len_name - 1] == '.');
+}
+
+static char const *zone_qualify(char const *tok, char const *origin,
+	char *buf, size_t size)
+{
+	if (strcmp(tok, "@") == 0)
+		tok = origin;
+	else
+	{
+		size_t const len = strlen(tok);
+		if (len && tok[len - 1] != '.' && *origin)
+		{
+			if ((size_t)snprintf(buf, size, "%s.%s", tok, origin) >= size)
+				return NULL;
+			return zone_normalize(buf);
+		}
+	}
+
+	if (strlen(tok) >= size)
+		return NULL;
+	return zone_normalize(strcpy(buf, tok));
+}
+
+static int zone_add_rr(zone_name *zn, int type, unsigned long ttl,
+	char **rdata, int ntok)
+{
+	size_t rdlength = 0;
+	unsigned char a[4];
+	if (type == 1) // A
+	{
+		if (ntok != 1 || inet_pton(AF_INET, rdata[0], a) != 1)
+			return -1;
+		rdlength = sizeof a;
+	}
+	else if (type == 16) // TXT
+	{
+		if (ntok < 1)
+			return -1;
+		for (int i = 0; i < ntok; ++i)
+		{
+			size_t const len = strlen(rdata[i]);
+			rdlength += len + (len + 254) / 255 + (len == 0);
+		}
+		if (rdlength > 65535)
+			return -1;
+	}
+	else
+		return 0; // name exists, nothing to serve
+
+	zone_rr *const rr = malloc(sizeof *rr + rdlength);
+	if (rr == NULL)
+		return -1;
+
+	rr->type = type;
+	rr->ttl = ttl;
+	rr->rdlength = rdlength;
+	if (type == 1)
+		memcpy(rr->rdata, a, sizeof a);
+	else
+	{
+		unsigned char *p = rr->rdata;
+		for (int i = 0; i < ntok; ++i)
+		{
+			char const *s = rdata[i];
+			size_t len = strlen(s);
+			do // split long strings in <character-string>s
+			{
+				size_t const chunk = len > 255? 255: len;
+				*p++ = (unsigned char)chunk;
+				memcpy(p, s, chunk);
+				p += chunk;
+				s += chunk;
+				len -= chunk;
+			} while (len > 0);
+		}
+	}
+
+	// keep records in file order
+	zone_rr **last = &zn->rr;
+	while (*last)
+		last = &(*last)->next;
+	rr->next = NULL;
+	*last = rr;
+	return 1;
+}
+
+static int zone_record(char **tok, int ntok, bool same_owner,
+	char *origin, char *owner)
+/*
+* Process a record or a directive, origin and owner are NS_MAXDNAME long.
+* Return 1 if a record was added, 0 if not, -1 on error.
+*/
+{
+	char buf[NS_MAXDNAME];
+	if (ntok == 0)
+		return 0;
+
+	if (!same_owner && tok[0][0] == '$')
+	{
+		char *const d = tok[0] + 1;
+		zone_name *zn = NULL;
+		if (ntok == 3 || (ntok == 2 && strcasecmp(d, "SERVFAIL") == 0))
+		{
+			char const *const name = zone_qualify(tok[ntok - 1], origin,
+				buf, sizeof buf);
+			if (name == NULL || (zn = zone_find(name, true)) == NULL)
+				return -1;
+		}
+
+		char *t = NULL;
+		long const l = ntok >= 2? strtol(tok[1], &t, 10): 0;
+		bool const num = t && *t == 0 && l >= 0;
+
+		if (strcasecmp(d, "ORIGIN") == 0 && ntok == 2)
+		{
+			if (zone_qualify(tok[1], origin, buf, sizeof buf) == NULL)
+				return -1;
+			strcpy(origin, buf);
+		}
+		else if (strcasecmp(d, "TTL") == 0 && num && ntok == 2)
+			zone.ttl = l;
+		else if (strcasecmp(d, "LATENCY") == 0 && num)
+		{
+			if (zn)
+			{
+				zn->latency = l;
+				zn->has_latency = 1;
+			}
+			else
+				zone.latency = l;
+		}
+		else if (strcasecmp(d, "LOSS") == 0 && num && l <= 100)
+		{
+			if (zn)
+			{
+				zn->loss = (int)l;
+				zn->has_loss = 1;
+			}
+			else
+				zone.loss = (int)l;
+		}
+		else if (strcasecmp(d, "SERVFAIL") == 0 && zn)
+			zn->servfail = 1;
+		else if (strcasecmp(d, "TIMEOUT") == 0 && num && ntok == 2)
+			zone.timeout = l;
+		else
+			return -1;
+		return 0;
+	}
+
+	int i = 0;
+	if (!same_owner)
+	{
+		char const *const name = zone_qualify(tok[i++], origin,
+			buf, sizeof buf);
+		if (name == NULL)
+			return -1;
+		strcpy(owner, name);
+	}
+	if (*owner == 0)
+		return -1;
+
+	// optional ttl and class, in any order
+	unsigned long ttl = zone.ttl;
+	for (int j = 0; j < 2 && i < ntok; ++j)
+		if (isdigit(*(unsigned char*)tok[i]))
+			ttl = strtoul(tok[i++], NULL, 10);
+		else if (strcasecmp(tok[i], "IN") == 0)
+			++i;
+
+	if (i >= ntok)
+		return -1;
+
+	char const *const type_name = tok[i++];
+	int const type =
+		strcasecmp(type_name, "A") == 0? 1:
+		strcasecmp(type_name, "TXT") == 0? 16: 0;
+
+	zone_name *const zn = zone_find(owner, true);
+	if (zn == NULL)
+		return -1;
+
+	zn->in_zone = 1;
+	return zone_add_rr(zn, type, ttl, &tok[i], ntok - i);
+}
+
+#define ZONE_MAX_TOKENS 64
+
+int dns_zone_load(char const *fname, int *bad_line)
+/*
+* Load the zone, replacing any previous one.  Return the number of records
+* loaded, or -1 on error.  Malformed lines are skipped, and the first one
+* is reported in bad_line, if given.  A NULL fname unloads the zone.
+*/
+{
+	zone_clear();
+	if (bad_line)
+		*bad_line = 0;
+	if (fname == NULL)
+		return 0;
+
+	FILE *fp = fopen(fname, "r");
+	if (fp == NULL)
+		return -1;
+
+	char *text = NULL, *scratch = NULL;
+	long size = -1;
+	if (fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) >= 0 &&
+		fseek(fp, 0, SEEK_SET) == 0 &&
+		(text = malloc(size + 1)) != NULL &&
+		(scratch = malloc(size + 1)) != NULL &&
+		fread(text, 1, size, fp) == (size_t)size)
+			text[size] = 0;
+	else
+		size = -1;
+	fclose(fp);
+
+	if (size < 0)
+	{
+		free(text);
+		free(scratch);
+		return -1;
+	}
+
+	char origin[NS_MAXDNAME], owner[NS_MAXDNAME];
+	origin[0] = owner[0] = 0;
+
+	int count = 0, line = 1;
+	char *p = text;
+	while (*p)
+	{
+		char *tok[ZONE_MAX_TOKENS];
+		int ntok = 0, paren = 0, record_line = line;
+		bool const same_owner = *p == ' ' || *p == '\t';
+		bool bad = false;
+		char *d = scratch;
+
+		for (;;)
+		{
+			while (*p == ' ' || *p == '\t' || *p == '\r')
+				++p;
+			if (*p == ';')
+				while (*p && *p != '\n')
+					++p;
+			if (*p == 0)
+				break;
+			if (*p == '\n')
+			{
+				++p;
+				++line;
+				if (paren)
+					continue;
+				break;
+			}
+			if (*p == '(' || *p == ')')
+			{
+				paren += *p++ == '('? 1: paren? -1: 0;
+				continue;
+			}
+
+			if (ntok >= ZONE_MAX_TOKENS)
+				bad = true;
+			else
+				tok[ntok++] = d;
+
+			if (*p == '"')
+			{
+				++p;
+				while (*p && *p != '"' && *p != '\n')
+				{
+					if (*p == '\\' && p[1])
+					{
+						++p;
+						if (isdigit(*(unsigned char*)p) &&
+							isdigit(((unsigned char*)p)[1]) &&
+							isdigit(((unsigned char*)p)[2]))
+						{
+							*d++ = (char)((p[0] - '0') * 100 +
+								(p[1] - '0') * 10 + p[2] - '0');
+							p += 3;
+							continue;
+						}
+					}
+					*d++ = *p++;
+				}
+				if (*p == '"')
+					++p;
+				else
+					bad = true;
+			}
+			else
+				while (*p && strchr(" \t\r\n;()\"", *p) == NULL)
+					*d++ = *p++;
+			*d++ = 0;
+		}
+
+		int const rtc = bad? -1:
+			zone_record(tok, ntok, same_owner, origin, owner);
+		if (rtc > 0)
+			count += rtc;
+		else if (rtc < 0 && bad_line && *bad_line == 0)
+			*bad_line = record_line;
+	}
+
+	free(text);
+	free(scratch);
+	zone.loaded = true;
+	return count;
+}
+
+static int zone_answer(char const *qname, int type,
+	unsigned char *answer, int anslen, long *delay)
+/*
+* Build the answer packet and set the simulated delay.
+* Return the packet length, or -1 for a lost query.
+*/
+{
+	char name[NS_MAXDNAME];
+	if (strlen(qname) >= sizeof name)
+		return -1;
+	zone_normalize(strcpy(name, qname));
+	size_t const len_name = strlen(name);
+
+	// simulation settings by longest match
+	long latency = zone.latency;
+	int loss = zone.loss;
+	unsigned *queries = &zone.queries;
+	bool servfail = false, exists = false;
+	size_t best_latency = 0, best_loss = 0;
+	zone_name *exact = NULL;
+	for (zone_name *zn = zone.head; zn; zn = zn->next)
+	{
+		size_t const len = strlen(zn->name);
+		if (is_subdomain(name, len_name, zn->name, len))
+		{
+			if (len == len_name)
+				exact = zn;
+			if (zn->servfail)
+				servfail = true;
+			if (zn->has_latency && len >= best_latency)
+			{
+				best_latency = len;
+				latency = zn->latency;
+			}
+			if (zn->has_loss && len >= best_loss)
+			{
+				best_loss = len;
+				loss = zn->loss;
+				queries = &zn->queries;
+			}
+		}
+		if (!exists && zn->in_zone &&
+			is_subdomain(zn->name, len, name, len_name))
+				exists = true;
+	}
+
+	unsigned const q = (*queries)++;
+	if ((q + 1) * loss / 100 != q * loss / 100)
+	{
+		*delay = zone.timeout;
+		return -1;
+	}
+	*delay = latency;
+
+	int len = res_mkquery(QUERY, name, 1 /* Internet */, type,
+		NULL, 0, NULL, answer, anslen);
+	if (len < 0)
+		return -1;
+
+	HEADER *const h = (HEADER*)answer;
+	h->qr = h->aa = h->ra = 1;
+	h->rcode = servfail? SERVFAIL: exists? NOERROR: NXDOMAIN;
+
+	unsigned ancount = 0;
+	if (exact && !servfail)
+		for (zone_rr *rr = exact->rr; rr; rr = rr->next)
+		{
+			if (rr->type != type)
+				continue;
+
+			if (len + 12 + (int)rr->rdlength > anslen)
+			{
+				h->tc = 1;
+				break;
+			}
+
+			unsigned char *cp = answer + len;
+			ns_put16(0xc000 | HFIXEDSZ, cp); // pointer to question name
+			ns_put16(type, cp + 2);
+			ns_put16(1, cp + 4);  // class Internet
+			ns_put32(rr->ttl, cp + 6);
+			ns_put16(rr->rdlength, cp + 10);
+			memcpy(cp + 12, rr->rdata, rr->rdlength);
+			len += 12 + rr->rdlength;
+			++ancount;
+		}
+	h->ancount = htons(ancount);
+
+	return len;
+}
+
+static void sleep_ms(long ms)
+{
+	if (ms > 0)
+	{
+		struct timespec ts, rem;
+		ts.tv_sec = ms / 1000;
+		ts.tv_nsec = (ms % 1000) * 1000000L;
+		while (nanosleep(&ts, &rem) != 0 && errno == EINTR)
+			ts = rem;
+	}
+}
+
+int dns_zone_query(char const *name, int type, unsigned char *answer,
+	int anslen)
+/*
+* Answer from the zone, after simulated latency.  Return the packet length,
+* including NXDOMAIN and SERVFAIL packets, or -1 for a lost query.
+*/
+{
+	long delay = 0;
+	int const len = zone_answer(name, type, answer, anslen, &delay);
+	sleep_ms(delay);
+	return len;
+}
+
+/*
+* Zone health.  The zone of a name is what follows its last underscore
+* label (_dmarc, _domainkey, _vouch, ...) or hash label (reputation), or the
+* name itself.  Each zone has a histogram of latencies, where bucket b
+* counts answers that took less than 2^b ms.  With adaptive timeouts, a
+* query waits twice the upper bound of the bucket holding the 99th
+* percentile, within HEALTH_MIN_TIMEOUT and the configured timeout.  A
+* timeout counts as a sample of its length, so that a too short timeout
+* grows by itself.
+*
+* Timeouts and error answers are failures.  After the configured number of
+* consecutive failures the breaker opens, and queries to that zone fail
+* immediately for the cool-down period.  Then a single probe is let through;
+* its outcome closes or reopens the breaker.
+*/
+
+#define HEALTH_SLOTS 256
+#define HEALTH_PROBE 8
+#define HEALTH_BUCKETS 16
+#define HEALTH_MIN_SAMPLES 20
+#define HEALTH_MAX_SAMPLES 1000  // then halve the histogram
+#define HEALTH_MIN_TIMEOUT 250   // ms
+#define HEALTH_COOLDOWN 60       // secs
+#define HEALTH_ZONE_LEN 128
+
+typedef enum breaker_state
+{
+	breaker_closed,
+	breaker_open,
+	breaker_half_open
+} breaker_state;
+
+typedef enum health_outcome
+{
+	outcome_ok,
+	outcome_timeout,
+	outcome_error
+} health_outcome;
+
+typedef struct zone_health
+{
+	time_t last_used, open_until;
+	unsigned long queries, timeouts, errors, short_circuits, trips, recoveries;
+	unsigned hist[HEALTH_BUCKETS];
+	unsigned samples, failures;  // failures are consecutive
+	unsigned char state;
+	char zone[HEALTH_ZONE_LEN];
+} zone_health;
+
+typedef struct health_table
+{
+	shm_lock lock;
+	long max_timeout;            // ms, 0 for the resolver's
+	int failures, cooldown;
+	bool adaptive;
+	zone_health slot[HEALTH_SLOTS];
+} health_table;
+
+static health_table *health;
+static void (*health_log)(int, char const*, ...) = &syslog;
+
+static bool health_lock(void)
+// false if the table cannot be used
+{
+	int const rc = shm_lock_acquire(&health->lock);
+	if (rc > 0) // the holder died midway, forget all zones
+		memset(health->slot, 0, sizeof health->slot);
+	return rc >= 0;
+}
+
+static void health_unlock(void)
+{
+	shm_lock_release(&health->lock);
+}
+
+static char *health_zone(char const *name, char *zone)
+{
+	char const *z = name, *label = name;
+	for (;;)
+	{
+		char const *const dot = strchr(label, '.');
+		if (dot == NULL)
+			break;
+
+		if (*label == '_' || dot - label >= 32)
+			z = dot + 1;
+		label = dot + 1;
+	}
+
+	size_t len = strlen(z);
+	if (len && z[len - 1] == '.')
+		--len;
+	if (len == 0 || len >= HEALTH_ZONE_LEN)
+		return NULL;
+
+	for (size_t i = 0; i < len; ++i)
+		zone[i] = tolower(((unsigned char const*)z)[i]);
+	zone[len] = 0;
+	return zone;
+}
+
+static zone_health *health_find(char const *name)
+// call locked; a new zone takes a free slot, or evicts the least recently used
+{
+	char zone[HEALTH_ZONE_LEN];
+	if (health_zone(name, zone) == NULL)
+		return NULL;
+
+	unsigned h = 2166136261U; // FNV-1a
+	for (unsigned char const *s = (unsigned char const*)zone; *s; ++s)
+		h = (h ^ *s) * 16777619U;
+
+	zone_health *victim = NULL;
+	for (int i = 0; i < HEALTH_PROBE; ++i)
+	{
+		zone_health *const zh = &health->slot[(h + i) % HEALTH_SLOTS];
+		if (strcmp(zh->zone, zone) == 0)
+			return zh;
+
+		if (zh->zone[0] == 0)
+		{
+			victim = zh;
+			break;
+		}
+
+		if (victim == NULL || zh->last_used < victim->last_used)
+			victim = zh;
+	}
+
+	memset(victim, 0, sizeof *victim);
+	strcpy(victim->zone, zone);
+	return victim;
+}
+
+static long health_max_timeout(void)
+{
+	if (health && health->max_timeout > 0)
+		return health->max_timeout;
+
+	return (_res.retrans > 0? _res.retrans: RES_TIMEOUT) * 1000L;
+}
+
+static long health_p99(zone_health const *zh)
+// upper bound of the bucket holding the 99th percentile
+{
+	unsigned long sum = 0;
+	for (int b = 0; b < HEALTH_BUCKETS; ++b)
+	{
+		sum += zh->hist[b];
+		if (sum * 100 >= zh->samples * 99UL)
+			return 1L << b;
+	}
+	return 1L << (HEALTH_BUCKETS - 1);
+}
+
+static long health_timeout(zone_health const *zh)
+{
+	long const max = health_max_timeout();
+	if (!health->adaptive || zh->samples < HEALTH_MIN_SAMPLES)
+		return max;
+
+	long const timeout = 2 * health_p99(zh);
+	return timeout < HEALTH_MIN_TIMEOUT? HEALTH_MIN_TIMEOUT:
+		timeout > max? max: timeout;
+}
+
+static bool health_blocked(char const *name)
+// peek at the breaker, for prefetching
+{
+	if (health == NULL || !health_lock())
+		return false;
+
+	zone_health const *const zh = health_find(name);
+	bool const blocked = zh && zh->state != breaker_closed &&
+		time(NULL) < zh->open_until;
+	health_unlock();
+	return blocked;
+}
+
+static int health_begin(char const *name, long *timeout)
+/*
+* Account a query.  Return -1 if the breaker is open, otherwise 0 and set
+* the timeout.
+*/
+{
+	*timeout = health_max_timeout();
+	if (health == NULL)
+		return 0;
+
+	int rtc = 0;
+	bool probe = false;
+	char zone[HEALTH_ZONE_LEN];
+	if (!health_lock())
+		return 0;
+
+	zone_health *const zh = health_find(name);
+	if (zh)
+	{
+		time_t const now = time(NULL);
+		zh->last_used = now;
+		zh->queries += 1;
+		if (zh->state != breaker_closed && now < zh->open_until)
+		{
+			zh->short_circuits += 1;
+			rtc = -1;
+		}
+		else
+		{
+			*timeout = health_timeout(zh);
+			if (zh->state != breaker_closed)
+			{
+				// hold other queries while this one probes
+				probe = zh->state == breaker_open;
+				zh->state = breaker_half_open;
+				zh->open_until = now + (*timeout + 999) / 1000;
+				strcpy(zone, zh->zone);
+			}
+		}
+	}
+	health_unlock();
+
+	if (probe)
+		(*health_log)(LOG_INFO, "DNS breaker for %s half-open, probing", zone);
+	return rtc;
+}
+
+static void health_end(char const *name, long ms, health_outcome outcome)
+// record the outcome of a query
+{
+	if (health == NULL)
+		return;
+
+	breaker_state transition = breaker_half_open;  // means none
+	unsigned failures = 0;
+	int cooldown = 0;
+	char zone[HEALTH_ZONE_LEN];
+	if (!health_lock())
+		return;
+
+	zone_health *const zh = health_find(name);
+	if (zh)
+	{
+		time_t const now = time(NULL);
+		zh->last_used = now;
+		if (outcome != outcome_error)
+		{
+			int b = 0;
+			while (b < HEALTH_BUCKETS - 1 && (1L << b) <= ms)
+				++b;
+			zh->hist[b] += 1;
+			if (++zh->samples >= HEALTH_MAX_SAMPLES)
+			{
+				zh->samples = 0;
+				for (b = 0; b < HEALTH_BUCKETS; ++b)
+					zh->samples += zh->hist[b] /= 2;
+			}
+		}
+
+		if (outcome == outcome_ok)
+		{
+			zh->failures = 0;
+			if (zh->state != breaker_closed)
+			{
+				zh->state = transition = breaker_closed;
+				zh->recoveries += 1;
+			}
+		}
+		else
+		{
+			if (outcome == outcome_timeout)
+				zh->timeouts += 1;
+			else
+				zh->errors += 1;
+			failures = ++zh->failures;
+			if (zh->state == breaker_half_open ||
+				(zh->state == breaker_closed && health->failures > 0 &&
+					zh->failures >= (unsigned)health->failures))
+			{
+				zh->state = transition = breaker_open;
+				zh->open_until = now + (cooldown = health->cooldown);
+				zh->trips += 1;
+			}
+		}
+		strcpy(zone, zh->zone);
+	}
+	health_unlock();
+
+	if (transition == breaker_open)
+		(*health_log)(LOG_NOTICE,
+			"DNS breaker for %s open for %d secs after %u failure(s)",
+			zone, cooldown, failures);
+	else if (transition == breaker_closed)
+		(*health_log)(LOG_INFO, "DNS breaker for %s closed", zone);
+}
+
+int dns_health_init(int timeout, int adaptive, int failures, int cooldown,
+	void (*log)(int, char const*, ...))
+/*
+* Create the shared table, or adjust its parameters; call before forking.
+* timeout is the maximum in seconds, 0 for the resolver's, failures is the
+* threshold for opening the breaker, 0 for never, and cooldown is in
+* seconds.  With neither adaptive timeouts nor breaker, drop the table.
+* Return 0 on success, -1 on error.
+*/
+{
+	if (log)
+		health_log = log;
+
+	if (!adaptive && failures <= 0)
+	{
+		if (health)
+		{
+			munmap(health, sizeof *health);
+			health = NULL;
+		}
+		return 0;
+	}
+
+	if (health == NULL)
+	{
+		void *const p = mmap(NULL, sizeof *health, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			return -1;
+		if (shm_lock_init(&((health_table*)p)->lock))
+		{
+			munmap(p, sizeof *health);
+			return -1;
+		}
+		health = p;
+	}
+
+	health->max_timeout = timeout > 0? timeout * 1000L: 0;
+	health->adaptive = adaptive != 0;
+	health->failures = failures > 0? failures: 0;
+	health->cooldown = cooldown > 0? cooldown: HEALTH_COOLDOWN;
+	return 0;
+}
+
+void dns_health_report(void)
+// log a line for each zone; racy reads are good enough here
+{
+	if (health == NULL)
+		return;
+
+	static char const *const state_name[] = {"closed", "open", "half-open"};
+	for (int i = 0; i < HEALTH_SLOTS; ++i)
+	{
+		zone_health zh = health->slot[i];
+		if (zh.zone[0] == 0 || zh.state > breaker_half_open)
+			continue;
+
+		zh.zone[HEALTH_ZONE_LEN - 1] = 0;
+		(*health_log)(LOG_INFO,
+			"DNS %s: breaker %s, %lu queries, timeout %ld ms, "
+			"%lu timeouts, %lu errors, %lu short-circuited, "
+			"%lu trips, %lu recoveries",
+			zh.zone, state_name[zh.state], zh.queries, health_timeout(&zh),
+			zh.timeouts, zh.errors, zh.short_circuits,
+			zh.trips, zh.recoveries);
+	}
+}
+
+static int pf_open(void)
+{
+	if (pf_sock >= 0)
+		return 0;
+
+	if ((_res.options & RES_INIT) == 0 && res_init() != 0)
+		return -1;
+
+	if (_res.nscount <= 0)
+		return -1;
+
+	struct sockaddr_in const *const ns = &_res.nsaddr_list[0];
+	int const sock = socket(ns->sin_family, SOCK_DGRAM, 0);
+	if (sock < 0)
+		return -1;
+
+	int const flags = fcntl(sock, F_GETFL);
+	if (flags == -1 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1 ||
+		fcntl(sock, F_SETFD, FD_CLOEXEC) == -1 ||
+		connect(sock, (struct sockaddr const*)ns, sizeof *ns) != 0)
+	{
+		close(sock);
+		return -1;
+	}
+
+	pf_sock = sock;
+	return 0;
+}
+
+static prefetch_entry *pf_find(char const *name, int qtype)
+{
+	for (int i = 0; i < pf_count; ++i)
+	{
+		prefetch_entry *const pf = &pf_table[i];
+		if (pf->state != pf_unused && pf->qtype == qtype &&
+			strcasecmp(pf->name, name) == 0)
+				return pf;
+	}
+	return NULL;
+}
+
+static void pf_release(prefetch_entry *pf)
+{
+	assert(pf);
+	free(pf->answer);
+	pf->answer = NULL;
+	pf->state = pf_unused;
+}
+
+static long elapsed_ms(struct timespec const *since)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1000L +
+		(now.tv_nsec - since->tv_nsec) / 1000000L;
+}
+
+static void pf_receive(void)
+// read any available answer, match it to its query
+{
+	union dns_buffer
+	{
+		unsigned char answer[NS_BUFFER_SIZE];
+		HEADER h;
+	} buf;
+
+	for (;;)
+	{
+		ssize_t const rc = recv(pf_sock, buf.answer, sizeof buf.answer, 0);
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break; // EAGAIN, or refused
+		}
+
+		if (rc < HFIXEDSZ || buf.h.qr == 0 || ntohs(buf.h.qdcount) != 1)
+			continue;
+
+		unsigned short const id = ntohs(buf.h.id);
+		prefetch_entry *pf = NULL;
+		for (int i = 0; i < pf_count; ++i)
+			if (pf_table[i].state == pf_pending && pf_table[i].id == id)
+			{
+				pf = &pf_table[i];
+				break;
+			}
+
+		if (pf == NULL)
+			continue;
+
+		// question must match, or it is not our answer
+		unsigned char *cp = &buf.answer[HFIXEDSZ];
+		unsigned char *const eom = &buf.answer[rc];
+		char expand[NS_MAXDNAME];
+		int n = dn_expand(buf.answer, eom, cp, expand, sizeof expand);
+		if (n < 0 || strcasecmp(expand, pf->name) != 0 ||
+			cp + n + 2*INT16SZ > eom ||
+			ns_get16(cp + n) != (unsigned)pf->qtype ||
+			ns_get16(cp + n + INT16SZ) != 1 /* Internet */)
+				continue;
+
+		if (buf.h.tc)
+			pf->state = pf_truncated;
+		else if ((pf->answer = malloc(rc)) == NULL)
+			pf->state = pf_failed;
+		else
+		{
+			memcpy(pf->answer, buf.answer, rc);
+			pf->len = (int)rc;
+			pf->rtt = elapsed_ms(&pf->sent);
+			pf->state = pf_answered;
+		}
+	}
+}
+
+static prefetch_entry *pf_slot(void)
+// return an unused or stale entry, NULL if the table is full
+{
+	for (int i = 0; i < pf_count; ++i)
+	{
+		prefetch_entry *const pf = &pf_table[i];
+		if (pf->state == pf_unused ||
+			elapsed_ms(&pf->sent) > PREFETCH_STALE * 1000L)
+		{
+			pf_release(pf);
+			return pf;
+		}
+	}
+	return pf_count < PREFETCH_MAX? &pf_table[pf_count++]: NULL;
+}
+
+static void pf_wait(prefetch_entry *pf, long timeout)
+// wait for the answer, not longer than timeout ms after sending
+{
+	assert(pf);
+
+	if (zone.loaded)
+	{
+		if (pf->state == pf_answered && pf->delay > timeout)
+		{
+			free(pf->answer);
+			pf->answer = NULL;
+			pf->state = pf_pending;
+		}
+		sleep_ms((pf->state == pf_pending? timeout: pf->delay) -
+			elapsed_ms(&pf->sent));
+		if (pf->state == pf_pending)
+			pf->state = pf_expired;
+		return;
+	}
+
+	assert(pf_sock >= 0);
+
+	while (pf->state == pf_pending)
+	{
+		pf_receive();
+		if (pf->state != pf_pending)
+			break;
+
+		long const left = timeout - elapsed_ms(&pf->sent);
+		if (left <= 0)
+		{
+			pf->state = pf_expired;
+			break;
+		}
+
+		struct pollfd pfd;
+		pfd.fd = pf_sock;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, (int)left) < 0 && errno != EINTR)
+		{
+			pf->state = pf_failed;
+			break;
+		}
+	}
+}
+
+static int pf_send(char const *name, int qtype)
+// return 0 if sent, 1 if not sent, -1 on error
+{
+	if (!zone.loaded && pf_open() != 0)
+		return -1;
+
+	prefetch_entry *const pf = pf_slot();
+	if (pf == NULL)
+		return 1;
+
+	if (zone.loaded)
+	{
+		unsigned char answer[NS_PACKETSZ]; // no EDNS, like pf_receive()
+		long delay = 0;
+		int const len = zone_answer(name, qtype, answer, sizeof answer, &delay);
+
+		memset(pf, 0, sizeof *pf);
+		if (len < 0) // lost
+			pf->state = pf_pending;
+		else if (((HEADER*)answer)->tc)
+			pf->state = pf_truncated;
+		else if ((pf->answer = malloc(len)) != NULL)
+		{
+			memcpy(pf->answer, answer, len);
+			pf->len = len;
+			pf->rtt = delay;
+			pf->state = pf_answered;
+		}
+		else
+			pf->state = pf_failed;
+		strcpy(pf->name, name);
+		pf->qtype = qtype;
+		pf->delay = delay;
+		clock_gettime(CLOCK_MONOTONIC, &pf->sent);
+		return 0;
+	}
+
+	union dns_buffer
+	{
+		unsigned char query[NS_PACKETSZ];
+		HEADER h;
+	} buf;
+
+	int const len = res_mkquery(QUERY, name, 1 /* Internet */, qtype,
+		NULL, 0, NULL, buf.query, sizeof buf.query);
+	if (len <= 0)
+		return -1;
+
+	buf.h.rd = 1;
+
+	ssize_t rc;
+	while ((rc = send(pf_sock, buf.query, len, 0)) < 0 && errno == EINTR)
+		continue;
+	if (rc != len)
+		return 1;
+
+	memset(pf, 0, sizeof *pf);
+	strcpy(pf->name, name);
+	pf->qtype = qtype;
+	pf->id = ntohs(buf.h.id);
+	pf->state = pf_pending;
+	clock_gettime(CLOCK_MONOTONIC, &pf->sent);
+	return 0;
+}
+
+int dns_prefetch(char const *name, int qtype)
+/*
+* Send a query whose answer is going to be needed later.
+* Return 0 if sent or already in progress, 1 if not sent, -1 on error.
+*/
+{
+	if (name == NULL || *name == 0 || strlen(name) >= NS_MAXDNAME)
+		return -1;
+
+	if (pf_find(name, qtype) != NULL)
+		return 0;
+
+	if (health_blocked(name))
+		return 1;
+
+	return pf_send(name, qtype);
+}
+
+static int res_result(unsigned char const *packet, int len,
+	unsigned char *answer, int anslen)
+/*
+* Return what res_query() would return for the packet, possibly copying it
+* to answer, or -2 for SERVFAIL and the like, which have to be retried.
+*/
+{
+	HEADER const *const h = (HEADER const*)packet;
+	if (len < HFIXEDSZ || len > anslen)
+		return -2;
+
+	if (h->rcode == NXDOMAIN)
+	{
+		h_errno = HOST_NOT_FOUND;
+		return -1;
+	}
+
+	if (h->rcode != NOERROR)
+		return -2;
+
+	if (h->ancount == 0)
+	{
+		h_errno = NO_DATA;
+		return -1;
+	}
+
+	if (answer != packet)
+		memcpy(answer, packet, len);
+	return len;
+}
+
+static int dns_retry(char const *name, int type, unsigned char *answer,
+	int anslen, long timeout, bool tcp)
+/*
+* Ask the resolver, which tries all the name servers, once each, waiting
+* about timeout ms for each; use TCP if tcp.  Return the answer length, or -1.
+*/
+{
+	if (zone.loaded)
+		return dns_zone_query(name, type, answer, anslen);
+
+	unsigned char query[NS_PACKETSZ];
+	int const qlen = res_mkquery(QUERY, name, 1 /* Internet */, type,
+		NULL, 0, NULL, query, sizeof query);
+	if (qlen <= 0)
+		return -1;
+
+	unsigned long const options = _res.options;
+	int const retrans = _res.retrans, retry = _res.retry;
+	if (tcp)
+		_res.options |= RES_USEVC;
+	_res.retrans = timeout > 1000? (int)((timeout + 999) / 1000): 1;
+	_res.retry = 1;
+	int const len = res_send(query, qlen, answer, anslen);
+	_res.options = options;
+	_res.retrans = retrans;
+	_res.retry = retry;
+	return len;
+}
+
+int dns_query(char const *name, int type, unsigned char *answer, int anslen)
+/*
+* Return the length of the answer packet, which can be NXDOMAIN or SERVFAIL
+* as well, using a prefetched answer if available.  A truncated answer is
+* asked again over TCP, and a lost one is retried once, before recording a
+* timeout.  Return -1 if the query got no usable answer in time, -2 if the
+* zone's breaker is open.
+*/
+{
+	long timeout;
+	if (health_begin(name, &timeout) < 0)
+		return -2;
+
+	prefetch_entry *pf = pf_find(name, type);
+	if (pf == NULL && strlen(name) < NS_MAXDNAME && pf_send(name, type) == 0)
+		pf = pf_find(name, type);
+
+	int len = -1;
+	long rtt;
+	health_outcome outcome = outcome_error;
+	if (pf)
+	{
+		pf_wait(pf, timeout);
+		prefetch_state const state = pf->state;
+		struct timespec const sent = pf->sent;
+		if (state == pf_answered)
+		{
+			rtt = pf->rtt;
+			if (pf->len <= anslen)
+				memcpy(answer, pf->answer, len = pf->len);
+		}
+		pf_release(pf);
+
+		if (state != pf_answered)
+		{
+			len = dns_retry(name, type, answer, anslen, timeout,
+				state == pf_truncated);
+			rtt = elapsed_ms(&sent);
+			if (len < 0)
+				outcome = outcome_timeout;
+		}
+	}
+	else // no socket or table full, the resolver's own timing applies
+	{
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (zone.loaded)
+			len = dns_zone_query(name, type, answer, anslen);
+		else
+		{
+			unsigned char query[NS_PACKETSZ];
+			int const qlen = res_mkquery(QUERY, name, 1 /* Internet */, type,
+				NULL, 0, NULL, query, sizeof query);
+			if (qlen > 0)
+				len = res_send(query, qlen, answer, anslen);
+		}
+		rtt = elapsed_ms(&start);
+		if (len < 0)
+			outcome = outcome_timeout;
+	}
+
+	if (len >= HFIXEDSZ)
+	{
+		int const rcode = ((HEADER*)answer)->rcode;
+		outcome = rcode == NOERROR || rcode == NXDOMAIN?
+			outcome_ok: outcome_error;
+	}
+	else
+		len = -1;
+
+	health_end(name, rtt, outcome);
+	return len;
+}
+
+int my_res_query(char const *name, int class, int type,
+	unsigned char *answer, int anslen)
+/*
+* Same as res_query(), but use prefetched answers if available.  Without
+* zone file or health table, a failed prefetch is retried by res_query().
+*/
+{
+	if (class == 1 /* Internet */ &&
+		(health || zone.loaded || pf_find(name, type)))
+	{
+		int const len = dns_query(name, type, answer, anslen);
+		int const rc = len < 0? -2: res_result(answer, len, answer, anslen);
+		if (rc != -2)
+			return rc;
+
+		if (health || zone.loaded)
+		{
+			h_errno = TRY_AGAIN;
+			return -1;
+		}
+	}
+
+	return res_query(name, class, type, answer, anslen);
+}
+
+void dns_prefetch_clear(void)
+{
+	for (int i = 0; i < pf_count; ++i)
+		pf_release(&pf_table[i]);
+	pf_count = 0;
+
+	if (pf_sock >= 0)
+	{
+		close(pf_sock);
+		pf_sock = -1;
+	}
+}
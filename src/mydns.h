@@ -0,0 +1,21 @@
+/*
+** mydns.h - written in milano by vesely on 19oct2026
+** dns query front end with asynchronous prefetch
+*/
+
+#if !defined MYDNS_H_INCLUDED
+
+int dns_prefetch(char const *name, int qtype);
+int my_res_query(char const *name, int class, int type,
+	unsigned char *answer, int anslen);
+void dns_prefetch_clear(void);
+int dns_zone_load(char const *fname, int *bad_line);
+int dns_zone_query(char const *name, int type, unsigned char *answer,
+	int anslen);
+int dns_query(char const *name, int type, unsigned char *answer, int anslen);
+int dns_health_init(int timeout, int adaptive, int failures, int cooldown,
+	void (*log)(int, char const*, ...));
+void dns_health_report(void);
+
+#define MYDNS_H_INCLUDED
+#endif
@@ -0,0 +1,570 @@
+/*
+** mykey.c - written in milano by vesely on 19oct2026
+** DKIM key records, cached across processes
+*/
+/*
+* zdkimfilter - Sign outgoing, verify incoming mail messages
+
+Copyright (C) 2026 Alessandro Vesely
+
+This file is part of zdkimfilter
+
+zdkimfilter is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+zdkimfilter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License version 3
+along with zdkimfilter.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPLv3 section 7:
+
+If you modify zdkimfilter, or any covered work, by linking or combining it
+with software developed by The OpenDKIM Project and its contributors,
+containing parts covered by the applicable licence, the licensor or
+zdkimfilter grants you additional permission to convey the resulting work.
+*/
+#include <config.h>
+#if !ZDKIMFILTER_DEBUG
+#define NDEBUG
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <time.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#if defined HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+#if defined HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+#if defined HAVE_ARPA_NAMESER_H
+#include <arpa/nameser.h>
+#endif
+#if defined HAVE_NETDB_H
+#include <netdb.h>
+#endif
+#include <resolv.h>
+
+#include "mykey.h"
+#include "mydns.h"
+#include "shmlock.h"
+#if defined TEST_MAIN
+#include <stdarg.h>
+#endif
+#include <assert.h>
+
+/*
+* Key records are looked up through my_res_query(), so that prefetched
+* answers, the zone file, and zone health apply, and failed or truncated
+* answers are retried by the resolver.  With key_cache_init(),
+* records are also kept in a table shared by forked processes, for the
+* lesser of their DNS TTL and the configured ttl.  Non-existent keys are
+* kept for KEY_NEGATIVE_TTL at most.
+*
+* Records are parsed before being stored:  v= must be first, if present, and
+* p= is required.  Malformed records are not cached, and are passed on as
+* they are, so that the verifier reports them.
+*/
+
+#define NS_BUFFER_SIZE 1536
+#define KEY_SLOTS 256
+#define KEY_PROBE 8
+#define KEY_NAME_LEN 256
+#define KEY_RECORD_LEN 1024
+#define KEY_NEGATIVE_TTL 60
+
+typedef enum key_status
+{
+	key_free,
+	key_found,
+	key_nxdomain
+} key_status;
+
+// key types (k=), hashes (h=, 0 for any), flags (t=, and empty p=)
+#define KEY_TYPE_RSA 0
+#define KEY_TYPE_ED25519 1
+#define KEY_TYPE_OTHER 2
+#define KEY_HASH_SHA1 1
+#define KEY_HASH_SHA256 2
+#define KEY_FLAG_TESTING 1
+#define KEY_FLAG_STRICT 2
+#define KEY_FLAG_REVOKED 4
+
+typedef struct key_entry
+{
+	time_t expire, last_used;
+	unsigned long hits;
+	unsigned short len;
+	unsigned char status, key_type, hashes, flags;
+	char name[KEY_NAME_LEN];
+	char record[KEY_RECORD_LEN];
+} key_entry;
+
+typedef struct key_table
+{
+	shm_lock lock;
+	int ttl;
+	unsigned long lookups, hits, stored;
+	key_entry slot[KEY_SLOTS];
+} key_table;
+
+static key_table *cache;
+static void (*key_log)(int, char const*, ...) = &syslog;
+
+static bool key_lock(void)
+// false if the table cannot be used
+{
+	int const rc = shm_lock_acquire(&cache->lock);
+	if (rc > 0) // the holder died midway, drop all keys
+		memset(cache->slot, 0, sizeof cache->slot);
+	return rc >= 0;
+}
+
+static void key_unlock(void)
+{
+	shm_lock_release(&cache->lock);
+}
+
+int key_cache_init(int ttl, void (*log)(int, char const*, ...))
+/*
+* Create the shared table, or set its ttl; call before forking.  A ttl
+* of 0 drops the table.  Return 0 on success, -1 on error.
+*/
+{
+	if (log)
+		key_log = log;
+
+	if (ttl <= 0)
+	{
+		if (cache)
+		{
+			munmap(cache, sizeof *cache);
+			cache = NULL;
+		}
+		return 0;
+	}
+
+	if (cache == NULL)
+	{
+		void *const p = mmap(NULL, sizeof *cache, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			return -1;
+		if (shm_lock_init(&((key_table*)p)->lock))
+		{
+			munmap(p, sizeof *cache);
+			return -1;
+		}
+		cache = p;
+	}
+
+	cache->ttl = ttl;
+	return 0;
+}
+
+static key_entry *key_find(char const *name, bool create)
+// call locked; a new name takes a free or expired slot, or the LRU one
+{
+	unsigned h = 2166136261U; // FNV-1a
+	for (unsigned char const *s = (unsigned char const*)name; *s; ++s)
+		h = (h ^ *s) * 16777619U;
+
+	time_t const now = time(NULL);
+	key_entry *victim = NULL;
+	for (int i = 0; i < KEY_PROBE; ++i)
+	{
+		key_entry *const e = &cache->slot[(h + i) % KEY_SLOTS];
+		if (e->status != key_free && strcmp(e->name, name) == 0)
+		{
+			if (e->expire > now)
+				return e;
+
+			e->status = key_free;
+		}
+
+		if (victim == NULL ||
+			(victim->status != key_free &&
+				(e->status == key_free || e->last_used < victim->last_used)))
+					victim = e;
+	}
+
+	return create? victim: NULL;
+}
+
+static char *skip_fws(char const *s)
+{
+	while (isspace(*(unsigned char const*)s))
+		++s;
+	return (char*)s;
+}
+
+static int parse_key_record(char const *record, key_entry *e)
+/*
+* Set type, hashes, and flags.  Return 0 if well formed, -1 otherwise.
+*/
+{
+	bool have_p = false;
+	e->key_type = KEY_TYPE_RSA;
+	e->hashes = e->flags = 0;
+
+	for (int n = 0; *(record = skip_fws(record)); ++n)
+	{
+		char const *const tag = record;
+		while (isalnum(*(unsigned char const*)record) || *record == '_')
+			++record;
+		size_t const tag_len = record - tag;
+		record = skip_fws(record);
+		if (tag_len == 0 || *record++ != '=')
+			return -1;
+
+		char const *const value = record = skip_fws(record);
+		while (*record && *record != ';')
+			++record;
+		char const *end = record;
+		while (end > value && isspace(((unsigned char const*)end)[-1]))
+			--end;
+		size_t const len = end - value;
+		if (*record == ';')
+			++record;
+
+		if (tag_len != 1)
+			continue;
+
+		switch (*tag)
+		{
+			case 'v':
+				if (n != 0 || len != 5 || strncmp(value, "DKIM1", 5) != 0)
+					return -1;
+				break;
+
+			case 'k':
+				e->key_type =
+					len == 3 && strncmp(value, "rsa", 3) == 0? KEY_TYPE_RSA:
+					len == 7 && strncmp(value, "ed25519", 7) == 0?
+						KEY_TYPE_ED25519: KEY_TYPE_OTHER;
+				break;
+
+			case 'h':
+			case 't':
+				for (char const *v = value; v < end;)
+				{
+					char const *const item = v;
+					while (v < end && *v != ':')
+						++v;
+					char const *item_end = v;
+					while (item_end > item &&
+						isspace(((unsigned char const*)item_end)[-1]))
+							--item_end;
+					size_t const item_len = item_end - item;
+					if (*tag == 'h')
+						e->hashes |=
+							item_len == 4 && strncmp(item, "sha1", 4) == 0?
+								KEY_HASH_SHA1:
+							item_len == 6 && strncmp(item, "sha256", 6) == 0?
+								KEY_HASH_SHA256: 0;
+					else if (item_len == 1)
+						e->flags |= *item == 'y'? KEY_FLAG_TESTING:
+							*item == 's'? KEY_FLAG_STRICT: 0;
+					if (v < end)
+						v = skip_fws(v + 1);
+				}
+				break;
+
+			case 'p':
+				have_p = true;
+				if (len == 0)
+					e->flags |= KEY_FLAG_REVOKED;
+				break;
+
+			default:
+				break;
+		}
+	}
+
+	return have_p? 0: -1;
+}
+
+static int key_answer(unsigned char *answer, int len, char const *name,
+	char *record, size_t size, unsigned long *ttl)
+/*
+* Assemble the TXT record from the answer.  Return 0 if found, 1 if there
+* is no TXT record, -3 if data is bad or there are multiple records.
+*/
+{
+	HEADER const *const h = (HEADER const*)answer;
+	unsigned char *cp = answer + HFIXEDSZ;
+	unsigned char *const eom = answer + len;
+	char expand[NS_MAXDNAME];
+
+	if (ntohs(h->qdcount) != 1 || h->tc)
+		return -3;
+
+	int n = dn_expand(answer, eom, cp, expand, sizeof expand);
+	if (n < 0 || strcasecmp(expand, name) != 0 || cp + n + 2*INT16SZ > eom)
+		return -3;
+
+	cp += n + 2*INT16SZ;
+
+	int found = 0;
+	for (unsigned ancount = ntohs(h->ancount); ancount > 0; --ancount)
+	{
+		n = dn_expand(answer, eom, cp, expand, sizeof expand);
+		if (n < 0 || cp + n + 3*INT16SZ + INT32SZ > eom)
+			return -3;
+
+		uint16_t const type = ns_get16(cp + n);
+		uint16_t const class = ns_get16(cp + n + INT16SZ);
+		unsigned long const rr_ttl = ns_get32(cp + n + 2*INT16SZ);
+		uint16_t rdlength = ns_get16(cp + n + 2*INT16SZ + INT32SZ);
+
+		cp += n + 3*INT16SZ + INT32SZ;
+		if (cp + rdlength > eom)
+			return -3;
+
+		if (type != 16 /* TXT */ || class != 1 /* Internet */)
+		{
+			cp += rdlength; // most likely a CNAME
+			continue;
+		}
+
+		if (found++)
+			return -3;
+
+		size_t l = 0;
+		while (rdlength > 0)
+		{
+			size_t const sl = *cp++;
+			rdlength -= 1;
+			if (sl > rdlength || l + sl >= size)
+				return -3;
+
+			memcpy(record + l, cp, sl);
+			l += sl;
+			cp += sl;
+			rdlength -= sl;
+		}
+		record[l] = 0;
+		*ttl = rr_ttl;
+	}
+
+	return found? 0: 1;
+}
+
+static void key_store(char const *name, key_entry const *parsed,
+	char const *record, key_status status, unsigned long ttl)
+{
+	if ((unsigned long)cache->ttl < ttl)
+		ttl = cache->ttl;
+	if (status == key_nxdomain && ttl > KEY_NEGATIVE_TTL)
+		ttl = KEY_NEGATIVE_TTL;
+	if (ttl == 0)
+		return;
+
+	size_t const len = record? strlen(record): 0;
+	if (len >= KEY_RECORD_LEN)
+		return;
+
+	if (!key_lock())
+		return;
+
+	key_entry *const e = key_find(name, true);
+	time_t const now = time(NULL);
+	e->expire = now + ttl;
+	e->last_used = now;
+	e->hits = 0;
+	e->len = len;
+	e->status = status;
+	e->key_type = parsed? parsed->key_type: 0;
+	e->hashes = parsed? parsed->hashes: 0;
+	e->flags = parsed? parsed->flags: 0;
+	strcpy(e->name, name);
+	if (record)
+		memcpy(e->record, record, len + 1);
+	cache->stored += 1;
+	key_unlock();
+}
+
+int key_lookup(char const *selector, char const *domain,
+	char *buf, size_t buflen)
+/*
+* Copy the key record of selector and domain to buf, and return:
+*   0  found
+*   1  no key record
+*   3  NXDOMAIN
+*  -1  on caller's error
+*  -2  on temporary error (includes SERVFAIL)
+*  -3  on bad DNS data, including multiple records
+*/
+{
+	if (selector == NULL || *selector == 0 ||
+		domain == NULL || *domain == 0 || buf == NULL || buflen == 0)
+			return -1;
+
+	char name[KEY_NAME_LEN];
+	if ((size_t)snprintf(name, sizeof name, "%s._domainkey.%s",
+		selector, domain) >= sizeof name)
+			return -1;
+
+	for (char *s = name; *s; ++s)
+		*s = tolower(*(unsigned char*)s);
+
+	if (cache && key_lock())
+	{
+		int rtc = -4;
+		cache->lookups += 1;
+		key_entry *const e = key_find(name, false);
+		if (e && (e->status == key_nxdomain || e->len < buflen))
+		{
+			e->last_used = time(NULL);
+			e->hits += 1;
+			cache->hits += 1;
+			if (e->status == key_nxdomain)
+				rtc = 3;
+			else
+			{
+				memcpy(buf, e->record, e->len + 1);
+				rtc = 0;
+			}
+		}
+		key_unlock();
+		if (rtc != -4)
+			return rtc;
+	}
+
+	union dns_buffer
+	{
+		unsigned char answer[NS_BUFFER_SIZE];
+		HEADER h;
+	} a;
+
+	int const len = my_res_query(name, 1 /* Internet */, 16 /* TXT */,
+		a.answer, sizeof a.answer);
+	if (len < 0)
+	{
+		if (h_errno == HOST_NOT_FOUND)
+		{
+			if (cache)
+				key_store(name, NULL, NULL, key_nxdomain, KEY_NEGATIVE_TTL);
+			return 3;
+		}
+		return h_errno == NO_DATA? 1: -2;
+	}
+
+	unsigned long ttl = 0;
+	int const rtc = key_answer(a.answer, len, name, buf, buflen, &ttl);
+	if (rtc == 0 && cache)
+	{
+		key_entry parsed;
+		if (parse_key_record(buf, &parsed) == 0)
+			key_store(name, &parsed, buf, key_found, ttl);
+	}
+
+	return rtc;
+}
+
+void key_cache_report(void)
+// log usage; racy reads are good enough here
+{
+	if (cache == NULL)
+		return;
+
+	unsigned entries = 0, revoked = 0, testing = 0, negative = 0;
+	time_t const now = time(NULL);
+	for (int i = 0; i < KEY_SLOTS; ++i)
+	{
+		key_entry const *const e = &cache->slot[i];
+		if (e->status == key_free || e->expire <= now)
+			continue;
+
+		entries += 1;
+		if (e->status == key_nxdomain)
+			negative += 1;
+		if (e->flags & KEY_FLAG_REVOKED)
+			revoked += 1;
+		if (e->flags & KEY_FLAG_TESTING)
+			testing += 1;
+	}
+
+	(*key_log)(LOG_INFO,
+		"key cache: %lu lookups, %lu hits, %lu stored, %u entries "
+		"(%u non-existent, %u revoked, %u testing)",
+		cache->lookups, cache->hits, cache->stored, entries,
+		negative, revoked, testing);
+}
+
+#if defined TEST_MAIN
+static void printlog(int severity, char const *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	putchar('\n');
+	(void)severity;
+}
+
+int main(int argc, char *argv[])
+{
+	int i = 1, prefetch = 0;
+	for (; i + 1 < argc && argv[i][0] == '-'; ++i)
+	{
+		if (strcmp(argv[i], "-z") == 0)
+		{
+			int bad_line = 0;
+			if (dns_zone_load(argv[++i], &bad_line) < 0)
+				printf("cannot load %s (line %d)\n", argv[i], bad_line);
+		}
+		else if (strcmp(argv[i], "-c") == 0)
+			key_cache_init(atoi(argv[++i]), &printlog);
+		else if (strcmp(argv[i], "-p") == 0)
+			prefetch = 1;
+		else
+			break;
+	}
+
+	if (i + 1 >= argc)
+	{
+		printf("Usage:\n\t%s [-z zonefile] [-c ttl] [-p] selector domain...\n",
+			argv[0]);
+		return 1;
+	}
+
+	char const *const selector = argv[i++];
+	if (prefetch) // as verify_headers() does before reading the body
+		for (int j = i; j < argc; ++j)
+		{
+			char name[KEY_NAME_LEN];
+			snprintf(name, sizeof name, "%s._domainkey.%s", selector, argv[j]);
+			dns_prefetch(name, 16 /* TXT */);
+		}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (; i < argc; ++i)
+	{
+		char buf[KEY_RECORD_LEN];
+		int const rtc = key_lookup(selector, argv[i], buf, sizeof buf);
+		printf("%s: rtc = %d", argv[i], rtc);
+		if (rtc == 0)
+			printf(" %.20s%s", buf, strlen(buf) > 20? "...": "");
+		putchar('\n');
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (prefetch)
+		printf("lookups took %ld ms\n", (long)((end.tv_sec - start.tv_sec) * 1000 +
+			(end.tv_nsec - start.tv_nsec) / 1000000));
+
+	key_cache_report();
+	return 0;
+}
+#endif
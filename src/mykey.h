@@ -0,0 +1,16 @@
+/*
+** mykey.h - written in milano by vesely on 19oct2026
+** DKIM key records, cached across processes
+*/
+
+#if !defined MYKEY_H_INCLUDED
+
+#include <stddef.h>
+
+int key_cache_init(int ttl, void (*log)(int, char const*, ...));
+int key_lookup(char const *selector, char const *domain,
+	char *buf, size_t buflen);
+void key_cache_report(void);
+
+#define MYKEY_H_INCLUDED
+#endif
@@ -0,0 +1,349 @@
+/*
+** myrate.c - written in milano by vesely on 19oct2026
+** sliding-window message counts per user, shared across processes
+*/
+/*
+* zdkimfilter - Sign outgoing, verify incoming mail messages
+
+Copyright (C) 2026 Alessandro Vesely
+
+This file is part of zdkimfilter
+
+zdkimfilter is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+zdkimfilter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License version 3
+along with zdkimfilter.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPLv3 section 7:
+
+If you modify zdkimfilter, or any covered work, by linking or combining it
+with software developed by The OpenDKIM Project and its contributors,
+containing parts covered by the applicable licence, the licensor or
+zdkimfilter grants you additional permission to convey the resulting work.
+*/
+#include <config.h>
+#if !ZDKIMFILTER_DEBUG
+#define NDEBUG
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <time.h>
+#include <syslog.h>
+#include <sys/mman.h>
+
+#include "myrate.h"
+#include "shmlock.h"
+#if defined TEST_MAIN
+#include <stdarg.h>
+#endif
+#include <assert.h>
+
+/*
+* Messages and recipients of each authenticated user are counted in a table
+* shared by forked processes.  The window is RATE_SLICES slices of whole
+* seconds, so the interval is rounded up to a multiple of RATE_SLICES seconds.
+* The window slides one slice at a time:  counts are dropped a whole slice at
+* a time, so the window spans between RATE_SLICES - 1 and RATE_SLICES slices.
+*
+* A message that would exceed a limit is not counted.  Users idle for a whole
+* window have no counts left, so their slots are free.  Otherwise, when all
+* RATE_PROBE slots after its hash are taken, a new user evicts the least
+* recently used, whose counts are lost.
+*/
+
+#define RATE_SLOTS 1024
+#define RATE_PROBE 8
+#define RATE_USER_LEN 256
+#define RATE_SLICES 16
+
+typedef struct rate_entry
+{
+	time_t last_used, next_check;
+	time_t slice; // newest slice, in slice_len units
+	unsigned msgs[RATE_SLICES], rcpts[RATE_SLICES];
+	unsigned char used;
+	char user[RATE_USER_LEN];
+} rate_entry;
+
+typedef struct rate_table
+{
+	shm_lock lock;
+	int interval, slice_len, window; // window is interval rounded up
+	unsigned max_msgs, max_rcpts;
+	unsigned long messages, rejected, reconciled;
+	rate_entry slot[RATE_SLOTS];
+} rate_table;
+
+static rate_table *table;
+static void (*rate_log)(int, char const*, ...) = &syslog;
+
+#if defined TEST_MAIN
+static time_t test_time;
+static time_t rate_time(void) { return test_time; }
+#else
+static inline time_t rate_time(void) { return time(NULL); }
+#endif
+
+static int rate_lock(void)
+/*
+* Return 0 when locked, -1 on error.  If the holder died, counts are kept:
+* a slot is marked used only after its user is copied, so the worst case
+* is a message counted in part.
+*/
+{
+	return shm_lock_acquire(&table->lock) < 0? -1: 0;
+}
+
+static void rate_unlock(void)
+{
+	shm_lock_release(&table->lock);
+}
+
+int rate_limit_init(int interval, int max_msgs, int max_rcpts,
+	void (*log)(int, char const*, ...))
+/*
+* Create the shared table, or set its limits; call before forking.  Counts
+* are dropped if the interval changes.  A zero interval, or no limits, drop
+* the table.  Return 0 on success, -1 on error.
+*/
+{
+	if (log)
+		rate_log = log;
+
+	if (interval <= 0 || (max_msgs <= 0 && max_rcpts <= 0))
+	{
+		if (table)
+		{
+			munmap(table, sizeof *table);
+			table = NULL;
+		}
+		return 0;
+	}
+
+	if (table == NULL)
+	{
+		void *const p = mmap(NULL, sizeof *table, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			return -1;
+		if (shm_lock_init(&((rate_table*)p)->lock))
+		{
+			munmap(p, sizeof *table);
+			return -1;
+		}
+		table = p;
+	}
+
+	if (rate_lock())
+		return -1;
+
+	if (table->interval != interval)
+	{
+		memset(table->slot, 0, sizeof table->slot);
+		table->interval = interval;
+		table->slice_len = (interval + RATE_SLICES - 1) / RATE_SLICES;
+		table->window = table->slice_len * RATE_SLICES;
+	}
+	table->max_msgs = max_msgs > 0? max_msgs: 0;
+	table->max_rcpts = max_rcpts > 0? max_rcpts: 0;
+	rate_unlock();
+	return 0;
+}
+
+static rate_entry *rate_find(char const *user, unsigned h, time_t now)
+// call locked; a new user takes a free or idle slot, or the LRU one
+{
+	rate_entry *victim = NULL;
+	for (int i = 0; i < RATE_PROBE; ++i)
+	{
+		rate_entry *const e = &table->slot[(h + i) % RATE_SLOTS];
+		if (e->used && strcmp(e->user, user) == 0)
+			return e;
+
+		if (!e->used || e->last_used + table->window <= now)
+		{
+			if (victim == NULL || victim->used)
+				victim = e;
+		}
+		else if (victim == NULL ||
+			(victim->used && e->last_used < victim->last_used))
+				victim = e;
+	}
+
+	memset(victim, 0, sizeof *victim);
+	strcpy(victim->user, user);
+	victim->slice = now / table->slice_len;
+	victim->used = 1;
+	return victim;
+}
+
+int rate_limit_count(char const *user, unsigned rcpts, int reconcile,
+	unsigned *msgs_in, unsigned *rcpts_in)
+/*
+* Count a message with rcpts recipients for user, unless that exceeds a
+* limit.  If reconcile > 0, RATE_RECONCILE is set on the first message of
+* the user and then every reconcile seconds.  Return RATE_* bits, and the
+* counts in the window including this message if counted; return 0 if
+* there are no limits or the user doesn't fit.
+*/
+{
+	char buf[RATE_USER_LEN];
+	if (table == NULL || user == NULL || strlen(user) >= sizeof buf)
+		return 0;
+
+	unsigned h = 2166136261U; // FNV-1a
+	char *d = buf;
+	for (char const *s = user; *s; ++s)
+	{
+		int const ch = tolower(*(unsigned char const*)s);
+		*d++ = ch;
+		h = (h ^ (unsigned char)ch) * 16777619U;
+	}
+	*d = 0;
+
+	time_t const now = rate_time();
+	if (rate_lock())
+		return 0;
+
+	rate_entry *const e = rate_find(buf, h, now);
+
+	time_t const slice = now / table->slice_len;
+	if (slice > e->slice)
+	{
+		time_t const gone = slice - e->slice;
+		for (time_t i = 1; i <= gone && i <= RATE_SLICES; ++i)
+		{
+			int const k = (e->slice + i) % RATE_SLICES;
+			e->msgs[k] = e->rcpts[k] = 0;
+		}
+		e->slice = slice;
+	}
+
+	unsigned msgs = 0, rcpt_sum = 0;
+	for (int i = 0; i < RATE_SLICES; ++i)
+	{
+		msgs += e->msgs[i];
+		rcpt_sum += e->rcpts[i];
+	}
+
+	int rtc = 0;
+	if (table->max_msgs && msgs + 1 > table->max_msgs)
+		rtc |= RATE_OVER_MESSAGES;
+	if (table->max_rcpts && rcpt_sum + rcpts > table->max_rcpts)
+		rtc |= RATE_OVER_RCPTS;
+
+	if (rtc == 0)
+	{
+		int const k = slice % RATE_SLICES;
+		e->msgs[k] += 1;
+		e->rcpts[k] += rcpts;
+		msgs += 1;
+		rcpt_sum += rcpts;
+		table->messages += 1;
+		rtc = RATE_OK;
+		if (reconcile > 0 && e->next_check <= now)
+		{
+			e->next_check = now + reconcile;
+			table->reconciled += 1;
+			rtc |= RATE_RECONCILE;
+		}
+	}
+	else
+		table->rejected += 1;
+
+	e->last_used = now;
+	rate_unlock();
+
+	if (msgs_in)
+		*msgs_in = msgs;
+	if (rcpts_in)
+		*rcpts_in = rcpt_sum;
+	return rtc;
+}
+
+void rate_limit_report(void)
+// log usage; racy reads are good enough here
+{
+	if (table == NULL)
+		return;
+
+	unsigned users = 0;
+	time_t const now = rate_time();
+	for (int i = 0; i < RATE_SLOTS; ++i)
+		if (table->slot[i].used &&
+			table->slot[i].last_used + table->window > now)
+				users += 1;
+
+	(*rate_log)(LOG_INFO,
+		"rate limit: %lu messages, %lu rejected, %lu reconciled, %u users",
+		table->messages, table->rejected, table->reconciled, users);
+}
+
+#if defined TEST_MAIN
+static void printlog(int severity, char const *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	putchar('\n');
+	(void)severity;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 5)
+	{
+		printf("Usage:\n\t%s interval max-msgs max-rcpts reconcile "
+			"secs:user:rcpts ...\n", argv[0]);
+		return 1;
+	}
+
+	int const reconcile = atoi(argv[4]);
+	if (rate_limit_init(atoi(argv[1]), atoi(argv[2]), atoi(argv[3]),
+		&printlog))
+	{
+		perror("rate_limit_init");
+		return 1;
+	}
+
+	for (int i = 5; i < argc; ++i)
+	{
+		char *user = strchr(argv[i], ':'), *rcpts = NULL;
+		if (user)
+		{
+			*user++ = 0;
+			rcpts = strchr(user, ':');
+		}
+		if (rcpts == NULL)
+		{
+			printf("bad argument %s\n", argv[i]);
+			continue;
+		}
+		*rcpts++ = 0;
+
+		test_time = 1000000 + atol(argv[i]);
+		unsigned msgs = 0, n = 0;
+		int const rtc = rate_limit_count(user, atoi(rcpts), reconcile,
+			&msgs, &n);
+		printf("%s at %s: %u msgs, %u rcpts%s%s%s%s\n", user, argv[i], msgs, n,
+			rtc & RATE_OK? " ok": "",
+			rtc & RATE_OVER_MESSAGES? " over messages": "",
+			rtc & RATE_OVER_RCPTS? " over rcpts": "",
+			rtc & RATE_RECONCILE? " reconcile": "");
+	}
+
+	rate_limit_report();
+	return 0;
+}
+#endif
@@ -0,0 +1,21 @@
+/*
+** myrate.h - written in milano by vesely on 19oct2026
+** sliding-window message counts per user, shared across processes
+*/
+
+#if !defined MYRATE_H_INCLUDED
+
+// rate_limit_count() return bits
+#define RATE_OK 1             // within limits, counted
+#define RATE_OVER_MESSAGES 2  // not counted
+#define RATE_OVER_RCPTS 4     // not counted
+#define RATE_RECONCILE 8      // time to check the user by other means
+
+int rate_limit_init(int interval, int max_msgs, int max_rcpts,
+	void (*log)(int, char const*, ...));
+int rate_limit_count(char const *user, unsigned rcpts, int reconcile,
+	unsigned *msgs_in, unsigned *rcpts_in);
+void rate_limit_report(void);
+
+#define MYRATE_H_INCLUDED
+#endif
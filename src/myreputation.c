@@ -58,6 +58,7 @@ zdkimfilter grants you additional permission to convey the resulting work.
 #include <resolv.h>
 
 #include "myreputation.h"
+#include "mydns.h"
 #include "util.h"
 #if defined TEST_MAIN
 #include <unistd.h> // isatty
@@ -104,29 +105,21 @@ static char *skip_fws(char *s)
 	return s;
 }
 
-static int
-do_reputation_query(char const *user, char const *domain,
-	char const *signer, char const *rep_root, int *rep)
-// run query and return:
-//   0  and a response if found
-//   1  found, but no reputation retrieved
-//   3  for NXDOMAIN
-//  -1  on caller's error
-//  -2  on temporary error (includes SERVFAIL)
-//  -3  on bad data or other error
+static size_t
+reputation_query_name(char query[1536], char const *user, char const *domain,
+	char const *signer, char const *rep_root)
+// construct the query, return its length or 0 on caller's error
 {
 	if (user == NULL || *user == 0 ||
 		domain == NULL || *domain == 0 ||
 		signer == NULL || *signer == 0 ||
 		rep_root == NULL || *rep_root == 0)
-			return -1;
+			return 0;
 
-	/* construct the query */
 	size_t const len_d = strlen(rep_root) + 3 * MD5_STRING_LENGTH + 3;
-	char query[1536];
 
-	if (len_d >= sizeof query)
-		return -1;
+	if (len_d >= 1536)
+		return 0;
 
 	char *p = md5_string(query, user);
 	*p++ = '.';
@@ -134,7 +127,27 @@ do_reputation_query(char const *user, char const *domain,
 	*p++ = '.';
 	p = md5_string(p, signer);
 	*p++ = '.';
-	strcat(p, rep_root);
+	strcpy(p, rep_root);
+	return len_d;
+}
+
+static int
+do_reputation_query(char const *user, char const *domain,
+	char const *signer, char const *rep_root, int *rep)
+// run query and return:
+//   0  and a response if found
+//   1  found, but no reputation retrieved
+//   3  for NXDOMAIN
+//  -1  on caller's error
+//  -2  on temporary error (includes SERVFAIL)
+//  -3  on bad data or other error
+{
+	char query[1536];
+	size_t const len_d =
+		reputation_query_name(query, user, domain, signer, rep_root);
+
+	if (len_d == 0)
+		return -1;
 
 #if defined TEST_MAIN
 	if (isatty(fileno(stdout)))
@@ -148,7 +161,7 @@ do_reputation_query(char const *user, char const *domain,
 	} buf;
 	
 	// res_query returns -1 for NXDOMAIN
-	int rc = res_query(query, 1 /* Internet */, 16 /* TXT */,
+	int rc = my_res_query(query, 1 /* Internet */, 16 /* TXT */,
 		buf.answer, sizeof buf.answer);
 
 	if (rc < 0)
@@ -388,6 +401,19 @@ int my_get_reputation(DKIM* dkim, DKIM_SIGINFO* sig, char *root, int *rep)
 {
 	return (*reputation_query)(dkim, sig, root, rep);
 }
+
+int prefetch_reputation(char const *user, char const *domain,
+	char const *signer, char const *root)
+// start the query that do_get_reputation() is going to run
+{
+#if defined DKIM_REPUTATION_ROOT
+	char query[1536];
+	if (reputation_query == &do_get_reputation &&
+		reputation_query_name(query, user, domain, signer, root))
+			return dns_prefetch(query, 16 /* TXT */);
+#endif
+	return 1;
+}
 #endif // TEST_MAIN
 
 
@@ -8,6 +8,8 @@
 #define DKIM_REPUTATION_ROOT "al.dkim-reputation.org"
 
 int my_get_reputation(DKIM* dkim, DKIM_SIGINFO* sig, char *root, int *rep);
+int prefetch_reputation(char const *user, char const *domain,
+	char const *signer, char const *root);
 int flip_reputation_query_was_faked(void);
 
 #define MYREPUTATION_H_INCLUDED
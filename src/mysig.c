@@ -0,0 +1,360 @@
+/*
+** mysig.c - written in milano by vesely on 19oct2026
+** DKIM verification results, cached across processes
+*/
+/*
+* zdkimfilter - Sign outgoing, verify incoming mail messages
+
+Copyright (C) 2026 Alessandro Vesely
+
+This file is part of zdkimfilter
+
+zdkimfilter is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+zdkimfilter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License version 3
+along with zdkimfilter.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPLv3 section 7:
+
+If you modify zdkimfilter, or any covered work, by linking or combining it
+with software developed by The OpenDKIM Project and its contributors,
+containing parts covered by the applicable licence, the licensor or
+zdkimfilter grants you additional permission to convey the resulting work.
+*/
+#include <config.h>
+#if !ZDKIMFILTER_DEBUG
+#define NDEBUG
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <time.h>
+#include <syslog.h>
+#include <sys/mman.h>
+
+#include "mysig.h"
+#include "shmlock.h"
+#if defined TEST_MAIN
+#include <stdarg.h>
+#endif
+#include <assert.h>
+
+/*
+* Signatures that passed verification are kept in a table shared by forked
+* processes, for the configured ttl.  An entry matches if domain, selector,
+* b=, and the header and body hashes computed for the current message are
+* all equal.  The header hash covers the signed fields and the signature
+* itself, including bh=, so that a match is an exact replay of a verified
+* signature on identical content:  it passed with the same key, unless the
+* key changed within ttl.
+*
+* Failures are not cached.  They are rare in bulk mail, and OpenDKIM details
+* them when the signature is processed.
+*/
+
+#define SIG_SLOTS 256
+#define SIG_PROBE 8
+#define SIG_ID_LEN 320
+#define SIG_B_LEN 1024
+#define SIG_HASH_LEN 64
+
+typedef struct sig_entry
+{
+	time_t expire, last_used;
+	unsigned long hits;
+	unsigned short blen;
+	unsigned char hhlen, bhlen, flags, used;
+	unsigned char hh[SIG_HASH_LEN], bh[SIG_HASH_LEN];
+	char id[SIG_ID_LEN]; // selector._domainkey.domain
+	char b[SIG_B_LEN];
+} sig_entry;
+
+typedef struct sig_table
+{
+	shm_lock lock;
+	int ttl;
+	unsigned long lookups, hits, stored;
+	sig_entry slot[SIG_SLOTS];
+} sig_table;
+
+static sig_table *cache;
+static void (*sig_log)(int, char const*, ...) = &syslog;
+
+static bool sig_lock(void)
+// false if the table cannot be used
+{
+	int const rc = shm_lock_acquire(&cache->lock);
+	if (rc > 0) // the holder died midway, drop all signatures
+		memset(cache->slot, 0, sizeof cache->slot);
+	return rc >= 0;
+}
+
+static void sig_unlock(void)
+{
+	shm_lock_release(&cache->lock);
+}
+
+int sig_cache_init(int ttl, void (*log)(int, char const*, ...))
+/*
+* Create the shared table, or set its ttl; call before forking.  A ttl
+* of 0 drops the table.  Return 0 on success, -1 on error.
+*/
+{
+	if (log)
+		sig_log = log;
+
+	if (ttl <= 0)
+	{
+		if (cache)
+		{
+			munmap(cache, sizeof *cache);
+			cache = NULL;
+		}
+		return 0;
+	}
+
+	if (cache == NULL)
+	{
+		void *const p = mmap(NULL, sizeof *cache, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			return -1;
+		if (shm_lock_init(&((sig_table*)p)->lock))
+		{
+			munmap(p, sizeof *cache);
+			return -1;
+		}
+		cache = p;
+	}
+
+	cache->ttl = ttl;
+	return 0;
+}
+
+typedef struct sig_probe
+{
+	char id[SIG_ID_LEN];
+	char b[SIG_B_LEN];
+	size_t blen;
+	unsigned h;
+} sig_probe;
+
+static int sig_prepare(sig_cache_key const *k, sig_probe *p)
+// lowercase the id, strip FWS from b=, and hash; return -1 if unfit
+{
+	if (k == NULL || k->domain == NULL || k->selector == NULL ||
+		k->b == NULL || k->hh == NULL || k->bh == NULL ||
+		k->hhlen == 0 || k->hhlen > SIG_HASH_LEN ||
+		k->bhlen == 0 || k->bhlen > SIG_HASH_LEN ||
+		(size_t)snprintf(p->id, sizeof p->id, "%s._domainkey.%s",
+			k->selector, k->domain) >= sizeof p->id)
+				return -1;
+
+	for (char *s = p->id; *s; ++s)
+		*s = tolower(*(unsigned char*)s);
+
+	size_t l = 0;
+	for (char const *s = k->b; *s; ++s)
+		if (!isspace(*(unsigned char const*)s))
+		{
+			if (l + 1 >= sizeof p->b)
+				return -1;
+			p->b[l++] = *s;
+		}
+	if (l == 0)
+		return -1;
+	p->b[l] = 0;
+	p->blen = l;
+
+	unsigned h = 2166136261U; // FNV-1a, on b= which is random enough
+	for (size_t i = 0; i < l; ++i)
+		h = (h ^ (unsigned char)p->b[i]) * 16777619U;
+	p->h = h;
+	return 0;
+}
+
+static bool sig_match(sig_entry const *e, sig_cache_key const *k,
+	sig_probe const *p)
+{
+	return e->used && e->blen == p->blen &&
+		e->hhlen == k->hhlen && e->bhlen == k->bhlen &&
+		memcmp(e->b, p->b, p->blen) == 0 &&
+		memcmp(e->hh, k->hh, k->hhlen) == 0 &&
+		memcmp(e->bh, k->bh, k->bhlen) == 0 &&
+		strcmp(e->id, p->id) == 0;
+}
+
+int sig_cache_lookup(sig_cache_key const *k, unsigned *flags)
+/*
+* Return 1 if k passed verification within ttl, and set flags;
+* return 0 otherwise.
+*/
+{
+	sig_probe p;
+	if (cache == NULL || sig_prepare(k, &p))
+		return 0;
+
+	int rtc = 0;
+	time_t const now = time(NULL);
+	if (!sig_lock())
+		return 0;
+
+	cache->lookups += 1;
+	for (int i = 0; i < SIG_PROBE; ++i)
+	{
+		sig_entry *const e = &cache->slot[(p.h + i) % SIG_SLOTS];
+		if (sig_match(e, k, &p))
+		{
+			if (e->expire > now)
+			{
+				e->last_used = now;
+				e->hits += 1;
+				cache->hits += 1;
+				if (flags)
+					*flags = e->flags;
+				rtc = 1;
+			}
+			else
+				e->used = 0;
+			break;
+		}
+	}
+	sig_unlock();
+	return rtc;
+}
+
+void sig_cache_store(sig_cache_key const *k, unsigned flags)
+// remember that k passed; take a free or expired slot, or the LRU one
+{
+	sig_probe p;
+	if (cache == NULL || sig_prepare(k, &p))
+		return;
+
+	time_t const now = time(NULL);
+	if (!sig_lock())
+		return;
+
+	sig_entry *victim = NULL;
+	for (int i = 0; i < SIG_PROBE; ++i)
+	{
+		sig_entry *const e = &cache->slot[(p.h + i) % SIG_SLOTS];
+		if (sig_match(e, k, &p) || !e->used || e->expire <= now)
+		{
+			victim = e;
+			break;
+		}
+
+		if (victim == NULL || e->last_used < victim->last_used)
+			victim = e;
+	}
+
+	victim->expire = now + cache->ttl;
+	victim->last_used = now;
+	victim->hits = 0;
+	victim->flags = flags;
+	victim->blen = p.blen;
+	victim->hhlen = k->hhlen;
+	victim->bhlen = k->bhlen;
+	memcpy(victim->b, p.b, p.blen + 1);
+	memcpy(victim->hh, k->hh, k->hhlen);
+	memcpy(victim->bh, k->bh, k->bhlen);
+	strcpy(victim->id, p.id);
+	victim->used = 1;
+	cache->stored += 1;
+	sig_unlock();
+}
+
+void sig_cache_report(void)
+// log usage; racy reads are good enough here
+{
+	if (cache == NULL)
+		return;
+
+	unsigned entries = 0;
+	time_t const now = time(NULL);
+	for (int i = 0; i < SIG_SLOTS; ++i)
+		if (cache->slot[i].used && cache->slot[i].expire > now)
+			entries += 1;
+
+	(*sig_log)(LOG_INFO,
+		"verify cache: %lu lookups, %lu hits, %lu stored, %u entries",
+		cache->lookups, cache->hits, cache->stored, entries);
+}
+
+#if defined TEST_MAIN
+static void printlog(int severity, char const *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	putchar('\n');
+	(void)severity;
+}
+
+static void try(char const *what, sig_cache_key const *k)
+{
+	unsigned flags = 0;
+	int const rtc = sig_cache_lookup(k, &flags);
+	printf("%s: %s", what, rtc? "pass": "miss");
+	if (rtc && (flags & SIG_CACHE_TESTKEY))
+		fputs(" (test key)", stdout);
+	putchar('\n');
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 2)
+	{
+		printf("Usage:\n\t%s ttl\n", argv[0]);
+		return 1;
+	}
+
+	sig_cache_init(atoi(argv[1]), &printlog);
+
+	unsigned char hh[32], bh[32];
+	memset(hh, 'h', sizeof hh);
+	memset(bh, 'b', sizeof bh);
+	sig_cache_key k = {"Example.COM", "x1",
+		"dGhpcyBpcyBub3QgYSBy\r\n\tZWFsIHNpZ25hdHVyZQ==",
+		hh, bh, sizeof hh, sizeof bh};
+
+	try("before store", &k);
+	sig_cache_store(&k, 0);
+	try("stored", &k);
+
+	sig_cache_key k2 = k;
+	k2.domain = "example.com";
+	k2.b = "dGhpcyBpcyBub3QgYSByZWFsIHNpZ25hdHVyZQ==";
+	try("case and FWS", &k2);
+
+	k2.selector = "x2";
+	try("other selector", &k2);
+
+	k2 = k;
+	k2.b = "dGhpcyBpcyBub3QgYSByZWFsIHNpZ25hdHVyZR==";
+	try("other b=", &k2);
+
+	bh[0] = 'x';
+	try("other body", &k);
+	bh[0] = 'b';
+
+	hh[31] = 'x';
+	try("other header", &k);
+	sig_cache_store(&k, SIG_CACHE_TESTKEY);
+	try("stored test key", &k);
+
+	sig_cache_report();
+	return 0;
+}
+#endif
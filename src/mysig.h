@@ -0,0 +1,26 @@
+/*
+** mysig.h - written in milano by vesely on 19oct2026
+** DKIM verification results, cached across processes
+*/
+
+#if !defined MYSIG_H_INCLUDED
+
+#include <stddef.h>
+
+typedef struct sig_cache_key
+{
+	char const *domain, *selector;
+	char const *b;           // b= tag value, FWS is ignored
+	void const *hh, *bh;     // computed header and body hashes
+	size_t hhlen, bhlen;
+} sig_cache_key;
+
+#define SIG_CACHE_TESTKEY 1
+
+int sig_cache_init(int ttl, void (*log)(int, char const*, ...));
+int sig_cache_lookup(sig_cache_key const *k, unsigned *flags);
+void sig_cache_store(sig_cache_key const *k, unsigned flags);
+void sig_cache_report(void);
+
+#define MYSIG_H_INCLUDED
+#endif
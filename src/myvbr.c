@@ -52,6 +52,7 @@ zdkimfilter grants you additional permission to convey the resulting work.
 #include <resolv.h>
 
 #include <myvbr.h>
+#include "mydns.h"
 #include <assert.h>
 
 static char *skip_fws(char *s)
@@ -349,7 +350,7 @@ static int do_vbr_query(char const *signer, char const *vouch, char **resp)
 	} buf;
 	
 	// res_query returns -1 for NXDOMAIN
-	int rc = res_query(query, 1 /* Internet */, 16 /* TXT */,
+	int rc = my_res_query(query, 1 /* Internet */, 16 /* TXT */,
 		buf.answer, sizeof buf.answer);
 
 	if (rc < 0)
@@ -528,6 +529,27 @@ int flip_vbr_query_was_faked(void)
 	return faked;
 }
 
+int vbr_prefetch(vbr_info *first, vbr_cb cb, char const **tv)
+// start the queries vbr_check() may run for any domain, return how many
+{
+	int count = 0;
+	if (cb == NULL || my_vbr_query != &do_vbr_query)
+		return count;
+
+	for (vbr_info *v = first; v; v = v->next)
+		for (char **mv = v->mv; *mv; ++mv)
+			if ((*cb)(tv, *mv))
+			{
+				char query[1536];
+				if ((size_t)snprintf(query, sizeof query, "%s%s%s",
+					v->md, dwl_query, *mv) < sizeof query &&
+					dns_prefetch(query, 16 /* TXT */) == 0)
+						++count;
+			}
+
+	return count;
+}
+
 #if defined TEST_MAIN
 
 // fields we can/cannot parse
@@ -0,0 +1,1139 @@
+/*
+** myverify.c - written in milano by vesely on 19oct2026
+** native DKIM verification of common signatures
+*/
+/*
+* zdkimfilter - Sign outgoing, verify incoming mail messages
+
+Copyright (C) 2026 Alessandro Vesely
+
+This file is part of zdkimfilter
+
+zdkimfilter is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+zdkimfilter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License version 3
+along with zdkimfilter.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPLv3 section 7:
+
+If you modify zdkimfilter, or any covered work, by linking or combining it
+with software developed by The OpenDKIM Project and its contributors,
+containing parts covered by the applicable licence, the licensor or
+zdkimfilter grants you additional permission to convey the resulting work.
+*/
+#include <config.h>
+#if !ZDKIMFILTER_DEBUG
+#define NDEBUG
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "myverify.h"
+#if defined HAVE_HOGWEED
+#include <nettle/sha2.h>
+#include <nettle/base64.h>
+#include <nettle/asn1.h>
+#include <nettle/rsa.h>
+#include <nettle/eddsa.h>
+#include <nettle/bignum.h>
+#endif
+#if defined TEST_MAIN
+#include <sys/time.h>
+#endif
+#include <assert.h>
+
+/*
+* This is not a DKIM implementation.  It verifies the signatures that
+* make up most of the traffic, rsa-sha256 and ed25519-sha256 with simple
+* or relaxed canonicalization, and answers "pass" or "don't know".  Any
+* signature it cannot handle, or that does not pass, is left to OpenDKIM,
+* which then produces the result and its details.
+*
+* Header fields are given exactly as they are passed to dkim_header().
+* The body is given as it is in the message file, where each \n stands
+* for CRLF.  Each body canonicalization runs once, and feeds the hashes
+* of all the signatures that use it; signatures with the same l= share
+* the same hash.
+*/
+
+#if defined HAVE_HOGWEED
+
+#define FV_MAX_SIGS 16
+#define FV_MAX_TAGS 32
+#define FV_KEY_LEN 4096
+#define FV_CLOCK_DRIFT 300
+
+typedef enum fv_state
+{
+	fv_unusable, fv_ready, fv_pass, fv_fail
+} fv_state;
+
+typedef struct fv_sig
+{
+	fv_state state;
+	char const *why;        // reason for unusable or fail
+	size_t field;           // index of the DKIM-Signature field
+	char *tags;             // copy of the tag-list, values point here
+	char const *d, *s, *i, *h, *b64;
+	unsigned char *b;       // decoded signature
+	size_t blen;
+	unsigned char bh[SHA256_DIGEST_SIZE];
+	uint64_t l;
+	int sink;
+	unsigned flags;
+	unsigned char ed25519, relaxed_h, relaxed_b;
+} fv_sig;
+
+typedef struct fv_sink // a body hash
+{
+	struct sha256_ctx ctx;
+	uint64_t limit, hashed;
+	unsigned char digest[SHA256_DIGEST_SIZE];
+	int relaxed;
+} fv_sink;
+
+typedef struct fv_canon // a body canonicalization
+{
+	uint64_t total;
+	size_t pending_crlf, n;
+	int in_line, pending_sp;
+	unsigned char out[4096];
+} fv_canon;
+
+typedef struct fv_field
+{
+	size_t start, len;
+	size_t colon;           // len if there is no colon
+	size_t name_len;        // without WSP before the colon
+} fv_field;
+
+struct fast_verify
+{
+	char *buf;
+	size_t len, alloc;
+	fv_field *field;
+	size_t nfields, field_alloc;
+	int nsigs, nsinks, open_sinks;
+	int overflow;
+	int use_canon[2];       // simple, relaxed
+	fv_canon canon[2];
+	fv_sig sig[FV_MAX_SIGS];
+	fv_sink sink[FV_MAX_SIGS];
+};
+
+static inline int is_fws(int ch)
+{
+	return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n';
+}
+
+static int ci_equal(char const *a, char const *b, size_t len)
+{
+	for (size_t i = 0; i < len; ++i)
+		if (tolower(((unsigned char const*)a)[i]) !=
+			tolower(((unsigned char const*)b)[i]))
+				return 0;
+	return 1;
+}
+
+static char *trim_fws(char *s)
+{
+	while (is_fws(*(unsigned char*)s))
+		++s;
+	char *e = s + strlen(s);
+	while (e > s && is_fws(((unsigned char*)e)[-1]))
+		--e;
+	*e = 0;
+	return s;
+}
+
+static char *strip_fws(char *s)
+{
+	char *d = s;
+	for (char *p = s; *p; ++p)
+		if (!is_fws(*(unsigned char*)p))
+			*d++ = *p;
+	*d = 0;
+	return s;
+}
+
+typedef struct fv_tag
+{
+	char *name, *value;
+} fv_tag;
+
+static int parse_tags(char *s, fv_tag *tag, int max)
+/*
+* Split a tag-list in place, trimming FWS around names and values.
+* Return the number of tags, or -1 on syntax errors and duplicate tags.
+*/
+{
+	int n = 0;
+	for (;;)
+	{
+		char *const semi = strchr(s, ';');
+		if (semi)
+			*semi = 0;
+		char *const eq = strchr(s, '=');
+		if (eq)
+		{
+			*eq = 0;
+			char *const name = trim_fws(s);
+			if (*name == 0 || n >= max)
+				return -1;
+			for (int i = 0; i < n; ++i)
+				if (strcmp(tag[i].name, name) == 0)
+					return -1;
+			tag[n].name = name;
+			tag[n++].value = trim_fws(eq + 1);
+		}
+		else if (*trim_fws(s))
+			return -1;
+
+		if (semi == NULL)
+			return n;
+		s = semi + 1;
+	}
+}
+
+static char *tag_value(fv_tag const *tag, int n, char const *name)
+{
+	for (int i = 0; i < n; ++i)
+		if (strcmp(tag[i].name, name) == 0)
+			return tag[i].value;
+	return NULL;
+}
+
+static int has_item(char const *list, char const *item)
+// list is colon-separated without FWS
+{
+	size_t const len = strlen(item);
+	for (;;)
+	{
+		char const *const colon = strchr(list, ':');
+		size_t const l = colon? (size_t)(colon - list): strlen(list);
+		if (l == len && ci_equal(list, item, len))
+			return 1;
+		if (colon == NULL)
+			return 0;
+		list = colon + 1;
+	}
+}
+
+static int get_number(char const *s, uint64_t *n)
+{
+	if (s == NULL || *s == 0 || strlen(s) > 18)
+		return -1;
+
+	uint64_t v = 0;
+	for (; *s; ++s)
+		if (isdigit(*(unsigned char const*)s))
+			v = 10*v + *s - '0';
+		else
+			return -1;
+	*n = v;
+	return 0;
+}
+
+static unsigned char *decode_base64(char const *s, size_t *len)
+{
+	size_t const slen = strlen(s);
+	size_t dlen = BASE64_DECODE_LENGTH(slen);
+	unsigned char *const out = malloc(dlen + 1);
+	if (out == NULL)
+		return NULL;
+
+	struct base64_decode_ctx ctx;
+	base64_decode_init(&ctx);
+	if (!base64_decode_update(&ctx, &dlen, out, slen, s) ||
+		!base64_decode_final(&ctx) || dlen == 0)
+	{
+		free(out);
+		return NULL;
+	}
+	*len = dlen;
+	return out;
+}
+
+static int canon_type(char const *s)
+{
+	if (strcmp(s, "simple") == 0)
+		return 0;
+	if (strcmp(s, "relaxed") == 0)
+		return 1;
+	return -1;
+}
+
+static void parse_sig(fast_verify *fv, size_t field,
+	char const *value, size_t vlen)
+{
+	if (fv->nsigs >= FV_MAX_SIGS)
+	{
+		fv->overflow = 1;
+		return;
+	}
+
+	fv_sig *const sig = &fv->sig[fv->nsigs++];
+	memset(sig, 0, sizeof *sig);
+	sig->field = field;
+	sig->state = fv_unusable;
+	sig->why = "memory fault";
+	if ((sig->tags = malloc(vlen + 1)) == NULL)
+		return;
+
+	memcpy(sig->tags, value, vlen);
+	sig->tags[vlen] = 0;
+
+	fv_tag tag[FV_MAX_TAGS];
+	int const ntags = parse_tags(sig->tags, tag, FV_MAX_TAGS);
+	char *const v = tag_value(tag, ntags, "v"),
+		*const a = tag_value(tag, ntags, "a"),
+		*const c = tag_value(tag, ntags, "c"),
+		*const q = tag_value(tag, ntags, "q"),
+		*const d = tag_value(tag, ntags, "d"),
+		*const s = tag_value(tag, ntags, "s"),
+		*const i = tag_value(tag, ntags, "i"),
+		*const h = tag_value(tag, ntags, "h"),
+		*const l = tag_value(tag, ntags, "l"),
+		*const t = tag_value(tag, ntags, "t"),
+		*const x = tag_value(tag, ntags, "x"),
+		*const bh = tag_value(tag, ntags, "bh"),
+		*const b = tag_value(tag, ntags, "b");
+
+	sig->why = "syntax error";
+	if (ntags <= 0 || v == NULL || strcmp(v, "1") != 0 ||
+		a == NULL || d == NULL || *d == 0 || s == NULL || *s == 0 ||
+		h == NULL || bh == NULL || b == NULL)
+			return;
+
+	sig->why = "unsupported";
+	if (strcmp(a, "rsa-sha256") == 0)
+		sig->ed25519 = 0;
+	else if (strcmp(a, "ed25519-sha256") == 0)
+		sig->ed25519 = 1;
+	else
+		return;
+
+	if (q && strcmp(q, "dns/txt") != 0)
+		return;
+
+	int ch = 0, cb = 0;
+	if (c)
+	{
+		char *const slash = strchr(c, '/');
+		if (slash)
+		{
+			*slash = 0;
+			cb = canon_type(slash + 1);
+		}
+		ch = canon_type(c);
+		if (ch < 0 || cb < 0)
+			return;
+	}
+	sig->relaxed_h = ch;
+	sig->relaxed_b = cb;
+
+	sig->l = UINT64_MAX;
+	if (l && get_number(l, &sig->l))
+		return;
+
+	time_t const now = time(NULL);
+	uint64_t ts;
+	if (t && (get_number(t, &ts) || ts > (uint64_t)now + FV_CLOCK_DRIFT))
+		return;
+	if (x && (get_number(x, &ts) || ts < (uint64_t)now))
+		return;
+
+	strip_fws(h);
+	if (!has_item(h, "from") || has_item(h, "dkim-signature"))
+		return;
+
+	if (i)
+	{
+		char const *const at = strchr(i, '@');
+		if (at == NULL)
+			return;
+		size_t const ilen = strlen(at + 1), dlen = strlen(d);
+		if (ilen < dlen || !ci_equal(at + 1 + ilen - dlen, d, dlen) ||
+			(ilen > dlen && at[ilen - dlen] != '.'))
+				return;
+	}
+
+	size_t len;
+	unsigned char *body_hash = decode_base64(strip_fws(bh), &len);
+	if (body_hash == NULL || len != sizeof sig->bh)
+	{
+		free(body_hash);
+		return;
+	}
+	memcpy(sig->bh, body_hash, sizeof sig->bh);
+	free(body_hash);
+
+	sig->b64 = strip_fws(b);
+	if ((sig->b = decode_base64(sig->b64, &sig->blen)) == NULL)
+		return;
+
+	sig->d = d;
+	sig->s = s;
+	sig->i = i;
+	sig->h = h;
+	sig->state = fv_ready;
+	sig->why = NULL;
+}
+
+fast_verify *fast_verify_new(void)
+{
+	return calloc(1, sizeof(fast_verify));
+}
+
+int fast_verify_header(fast_verify *fv, char const *field, size_t len)
+/*
+* Store a header field, given with CRLF folds and no trailing CRLF.
+* Return 0, or -1 on memory fault.
+*/
+{
+	assert(fv);
+
+	if (fv->len + len > fv->alloc)
+	{
+		size_t n = fv->alloc? fv->alloc: 4096;
+		while (n < fv->len + len)
+			n *= 2;
+		char *const nb = realloc(fv->buf, n);
+		if (nb == NULL)
+			return -1;
+		fv->buf = nb;
+		fv->alloc = n;
+	}
+
+	if (fv->nfields >= fv->field_alloc)
+	{
+		size_t const n = fv->field_alloc? 2*fv->field_alloc: 64;
+		fv_field *const nf = realloc(fv->field, n * sizeof *nf);
+		if (nf == NULL)
+			return -1;
+		fv->field = nf;
+		fv->field_alloc = n;
+	}
+
+	fv_field *const f = &fv->field[fv->nfields];
+	char const *const colon = memchr(field, ':', len);
+	f->start = fv->len;
+	f->len = len;
+	f->colon = colon? (size_t)(colon - field): len;
+	f->name_len = colon? f->colon: 0;
+	while (f->name_len > 0 &&
+		(field[f->name_len - 1] == ' ' || field[f->name_len - 1] == '\t'))
+			--f->name_len;
+
+	memcpy(fv->buf + fv->len, field, len);
+	fv->len += len;
+
+	static char const dkim_signature[] = "DKIM-Signature";
+	if (f->name_len == sizeof dkim_signature - 1 &&
+		ci_equal(field, dkim_signature, f->name_len))
+			parse_sig(fv, fv->nfields, field + f->colon + 1, len - f->colon - 1);
+
+	fv->nfields += 1;
+	return 0;
+}
+
+int fast_verify_eoh(fast_verify *fv)
+/*
+* Set up the body hashes.  Return the number of signatures if all of
+* them can be checked natively, 0 otherwise.
+*/
+{
+	assert(fv);
+
+	int ready = 0;
+	for (int n = 0; n < fv->nsigs; ++n)
+	{
+		fv_sig *const sig = &fv->sig[n];
+		if (sig->state != fv_ready)
+			continue;
+
+		ready += 1;
+		int k;
+		for (k = 0; k < fv->nsinks; ++k)
+			if (fv->sink[k].relaxed == sig->relaxed_b &&
+				fv->sink[k].limit == sig->l)
+					break;
+		if (k >= fv->nsinks)
+		{
+			fv_sink *const sk = &fv->sink[fv->nsinks++];
+			sha256_init(&sk->ctx);
+			sk->limit = sig->l;
+			sk->hashed = 0;
+			sk->relaxed = sig->relaxed_b;
+			fv->use_canon[sk->relaxed] = 1;
+			if (sk->limit > 0)
+				fv->open_sinks += 1;
+		}
+		sig->sink = k;
+	}
+
+	return fv->overflow || ready < fv->nsigs? 0: ready;
+}
+
+static void canon_flush(fast_verify *fv, int relaxed)
+{
+	fv_canon *const c = &fv->canon[relaxed];
+	for (int k = 0; k < fv->nsinks; ++k)
+	{
+		fv_sink *const sk = &fv->sink[k];
+		if (sk->relaxed == relaxed && sk->hashed < sk->limit)
+		{
+			uint64_t n = c->n;
+			if (n > sk->limit - sk->hashed)
+				n = sk->limit - sk->hashed;
+			sha256_update(&sk->ctx, n, c->out);
+			sk->hashed += n;
+			if (sk->hashed >= sk->limit)
+				fv->open_sinks -= 1;
+		}
+	}
+	c->n = 0;
+}
+
+static void canon_put(fast_verify *fv, int relaxed, void const *data, size_t len)
+{
+	fv_canon *const c = &fv->canon[relaxed];
+	unsigned char const *p = data;
+	c->total += len;
+	while (len > 0)
+	{
+		size_t n = sizeof c->out - c->n;
+		if (n > len)
+			n = len;
+		memcpy(c->out + c->n, p, n);
+		c->n += n;
+		p += n;
+		len -= n;
+		if (c->n >= sizeof c->out)
+			canon_flush(fv, relaxed);
+	}
+}
+
+static void canon_pending(fast_verify *fv, int relaxed)
+// empty lines turn out not to be at the end of the body
+{
+	fv_canon *const c = &fv->canon[relaxed];
+	for (; c->pending_crlf > 0; --c->pending_crlf)
+		canon_put(fv, relaxed, "\r\n", 2);
+}
+
+static void body_simple(fast_verify *fv, char const *p, char const *end)
+{
+	fv_canon *const c = &fv->canon[0];
+	while (p < end)
+	{
+		char const *const nl = memchr(p, '\n', end - p);
+		char const *const eol = nl? nl: end;
+		if (eol > p)
+		{
+			canon_pending(fv, 0);
+			canon_put(fv, 0, p, eol - p);
+			c->in_line = 1;
+		}
+		if (nl == NULL)
+			break;
+
+		if (c->in_line)
+			canon_put(fv, 0, "\r\n", 2);
+		else
+			c->pending_crlf += 1;
+		c->in_line = 0;
+		p = nl + 1;
+	}
+}
+
+// bytes that end a run in relaxed body canonicalization
+static unsigned char const relaxed_stop[256] = {[' '] = 1, ['\t'] = 1, ['\n'] = 1};
+
+static void body_relaxed(fast_verify *fv, unsigned char const *p,
+	unsigned char const *end)
+{
+	fv_canon *const c = &fv->canon[1];
+	while (p < end)
+	{
+		unsigned char const *q = p;
+		while (q < end && relaxed_stop[*q] == 0)
+			++q;
+
+		if (q > p)
+		{
+			canon_pending(fv, 1);
+			if (c->pending_sp)
+			{
+				canon_put(fv, 1, " ", 1);
+				c->pending_sp = 0;
+			}
+			canon_put(fv, 1, p, q - p);
+			c->in_line = 1;
+			p = q;
+			continue;
+		}
+
+		if (*p == '\n')
+		{
+			if (c->in_line)
+				canon_put(fv, 1, "\r\n", 2);
+			else
+				c->pending_crlf += 1;
+			c->in_line = c->pending_sp = 0;
+		}
+		else
+			c->pending_sp = 1;
+		++p;
+	}
+}
+
+int fast_verify_body(fast_verify *fv, char const *buf, size_t len)
+/*
+* Hash a chunk of body.  Return 1 if no more body is needed.
+*/
+{
+	assert(fv);
+
+	if (fv->use_canon[0])
+		body_simple(fv, buf, buf + len);
+	if (fv->use_canon[1])
+		body_relaxed(fv, (unsigned char const*)buf,
+			(unsigned char const*)buf + len);
+
+	return fv->open_sinks <= 0;
+}
+
+static void header_put(struct sha256_ctx *ctx, unsigned char *out, size_t *n,
+	int ch)
+{
+	out[(*n)++] = ch;
+	if (*n >= 256)
+	{
+		sha256_update(ctx, *n, out);
+		*n = 0;
+	}
+}
+
+static void hash_field(struct sha256_ctx *ctx, char const *text,
+	fv_field const *f, int relaxed, int crlf)
+{
+	if (relaxed == 0)
+	{
+		sha256_update(ctx, f->len, (unsigned char const*)text);
+		if (crlf)
+			sha256_update(ctx, 2, (unsigned char const*)"\r\n");
+		return;
+	}
+
+	unsigned char out[256];
+	size_t n = 0;
+	for (size_t i = 0; i < f->name_len; ++i)
+		header_put(ctx, out, &n, tolower(((unsigned char const*)text)[i]));
+	header_put(ctx, out, &n, ':');
+
+	int started = 0, sp = 0;
+	for (size_t i = f->colon + 1; i < f->len; ++i)
+	{
+		int const ch = ((unsigned char const*)text)[i];
+		if (ch == '\r' || ch == '\n')
+			continue;
+		if (ch == ' ' || ch == '\t')
+		{
+			sp = 1;
+			continue;
+		}
+		if (sp && started)
+			header_put(ctx, out, &n, ' ');
+		sp = 0;
+		started = 1;
+		header_put(ctx, out, &n, ch);
+	}
+	if (crlf)
+	{
+		header_put(ctx, out, &n, '\r');
+		header_put(ctx, out, &n, '\n');
+	}
+	if (n)
+		sha256_update(ctx, n, out);
+}
+
+static size_t strip_b(char const *text, fv_field const *f, char *out)
+// copy the signature field, with an empty b= value
+{
+	memcpy(out, text, f->colon + 1);
+	size_t o = f->colon + 1;
+	char const *p = text + f->colon + 1, *const end = text + f->len;
+	while (p < end)
+	{
+		char const *const semi = memchr(p, ';', end - p);
+		char const *const spec_end = semi? semi: end;
+		char const *const eq = memchr(p, '=', spec_end - p);
+		char const *name = p, *name_end = eq? eq: spec_end;
+		while (name < name_end && is_fws(*(unsigned char const*)name))
+			++name;
+		while (name_end > name && is_fws(((unsigned char const*)name_end)[-1]))
+			--name_end;
+
+		size_t const keep = eq && name_end - name == 1 && *name == 'b'?
+			(size_t)(eq + 1 - p): (size_t)(spec_end - p);
+		memcpy(out + o, p, keep);
+		o += keep;
+		if (semi)
+			out[o++] = ';';
+		p = semi? semi + 1: end;
+	}
+	return o;
+}
+
+static int hash_headers(fast_verify const *fv, fv_sig const *sig,
+	unsigned char *used, unsigned char *digest)
+{
+	struct sha256_ctx ctx;
+	sha256_init(&ctx);
+	memset(used, 0, fv->nfields);
+
+	for (char const *h = sig->h; *h;)
+	{
+		char const *const colon = strchr(h, ':');
+		size_t const len = colon? (size_t)(colon - h): strlen(h);
+		for (size_t f = fv->nfields; f-- > 0;)
+		{
+			fv_field const *const fld = &fv->field[f];
+			if (used[f] == 0 && fld->name_len == len &&
+				ci_equal(fv->buf + fld->start, h, len))
+			{
+				used[f] = 1;
+				hash_field(&ctx, fv->buf + fld->start, fld, sig->relaxed_h, 1);
+				break;
+			}
+		}
+		if (colon == NULL)
+			break;
+		h = colon + 1;
+	}
+
+	fv_field field = fv->field[sig->field];
+	char *const copy = malloc(field.len);
+	if (copy == NULL)
+		return -1;
+
+	field.len = strip_b(fv->buf + field.start, &field, copy);
+	hash_field(&ctx, copy, &field, sig->relaxed_h, 0);
+	free(copy);
+	sha256_digest(&ctx, SHA256_DIGEST_SIZE, digest);
+	return 0;
+}
+
+static int rsa_key_from_spki(struct rsa_public_key *pub,
+	size_t len, unsigned char const *der)
+// SubjectPublicKeyInfo, as in nettle's pkcs1-conv
+{
+	static unsigned char const id_rsa_encryption[9] =
+		{0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x01, 0x01};
+	struct asn1_der_iterator i, j;
+
+	return asn1_der_iterator_first(&i, len, der) == ASN1_ITERATOR_CONSTRUCTED &&
+		i.type == ASN1_SEQUENCE &&
+		asn1_der_decode_constructed_last(&i) == ASN1_ITERATOR_CONSTRUCTED &&
+		i.type == ASN1_SEQUENCE &&
+		asn1_der_decode_constructed(&i, &j) == ASN1_ITERATOR_PRIMITIVE &&
+		j.type == ASN1_IDENTIFIER &&
+		j.length == sizeof id_rsa_encryption &&
+		memcmp(j.data, id_rsa_encryption, sizeof id_rsa_encryption) == 0 &&
+		asn1_der_iterator_next(&i) == ASN1_ITERATOR_PRIMITIVE &&
+		i.type == ASN1_BITSTRING &&
+		asn1_der_decode_bitstring_last(&i) &&
+		rsa_public_key_from_der_iterator(pub, 0, &i)? 0: -1;
+}
+
+static void check_sig(fast_verify const *fv, fv_sig *sig, int min_key_bits,
+	fast_verify_key_lookup *lookup, unsigned char *used)
+{
+	fv_sink const *const sk = &fv->sink[sig->sink];
+	if (sk->limit != UINT64_MAX && sk->hashed < sk->limit)
+	{
+		sig->state = fv_fail;
+		sig->why = "body shorter than l=";
+		return;
+	}
+
+	if (memcmp(sk->digest, sig->bh, sizeof sig->bh) != 0)
+	{
+		sig->state = fv_fail;
+		sig->why = "body hash mismatch";
+		return;
+	}
+
+	sig->state = fv_unusable;
+	char key[FV_KEY_LEN];
+	if ((*lookup)(sig->s, sig->d, key, sizeof key) != 0)
+	{
+		sig->why = "no key";
+		return;
+	}
+
+	fv_tag tag[FV_MAX_TAGS];
+	int const ntags = parse_tags(key, tag, FV_MAX_TAGS);
+	char *const v = tag_value(tag, ntags, "v"),
+		*const k = tag_value(tag, ntags, "k"),
+		*const h = tag_value(tag, ntags, "h"),
+		*const s = tag_value(tag, ntags, "s"),
+		*const t = tag_value(tag, ntags, "t"),
+		*const g = tag_value(tag, ntags, "g"),
+		*const p = tag_value(tag, ntags, "p");
+
+	sig->why = "unsupported key";
+	if (ntags <= 0 || (v && strcmp(v, "DKIM1") != 0) ||
+		strcmp(k? k: "rsa", sig->ed25519? "ed25519": "rsa") != 0 ||
+		(h && !has_item(strip_fws(h), "sha256")) ||
+		(s && !has_item(strip_fws(s), "*") && !has_item(s, "email")) ||
+		(g && *g && strcmp(g, "*") != 0))
+			return;
+
+	if (t)
+	{
+		strip_fws(t);
+		if (has_item(t, "y"))
+			sig->flags |= FAST_VERIFY_TESTKEY;
+		if (has_item(t, "s") && sig->i &&
+			strcasecmp(strchr(sig->i, '@') + 1, sig->d) != 0)
+				return;
+	}
+
+	if (p == NULL || *strip_fws(p) == 0)
+	{
+		sig->why = "key revoked";
+		return;
+	}
+
+	size_t len;
+	unsigned char *const der = decode_base64(p, &len);
+	if (der == NULL)
+		return;
+
+	unsigned char digest[SHA256_DIGEST_SIZE];
+	if (hash_headers(fv, sig, used, digest))
+	{
+		free(der);
+		sig->why = "memory fault";
+		return;
+	}
+
+	int ok = 0;
+	if (sig->ed25519)
+	{
+		if (len != ED25519_KEY_SIZE || sig->blen != ED25519_SIGNATURE_SIZE)
+		{
+			free(der);
+			return;
+		}
+		ok = ed25519_sha512_verify(der, sizeof digest, digest, sig->b);
+	}
+	else
+	{
+		struct rsa_public_key pub;
+		rsa_public_key_init(&pub);
+		if (rsa_key_from_spki(&pub, len, der) ||
+			mpz_sizeinbase(pub.n, 2) <
+				(size_t)(min_key_bits > 0? min_key_bits: 1024))
+		{
+			rsa_public_key_clear(&pub);
+			free(der);
+			return;
+		}
+
+		mpz_t b;
+		mpz_init(b);
+		nettle_mpz_set_str_256_u(b, sig->blen, sig->b);
+		ok = rsa_sha256_verify_digest(&pub, digest, b);
+		mpz_clear(b);
+		rsa_public_key_clear(&pub);
+	}
+	free(der);
+
+	sig->state = ok? fv_pass: fv_fail;
+	sig->why = ok? NULL: "bad signature";
+}
+
+int fast_verify_eom(fast_verify *fv, int min_key_bits,
+	fast_verify_key_lookup *lookup)
+/*
+* Finish body hashes and check each signature.  Return the number of
+* signatures that passed.
+*/
+{
+	assert(fv && lookup);
+
+	for (int r = 0; r < 2; ++r)
+		if (fv->use_canon[r])
+		{
+			fv_canon *const c = &fv->canon[r];
+			if (c->in_line || (r == 0 && c->total == 0))
+				canon_put(fv, r, "\r\n", 2);
+			canon_flush(fv, r);
+		}
+
+	for (int k = 0; k < fv->nsinks; ++k)
+		sha256_digest(&fv->sink[k].ctx, SHA256_DIGEST_SIZE, fv->sink[k].digest);
+
+	unsigned char *const used = malloc(fv->nfields + 1);
+	if (used == NULL)
+		return 0;
+
+	int passed = 0;
+	for (int n = 0; n < fv->nsigs; ++n)
+	{
+		fv_sig *const sig = &fv->sig[n];
+		if (sig->state == fv_ready)
+			check_sig(fv, sig, min_key_bits, lookup, used);
+		if (sig->state == fv_pass)
+			passed += 1;
+	}
+
+	free(used);
+	return passed;
+}
+
+int fast_verify_passed(fast_verify const *fv, char const *domain,
+	char const *b, unsigned *flags)
+/*
+* Return 1 if the signature by domain with the given b= passed, and set
+* flags; return 0 otherwise.  FWS in b is ignored.
+*/
+{
+	if (fv == NULL || domain == NULL || b == NULL)
+		return 0;
+
+	for (int n = 0; n < fv->nsigs; ++n)
+	{
+		fv_sig const *const sig = &fv->sig[n];
+		if (sig->state != fv_pass || strcasecmp(sig->d, domain) != 0)
+			continue;
+
+		char const *s = b, *t = sig->b64;
+		for (;; ++s, ++t)
+		{
+			while (is_fws(*(unsigned char const*)s))
+				++s;
+			if (*s != *t || *s == 0)
+				break;
+		}
+		if (*s == 0 && *t == 0)
+		{
+			if (flags)
+				*flags = sig->flags;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void fast_verify_free(fast_verify *fv)
+{
+	if (fv)
+	{
+		for (int n = 0; n < fv->nsigs; ++n)
+		{
+			free(fv->sig[n].tags);
+			free(fv->sig[n].b);
+		}
+		free(fv->field);
+		free(fv->buf);
+		free(fv);
+	}
+}
+
+#else // !HAVE_HOGWEED
+
+// return NULL, since we don't have nettle's hogweed
+fast_verify *fast_verify_new(void) { return NULL; }
+int fast_verify_header(fast_verify *fv, char const *field, size_t len)
+	{ (void)fv; (void)field; (void)len; return -1; }
+int fast_verify_eoh(fast_verify *fv) { (void)fv; return 0; }
+int fast_verify_body(fast_verify *fv, char const *buf, size_t len)
+	{ (void)fv; (void)buf; (void)len; return 1; }
+int fast_verify_eom(fast_verify *fv, int min_key_bits,
+	fast_verify_key_lookup *lookup)
+	{ (void)fv; (void)min_key_bits; (void)lookup; return 0; }
+int fast_verify_passed(fast_verify const *fv, char const *domain,
+	char const *b, unsigned *flags)
+	{ (void)fv; (void)domain; (void)b; (void)flags; return 0; }
+void fast_verify_free(fast_verify *fv) { (void)fv; }
+
+#endif // HAVE_HOGWEED
+
+#if defined TEST_MAIN
+#if defined HAVE_HOGWEED
+/*
+* Keys are read from a file in the format of KEYFILE, one record per line:
+*   selector._domainkey.domain record
+*/
+static char const *keyfile;
+
+static int test_lookup(char const *selector, char const *domain,
+	char *buf, size_t buflen)
+{
+	char name[512];
+	size_t const nlen = snprintf(name, sizeof name, "%s._domainkey.%s",
+		selector, domain);
+	FILE *fp = fopen(keyfile, "r");
+	if (fp == NULL || nlen >= sizeof name)
+	{
+		if (fp)
+			fclose(fp);
+		return -2;
+	}
+
+	char line[8192];
+	int rtc = 1;
+	while (fgets(line, sizeof line, fp))
+		if (strncasecmp(line, name, nlen) == 0 &&
+			isspace(((unsigned char*)line)[nlen]))
+		{
+			char *s = line + nlen;
+			while (isspace(*(unsigned char*)s))
+				++s;
+			size_t len = strlen(s);
+			while (len > 0 && isspace(((unsigned char*)s)[len - 1]))
+				--len;
+			if (len < buflen)
+			{
+				memcpy(buf, s, len);
+				buf[len] = 0;
+				rtc = 0;
+			}
+			break;
+		}
+	fclose(fp);
+	return rtc;
+}
+
+static fast_verify *verify_file(char const *fname)
+{
+	FILE *fp = fopen(fname, "r");
+	if (fp == NULL)
+	{
+		perror(fname);
+		return NULL;
+	}
+
+	fast_verify *fv = fast_verify_new();
+	char *line = NULL, *field = NULL;
+	size_t line_alloc = 0, flen = 0;
+	ssize_t len;
+	while (fv && (len = getline(&line, &line_alloc, fp)) > 0)
+	{
+		if (line[len - 1] == '\n')
+			line[--len] = 0;
+		if (field && len > 0 && (line[0] == ' ' || line[0] == '\t'))
+		{
+			char *const nf = realloc(field, flen + len + 3);
+			if (nf == NULL)
+				break;
+			field = nf;
+			memcpy(field + flen, "\r\n", 2);
+			memcpy(field + flen + 2, line, len + 1);
+			flen += len + 2;
+			continue;
+		}
+
+		if (field && fast_verify_header(fv, field, flen))
+			break;
+		free(field);
+		field = NULL;
+		if (len == 0)
+			break;
+		field = strdup(line);
+		flen = len;
+	}
+	free(field);
+	free(line);
+
+	if (fv)
+	{
+		fast_verify_eoh(fv);
+		char buf[16384];
+		size_t n;
+		while ((n = fread(buf, 1, sizeof buf, fp)) > 0)
+			if (fast_verify_body(fv, buf, n))
+				break;
+		fast_verify_eom(fv, 0, &test_lookup);
+	}
+	fclose(fp);
+	return fv;
+}
+#endif // HAVE_HOGWEED
+
+int main(int argc, char *argv[])
+{
+#if !defined HAVE_HOGWEED
+	puts("not compiled with nettle's hogweed");
+	return 0;
+	(void)argc; (void)argv;
+#else
+	int rounds = 0, i = 1;
+	if (argc > 2 && strcmp(argv[1], "-r") == 0)
+	{
+		rounds = atoi(argv[2]);
+		i = 3;
+	}
+
+	if (argc < i + 2)
+	{
+		printf("Usage:\n\t%s [-r rounds] keyfile message...\n", argv[0]);
+		return 1;
+	}
+
+	keyfile = argv[i++];
+	for (; i < argc; ++i)
+	{
+		fast_verify *const fv = verify_file(argv[i]);
+		if (fv == NULL)
+			continue;
+
+		for (int n = 0; n < fv->nsigs; ++n)
+		{
+			fv_sig const *const sig = &fv->sig[n];
+			static char const *const state[] =
+				{"unusable", "ready", "pass", "fail"};
+			printf("%s: d=%s s=%s: %s", argv[i],
+				sig->d? sig->d: "?", sig->s? sig->s: "?", state[sig->state]);
+			if (sig->why)
+				printf(" (%s)", sig->why);
+			if (sig->flags & FAST_VERIFY_TESTKEY)
+				fputs(" (test key)", stdout);
+			putchar('\n');
+		}
+		fast_verify_free(fv);
+
+		if (rounds > 0)
+		{
+			struct timeval start, end;
+			gettimeofday(&start, NULL);
+			for (int r = 0; r < rounds; ++r)
+				fast_verify_free(verify_file(argv[i]));
+			gettimeofday(&end, NULL);
+			double const us = (end.tv_sec - start.tv_sec) * 1e6 +
+				(end.tv_usec - start.tv_usec);
+			printf("%d rounds: %.1f us per message\n", rounds, us / rounds);
+		}
+	}
+	return 0;
+#endif
+}
+#endif // TEST_MAIN
@@ -0,0 +1,29 @@
+/*
+** myverify.h - written in milano by vesely on 19oct2026
+** native DKIM verification of common signatures
+*/
+
+#if !defined MYVERIFY_H_INCLUDED
+
+#include <stddef.h>
+
+typedef struct fast_verify fast_verify;
+
+// same semantics as key_lookup() in mykey.h
+typedef int fast_verify_key_lookup(char const *selector, char const *domain,
+	char *buf, size_t buflen);
+
+#define FAST_VERIFY_TESTKEY 1
+
+fast_verify *fast_verify_new(void);
+int fast_verify_header(fast_verify *fv, char const *field, size_t len);
+int fast_verify_eoh(fast_verify *fv);
+int fast_verify_body(fast_verify *fv, char const *buf, size_t len);
+int fast_verify_eom(fast_verify *fv, int min_key_bits,
+	fast_verify_key_lookup *lookup);
+int fast_verify_passed(fast_verify const *fv, char const *domain,
+	char const *b, unsigned *flags);
+void fast_verify_free(fast_verify *fv);
+
+#define MYVERIFY_H_INCLUDED
+#endif
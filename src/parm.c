@@ -283,6 +283,23 @@ static config_conf const conf[] =
 	CONFIG(parm_t, trusted_dnswl, "space-separated dns.zones", assign_array),
 	CONFIG(parm_t, whitelisted_pass, "int", assign_int),
 	CONFIG(parm_t, dns_timeout, "secs", assign_int),
+	CONFIG(parm_t, dns_prefetch, "Y/N", assign_char),
+	CONFIG(parm_t, dns_adaptive_timeout, "Y/N", assign_char),
+	CONFIG(parm_t, dns_breaker_failures, "int", assign_int),
+	CONFIG(parm_t, dns_breaker_cooldown, "secs", assign_int),
+	CONFIG(parm_t, key_cache_ttl, "secs", assign_int),
+	CONFIG(parm_t, verify_cache_ttl, "secs", assign_int),
+	CONFIG(parm_t, verify_native, "Y/N", assign_char),
+	CONFIG(parm_t, verify_unsigned_fast, "Y/N", assign_char),
+	CONFIG(parm_t, stats_writer_queue, "KB", assign_int),
+	CONFIG(parm_t, stats_spool, "filename", assign_ptr),
+	CONFIG(parm_t, domain_flags_snapshot, "filename", assign_ptr),
+	CONFIG(parm_t, rate_limit_interval, "secs", assign_int),
+	CONFIG(parm_t, rate_limit_messages, "int", assign_int),
+	CONFIG(parm_t, rate_limit_rcpts, "int", assign_int),
+	CONFIG(parm_t, rate_limit_reconcile, "secs", assign_int),
+	CONFIG(parm_t, stats_store, "directory", assign_ptr),
+	CONFIG(parm_t, stats_store_segment, "secs", assign_int),
 
 	CONFIG(db_parm_t, db_backend, "conn", assign_ptr),
 	CONFIG(db_parm_t, db_host, "conn", assign_ptr),
@@ -293,6 +310,16 @@ static config_conf const conf[] =
 	CONFIG(db_parm_t, db_opt_mode, "", assign_ptr),
 	CONFIG(db_parm_t, db_opt_paged_results, "int", assign_int),
 	CONFIG(db_parm_t, db_timeout, "secs", assign_int),
+	CONFIG(db_parm_t, db_batch_rows, "int", assign_int),
+	CONFIG(db_parm_t, db_batch_window, "secs", assign_int),
+	CONFIG(db_parm_t, db_ref_cache_size, "entries", assign_int),
+	CONFIG(db_parm_t, db_ref_cache_ttl, "secs", assign_int),
+	CONFIG(db_parm_t, db_ref_cache_flush, "secs", assign_int),
+	CONFIG(db_parm_t, db_flags_snapshot_refresh, "secs", assign_int),
+	CONFIG(db_parm_t, db_slow_query, "millisecs", assign_int),
+	CONFIG(db_parm_t, db_purge_retention, "days", assign_int),
+	CONFIG(db_parm_t, db_purge_batch, "rows", assign_int),
+	CONFIG(db_parm_t, db_purge_pause, "millisecs", assign_int),
 	CONFIG(db_parm_t, db_database, "", assign_ptr),
 	CONFIG(db_parm_t, db_user, "credentials", assign_ptr),
 	CONFIG(db_parm_t, db_password, "credentials", assign_ptr),
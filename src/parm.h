@@ -50,6 +50,9 @@ typedef struct parm_t
 	char *save_drop;
 	char *action_header;
 	char *publicsuffix;
+	char *stats_spool;
+	char *domain_flags_snapshot;
+	char *stats_store;
 	const char **sign_hfields;
 	const char **skip_hfields;
 	const char **key_choice_header;
@@ -69,6 +72,16 @@ typedef struct parm_t
 
 	int dnswl_octet_index;
 	int min_key_bits;
+	int dns_breaker_failures;
+	int dns_breaker_cooldown;
+	int key_cache_ttl;
+	int verify_cache_ttl;
+	int stats_writer_queue;
+	int rate_limit_interval;
+	int rate_limit_messages;
+	int rate_limit_rcpts;
+	int rate_limit_reconcile;
+	int stats_store_segment;
 
 	char trust_a_r;
 	char add_a_r_anyway;
@@ -91,7 +104,11 @@ typedef struct parm_t
 	char save_from_anyway;
 	char add_ztags;
 	char header_action_is_reject;
-	char not_used[1];
+	char dns_prefetch;
+	char dns_adaptive_timeout;
+	char verify_native;
+	char verify_unsigned_fast;
+	char not_used[1]; // keep the flags a multiple of 4 bytes
 } parm_t;
 
 typedef struct db_parm_t
@@ -111,6 +128,16 @@ typedef struct db_parm_t
 
 	int db_opt_paged_results;
 	int db_timeout; // seconds
+	int db_batch_rows;
+	int db_batch_window; // seconds
+	int db_ref_cache_size;
+	int db_ref_cache_ttl; // seconds
+	int db_ref_cache_flush; // seconds
+	int db_flags_snapshot_refresh; // seconds
+	int db_slow_query; // milliseconds
+	int db_purge_retention; // days
+	int db_purge_batch;
+	int db_purge_pause; // milliseconds
 	char db_opt_multi_statements;
 	char db_opt_compress;
 	char not_used[30];
@@ -44,6 +44,8 @@ the resulting work.
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <unistd.h>
 
 // LIBIDN2
@@ -54,6 +56,7 @@ the resulting work.
 
 #include "parm.h" // for do_report
 #include "publicsuffix.h"
+#include "shmlock.h"
 #include <assert.h>
 
 static logfun_t do_report = &syslog;
@@ -76,7 +79,8 @@ static logfun_t do_report = &syslog;
 * of a given node are stored consecutively (one after another, without gaps)
 * after the first child.  Elements of the long array, string_node's, hold
 * just the string offset.  Equal indexes of both array semantically refer to
-* the same trie node.
+* the same trie node.  Rather than bsearch'ing the children of a node, a
+* hash table of string_node indexes, keyed by parent and label, is used.
 *
 * Initialization consists of about twice as much lines of code as the runtime
 * functions, and it uses more than twelve times as much memory.  Memory used
@@ -84,6 +88,10 @@ static logfun_t do_report = &syslog;
 * amounts allocated as needed and linked into lists.  The corresponding
 * structures are defined right before the code which uses them, so that it is
 * clear that functions defined earlier don't use them.
+*
+* The final chunk can be written to a file by publicsuffix_compile(), as is,
+* preceded by a psl_header.  publicsuffix_init() recognizes such a file and
+* maps it read-only instead of parsing, so that all processes share it.
 */
 
 static char **
@@ -166,14 +174,16 @@ reverse_labels(char *domain, size_t len, char const *extra)
 // trie nodes, only for the first names
 typedef struct trie_node // 4 bytes
 {
-	unsigned int first_child: 13;
-#define MAX_NUM_TRIE_NODES 0x1fffU
+	unsigned int first_child: 16;
+#define MAX_NUM_TRIE_NODES 0xfffeU
 
 	unsigned int num_children: 11;
 #define MAX_NUM_CHILDREN 0x7ffU
 
 	unsigned int is_terminal: 1;
-	//unsigned int nu: 7;
+	unsigned int has_wildcard: 1;  // a child is "*"
+	unsigned int has_exception: 1; // a child is "!label"
+	//unsigned int nu: 2;
 } trie_node;
 
 // string table entry, for each name
@@ -182,196 +192,396 @@ typedef struct string_node
 	uint16_t n;
 } string_node;
 
+/*
+* Children are found by hashing (parent, label) into an open addressing
+* table of string_node indexes, at most half full.  A candidate is checked
+* to be in the parent's range of children before comparing the label.
+*/
+#define HASH_EMPTY UINT16_MAX
+#define MAX_NUM_STRINGS (UINT16_MAX - 1U)
+
+typedef struct psl_cache psl_cache;
+
 /*
 * Data structures used to perform the search. Should be
 * populated once at startup by a call to publicsuffix_init.
 */
 struct publicsuffix_trie
 {
-	trie_node *node_table; // allocated
+	trie_node *node_table; // allocated, or in map
 	string_node *str;
+	uint16_t *hash;
 	char* string_table;
+	void *map; // mmapped compiled file, or NULL
+	psl_cache *cache; // shared by forked processes
+	size_t map_size, string_size, hash_size;
 
 	size_t num_root_nodes, num_trie_nodes;
 	size_t num_strings; // total number of string nodes
+	trie_node root; // only the flags
 	time_t old_time;
 	off_t old_size;
 	char old_fname[];
 };
 
-typedef struct bsearch_key
+/*
+* A label as looked up.  The string table has "#..." for "xn--..." (see
+* reverse_labels) and "!..." for exceptions, so the key has a prefix char.
+*/
+typedef struct label_key
 {
-	publicsuffix_trie const *pst;
-	char const *component;
-} bsearch_key;
+	char const *p;
+	size_t len;
+	int pre;
+} label_key;
 
-static int bsearch_cmp(void const *k, void const *el)
+static inline unsigned hash_start(int parent)
 {
-	bsearch_key const *const key = k;
-	register char const *a = key->component;
-	string_node const *const str = el;
-	register char const *b = key->pst->string_table + str->n;
+	return (2166136261U ^ (unsigned)(parent + 1)) * 16777619U;
+}
 
-	register int c, d, r;
-	do c = *a++, d = *b++;
-	while (c && d && (r = c - d) == 0);
+static inline unsigned hash_step(unsigned h, int ch)
+{
+	return (h ^ (unsigned char)ch) * 16777619U; // FNV-1a
+}
 
-	return c - d;
+static unsigned key_hash(int parent, label_key const *key)
+{
+	unsigned h = hash_start(parent);
+	if (key->pre)
+		h = hash_step(h, key->pre);
+	for (size_t i = 0; i < key->len; ++i)
+		h = hash_step(h, key->p[i]);
+	return h;
 }
 
-static string_node *find_node(publicsuffix_trie const *pst,
-	char *component, string_node *parent)
+static int key_eq(char const *s, label_key const *key)
 {
-	assert(pst);
-	assert(component);
-	assert(parent == NULL ||
-		(parent >= pst->str && parent - pst->str < (int)pst->num_strings));
+	if (key->pre && *s++ != key->pre)
+		return 0;
+	return strncmp(s, key->p, key->len) == 0 && s[key->len] == 0;
+}
 
-	bsearch_key key;
-	key.pst = pst;
-	key.component = component;
+static int find_child(publicsuffix_trie const *pst, int parent,
+	label_key const *key)
+/*
+* parent is a trie_node index, or -1 for the root.
+* return the string_node index of the child, or -1 if not found.
+*/
+{
+	size_t first, count;
+	if (parent < 0)
+	{
+		first = 0;
+		count = pst->num_root_nodes;
+	}
+	else
+	{
+		trie_node const *const node = &pst->node_table[parent];
+		first = node->first_child;
+		count = node->num_children;
+	}
 
-	string_node *base;
-	size_t size;
-	if (parent == NULL)
+	size_t const mask = pst->hash_size - 1;
+	for (size_t h = key_hash(parent, key) & mask;; h = (h + 1) & mask)
 	{
-		base = pst->str;
-		size = pst->num_root_nodes;
+		size_t const n = pst->hash[h];
+		if (n == HASH_EMPTY)
+			return -1;
+
+		if (n - first < count &&
+			key_eq(pst->string_table + pst->str[n].n, key))
+				return n;
 	}
-	else if ((size = parent - pst->str) < pst->num_trie_nodes)
+}
+
+static int find_node(publicsuffix_trie const *pst,
+	char const *label, size_t len, int parent, int *exception)
+/*
+* Like find_child, but apply wildcard and exception rules.  From
+* https://publicsuffix.org/list/: "The wildcard character * (asterisk)
+* matches any valid sequence of characters in a hostname part.  [...]  An
+* exclamation mark (!) at the start of a rule marks an exception to a
+* previous wildcard rule.  An exception rule takes priority over any other
+* matching rule."
+*/
+{
+	assert(pst);
+	assert(parent < (int)pst->num_trie_nodes);
+
+	label_key key;
+	key.p = label;
+	key.len = len;
+	key.pre = 0;
+	if (len > 4 && strncmp(label, "xn--", 4) == 0)
 	{
-		trie_node const *const node = &pst->node_table[size];
-		base = &pst->str[node->first_child];
-		size = node->num_children;
+		key.p += 4;
+		key.len -= 4;
+		key.pre = '#';
 	}
-	else
-		return NULL;
 
-	string_node *current =
-		bsearch(&key, base, size, sizeof(string_node), bsearch_cmp);
-	if (current)
+	int current = find_child(pst, parent, &key);
+	if (current >= 0)
 		return current;
 
-	/*
-	* We didn't find an exact match, so see if there's a wildcard
-	* match.  From https://publicsuffix.org/list/: "The wildcard
-	* character * (asterisk) matches any valid sequence of characters
-	* in a hostname part. (Note: the list uses Unicode, not Punycode
-	* forms, and is encoded using UTF-8.) Wildcards may only be used to
-	* wildcard an entire level. That is, they must be surrounded by
-	* dots (or implicit dots, at the beginning of a line)."
-	*/
-	key.component = "*";
-	current = bsearch(&key, base, size, sizeof(string_node), bsearch_cmp);
-	if (current)
-	/*
-	* If there was a wildcard match, see if there is a wildcard
-	* exception match, and prefer it if so.  From
-	* https://publicsuffix.org/list/: "An exclamation mark (!) at
-	* the start of a rule marks an exception to a previous wildcard
-	* rule. An exception rule takes priority over any other matching
-	* rule."
-	*/
+	trie_node const *const node =
+		parent < 0? &pst->root: &pst->node_table[parent];
+	if (node->has_wildcard)
 	{
-		char exception_component[68];
-		exception_component[0] = '!';
-		strcpy(&exception_component[1], component);
-		key.component = exception_component;
-		string_node *exception =
-			bsearch(&key, base, size, sizeof(string_node), bsearch_cmp);
-		if (exception)
-			current = exception;
+		label_key const star = {"*", 1, 0};
+		current = find_child(pst, parent, &star);
+		if (current >= 0 && node->has_exception)
+		{
+			key.p = label;
+			key.len = len;
+			key.pre = '!';
+			int const n = find_child(pst, parent, &key);
+			if (n >= 0)
+			{
+				*exception = 1;
+				current = n;
+			}
+		}
 	}
 
 	return current;
 }
 
-char *org_domain(publicsuffix_trie const *pst, char const *c_domain)
+static int org_offset(publicsuffix_trie const *pst, char const *d, size_t len)
 /*
-* c_domain must be ascii
+* d is a lowercase, validated domain of length len.  Walk its labels
+* right to left.  return the offset of the org domain in d, or -1.
 */
 {
-	char *domain = c_domain? strdup(c_domain): NULL;
-	if (domain == NULL)
-		return NULL;
-
-	char *org = NULL;
-	size_t len = strlen(domain);
-	char **labels = reverse_labels(domain, len, NULL);
+	int last_valid = -1, current = -1, exception = 0;
+	size_t end = len;
 
-	if (labels)
+	for (;;)
 	{
-		char **last_valid = NULL;
-		string_node *current = NULL;
-		for (char **l = labels; *l; ++l)
+		size_t start = end;
+		while (start > 0 && d[start - 1] != '.')
+			--start;
+
+		exception = 0;
+		current = find_node(pst, d + start, end - start, current, &exception);
+		if (current < 0)
+			break;
+
+		int const is_leaf = (size_t)current >= pst->num_trie_nodes;
+		if (is_leaf || pst->node_table[current].is_terminal)
 		{
-			current = find_node(pst, *l, current);
-			if (current == NULL)
+			last_valid = start;
+			if (is_leaf)
 				break;
-
-			unsigned int const ndx = current - pst->str;
-			if (ndx >= pst->num_trie_nodes || pst->node_table[ndx].is_terminal)
-			{
-				last_valid = l;
-				if (ndx >= pst->num_trie_nodes)
-					break;
-			}
-			else
-				last_valid = NULL;
 		}
+		else
+			last_valid = -1;
 
-		if (last_valid == NULL)
+		if (start == 0)
+			break;
+
+		end = start - 1;
+	}
+
+	if (last_valid < 0)
+		return -1; // not listed
+
+	if (!exception)
+	{
+		if (last_valid > 0) // one more label
 		{
-			free(domain);
-			free(labels);
-			return NULL; // not listed
+			size_t start = last_valid - 1;
+			while (start > 0 && d[start - 1] != '.')
+				--start;
+			last_valid = start;
 		}
+		else if (current >= 0)
+			return -1; // listed, but missing an org domain
+	}
 
-		int const exception = current && pst->string_table[current->n] == '!';
+	return last_valid;
+}
 
-		if (!exception)
+static size_t normalize_domain(char const *domain, char *buf, size_t size)
+/*
+* Copy domain to buf, lowercase, without leading and trailing dots, and
+* check its labels.  return its length, or 0 if invalid (see reverse_labels).
+*/
+{
+	size_t len = strlen(domain);
+	while (len > 0 && domain[len-1] == '.')
+		--len;
+
+	while (len > 0 && *domain == '.')
+	{
+		++domain;
+		--len;
+	}
+
+	if (len == 0 || len > 255 || len >= size)
+		return 0;
+
+	size_t l_len = 0;
+	for (size_t i = 0; i < len; ++i)
+	{
+		int const ch = *(unsigned char const*)&domain[i];
+		if (ch == '.')
 		{
-			if (last_valid[1])
-				++last_valid;
-			else if (current)
-			{
-				free(domain);
-				free(labels);
-				return NULL; // listed, but missing an org domain
-			}
+			if (l_len == 0)
+				return 0;
+			l_len = 0;
 		}
+		else if (++l_len > 63)
+			return 0;
+
+		if ((ch >= 'a' && ch <= 'z') || (ch >= '0' && ch <= '9') ||
+			ch == '-' || ch == '.' || ch == '_')
+				buf[i] = ch;
+		else if (ch >= 'A' && ch <= 'Z')
+			buf[i] = ch - 'A' + 'a';
+		else
+			return 0;
+	}
 
-		len = 0;
-		for (char **l = labels; ; ++l)
+	buf[len] = 0;
+	return len;
+}
+
+// ----- org domain cache -----
+
+/*
+* A small cache, domain -> org domain offset, shared by forked processes.
+* It is created by publicsuffix_init, in the parent, and goes with its trie.
+* Sets of PSL_CACHE_WAYS slots are selected by hashing the domain; the least
+* recently used slot of a set is replaced.
+*/
+#define PSL_CACHE_SETS 256
+#define PSL_CACHE_WAYS 4
+
+typedef struct psl_cache_entry
+{
+	uint32_t last_used;
+	int16_t offset; // -1 for no org domain
+	uint8_t len;    // 0 = free
+	char domain[256];
+} psl_cache_entry;
+
+struct psl_cache
+{
+	shm_lock lock;
+	uint32_t tick;
+	unsigned long lookups, hits;
+	psl_cache_entry slot[PSL_CACHE_SETS][PSL_CACHE_WAYS];
+};
+
+static int cache_lock(psl_cache *cache)
+// return 0 when locked, -1 if the cache cannot be used
+{
+	int const rc = shm_lock_acquire(&cache->lock);
+	if (rc > 0) // the holder died midway, empty the cache
+		memset(cache->slot, 0, sizeof cache->slot);
+	return rc < 0? -1: 0;
+}
+
+static void cache_unlock(psl_cache *cache)
+{
+	shm_lock_release(&cache->lock);
+}
+
+static psl_cache *cache_new(void)
+{
+	void *const p = mmap(NULL, sizeof(psl_cache), PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	if (shm_lock_init(&((psl_cache*)p)->lock))
+	{
+		munmap(p, sizeof(psl_cache));
+		return NULL;
+	}
+
+	return p;
+}
+
+static int cached_offset(publicsuffix_trie const *pst, char const *d, size_t len)
+{
+	psl_cache *const cache = pst->cache;
+	if (cache == NULL || cache_lock(cache))
+		return org_offset(pst, d, len);
+
+	unsigned h = hash_start(-1);
+	for (size_t i = 0; i < len; ++i)
+		h = hash_step(h, d[i]);
+	psl_cache_entry *const set = cache->slot[h % PSL_CACHE_SETS];
+
+	cache->lookups += 1;
+	psl_cache_entry *victim = &set[0];
+	for (int i = 0; i < PSL_CACHE_WAYS; ++i)
+	{
+		psl_cache_entry *const e = &set[i];
+		if (e->len == len && memcmp(e->domain, d, len) == 0)
 		{
-			len += strlen(*l) + 1;
-			if (**l == '#')
-				len += 3;
-			if (l == last_valid)
-				break;
+			e->last_used = ++cache->tick;
+			cache->hits += 1;
+			int const offset = e->offset;
+			cache_unlock(cache);
+			return offset;
 		}
-		org = malloc(len);
-		if (org)
-		{
-			*org = 0;
-			for (char **l = last_valid; ; --l)
-			{
-				if (**l == '#')
-				{
-					strcat(org, "xn--");
-					*l += 1;
-				}
-				strcat(org,  *l);
-				if (l == labels)
-					break;
+		if (e->last_used < victim->last_used)
+			victim = e;
+	}
+	cache_unlock(cache);
 
-				strcat(org, ".");
-			}
-		}
-		free(labels);
+	int const offset = org_offset(pst, d, len);
+
+	if (cache_lock(cache) == 0)
+	{
+		victim->last_used = ++cache->tick;
+		victim->offset = offset;
+		victim->len = len;
+		memcpy(victim->domain, d, len);
+		cache_unlock(cache);
 	}
-	free(domain);
-	return org;
+
+	return offset;
+}
+
+char *org_domain_buf(publicsuffix_trie const *pst, char const *domain,
+	char *buf, size_t size)
+/*
+* Write the org domain of domain, lowercase, in buf; 256 bytes are enough.
+* domain must be ascii.  return buf, or NULL if domain has no org domain.
+* Does not allocate memory.
+*/
+{
+	assert(pst);
+	assert(buf);
+
+	if (domain == NULL)
+		return NULL;
+
+	char d[256];
+	size_t const len = normalize_domain(domain, d, sizeof d);
+	if (len == 0)
+		return NULL;
+
+	int const offset = cached_offset(pst, d, len);
+	if (offset < 0 || len - offset >= size)
+		return NULL;
+
+	memcpy(buf, d + offset, len - offset + 1);
+	return buf;
+}
+
+char *org_domain(publicsuffix_trie const *pst, char const *c_domain)
+/*
+* c_domain must be ascii; return a malloc'ed org domain, or NULL
+*/
+{
+	char buf[256];
+	char *od = org_domain_buf(pst, c_domain, buf, sizeof buf);
+	return od? strdup(od): NULL;
 }
 
 // ----- read rules -----
@@ -759,35 +969,300 @@ static int wt_step3(loose_trie* t, void *v, int depth)
 	(void)depth; // not used
 }
 
-void publicsuffix_done(publicsuffix_trie *pst)
+static size_t hash_size(size_t num_strings)
 {
-	if (pst)
+	size_t size = 2;
+	while (size < 2 * num_strings)
+		size <<= 1;
+	return size;
+}
+
+static void child_flags(publicsuffix_trie const *pst, trie_node *node,
+	size_t first, size_t count)
+{
+	for (size_t i = first; i < first + count; ++i)
 	{
-		free(pst->node_table);
-		free(pst);
+		char const *const label = pst->string_table + pst->str[i].n;
+		if (label[0] == '*')
+			node->has_wildcard = 1;
+		else if (label[0] == '!')
+			node->has_exception = 1;
 	}
 }
 
-publicsuffix_trie *publicsuffix_init(char const *fname, publicsuffix_trie *old)
-/*
-* If old is given, check if it needs an update and return immediately if not.
-* If an update is needed, do the initialization and free the old structure
-* before allocating the final chunk of memory --at that point initialization
-* cannot fail but for malloc.
-* If old is not given, use the file size as an estimate of the final chunk size
-* and allocate it before starting initialization.  That way, the final heap
-* should be shrinkable.
-*/
+static void hash_insert(publicsuffix_trie *pst, int parent, size_t n)
 {
-	assert(fname);
+	char const *s = pst->string_table + pst->str[n].n;
+	unsigned h = hash_start(parent);
+	while (*s)
+		h = hash_step(h, *s++);
+
+	size_t const mask = pst->hash_size - 1;
+	for (h &= mask; pst->hash[h] != HASH_EMPTY; h = (h + 1) & mask)
+		continue;
+	pst->hash[h] = n;
+}
 
-	do_report = set_parm_logfun(NULL);  // use that logging function
+static void build_index(publicsuffix_trie *pst)
+// set wildcard/exception flags and fill the hash table, after wt_step3
+{
+	memset(pst->hash, 0xff, pst->hash_size * sizeof *pst->hash);
 
-	if (_LIBUNISTRING_VERSION != _libunistring_version) // (major<<8) + minor
-		(*do_report)(LOG_WARNING,
-			"unistring version mismatch, expecting %d, have %d",
-			_LIBUNISTRING_VERSION, _libunistring_version);
-	if (!idn2_check_version(IDN2_VERSION))
+	child_flags(pst, &pst->root, 0, pst->num_root_nodes);
+	for (size_t n = 0; n < pst->num_root_nodes; ++n)
+		hash_insert(pst, -1, n);
+
+	for (size_t i = 0; i < pst->num_trie_nodes; ++i)
+	{
+		trie_node *const node = &pst->node_table[i];
+		child_flags(pst, node, node->first_child, node->num_children);
+		for (size_t n = node->first_child;
+			n < (size_t)node->first_child + node->num_children; ++n)
+				hash_insert(pst, i, n);
+	}
+}
+
+void publicsuffix_done(publicsuffix_trie *pst)
+{
+	if (pst)
+	{
+		if (pst->cache)
+			munmap(pst->cache, sizeof(psl_cache));
+		if (pst->map)
+			munmap(pst->map, pst->map_size);
+		else
+			free(pst->node_table);
+		free(pst);
+	}
+}
+
+// ----- compiled file -----
+
+/*
+* The header of a compiled file.  The tables are written in host order and
+* with the compiler's bit-field layout, so the reader checks both the endian
+* tag and a sample trie_node; a file compiled on a different architecture
+* is refused, and the text file has to be compiled again.
+*/
+typedef struct psl_header
+{
+	char magic[8];
+	uint32_t endian_tag;
+	uint16_t version, node_size;
+	uint32_t node_sample;
+	uint32_t num_root_nodes, num_trie_nodes, num_strings, string_size;
+	uint32_t hash_size;
+} psl_header;
+
+static char const psl_magic[8] = "zdkimPSL";
+#define PSL_ENDIAN_TAG 0x01020304U
+#define PSL_VERSION 2
+
+static uint32_t node_sample(void)
+{
+	trie_node sample;
+	uint32_t u = 0;
+	memset(&sample, 0, sizeof sample);
+	sample.first_child = 0x1234;
+	sample.num_children = 0x567;
+	sample.is_terminal = 1;
+	sample.has_exception = 1;
+	memcpy(&u, &sample, sizeof sample < sizeof u? sizeof sample: sizeof u);
+	return u;
+}
+
+static size_t compiled_size(psl_header const *hdr)
+{
+	return sizeof *hdr +
+		hdr->num_trie_nodes * sizeof(trie_node) +
+		hdr->num_strings * sizeof(string_node) +
+		hdr->hash_size * sizeof(uint16_t) +
+		hdr->string_size;
+}
+
+static int check_compiled(publicsuffix_trie const *pst)
+/*
+* The tables are only read, but org_domain() trusts the indexes it finds.
+* return 0 if they are consistent.
+*/
+{
+	size_t const size = pst->string_size;
+	if (size == 0 || pst->string_table[size - 1] != 0 ||
+		pst->num_root_nodes > pst->num_strings ||
+		pst->num_trie_nodes > pst->num_strings)
+			return -1;
+
+	for (size_t i = 0; i < pst->num_strings; ++i)
+		if (pst->str[i].n >= size)
+			return -1;
+
+	for (size_t i = 0; i < pst->num_trie_nodes; ++i)
+	{
+		trie_node const *const node = &pst->node_table[i];
+		if ((size_t)node->first_child + node->num_children > pst->num_strings)
+			return -1;
+	}
+
+	size_t empty = 0;
+	if (pst->hash_size != hash_size(pst->num_strings))
+		return -1;
+
+	for (size_t i = 0; i < pst->hash_size; ++i)
+		if (pst->hash[i] == HASH_EMPTY)
+			++empty;
+		else if (pst->hash[i] >= pst->num_strings)
+			return -1;
+
+	return empty > 0? 0: -1;
+}
+
+static publicsuffix_trie *
+map_compiled(int fd, char const *fname, struct stat const *stat_dat)
+/*
+* fd is a file whose magic was already recognized.
+* return the new structure, or NULL on error (already reported).
+*/
+{
+	psl_header hdr;
+	ssize_t const got = pread(fd, &hdr, sizeof hdr, 0);
+	if (got != (ssize_t)sizeof hdr)
+	{
+		(*do_report)(LOG_CRIT, "cannot read %s: %s",
+			fname, got < 0? strerror(errno): "short file");
+		return NULL;
+	}
+
+	if (hdr.endian_tag != PSL_ENDIAN_TAG || hdr.version != PSL_VERSION ||
+		hdr.node_size != sizeof(trie_node) || hdr.node_sample != node_sample())
+	{
+		(*do_report)(LOG_CRIT,
+			"%s was compiled for a different architecture or version", fname);
+		return NULL;
+	}
+
+	size_t const size = compiled_size(&hdr);
+	if ((off_t)size != stat_dat->st_size)
+	{
+		(*do_report)(LOG_CRIT, "%s: bad size %zu, expected %zu",
+			fname, (size_t)stat_dat->st_size, size);
+		return NULL;
+	}
+
+	publicsuffix_trie *pst = calloc(1, sizeof *pst + strlen(fname) + 1);
+	if (pst == NULL)
+		return NULL;
+
+	pst->map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (pst->map == MAP_FAILED)
+	{
+		(*do_report)(LOG_CRIT, "cannot mmap %s: %s", fname, strerror(errno));
+		free(pst);
+		return NULL;
+	}
+
+	pst->map_size = size;
+	pst->node_table = (trie_node*)((char*)pst->map + sizeof hdr);
+	pst->str = (string_node*)(pst->node_table + hdr.num_trie_nodes);
+	pst->hash = (uint16_t*)(pst->str + hdr.num_strings);
+	pst->string_table = (char*)(pst->hash + hdr.hash_size);
+	pst->num_root_nodes = hdr.num_root_nodes;
+	pst->num_trie_nodes = hdr.num_trie_nodes;
+	pst->num_strings = hdr.num_strings;
+	pst->string_size = hdr.string_size;
+	pst->hash_size = hdr.hash_size;
+	pst->old_time = stat_dat->st_mtime;
+	pst->old_size = stat_dat->st_size;
+	strcpy(pst->old_fname, fname);
+
+	if (check_compiled(pst))
+	{
+		(*do_report)(LOG_CRIT, "%s: inconsistent tables", fname);
+		publicsuffix_done(pst);
+		return NULL;
+	}
+
+	child_flags(pst, &pst->root, 0, pst->num_root_nodes);
+	pst->cache = cache_new();
+	return pst;
+}
+
+int publicsuffix_compile(publicsuffix_trie const *pst, char const *fname)
+/*
+* Write the tables to fname.tmp, then rename it to fname.
+* return 0 on success, -1 on error (already reported).
+*/
+{
+	assert(pst);
+	assert(fname);
+
+	psl_header hdr;
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, psl_magic, sizeof hdr.magic);
+	hdr.endian_tag = PSL_ENDIAN_TAG;
+	hdr.version = PSL_VERSION;
+	hdr.node_size = sizeof(trie_node);
+	hdr.node_sample = node_sample();
+	hdr.num_root_nodes = pst->num_root_nodes;
+	hdr.num_trie_nodes = pst->num_trie_nodes;
+	hdr.num_strings = pst->num_strings;
+	hdr.string_size = pst->string_size;
+	hdr.hash_size = pst->hash_size;
+
+	size_t const len = strlen(fname);
+	char tmp[len + 5];
+	memcpy(tmp, fname, len);
+	strcpy(&tmp[len], ".tmp");
+
+	FILE *fp = fopen(tmp, "w");
+	if (fp == NULL)
+	{
+		(*do_report)(LOG_CRIT, "cannot write %s: %s", tmp, strerror(errno));
+		return -1;
+	}
+
+	int rtc =
+		fwrite(&hdr, sizeof hdr, 1, fp) != 1 ||
+		fwrite(pst->node_table, sizeof(trie_node), pst->num_trie_nodes, fp) !=
+			pst->num_trie_nodes ||
+		fwrite(pst->str, sizeof(string_node), pst->num_strings, fp) !=
+			pst->num_strings ||
+		fwrite(pst->hash, sizeof(uint16_t), pst->hash_size, fp) !=
+			pst->hash_size ||
+		fwrite(pst->string_table, 1, pst->string_size, fp) != pst->string_size;
+	rtc |= fclose(fp) != 0;
+	if (rtc == 0 && rename(tmp, fname) != 0)
+		rtc = 1;
+
+	if (rtc)
+	{
+		(*do_report)(LOG_CRIT, "cannot write %s: %s", fname, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+publicsuffix_trie *publicsuffix_init(char const *fname, publicsuffix_trie *old)
+/*
+* If old is given, check if it needs an update and return immediately if not.
+* If an update is needed, do the initialization and free the old structure
+* before allocating the final chunk of memory --at that point initialization
+* cannot fail but for malloc.
+* If old is not given, use the file size as an estimate of the final chunk size
+* and allocate it before starting initialization.  That way, the final heap
+* should be shrinkable.
+*/
+{
+	assert(fname);
+
+	do_report = set_parm_logfun(NULL);  // use that logging function
+
+	if (_LIBUNISTRING_VERSION != _libunistring_version) // (major<<8) + minor
+		(*do_report)(LOG_WARNING,
+			"unistring version mismatch, expecting %d, have %d",
+			_LIBUNISTRING_VERSION, _libunistring_version);
+	if (!idn2_check_version(IDN2_VERSION))
 	{
 		(*do_report)(LOG_WARNING,
 			"IDN2 version mismatch, expecting %s", IDN2_VERSION);
@@ -809,8 +1284,26 @@ publicsuffix_trie *publicsuffix_init(char const *fname, publicsuffix_trie *old)
 
 	publicsuffix_trie *pst = NULL;
 	FILE *fp = fopen(fname, "r");
+	char magic[sizeof psl_magic];
+	if (fp && fread(magic, sizeof magic, 1, fp) == 1 &&
+		memcmp(magic, psl_magic, sizeof magic) == 0)
+	{
+		pst = map_compiled(fileno(fp), fname, &stat_dat);
+		fclose(fp);
+		if (pst)
+			publicsuffix_done(old);
+		else
+		{
+			pst = old;
+			(*do_report)(LOG_CRIT, "Cannot init publicsuffix%s",
+				pst? " (old data retained)": "");
+		}
+		return pst;
+	}
+
 	if (fp)
 	{
+		rewind(fp);
 		pst = calloc(1, sizeof *pst + strlen(fname) + 1);
 		if (pst)
 		{
@@ -833,7 +1326,8 @@ publicsuffix_trie *publicsuffix_init(char const *fname, publicsuffix_trie *old)
 				if (rtc == 0 &&
 					(pst->num_trie_nodes > MAX_NUM_TRIE_NODES ||
 					ini.max_num_children > MAX_NUM_CHILDREN ||
-					pst->num_strings > UINT16_MAX))
+					pst->num_strings > MAX_NUM_STRINGS ||
+					ini.string_size > UINT16_MAX))
 				{
 					if (pst->num_trie_nodes > MAX_NUM_TRIE_NODES)
 						(*do_report)(LOG_CRIT, "Too many trie nodes %zu, max %u",
@@ -841,18 +1335,23 @@ publicsuffix_trie *publicsuffix_init(char const *fname, publicsuffix_trie *old)
 					if (ini.max_num_children > MAX_NUM_CHILDREN)
 						(*do_report)(LOG_CRIT, "Too many child nodes %zu, max %u",
 							ini.max_num_children, MAX_NUM_CHILDREN);
-					if (pst->num_strings > UINT16_MAX)
+					if (pst->num_strings > MAX_NUM_STRINGS)
 						(*do_report)(LOG_CRIT, "Too many string nodes %zu, max %u",
-							pst->num_strings, UINT16_MAX);
+							pst->num_strings, MAX_NUM_STRINGS);
+					if (ini.string_size > UINT16_MAX)
+						(*do_report)(LOG_CRIT, "String table too large %zu, max %u",
+							ini.string_size, UINT16_MAX);
 					rtc = -1;
 				}
 			}
 
 			if (rtc == 0)
 			{
+				pst->hash_size = hash_size(pst->num_strings);
 				size_t const tot_alloc =
 					pst->num_trie_nodes * sizeof(trie_node) +
 					pst->num_strings * sizeof(string_node) +
+					pst->hash_size * sizeof(uint16_t) +
 					ini.string_size;
 
 #if DEBUG_PUBLICSUFFIX
@@ -876,7 +1375,7 @@ publicsuffix_trie *publicsuffix_init(char const *fname, publicsuffix_trie *old)
 						"%zu max children (max=%u)\n",
 						pst->num_root_nodes,
 						pst->num_trie_nodes, MAX_NUM_TRIE_NODES,
-						pst->num_strings, UINT16_MAX,
+						pst->num_strings, MAX_NUM_STRINGS,
 						ini.max_num_children, MAX_NUM_CHILDREN);
 					fprintf(ini.fp, "%zu num strings in string table\n\n",
 						ini.num_strings);
@@ -905,7 +1404,9 @@ publicsuffix_trie *publicsuffix_init(char const *fname, publicsuffix_trie *old)
 				{
 					pst->str = (string_node*)
 						(pst->node_table + pst->num_trie_nodes);
-					pst->string_table = (char*) (pst->str + pst->num_strings);
+					pst->hash = (uint16_t*) (pst->str + pst->num_strings);
+					pst->string_table = (char*) (pst->hash + pst->hash_size);
+					pst->string_size = ini.string_size;
 
 					// copy all labels in the string table;
 					uint16_t n = 0;
@@ -921,6 +1422,8 @@ publicsuffix_trie *publicsuffix_init(char const *fname, publicsuffix_trie *old)
 					// step2 and step 3 cannot fail
 					w_traverse(root, w_traverse_head, wt_step2, &ini, 0);
 					w_traverse(root, w_traverse_head, wt_step3, &ini, 0);
+					build_index(pst);
+					pst->cache = cache_new();
 				}
 				else rtc = -1;
 			}
@@ -954,7 +1457,7 @@ publicsuffix_trie *publicsuffix_init(char const *fname, publicsuffix_trie *old)
 	return pst;
 }
 
-#if defined TEST_MAIN
+#if defined TEST_MAIN || defined MAIN
 #include <stdarg.h>
 
 static void stdalone_reporting(int nu, char const *fmt, ...)
@@ -973,14 +1476,415 @@ logfun_t set_parm_logfun(logfun_t nu)
 	(void)nu;
 }
 
+#if defined TEST_MAIN
+/*
+* The former lookup, strdup + reverse_labels + bsearch, for comparison.
+*/
+typedef struct legacy_key
+{
+	publicsuffix_trie const *pst;
+	char const *component;
+} legacy_key;
+
+static int legacy_cmp(void const *k, void const *el)
+{
+	legacy_key const *const key = k;
+	register char const *a = key->component;
+	string_node const *const str = el;
+	register char const *b = key->pst->string_table + str->n;
+
+	register int c, d, r;
+	do c = *a++, d = *b++;
+	while (c && d && (r = c - d) == 0);
+
+	return c - d;
+}
+
+static string_node *legacy_find_node(publicsuffix_trie const *pst,
+	char *component, string_node *parent)
+{
+	assert(pst);
+	assert(component);
+	assert(parent == NULL ||
+		(parent >= pst->str && parent - pst->str < (int)pst->num_strings));
+
+	legacy_key key;
+	key.pst = pst;
+	key.component = component;
+
+	string_node *base;
+	size_t size;
+	if (parent == NULL)
+	{
+		base = pst->str;
+		size = pst->num_root_nodes;
+	}
+	else if ((size = parent - pst->str) < pst->num_trie_nodes)
+	{
+		trie_node const *const node = &pst->node_table[size];
+		base = &pst->str[node->first_child];
+		size = node->num_children;
+	}
+	else
+		return NULL;
+
+	string_node *current =
+		bsearch(&key, base, size, sizeof(string_node), legacy_cmp);
+	if (current)
+		return current;
+
+	/*
+	* We didn't find an exact match, so see if there's a wildcard
+	* match.  From https://publicsuffix.org/list/: "The wildcard
+	* character * (asterisk) matches any valid sequence of characters
+	* in a hostname part. (Note: the list uses Unicode, not Punycode
+	* forms, and is encoded using UTF-8.) Wildcards may only be used to
+	* wildcard an entire level. That is, they must be surrounded by
+	* dots (or implicit dots, at the beginning of a line)."
+	*/
+	key.component = "*";
+	current = bsearch(&key, base, size, sizeof(string_node), legacy_cmp);
+	if (current)
+	/*
+	* If there was a wildcard match, see if there is a wildcard
+	* exception match, and prefer it if so.  From
+	* https://publicsuffix.org/list/: "An exclamation mark (!) at
+	* the start of a rule marks an exception to a previous wildcard
+	* rule. An exception rule takes priority over any other matching
+	* rule."
+	*/
+	{
+		char exception_component[68];
+		exception_component[0] = '!';
+		strcpy(&exception_component[1], component);
+		key.component = exception_component;
+		string_node *exception =
+			bsearch(&key, base, size, sizeof(string_node), legacy_cmp);
+		if (exception)
+			current = exception;
+	}
+
+	return current;
+}
+
+static char *legacy_org_domain(publicsuffix_trie const *pst, char const *c_domain)
+/*
+* c_domain must be ascii
+*/
+{
+	char *domain = c_domain? strdup(c_domain): NULL;
+	if (domain == NULL)
+		return NULL;
+
+	char *org = NULL;
+	size_t len = strlen(domain);
+	char **labels = reverse_labels(domain, len, NULL);
+
+	if (labels)
+	{
+		char **last_valid = NULL;
+		string_node *current = NULL;
+		for (char **l = labels; *l; ++l)
+		{
+			current = legacy_find_node(pst, *l, current);
+			if (current == NULL)
+				break;
+
+			unsigned int const ndx = current - pst->str;
+			if (ndx >= pst->num_trie_nodes || pst->node_table[ndx].is_terminal)
+			{
+				last_valid = l;
+				if (ndx >= pst->num_trie_nodes)
+					break;
+			}
+			else
+				last_valid = NULL;
+		}
+
+		if (last_valid == NULL)
+		{
+			free(domain);
+			free(labels);
+			return NULL; // not listed
+		}
+
+		int const exception = current && pst->string_table[current->n] == '!';
+
+		if (!exception)
+		{
+			if (last_valid[1])
+				++last_valid;
+			else if (current)
+			{
+				free(domain);
+				free(labels);
+				return NULL; // listed, but missing an org domain
+			}
+		}
+
+		len = 0;
+		for (char **l = labels; ; ++l)
+		{
+			len += strlen(*l) + 1;
+			if (**l == '#')
+				len += 3;
+			if (l == last_valid)
+				break;
+		}
+		org = malloc(len);
+		if (org)
+		{
+			*org = 0;
+			for (char **l = last_valid; ; --l)
+			{
+				if (**l == '#')
+				{
+					strcat(org, "xn--");
+					*l += 1;
+				}
+				strcat(org,  *l);
+				if (l == labels)
+					break;
+
+				strcat(org, ".");
+			}
+		}
+		free(labels);
+	}
+	free(domain);
+	return org;
+}
+
+#include <time.h>
+
+static unsigned long bench_seed = 1;
+static unsigned bench_rand(void)
+{
+	bench_seed = bench_seed * 6364136223846793005UL + 1442695040888963407UL;
+	return bench_seed >> 33;
+}
+
+static char *random_label(char *p)
+{
+	static char const *const common[] =
+		{"www", "mail", "smtp", "mx1", "news", "bounce", "lists", "em"};
+	if (bench_rand() % 2)
+		return stpcpy(p, common[bench_rand() % 8]);
+
+	size_t const len = 3 + bench_rand() % 10;
+	for (size_t i = 0; i < len; ++i)
+		*p++ = 'a' + bench_rand() % 26;
+	*p = 0;
+	return p;
+}
+
+static void random_domain(publicsuffix_trie const *pst, char *buf)
+/*
+* Walk the trie down to a rule, then add one to three labels.  Half of the
+* domains go under a handful of popular suffixes, like real mail traffic.
+*/
+{
+	static char const *const popular[] =
+		{"com", "net", "org", "co.uk", "de", "it", "fr", "com.au", "jp", "io"};
+	char suffix[256], labels[128][64];
+	size_t n = 0;
+
+	if (bench_rand() % 2)
+		strcpy(suffix, popular[bench_rand() % 10]);
+	else
+	{
+		int parent = -1;
+		for (;;)
+		{
+			size_t first = 0, count = pst->num_root_nodes;
+			if (parent >= 0)
+			{
+				first = pst->node_table[parent].first_child;
+				count = pst->node_table[parent].num_children;
+			}
+			if (count == 0 || n >= 128)
+				break;
+
+			size_t const child = first + bench_rand() % count;
+			char const *label = pst->string_table + pst->str[child].n;
+			if (*label == '*')
+				random_label(labels[n]);
+			else if (*label == '#')
+				snprintf(labels[n], sizeof labels[n], "xn--%s", label + 1);
+			else
+				strcpy(labels[n], label + (*label == '!'));
+			++n;
+
+			if (child >= pst->num_trie_nodes ||
+				(pst->node_table[child].is_terminal && bench_rand() % 2))
+					break;
+			parent = child;
+		}
+
+		char *p = suffix;
+		while (n-- > 0)
+			p += sprintf(p, "%s%s", labels[n], n? ".": "");
+	}
+
+	char *p = buf;
+	for (int i = 1 + bench_rand() % 3; i > 0; --i)
+	{
+		p = random_label(p);
+		*p++ = '.';
+	}
+	strcpy(p, suffix);
+}
+
+static int zipf(double const *cdf, int n)
+{
+	double const u = (bench_rand() % 1000000) / 1000000.0;
+	int lo = 0, hi = n - 1;
+	while (lo < hi)
+	{
+		int const mid = (lo + hi) / 2;
+		if (cdf[mid] < u)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static double bench_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int benchmark(publicsuffix_trie *pst, int lookups)
+/*
+* Draw lookups from a population of domains, with Zipf distribution.
+* Check that the former and current lookups agree, then time them.
+*/
+{
+	enum { population = 5000 };
+	static char domain[population][320];
+	static double cdf[population];
+	double sum = 0;
+	for (int i = 0; i < population; ++i)
+	{
+		random_domain(pst, domain[i]);
+		cdf[i] = sum += 1.0 / (i + 1);
+	}
+	for (int i = 0; i < population; ++i)
+		cdf[i] /= sum;
+
+	int *const stream = malloc(lookups * sizeof *stream);
+	if (stream == NULL)
+		return 1;
+	for (int i = 0; i < lookups; ++i)
+		stream[i] = zipf(cdf, population);
+
+	int mismatches = 0;
+	psl_cache *const cache = pst->cache;
+	for (int i = 0; i < population; ++i)
+	{
+		char buf[256];
+		char *od = legacy_org_domain(pst, domain[i]);
+		char *nod = org_domain_buf(pst, domain[i], buf, sizeof buf);
+		if (od == NULL? nod != NULL: nod == NULL || strcmp(od, nod) != 0)
+		{
+			printf("MISMATCH on %s: %s vs %s\n",
+				domain[i], od? od: "null", nod? nod: "null");
+			++mismatches;
+		}
+		free(od);
+	}
+	printf("%d domains, %d mismatches\n", population, mismatches);
+
+	double t0 = bench_time();
+	size_t check_legacy = 0, check_hash = 0, check_cache = 0;
+	for (int i = 0; i < lookups; ++i)
+	{
+		char *od = legacy_org_domain(pst, domain[stream[i]]);
+		check_legacy += od? strlen(od): 0;
+		free(od);
+	}
+
+	double t1 = bench_time();
+	pst->cache = NULL;
+	for (int i = 0; i < lookups; ++i)
+	{
+		char buf[256];
+		char *od = org_domain_buf(pst, domain[stream[i]], buf, sizeof buf);
+		check_hash += od? strlen(od): 0;
+	}
+	pst->cache = cache;
+
+	double t2 = bench_time();
+	if (cache)
+		cache->lookups = cache->hits = 0;
+	for (int i = 0; i < lookups; ++i)
+	{
+		char buf[256];
+		char *od = org_domain_buf(pst, domain[stream[i]], buf, sizeof buf);
+		check_cache += od? strlen(od): 0;
+	}
+	double t3 = bench_time();
+
+	if (check_legacy != check_hash || check_hash != check_cache)
+		printf("checksum mismatch: %zu %zu %zu\n",
+			check_legacy, check_hash, check_cache);
+
+	printf("%d lookups: bsearch %.0f ns, hash %.0f ns, hash+cache %.0f ns "
+		"(%.1f%% hits)\n", lookups,
+		(t1 - t0) * 1e9 / lookups, (t2 - t1) * 1e9 / lookups,
+		(t3 - t2) * 1e9 / lookups,
+		cache && cache->lookups? 100.0 * cache->hits / cache->lookups: 0.0);
+
+	free(stream);
+	return mismatches != 0;
+}
+#endif // TEST_MAIN
+
 int main(int argc, char *argv[])
 {
-	if (argc > 1)
+	char const *out = NULL;
+	int i = 1, rtc = 0;
+
+	if (i + 1 < argc && strcmp(argv[i], "-o") == 0)
+	{
+		out = argv[i + 1];
+		i += 2;
+	}
+
+	if (i < argc && strcmp(argv[i], "--version") == 0)
+	{
+		puts(PACKAGE_NAME ", version " PACKAGE_VERSION);
+		return 0;
+	}
+
+#if defined TEST_MAIN
+	if (i + 1 < argc && strcmp(argv[i], "-b") == 0)
+	{
+		publicsuffix_trie *pst = publicsuffix_init(argv[i + 1], NULL);
+		if (pst == NULL)
+			return 1;
+		rtc = benchmark(pst, i + 2 < argc? atoi(argv[i + 2]): 1000000);
+		publicsuffix_done(pst);
+		return rtc;
+	}
+#endif
+
+	if (i < argc && argv[i][0] != '-')
 	{
-		publicsuffix_trie *pst = publicsuffix_init(argv[1], NULL);
+		publicsuffix_trie *pst = publicsuffix_init(argv[i], NULL);
 		if (pst)
 		{
-			for (int i = 2; i < argc; ++i)
+			if (out)
+			{
+				rtc = publicsuffix_compile(pst, out) != 0;
+				if (rtc == 0)
+					printf("%s: %zu nodes, %zu bytes of labels\n", out,
+						pst->num_strings, pst->string_size);
+			}
+			for (++i; i < argc; ++i)
 			{
 				char *od = org_domain(pst, argv[i]);
 				printf("%s -> %s\n", argv[i], od? od: "null");
@@ -988,9 +1892,18 @@ int main(int argc, char *argv[])
 			}
 			publicsuffix_done(pst);
 		}
+		else
+			rtc = 1;
+	}
+	else
+	{
+		fprintf(stderr, "usage: %s [-o compiled-file] rule-file domain...\n",
+			argv[0]);
+#if defined TEST_MAIN
+		fprintf(stderr, "       %s -b rule-file [lookups]\n", argv[0]);
+#endif
 	}
-	else fprintf(stderr, "usage: %s rule-file domain...\n", argv[0]);
 
-	return 0;
+	return rtc;
 }
-#endif // TEST_MAIN
+#endif // TEST_MAIN || MAIN
@@ -30,12 +30,17 @@ the resulting work.
 
 #if !defined PUBLICSUFFIX_H_INCLUDED
 
+#include <stddef.h>
+
 struct publicsuffix_trie;
 typedef struct publicsuffix_trie publicsuffix_trie;
 
 char *org_domain(publicsuffix_trie const *pst, char const *domain);
+char *org_domain_buf(publicsuffix_trie const *pst, char const *domain,
+	char *buf, size_t size);
 void publicsuffix_done(publicsuffix_trie *pst);
 publicsuffix_trie *publicsuffix_init(char const *fname, publicsuffix_trie *old);
+int publicsuffix_compile(publicsuffix_trie const *pst, char const *fname);
 
 #define PUBLICSUFFIX_H_INCLUDED
 #endif
@@ -0,0 +1,93 @@
+/*
+** shmlock.c - written in milano by vesely on 19oct2026
+** mutex for tables shared by forked processes
+*/
+/*
+* zdkimfilter - Sign outgoing, verify incoming mail messages
+
+Copyright (C) 2026 Alessandro Vesely
+
+This file is part of zdkimfilter
+
+zdkimfilter is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+zdkimfilter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License version 3
+along with zdkimfilter.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPLv3 section 7:
+
+If you modify zdkimfilter, or any covered work, by linking or combining it
+with software developed by The OpenDKIM Project and its contributors,
+containing parts covered by the applicable licence, the licensor or
+zdkimfilter grants you additional permission to convey the resulting work.
+*/
+#include <config.h>
+#if !ZDKIMFILTER_DEBUG
+#define NDEBUG
+#endif
+#include <errno.h>
+
+#include "shmlock.h"
+#include <assert.h>
+
+/*
+* The mutex lives in the shared mapping itself.  It is robust, so that if a
+* child dies holding it, the next process that locks it is told so, rather
+* than waiting forever.  A live holder is always waited for.
+*/
+
+int shm_lock_init(shm_lock *lock)
+// call once, on the freshly mapped table; return 0 on success, -1 on error
+{
+	assert(lock);
+
+	pthread_mutexattr_t attr;
+	if (pthread_mutexattr_init(&attr))
+		return -1;
+
+	int rtc = -1;
+	if (pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) == 0 &&
+		pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) == 0 &&
+		pthread_mutex_init(lock, &attr) == 0)
+			rtc = 0;
+
+	pthread_mutexattr_destroy(&attr);
+	return rtc;
+}
+
+int shm_lock_acquire(shm_lock *lock)
+/*
+* Return 0 when locked, 1 when locked after the previous holder died, in
+* which case the data it protects may be half updated, or -1 if not locked.
+*/
+{
+	assert(lock);
+
+	int const err = pthread_mutex_lock(lock);
+	if (err == 0)
+		return 0;
+
+	if (err == EOWNERDEAD)
+	{
+		if (pthread_mutex_consistent(lock) == 0)
+			return 1;
+
+		pthread_mutex_unlock(lock);
+	}
+
+	return -1;
+}
+
+void shm_lock_release(shm_lock *lock)
+{
+	assert(lock);
+	pthread_mutex_unlock(lock);
+}
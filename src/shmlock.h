@@ -0,0 +1,17 @@
+/*
+** shmlock.h - written in milano by vesely on 19oct2026
+** mutex for tables shared by forked processes
+*/
+
+#if !defined SHMLOCK_H_INCLUDED
+
+#include <pthread.h>
+
+typedef pthread_mutex_t shm_lock;
+
+int shm_lock_init(shm_lock *lock);
+int shm_lock_acquire(shm_lock *lock);
+void shm_lock_release(shm_lock *lock);
+
+#define SHMLOCK_H_INCLUDED
+#endif
@@ -0,0 +1,607 @@
+/*
+** snapshot.c - written in milano by vesely on 19oct2026
+** read-only snapshot of per-domain flags
+*/
+/*
+* zdkimfilter - Sign outgoing, verify incoming mail messages
+
+Copyright (C) 2026 Alessandro Vesely
+
+This file is part of zdkimfilter
+
+zdkimfilter is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+zdkimfilter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License version 3
+along with zdkimfilter.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPLv3 section 7:
+
+If you modify zdkimfilter, or any covered work, by linking or combining it
+with software developed by The OpenDKIM Project and its contributors,
+containing parts covered by the applicable licence, the licensor or
+zdkimfilter grants you additional permission to convey the resulting work.
+*/
+#include <config.h>
+#if !ZDKIMFILTER_DEBUG
+#define NDEBUG
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "snapshot.h"
+#include <assert.h>
+
+/*
+* The stats writer loads domain flags with db_sql_domain_flags_snapshot, and
+* writes them to a file:  a header, an open addressing table of buckets, the
+* entries, and their names.  A changed snapshot is written to PATH.tmp and
+* renamed over PATH.  A refresh that finds no changes just rewrites the time
+* in the header, in place.
+*
+* The parent maps the file before each fork, so children look domains up in
+* memory, without connecting to the database.  A snapshot that was not
+* refreshed for SNAPSHOT_STALE intervals is not used.
+*
+* Rows are domain, whitelisted, dmarc_enabled, adsp_enabled, and an integer
+* change mark, such as a counter or a timestamp.  The greatest mark is given
+* as $(snapshot_mark) to the next query, which can then return just the rows
+* changed since.  Without a mark column, or every SNAPSHOT_FULL_RELOAD
+* seconds, the mark is 0 and the table is rebuilt, dropping deleted rows.
+*/
+
+#define SNAPSHOT_MAGIC 0x5a465331 // "ZFS1"
+#define SNAPSHOT_FULL_RELOAD 3600
+#define SNAPSHOT_STALE 5
+#define SNAPSHOT_MIN_BUCKETS 16
+#define TMP_SUFFIX ".tmp"
+
+typedef struct snapshot_header
+{
+	uint32_t magic;
+	uint32_t count; // entries
+	uint32_t mask; // buckets - 1
+	uint32_t pool; // size of names
+	uint64_t mark;
+	int64_t loaded; // time of the last full load
+	int64_t refreshed; // time of the last successful query
+	int32_t refresh; // seconds between queries
+	int32_t not_used;
+} snapshot_header;
+
+typedef struct snapshot_entry
+{
+	uint32_t hash;
+	uint32_t name; // offset in the pool
+	int32_t whitelisted;
+	int16_t dmarc, adsp;
+} snapshot_entry;
+
+static uint32_t name_hash(char const *name)
+{
+	uint32_t h = 2166136261U; // FNV-1a
+	for (unsigned char const *p = (unsigned char const*)name; *p; ++p)
+		h = (h ^ *p) * 16777619U;
+	return h;
+}
+
+static int lower_name(char *buf, size_t size, char const *name)
+/*
+* Copy name to buf in lower case.  return 0, or -1 if it doesn't fit.
+*/
+{
+	size_t i = 0;
+	for (; name[i]; ++i)
+	{
+		if (i + 1 >= size)
+			return -1;
+		buf[i] = tolower((unsigned char)name[i]);
+	}
+	buf[i] = 0;
+	return 0;
+}
+
+/*
+* Writer side.  The table is built in memory, in the same layout as the file.
+*/
+typedef struct builder
+{
+	snapshot_entry *entry;
+	uint32_t *bucket; // entry index + 1, 0 if empty
+	char *pool;
+	size_t count, alloc, pool_len, pool_alloc;
+	uint32_t mask;
+	uint64_t mark, next_mark;
+	time_t loaded, refreshed;
+	unsigned has_mark: 1;
+	unsigned changed: 1;
+	unsigned failed: 1;
+} builder;
+
+static builder current;
+
+static void builder_free(builder *b)
+{
+	free(b->entry);
+	free(b->bucket);
+	free(b->pool);
+	memset(b, 0, sizeof *b);
+}
+
+static uint32_t *find_bucket(uint32_t *bucket, uint32_t mask,
+	snapshot_entry const *entry, char const *pool,
+	uint32_t hash, char const *name)
+/*
+* return the bucket of name, or the empty one where it would go.
+*/
+{
+	for (uint32_t i = hash & mask;; i = (i + 1) & mask)
+	{
+		uint32_t const n = bucket[i];
+		if (n == 0)
+			return &bucket[i];
+
+		snapshot_entry const *const e = &entry[n - 1];
+		if (e->hash == hash && strcmp(pool + e->name, name) == 0)
+			return &bucket[i];
+	}
+}
+
+static int builder_grow(builder *b)
+{
+	if (b->count >= b->alloc)
+	{
+		size_t const alloc = b->alloc? 2*b->alloc: 1024;
+		snapshot_entry *const entry = realloc(b->entry, alloc * sizeof *entry);
+		if (entry == NULL)
+			return -1;
+		b->entry = entry;
+		b->alloc = alloc;
+	}
+
+	// keep the load factor at most 1/2
+	if (b->bucket == NULL || 2*(b->count + 1) > (size_t)b->mask + 1)
+	{
+		uint32_t mask = b->bucket? 2*b->mask + 1: SNAPSHOT_MIN_BUCKETS - 1;
+		uint32_t *const bucket = calloc((size_t)mask + 1, sizeof *bucket);
+		if (bucket == NULL)
+			return -1;
+
+		for (size_t n = 0; n < b->count; ++n)
+		{
+			snapshot_entry const *const e = &b->entry[n];
+			*find_bucket(bucket, mask, b->entry, b->pool, e->hash,
+				b->pool + e->name) = n + 1;
+		}
+		free(b->bucket);
+		b->bucket = bucket;
+		b->mask = mask;
+	}
+	return 0;
+}
+
+static int builder_add(builder *b, char const *name, int w, int d, int a)
+{
+	uint32_t const hash = name_hash(name);
+	uint32_t *bucket = b->bucket?
+		find_bucket(b->bucket, b->mask, b->entry, b->pool, hash, name): NULL;
+
+	if (bucket && *bucket)
+	{
+		snapshot_entry *const e = &b->entry[*bucket - 1];
+		if (e->whitelisted != w || e->dmarc != d || e->adsp != a)
+		{
+			e->whitelisted = w;
+			e->dmarc = d;
+			e->adsp = a;
+			b->changed = 1;
+		}
+		return 0;
+	}
+
+	size_t const len = strlen(name) + 1;
+	if (b->count >= UINT32_MAX/2 || b->pool_len + len > UINT32_MAX)
+		return -1;
+
+	if (b->pool_len + len > b->pool_alloc)
+	{
+		size_t const alloc = b->pool_alloc? 2*b->pool_alloc + len: 16384;
+		char *const pool = realloc(b->pool, alloc);
+		if (pool == NULL)
+			return -1;
+		b->pool = pool;
+		b->pool_alloc = alloc;
+	}
+
+	if (builder_grow(b))
+		return -1;
+
+	snapshot_entry *const e = &b->entry[b->count];
+	e->hash = hash;
+	e->name = b->pool_len;
+	e->whitelisted = w;
+	e->dmarc = d;
+	e->adsp = a;
+	memcpy(b->pool + b->pool_len, name, len);
+	b->pool_len += len;
+	*find_bucket(b->bucket, b->mask, b->entry, b->pool, hash, name) =
+		++b->count;
+	b->changed = 1;
+	return 0;
+}
+
+static int int_field(char const *field)
+{
+	if (field == NULL)
+		return 0;
+
+	char *t = NULL;
+	long const l = strtol(field, &t, 0);
+	if (t && *t == 0 && l < INT32_MAX && l > INT32_MIN)
+		return (int)l;
+	return *field != 0;
+}
+
+static int snapshot_row(int ncols, char const *field[], void *arg)
+{
+	builder *const b = arg;
+	char name[256];
+	if (ncols < 4 || field[0] == NULL ||
+		lower_name(name, sizeof name, field[0]))
+			return 0;
+
+	if (ncols > 4 && field[4])
+	{
+		uint64_t const mark = strtoull(field[4], NULL, 0);
+		if (mark > b->next_mark)
+			b->next_mark = mark;
+		b->has_mark = 1;
+	}
+
+	int const dmarc = int_field(field[2]), adsp = int_field(field[3]);
+	if (builder_add(b, name, int_field(field[1]),
+		dmarc < INT16_MIN? INT16_MIN: dmarc > INT16_MAX? INT16_MAX: dmarc,
+		adsp < INT16_MIN? INT16_MIN: adsp > INT16_MAX? INT16_MAX: adsp))
+	{
+		b->failed = 1;
+		return -1;
+	}
+	return 0;
+}
+
+static void fill_header(snapshot_header *h, builder const *b, int refresh)
+{
+	memset(h, 0, sizeof *h);
+	h->magic = SNAPSHOT_MAGIC;
+	h->count = b->count;
+	h->mask = b->mask;
+	h->pool = b->pool_len;
+	h->mark = b->mark;
+	h->loaded = b->loaded;
+	h->refreshed = b->refreshed;
+	h->refresh = refresh;
+}
+
+static int write_all(int fd, void const *buf, size_t len)
+{
+	char const *p = buf;
+	while (len)
+	{
+		ssize_t const n = write(fd, p, len);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int write_snapshot(char const *path, builder const *b, int refresh,
+	logfun_t log)
+{
+	size_t const len = strlen(path);
+	char *tmp = malloc(len + sizeof TMP_SUFFIX);
+	if (tmp == NULL)
+	{
+		(*log)(LOG_ALERT, "MEMORY FAULT");
+		return -1;
+	}
+	memcpy(tmp, path, len);
+	memcpy(tmp + len, TMP_SUFFIX, sizeof TMP_SUFFIX);
+
+	snapshot_header h;
+	fill_header(&h, b, refresh);
+
+	int rc = -1;
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd >= 0)
+	{
+		if (write_all(fd, &h, sizeof h) == 0 &&
+			write_all(fd, b->bucket, ((size_t)b->mask + 1) * sizeof *b->bucket) == 0 &&
+			write_all(fd, b->entry, b->count * sizeof *b->entry) == 0 &&
+			write_all(fd, b->pool, b->pool_len) == 0)
+				rc = 0;
+		if (close(fd))
+			rc = -1;
+	}
+
+	if (rc == 0 && rename(tmp, path))
+		rc = -1;
+
+	if (rc)
+	{
+		(*log)(LOG_ERR, "cannot write domain flags snapshot %s: %s",
+			path, strerror(errno));
+		unlink(tmp);
+	}
+
+	free(tmp);
+	return rc;
+}
+
+static int touch_snapshot(char const *path, time_t refreshed)
+/*
+* Rewrite the refreshed time of an unchanged snapshot.
+*/
+{
+	int fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	int64_t const t = refreshed;
+	int const rc = pwrite(fd, &t, sizeof t,
+		offsetof(snapshot_header, refreshed)) == sizeof t? 0: -1;
+	close(fd);
+	return rc;
+}
+
+int snapshot_refresh(char const *path, db_work_area *dwa, int refresh,
+	int verbose, logfun_t log)
+/*
+* Called by the stats writer every refresh seconds, while connected.
+* return 0, or -1 on error.
+*/
+{
+	assert(path);
+	assert(dwa);
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	time_t const now = time(NULL);
+	int const full = current.has_mark == 0 ||
+		now - current.loaded >= SNAPSHOT_FULL_RELOAD;
+
+	// a full load builds a new table, an incremental one updates it
+	builder fresh;
+	memset(&fresh, 0, sizeof fresh);
+	builder *const b = full? &fresh: &current;
+
+	// the mark advances only after a complete query, as rows may be unsorted
+	char mark[32];
+	sprintf(mark, "%llu", (unsigned long long)b->mark);
+	b->next_mark = b->mark;
+	b->failed = 0;
+	int const rc = db_run_flags_snapshot(dwa, mark, &snapshot_row, b);
+	if (rc < 0 || b->failed)
+	{
+		if (b->failed)
+			(*log)(LOG_ALERT, "MEMORY FAULT");
+		builder_free(&fresh);
+		return -1;
+	}
+
+	b->mark = b->next_mark;
+	b->refreshed = now;
+	if (full)
+	{
+		fresh.loaded = now;
+		fresh.changed = 1;
+		builder_free(&current);
+		current = fresh;
+	}
+
+	if (current.changed || touch_snapshot(path, now))
+	{
+		if (current.bucket == NULL && builder_grow(&current))
+		{
+			(*log)(LOG_ALERT, "MEMORY FAULT");
+			return -1;
+		}
+
+		if (write_snapshot(path, &current, refresh, log))
+			return -1;
+
+		current.changed = 0;
+
+		if (verbose >= 3 && full)
+		{
+			struct timespec end;
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			(*log)(LOG_INFO,
+				"domain flags snapshot: %zu domains loaded in %.3f secs",
+				current.count, (end.tv_sec - start.tv_sec) +
+					(end.tv_nsec - start.tv_nsec) / 1.0e9);
+		}
+	}
+
+	return 0;
+}
+
+/*
+* Filter side.  The parent keeps the mapping, children inherit it.
+*/
+static struct mapping
+{
+	snapshot_header const *h;
+	size_t size;
+	dev_t dev;
+	ino_t ino;
+} map;
+
+static void unmap(void)
+{
+	if (map.h)
+		munmap((void*)map.h, map.size);
+	memset(&map, 0, sizeof map);
+}
+
+static int valid_header(snapshot_header const *h, size_t size)
+{
+	if (size < sizeof *h || h->magic != SNAPSHOT_MAGIC ||
+		((uint64_t)h->mask + 1) & h->mask || h->count > h->mask)
+			return 0;
+
+	uint64_t const need = sizeof *h +
+		((uint64_t)h->mask + 1) * sizeof(uint32_t) +
+		(uint64_t)h->count * sizeof(snapshot_entry) + h->pool;
+	return need == size &&
+		(h->pool == 0 || ((char const*)h)[size - 1] == 0);
+}
+
+int snapshot_map(char const *path, logfun_t log)
+/*
+* Called by the parent before forking.  Map path, if it was replaced.
+* return 0 if a snapshot is mapped, -1 otherwise.
+*/
+{
+	struct stat st;
+	if (path == NULL || stat(path, &st) != 0)
+	{
+		unmap();
+		return -1;
+	}
+
+	if (map.h && st.st_ino == map.ino && st.st_dev == map.dev)
+		return 0;
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) != 0)
+	{
+		if (fd >= 0)
+			close(fd);
+		unmap();
+		return -1;
+	}
+
+	void *addr = st.st_size > 0?
+		mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0): MAP_FAILED;
+	close(fd);
+
+	unmap();
+	if (addr == MAP_FAILED)
+		return -1;
+
+	if (!valid_header(addr, st.st_size))
+	{
+		(*log)(LOG_ERR, "invalid domain flags snapshot %s", path);
+		munmap(addr, st.st_size);
+		return -1;
+	}
+
+	map.h = addr;
+	map.size = st.st_size;
+	map.dev = st.st_dev;
+	map.ino = st.st_ino;
+	return 0;
+}
+
+int snapshot_fresh(void)
+/*
+* return 1 if a snapshot is mapped and was refreshed recently.
+*/
+{
+	snapshot_header const *const h = map.h;
+	return h && time(NULL) - (time_t)h->refreshed <=
+		(time_t)SNAPSHOT_STALE * (h->refresh > 0? h->refresh: 60);
+}
+
+int snapshot_lookup(char const *domain,
+	int *is_whitelisted, int *is_dmarc_enabled, int *is_adsp_enabled)
+/*
+* Same as db_get_domain_flags():  return 3 if the domain is found, and set
+* the flags, 0 if not found, -1 if there is no snapshot.
+*/
+{
+	assert(domain);
+
+	snapshot_header const *const h = map.h;
+	if (h == NULL)
+		return -1;
+
+	char name[256];
+	if (lower_name(name, sizeof name, domain))
+		return 0;
+
+	uint32_t const *const bucket = (uint32_t const*)(h + 1);
+	snapshot_entry const *const entry =
+		(snapshot_entry const*)(bucket + (size_t)h->mask + 1);
+	char const *const pool = (char const*)(entry + h->count);
+	uint32_t const hash = name_hash(name);
+
+	for (uint32_t i = hash & h->mask, n = 0; n <= h->mask;
+		i = (i + 1) & h->mask, ++n)
+	{
+		uint32_t const b = bucket[i];
+		if (b == 0 || b > h->count)
+			break;
+
+		snapshot_entry const *const e = &entry[b - 1];
+		if (e->hash == hash && e->name < h->pool &&
+			strcmp(pool + e->name, name) == 0)
+		{
+			*is_whitelisted = e->whitelisted;
+			*is_dmarc_enabled = e->dmarc;
+			*is_adsp_enabled = e->adsp;
+			return 3;
+		}
+	}
+
+	return 0;
+}
+
+void snapshot_report(char const *path, logfun_t log)
+/*
+* Log size and age of the snapshot.
+*/
+{
+	if (path == NULL)
+		return;
+
+	snapshot_header const *const h = map.h;
+	if (h == NULL)
+	{
+		(*log)(LOG_INFO, "domain flags snapshot %s: not loaded", path);
+		return;
+	}
+
+	time_t const now = time(NULL);
+	(*log)(LOG_INFO,
+		"domain flags snapshot %s: %u domains, mark %llu, "
+		"age %ld secs, full load %ld secs ago%s",
+		path, h->count, (unsigned long long)h->mark,
+		(long)(now - (time_t)h->refreshed), (long)(now - (time_t)h->loaded),
+		snapshot_fresh()? "": " (stale, not used)");
+}
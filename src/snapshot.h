@@ -0,0 +1,23 @@
+/*
+** snapshot.h - written in milano by vesely on 19oct2026
+** read-only snapshot of per-domain flags
+*/
+
+#if !defined SNAPSHOT_H_INCLUDED
+
+#include "database.h"
+#include "parm.h"
+
+// stats writer
+int snapshot_refresh(char const *path, db_work_area *dwa, int refresh,
+	int verbose, logfun_t log);
+
+// filter
+int snapshot_map(char const *path, logfun_t log);
+int snapshot_fresh(void);
+int snapshot_lookup(char const *domain,
+	int *is_whitelisted, int *is_dmarc_enabled, int *is_adsp_enabled);
+void snapshot_report(char const *path, logfun_t log);
+
+#define SNAPSHOT_H_INCLUDED
+#endif
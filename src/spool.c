@@ -0,0 +1,440 @@
+/*
+** spool.c - written in milano by vesely on 19oct2026
+** local journal of stats that could not reach the database
+*/
+/*
+* zdkimfilter - Sign outgoing, verify incoming mail messages
+
+Copyright (C) 2026 Alessandro Vesely
+
+This file is part of zdkimfilter
+
+zdkimfilter is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+zdkimfilter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License version 3
+along with zdkimfilter.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPLv3 section 7:
+
+If you modify zdkimfilter, or any covered work, by linking or combining it
+with software developed by The OpenDKIM Project and its contributors,
+containing parts covered by the applicable licence, the licensor or
+zdkimfilter grants you additional permission to convey the resulting work.
+*/
+#include <config.h>
+#if !ZDKIMFILTER_DEBUG
+#define NDEBUG
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include "spool.h"
+#include <assert.h>
+
+/*
+* The spool is a file where records are appended when the database cannot
+* be reached.  Each record is a header followed by what db_stats_serialize()
+* wrote.  The header holds a magic number, the time of writing, the payload
+* length, and its CRC-32.  Numbers are in host order, as the file is local.
+*
+* Appends are done with a single write() under an exclusive flock().  The
+* stats writer renames the file to PATH.replay before reading it, then
+* takes the lock once, so that appends in progress complete.  A writer that
+* finds, after locking, that its descriptor is no longer PATH reopens it.
+*
+* Replay is at least once:  a record whose statements broke the connection
+* is retried, even if some of its rows were written.
+*/
+
+#define SPOOL_MAGIC 0x5a535031 // "ZSP1"
+#define SPOOL_MAX_RECORD (1024*1024)
+#define REPLAY_SUFFIX ".replay"
+
+typedef struct spool_header
+{
+	uint32_t magic;
+	uint32_t time;
+	uint32_t length;
+	uint32_t crc;
+} spool_header;
+
+static uint32_t crc_table[256];
+
+static uint32_t crc32(unsigned char const *p, size_t len)
+{
+	if (crc_table[1] == 0)
+		for (uint32_t n = 0; n < 256; ++n)
+		{
+			uint32_t c = n;
+			for (int k = 0; k < 8; ++k)
+				c = c & 1? 0xedb88320U ^ (c >> 1): c >> 1;
+			crc_table[n] = c;
+		}
+
+	uint32_t c = 0xffffffffU;
+	while (len--)
+		c = crc_table[(c ^ *p++) & 0xff] ^ (c >> 8);
+	return c ^ 0xffffffffU;
+}
+
+static char *replay_name(char const *path)
+{
+	size_t const len = strlen(path);
+	char *name = malloc(len + sizeof REPLAY_SUFFIX);
+	if (name)
+	{
+		memcpy(name, path, len);
+		memcpy(name + len, REPLAY_SUFFIX, sizeof REPLAY_SUFFIX);
+	}
+	return name;
+}
+
+static int open_locked(char const *path, logfun_t log)
+/*
+* Open path for appending, and lock it.  Retry if it was renamed meanwhile.
+* return the descriptor, or -1.
+*/
+{
+	for (int retry = 0; retry < 8; ++retry)
+	{
+		int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+		if (fd < 0)
+			break;
+
+		struct stat fst, pst;
+		if (flock(fd, LOCK_EX) == 0 && fstat(fd, &fst) == 0)
+		{
+			if (stat(path, &pst) == 0 &&
+				pst.st_ino == fst.st_ino && pst.st_dev == fst.st_dev)
+					return fd;
+		}
+		close(fd);
+	}
+
+	(*log)(LOG_ERR, "cannot open stats spool %s: %s", path, strerror(errno));
+	return -1;
+}
+
+static int append_record(char const *path, char *buf, size_t len, logfun_t log)
+/*
+* buf has room for the header before the len bytes of payload.
+*/
+{
+	spool_header *const h = (spool_header*)buf;
+	h->magic = SPOOL_MAGIC;
+	h->time = (uint32_t)time(NULL);
+	h->length = (uint32_t)len;
+	h->crc = crc32((unsigned char*)buf + sizeof *h, len);
+
+	int fd = open_locked(path, log);
+	if (fd < 0)
+		return -1;
+
+	size_t const total = sizeof *h + len;
+	ssize_t const n = write(fd, buf, total);
+	int rc = 0;
+	if (n != (ssize_t)total)
+	{
+		(*log)(LOG_ERR, "cannot write stats spool %s: %s",
+			path, n < 0? strerror(errno): "short write");
+		if (n > 0) // don't leave a partial record
+		{
+			struct stat st;
+			if (fstat(fd, &st) == 0 && ftruncate(fd, st.st_size - n))
+				(*log)(LOG_CRIT, "stats spool %s is damaged", path);
+		}
+		rc = -1;
+	}
+	close(fd);
+	return rc;
+}
+
+int spool_append(char const *path, char const *rec, size_t len, logfun_t log)
+/*
+* Append a serialized record.  return 0, or -1 (error logged).
+*/
+{
+	assert(path);
+	assert(rec);
+
+	if (len > SPOOL_MAX_RECORD)
+		return -1;
+
+	char *buf = malloc(sizeof(spool_header) + len);
+	if (buf == NULL)
+	{
+		(*log)(LOG_ALERT, "MEMORY FAULT");
+		return -1;
+	}
+
+	memcpy(buf + sizeof(spool_header), rec, len);
+	int const rc = append_record(path, buf, len, log);
+	free(buf);
+	return rc;
+}
+
+int spool_append_stats(char const *path,
+	db_work_area *dwa, stats_info const *info, logfun_t log)
+/*
+* Serialize and append stats.  return 0, or -1 (error logged).
+*/
+{
+	assert(path);
+	assert(dwa);
+	assert(info);
+
+	size_t const len = db_stats_serialize(dwa, info, NULL, 0);
+	if (len == 0 || len > SPOOL_MAX_RECORD)
+		return -1;
+
+	char *buf = malloc(sizeof(spool_header) + len);
+	if (buf == NULL)
+	{
+		(*log)(LOG_ALERT, "MEMORY FAULT");
+		return -1;
+	}
+
+	db_stats_serialize(dwa, info, buf + sizeof(spool_header), len);
+	int const rc = append_record(path, buf, len, log);
+	free(buf);
+	return rc;
+}
+
+static int read_header(int fd, spool_header *h)
+/*
+* return 1 if a valid header was read, 0 at end of file, -1 if corrupted.
+*/
+{
+	ssize_t const n = read(fd, h, sizeof *h);
+	if (n == 0)
+		return 0;
+
+	if (n != sizeof *h || h->magic != SPOOL_MAGIC ||
+		h->length > SPOOL_MAX_RECORD)
+			return -1;
+
+	return 1;
+}
+
+/*
+* Replay state, kept by the stats writer between calls.
+*/
+static int replay_fd = -1;
+static off_t replay_offset;
+static unsigned long replay_count, replay_bad;
+static time_t replay_lag;
+static struct timespec replay_start;
+
+static void replay_done(char const *replay, logfun_t log)
+{
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double const secs = (end.tv_sec - replay_start.tv_sec) +
+		(end.tv_nsec - replay_start.tv_nsec) / 1.0e9;
+
+	(*log)(LOG_INFO,
+		"stats spool: replayed %lu record(s) in %.3f secs (%.0f/sec), "
+		"%lu bad, lag %ld secs",
+		replay_count, secs, secs > 0? replay_count / secs: 0.0,
+		replay_bad, (long)replay_lag);
+
+	close(replay_fd);
+	replay_fd = -1;
+	if (unlink(replay))
+		(*log)(LOG_ERR, "cannot remove %s: %s", replay, strerror(errno));
+}
+
+static int replay_open(char const *path, char const *replay, logfun_t log)
+/*
+* Open a leftover replay file, or move the spool to it.
+* return 1 if there is something to replay, 0 if not, -1 on error.
+*/
+{
+	struct stat st;
+	if (stat(replay, &st) != 0)
+	{
+		if (stat(path, &st) != 0 || st.st_size == 0)
+			return 0;
+
+		if (rename(path, replay))
+		{
+			(*log)(LOG_ERR, "cannot rename %s: %s", path, strerror(errno));
+			return -1;
+		}
+	}
+
+	int fd = open(replay, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		(*log)(LOG_ERR, "cannot open %s: %s", replay, strerror(errno));
+		return -1;
+	}
+
+	// wait for appends started before the rename
+	flock(fd, LOCK_EX);
+	flock(fd, LOCK_UN);
+
+	replay_fd = fd;
+	replay_offset = 0;
+	replay_count = replay_bad = 0;
+	replay_lag = 0;
+	clock_gettime(CLOCK_MONOTONIC, &replay_start);
+	return 1;
+}
+
+int spool_replay(char const *path,
+	db_work_area *dwa, publicsuffix_trie *pst, int max, logfun_t log)
+/*
+* Called by the stats writer while connected.  Run up to max records.
+* return 1 if more records are pending, 0 if done or there was nothing to
+* replay, -1 if the connection broke or on error.  The replay file is only
+* removed after all of its rows have been written.
+*/
+{
+	assert(path);
+	assert(dwa);
+
+	char *replay = replay_name(path);
+	if (replay == NULL)
+		return -1;
+
+	int rc = 0;
+	if (replay_fd < 0 && (rc = replay_open(path, replay, log)) <= 0)
+	{
+		free(replay);
+		return rc;
+	}
+
+	char *buf = NULL;
+	size_t alloc = 0;
+	int n;
+	for (n = 0; n < max; ++n)
+	{
+		spool_header h;
+		if (lseek(replay_fd, replay_offset, SEEK_SET) != replay_offset ||
+			(rc = read_header(replay_fd, &h)) <= 0)
+		{
+			if (rc < 0)
+				(*log)(LOG_CRIT,
+					"stats spool %s corrupted at offset %lld, rest discarded",
+					replay, (long long)replay_offset);
+			rc = 0;
+			break;
+		}
+
+		if (h.length > alloc)
+		{
+			free(buf);
+			if ((buf = malloc(alloc = h.length)) == NULL)
+			{
+				(*log)(LOG_ALERT, "MEMORY FAULT");
+				rc = -1;
+				break;
+			}
+		}
+
+		if (read(replay_fd, buf, h.length) != (ssize_t)h.length)
+		{
+			(*log)(LOG_ERR, "stats spool %s truncated at offset %lld",
+				replay, (long long)replay_offset);
+			rc = 0;
+			break;
+		}
+
+		if (replay_count == 0 && replay_bad == 0)
+			replay_lag = time(NULL) - (time_t)h.time;
+
+		if (crc32((unsigned char*)buf, h.length) != h.crc ||
+			db_set_stats_serialized(dwa, buf, h.length, pst) != 0)
+				++replay_bad;
+		else if (db_stats_lost(dwa))
+		{
+			rc = -1; // retry this record after reconnecting
+			break;
+		}
+		else
+			++replay_count;
+
+		replay_offset += sizeof h + h.length;
+		rc = 1;
+	}
+
+	free(buf);
+	if (rc == 0)
+	{
+		if (db_batch_flush(dwa))
+			rc = -1; // keep the file, flush again after reconnecting
+		else
+			replay_done(replay, log);
+	}
+
+	free(replay);
+	return rc;
+}
+
+static long oldest_record(char const *name)
+{
+	long age = -1;
+	int fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0)
+	{
+		spool_header h;
+		if (read_header(fd, &h) > 0)
+			age = (long)(time(NULL) - (time_t)h.time);
+		close(fd);
+	}
+	return age;
+}
+
+void spool_report(char const *path, logfun_t log)
+/*
+* Log the size of the spool and the age of its oldest record.
+*/
+{
+	if (path == NULL)
+		return;
+
+	char *replay = replay_name(path);
+	if (replay == NULL)
+		return;
+
+	struct stat st;
+	long long size = 0;
+	long age = -1;
+	if (stat(replay, &st) == 0)
+	{
+		size += st.st_size;
+		age = oldest_record(replay);
+	}
+	if (stat(path, &st) == 0)
+	{
+		size += st.st_size;
+		if (age < 0)
+			age = oldest_record(path);
+	}
+
+	if (size)
+		(*log)(LOG_INFO, "stats spool %s: %lld bytes, oldest record %ld secs",
+			path, size, age);
+	else
+		(*log)(LOG_INFO, "stats spool %s: empty", path);
+	free(replay);
+}
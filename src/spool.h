@@ -0,0 +1,19 @@
+/*
+** spool.h - written in milano by vesely on 19oct2026
+** local journal of stats that could not reach the database
+*/
+
+#if !defined SPOOL_H_INCLUDED
+
+#include "database.h"
+#include "parm.h"
+
+int spool_append(char const *path, char const *rec, size_t len, logfun_t log);
+int spool_append_stats(char const *path,
+	db_work_area *dwa, stats_info const *info, logfun_t log);
+int spool_replay(char const *path,
+	db_work_area *dwa, publicsuffix_trie *pst, int max, logfun_t log);
+void spool_report(char const *path, logfun_t log);
+
+#define SPOOL_H_INCLUDED
+#endif
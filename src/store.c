@@ -0,0 +1,1787 @@
+/*
+** store.c - written in milano by vesely on 19oct2026
+** append-only segment files of stats, for hosts without a database
+*/
+/*
+* zdkimfilter - Sign outgoing, verify incoming mail messages
+
+Copyright (C) 2026 Alessandro Vesely
+
+This file is part of zdkimfilter
+
+zdkimfilter is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+zdkimfilter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License version 3
+along with zdkimfilter.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPLv3 section 7:
+
+If you modify zdkimfilter, or any covered work, by linking or combining it
+with software developed by The OpenDKIM Project and its contributors,
+containing parts covered by the applicable licence, the licensor or
+zdkimfilter grants you additional permission to convey the resulting work.
+*/
+#include <config.h>
+#if !ZDKIMFILTER_DEBUG
+#define NDEBUG
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/utsname.h>
+#include <arpa/inet.h>
+
+#include "store.h"
+#if defined TEST_MAIN && ! defined NO_DNS_QUERY // not zfilter_db
+#define STORE_TEST_MAIN 1
+#endif
+#if STORE_TEST_MAIN
+#include <stdarg.h>
+#include <sys/wait.h>
+#endif
+#include <assert.h>
+
+/*
+* The store is a directory of segment files, one per node and period of
+* time.  A segment is named stats-YYYYmmddHHMM-node.seg after the UTC start
+* of its period, and is only appended to.  Once its period is over, a
+* segment can be copied to the store of another host, where readers merge
+* it with the local ones.
+*
+* A segment begins with a header, followed by entries.  Each entry is a
+* 16-bit type and a 16-bit length, followed by that many bytes.  Numbers
+* are little-endian, so that segments can be moved across hosts.  Entries:
+*
+*   DICT  a 32-bit id and a string (not terminated):  domain names, users,
+*         and DMARC records are written once per segment, and then referred
+*         to by their id;
+*   MSG   a message, fixed layout, see encode_msg();
+*   DOM   a domain of the preceding message, fixed layout.
+*
+* A DICT entry precedes the entries that refer to it.  Readers skip unknown
+* entry types.
+*
+* Writers serialize on a flock() of STORE_LOCK in the directory, and append
+* with a single write().  The id of recent strings are kept in a dictionary
+* shared by forked processes; it is valid for the segment it was built on,
+* and is rebuilt from the segment file when that changes.
+*/
+
+#define STORE_MAGIC "ZST1"
+#define STORE_VERSION 1
+#define STORE_LOCK "store.lock"
+#define STORE_LAST_REPORT "last_report"
+#define HEADER_SIZE 80
+#define NODE_LEN 64
+#define MAX_STRING 4096
+
+#define ENTRY_DICT 1
+#define ENTRY_MSG 2
+#define ENTRY_DOM 3
+#define MSG_SIZE 80
+#define DOM_SIZE 20
+
+#define DICT_SLOTS 2048
+#define DICT_PROBE 8
+#define DICT_LEN 248
+
+// stats_info and domain_prescreen flags, in the order they are stored
+#define MSG_FLAGS X(outgoing) X(nxdomain) X(adsp_any) X(adsp_found) \
+	X(adsp_unknown) X(adsp_all) X(adsp_discardable) X(adsp_fail) \
+	X(dmarc_found) X(dmarc_dkim) X(dmarc_spf) X(dkim_any) X(spf_any) \
+	X(dmarc_subdomain) X(dmarc_fail) X(policy_overridden) X(mailing_list) \
+	X(reject) X(drop)
+#define MSG_HAS_IP 0x80000000U
+#define MSG_HAS_ID 0x40000000U
+
+#define DOM_FLAGS X(sig_is_ok) X(spf_pass) X(has_vbr) X(vbr_is_trusted) \
+	X(vbr_is_ok) X(is_trusted) X(is_whitelisted) X(is_known) X(is_from) \
+	X(is_org_domain) X(is_aligned) X(is_dmarc) X(is_dnswl) X(is_mfrom) \
+	X(is_helo) X(is_spf_from) X(is_reputed) X(is_reputed_signer)
+
+typedef struct dict_slot
+{
+	uint32_t id, hash; // id 0 is a free slot
+	char str[DICT_LEN];
+} dict_slot;
+
+typedef struct store_cache
+{
+	dev_t dev;
+	ino_t ino;
+	off_t end;
+	uint32_t next_id; // 0 if not valid
+	unsigned long appends, errors, hits, misses, reloads;
+	dict_slot slot[DICT_SLOTS];
+} store_cache;
+
+static store_cache *cache;
+
+#if STORE_TEST_MAIN
+static time_t test_time;
+static time_t store_time(void) { return test_time; }
+#else
+static inline time_t store_time(void) { return time(NULL); }
+#endif
+
+static inline void set_u16(unsigned char *p, unsigned v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+}
+
+static inline void set_u32(unsigned char *p, uint32_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = v >> 24;
+}
+
+static inline unsigned get_u16(unsigned char const *p)
+{
+	return p[0] | (unsigned)p[1] << 8;
+}
+
+static inline uint32_t get_u32(unsigned char const *p)
+{
+	return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+		(uint32_t)p[3] << 24;
+}
+
+static uint32_t str_hash(char const *s)
+{
+	uint32_t h = 2166136261U; // FNV-1a
+	for (unsigned char const *p = (unsigned char const*)s; *p; ++p)
+		h = (h ^ *p) * 16777619U;
+	return h;
+}
+
+typedef struct st_buf
+{
+	unsigned char *p;
+	size_t len, alloc;
+	int bad;
+} st_buf;
+
+static unsigned char *st_room(st_buf *b, size_t n)
+{
+	if (b->bad)
+		return NULL;
+
+	if (b->len + n > b->alloc)
+	{
+		size_t const alloc = 2*b->alloc + n + 512;
+		unsigned char *const p = realloc(b->p, alloc);
+		if (p == NULL)
+		{
+			b->bad = 1;
+			return NULL;
+		}
+		b->p = p;
+		b->alloc = alloc;
+	}
+
+	unsigned char *const r = b->p + b->len;
+	b->len += n;
+	return r;
+}
+
+static unsigned char *st_entry(st_buf *b, unsigned type, size_t size)
+// return the zeroed payload of a new entry, or NULL
+{
+	assert(size <= 0xffff);
+	unsigned char *const p = st_room(b, 4 + size);
+	if (p == NULL)
+		return NULL;
+
+	set_u16(p, type);
+	set_u16(p + 2, size);
+	memset(p + 4, 0, size);
+	return p + 4;
+}
+
+static size_t parse_entry(unsigned char const *p, size_t avail,
+	unsigned *type, size_t *size)
+// return the total length of the entry at p, or 0 if incomplete
+{
+	if (avail < 4)
+		return 0;
+
+	*type = get_u16(p);
+	*size = get_u16(p + 2);
+	return avail - 4 < *size? 0: 4 + *size;
+}
+
+/*
+* Dictionary
+*/
+
+static uint32_t dict_find(char const *s, uint32_t h)
+{
+	for (int i = 0; i < DICT_PROBE; ++i)
+	{
+		dict_slot const *const d = &cache->slot[(h + i) % DICT_SLOTS];
+		if (d->id && d->hash == h && strcmp(d->str, s) == 0)
+			return d->id;
+	}
+	return 0;
+}
+
+static void dict_insert(char const *s, size_t len, uint32_t h, uint32_t id)
+// a free slot or the same string, else evict the oldest id
+{
+	if (len >= DICT_LEN)
+		return;
+
+	dict_slot *victim = NULL;
+	for (int i = 0; i < DICT_PROBE; ++i)
+	{
+		dict_slot *const d = &cache->slot[(h + i) % DICT_SLOTS];
+		if (d->id == 0 || (d->hash == h && strcmp(d->str, s) == 0))
+		{
+			victim = d;
+			break;
+		}
+		if (victim == NULL || d->id < victim->id)
+			victim = d;
+	}
+
+	victim->id = id;
+	victim->hash = h;
+	memcpy(victim->str, s, len + 1);
+}
+
+static uint32_t intern(st_buf *b, char const *s)
+/*
+* Return the id of s, appending a DICT entry to b if it is new.  Strings
+* too long to be cached get a new id each time.  0 is no string.
+*/
+{
+	if (s == NULL)
+		return 0;
+
+	size_t const len = strlen(s);
+	if (len > MAX_STRING)
+		return 0;
+
+	uint32_t const h = str_hash(s);
+	uint32_t id = dict_find(s, h);
+	if (id)
+	{
+		cache->hits += 1;
+		return id;
+	}
+
+	cache->misses += 1;
+	id = cache->next_id++;
+	unsigned char *const p = st_entry(b, ENTRY_DICT, 4 + len);
+	if (p)
+	{
+		set_u32(p, id);
+		memcpy(p + 4, s, len);
+	}
+	dict_insert(s, len, h, id);
+	return id;
+}
+
+int store_init(logfun_t log)
+/*
+* Create the shared dictionary; call before forking.  Return 0 or -1.
+*/
+{
+	if (cache)
+		return 0;
+
+	void *const p = mmap(NULL, sizeof *cache, PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+	{
+		(*log)(LOG_ERR, "cannot map stats store dictionary: %s",
+			strerror(errno));
+		return -1;
+	}
+	cache = p;
+	return 0;
+}
+
+/*
+* Segment files
+*/
+
+static time_t segment_length(int segment)
+{
+	if (segment <= 0)
+		return STORE_DEFAULT_SEGMENT;
+	if (segment > 86400)
+		return 86400;
+	return segment;
+}
+
+static char const *node_name(void)
+{
+	static char node[NODE_LEN];
+	if (node[0] == 0)
+	{
+		struct utsname u;
+		if (uname(&u) == 0 && u.nodename[0])
+		{
+			size_t const len = strnlen(u.nodename, sizeof node - 1);
+			memcpy(node, u.nodename, len);
+			node[len] = 0;
+			for (char *p = node; *p; ++p)
+				if (*p == '/')
+					*p = '_';
+		}
+		else
+			strcpy(node, "localhost");
+	}
+	return node;
+}
+
+static char *segment_name(char const *dir, time_t start)
+{
+	struct tm tm;
+	char stamp[32];
+	if (gmtime_r(&start, &tm) == NULL ||
+		strftime(stamp, sizeof stamp, "%Y%m%d%H%M", &tm) == 0)
+			return NULL;
+
+	char const *const node = node_name();
+	size_t const len = strlen(dir) + strlen(stamp) + strlen(node) + 16;
+	char *const name = malloc(len);
+	if (name)
+		sprintf(name, "%s/stats-%s-%s.seg", dir, stamp, node);
+	return name;
+}
+
+static int is_segment_name(char const *name)
+{
+	size_t const len = strlen(name);
+	return len > 10 && strncmp(name, "stats-", 6) == 0 &&
+		strcmp(name + len - 4, ".seg") == 0;
+}
+
+static char *dir_file(char const *dir, char const *name)
+{
+	char *const path = malloc(strlen(dir) + strlen(name) + 2);
+	if (path)
+		sprintf(path, "%s/%s", dir, name);
+	return path;
+}
+
+static int lock_store(char const *dir, logfun_t log)
+// return a descriptor holding the exclusive lock, or -1
+{
+	char *const path = dir_file(dir, STORE_LOCK);
+	if (path == NULL)
+		return -1;
+
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0 || flock(fd, LOCK_EX))
+	{
+		(*log)(LOG_ERR, "cannot lock %s: %s", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		fd = -1;
+	}
+	free(path);
+	return fd;
+}
+
+static unsigned char *read_file(int fd, off_t off, size_t size)
+{
+	unsigned char *const buf = malloc(size? size: 1);
+	if (buf == NULL)
+		return NULL;
+
+	size_t done = 0;
+	while (done < size)
+	{
+		ssize_t const n = pread(fd, buf + done, size - done, off + done);
+		if (n <= 0)
+		{
+			free(buf);
+			return NULL;
+		}
+		done += n;
+	}
+	return buf;
+}
+
+static int check_header(unsigned char const *h, size_t size,
+	time_t *start, time_t *length)
+// return the header size, or 0 if not a segment
+{
+	if (size < HEADER_SIZE || memcmp(h, STORE_MAGIC, 4) != 0)
+		return 0;
+
+	unsigned const hsize = get_u16(h + 6);
+	if (hsize < HEADER_SIZE || hsize > size)
+		return 0;
+
+	if (start)
+		*start = get_u32(h + 8);
+	if (length)
+		*length = get_u32(h + 12);
+	return hsize;
+}
+
+static int cache_sync(int fd, struct stat const *st, char const *path,
+	logfun_t log)
+/*
+* Make the dictionary reflect the segment.  If another process appended
+* without updating the dictionary --e.g. before a restart-- reload it from
+* the DICT entries.  Drop a partial entry left at the end by a crash.
+* return 0, or -1 if the file is not a segment.
+*/
+{
+	if (cache->next_id && cache->dev == st->st_dev &&
+		cache->ino == st->st_ino && cache->end == st->st_size)
+			return 0;
+
+	memset(cache->slot, 0, sizeof cache->slot);
+	cache->dev = st->st_dev;
+	cache->ino = st->st_ino;
+	cache->end = 0;
+	cache->next_id = 0;
+	if (st->st_size == 0)
+	{
+		cache->next_id = 1;
+		return 0;
+	}
+
+	cache->reloads += 1;
+	size_t const size = st->st_size;
+	unsigned char *const buf = read_file(fd, 0, size);
+	if (buf == NULL)
+	{
+		(*log)(LOG_ERR, "cannot read %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	size_t off = check_header(buf, size, NULL, NULL);
+	if (off == 0)
+	{
+		(*log)(LOG_ERR, "%s is not a stats segment", path);
+		free(buf);
+		return -1;
+	}
+
+	uint32_t max_id = 0;
+	unsigned type;
+	size_t len, psize;
+	while ((len = parse_entry(buf + off, size - off, &type, &psize)) > 0)
+	{
+		if (type == ENTRY_DICT && psize >= 4 && psize - 4 <= MAX_STRING)
+		{
+			char str[MAX_STRING + 1];
+			uint32_t const id = get_u32(buf + off + 4);
+			memcpy(str, buf + off + 8, psize - 4);
+			str[psize - 4] = 0;
+			dict_insert(str, psize - 4, str_hash(str), id);
+			if (id > max_id)
+				max_id = id;
+		}
+		off += len;
+	}
+	free(buf);
+
+	if (off < size)
+	{
+		(*log)(LOG_WARNING, "stats segment %s: dropping %zu bytes at the end",
+			path, size - off);
+		if (ftruncate(fd, off))
+		{
+			(*log)(LOG_ERR, "cannot truncate %s: %s", path, strerror(errno));
+			return -1;
+		}
+	}
+
+	cache->end = off;
+	cache->next_id = max_id + 1;
+	return 0;
+}
+
+static void put_header(st_buf *b, time_t start, time_t length)
+{
+	unsigned char *const h = st_room(b, HEADER_SIZE);
+	if (h == NULL)
+		return;
+
+	memset(h, 0, HEADER_SIZE);
+	memcpy(h, STORE_MAGIC, 4);
+	set_u16(h + 4, STORE_VERSION);
+	set_u16(h + 6, HEADER_SIZE);
+	set_u32(h + 8, (uint32_t)start);
+	set_u32(h + 12, (uint32_t)length);
+
+	// the node name is NUL-terminated within NODE_LEN, the rest is zeroed
+	char const *const node = node_name();
+	size_t len = strlen(node);
+	if (len >= NODE_LEN)
+		len = NODE_LEN - 1;
+	memcpy(h + 16, node, len);
+	h[16 + len] = 0;
+}
+
+static int keep_domain(stats_info const *info, domain_prescreen const *dps)
+// skip unauthenticated domains unless required, as the database does
+{
+	return info->outgoing ||
+		info->scope == save_unauthenticated_dmarc ||
+		(info->scope == save_unauthenticated_from && dps->u.f.is_from) ||
+		dps->u.f.sig_is_ok || dps->u.f.spf_pass || dps->u.f.is_dnswl;
+}
+
+static void encode_msg(st_buf *b, stats_info const *info,
+	char const *ip, char const *user, time_t now)
+{
+	uint32_t const user_id = intern(b, user),
+		record_id = intern(b, info->dmarc_record),
+		rua_id = intern(b, info->dmarc_rua);
+
+	unsigned ndomains = 0;
+	for (domain_prescreen const *dps = info->domain_head;
+		dps && ndomains < 0xffff; dps = dps->next)
+			if (keep_domain(info, dps))
+				++ndomains;
+
+	uint32_t flags = 0;
+	int bit = 0;
+#define X(N) flags |= (uint32_t)(info->N != 0) << bit++;
+	MSG_FLAGS
+#undef X
+
+	unsigned char addr[16];
+	memset(addr, 0, sizeof addr);
+	if (ip && inet_pton(AF_INET6, ip, addr) == 1)
+		flags |= MSG_HAS_IP;
+	else if (ip && inet_pton(AF_INET, ip, addr + 12) == 1)
+	{
+		addr[10] = addr[11] = 0xff; // IPv4-mapped
+		flags |= MSG_HAS_IP;
+	}
+
+	unsigned long long ino = 0;
+	unsigned long mtime = 0, pid = 0;
+	if (info->ino_mtime_pid &&
+		sscanf(info->ino_mtime_pid, "%llx.%lx.%lx", &ino, &mtime, &pid) == 3)
+			flags |= MSG_HAS_ID;
+
+	unsigned char *const m = st_entry(b, ENTRY_MSG, MSG_SIZE);
+	if (m == NULL)
+		return;
+
+	set_u32(m, (uint32_t)now);
+	set_u32(m + 4, (uint32_t)mtime);
+	set_u32(m + 8, (uint32_t)ino);
+	set_u32(m + 12, (uint32_t)(ino >> 32));
+	set_u32(m + 16, (uint32_t)pid);
+	memcpy(m + 20, addr, sizeof addr);
+	set_u32(m + 36, user_id);
+	set_u32(m + 40, record_id);
+	set_u32(m + 44, rua_id);
+	set_u32(m + 48, info->dmarc_ri);
+	set_u32(m + 52, info->original_ri);
+	set_u32(m + 56, flags);
+	set_u32(m + 60, info->rcpt_count);
+	set_u32(m + 64, info->complaint_flag);
+	set_u16(m + 68, info->received_count > 0xffff? 0xffff: info->received_count);
+	set_u16(m + 70, info->signatures_count > 0xffff? 0xffff:
+		info->signatures_count);
+	set_u32(m + 72, info->skipped_body);
+	m[76] = info->dmarc_dispo;
+	m[77] = info->dmarc_reason;
+	set_u16(m + 78, ndomains);
+
+	for (domain_prescreen const *dps = info->domain_head;
+		dps && ndomains > 0; dps = dps->next)
+	{
+		if (!keep_domain(info, dps))
+			continue;
+
+		--ndomains;
+		uint32_t const name_id = intern(b, dps->name),
+			vbr_id = dps->u.f.vbr_is_ok? intern(b, dps->vbr_mv): 0;
+
+		uint32_t dflags = 0;
+		bit = 0;
+#define X(N) dflags |= (uint32_t)(dps->u.f.N != 0) << bit++;
+		DOM_FLAGS
+#undef X
+
+		unsigned char *const d = st_entry(b, ENTRY_DOM, DOM_SIZE);
+		if (d == NULL)
+			return;
+
+		set_u32(d, name_id);
+		set_u32(d + 4, vbr_id);
+		set_u32(d + 8, dflags);
+		set_u32(d + 12, (uint32_t)dps->reputation);
+		set_u16(d + 16, dps->dkim_order > 0xffff? 0xffff: dps->dkim_order);
+		d[18] = dps->spf;
+		d[19] = dps->dkim;
+	}
+}
+
+int store_append(char const *dir, int segment, stats_info const *info,
+	char const *ip, char const *user, logfun_t log)
+/*
+* Append a message to the current segment.  ip and user can be NULL.
+* return 0, or -1 (error logged).
+*/
+{
+	assert(dir);
+	assert(info);
+
+	if (cache == NULL && (cache = calloc(1, sizeof *cache)) == NULL)
+	{
+		(*log)(LOG_ALERT, "MEMORY FAULT");
+		return -1;
+	}
+
+	time_t const now = store_time();
+	time_t const length = segment_length(segment);
+	time_t const start = now - now % length;
+	char *const path = segment_name(dir, start);
+	if (path == NULL)
+		return -1;
+
+	int const lock = lock_store(dir, log);
+	if (lock < 0)
+	{
+		free(path);
+		return -1;
+	}
+
+	int rc = -1;
+	struct stat st;
+	int fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0 || fstat(fd, &st))
+		(*log)(LOG_ERR, "cannot open %s: %s", path, strerror(errno));
+	else if (cache_sync(fd, &st, path, log) == 0)
+	{
+		st_buf b;
+		memset(&b, 0, sizeof b);
+		if (cache->end == 0)
+			put_header(&b, start, length);
+		encode_msg(&b, info, ip, user, now);
+
+		if (b.bad)
+			(*log)(LOG_ALERT, "MEMORY FAULT");
+		else
+		{
+			ssize_t const n = write(fd, b.p, b.len);
+			if (n == (ssize_t)b.len)
+			{
+				cache->end += n;
+				cache->appends += 1;
+				rc = 0;
+			}
+			else
+			{
+				(*log)(LOG_ERR, "cannot write %s: %s",
+					path, n < 0? strerror(errno): "short write");
+				if (n > 0 && ftruncate(fd, cache->end))
+					(*log)(LOG_CRIT, "stats segment %s is damaged", path);
+			}
+		}
+		free(b.p);
+	}
+
+	if (rc)
+	{
+		cache->errors += 1;
+		cache->next_id = 0; // reload next time
+	}
+	if (fd >= 0)
+		close(fd);
+	close(lock);
+	free(path);
+	return rc;
+}
+
+void store_report(char const *dir, logfun_t log)
+// log usage; racy reads are good enough here
+{
+	if (dir == NULL)
+		return;
+
+	unsigned long segments = 0;
+	long long bytes = 0;
+	DIR *d = opendir(dir);
+	if (d)
+	{
+		struct dirent *de;
+		while ((de = readdir(d)) != NULL)
+		{
+			struct stat st;
+			char *path;
+			if (is_segment_name(de->d_name) &&
+				(path = dir_file(dir, de->d_name)) != NULL)
+			{
+				if (stat(path, &st) == 0)
+				{
+					segments += 1;
+					bytes += st.st_size;
+				}
+				free(path);
+			}
+		}
+		closedir(d);
+	}
+
+	if (cache)
+		(*log)(LOG_INFO,
+			"stats store %s: %lu segment(s), %lld bytes, %lu appends, "
+			"%lu errors, dictionary %lu hits, %lu misses, %lu reloads",
+			dir, segments, bytes, cache->appends, cache->errors,
+			cache->hits, cache->misses, cache->reloads);
+	else
+		(*log)(LOG_INFO, "stats store %s: %lu segment(s), %lld bytes",
+			dir, segments, bytes);
+}
+
+/*
+* Readers
+*/
+
+typedef struct dict_array
+{
+	char **str;
+	size_t n;
+} dict_array;
+
+static int dict_set(dict_array *da, uint32_t id, unsigned char const *s,
+	size_t len)
+{
+	if (id >= da->n)
+	{
+		size_t n = da->n? 2*da->n: 1024;
+		while (n <= id)
+			n *= 2;
+		char **const str = realloc(da->str, n * sizeof *str);
+		if (str == NULL)
+			return -1;
+		memset(str + da->n, 0, (n - da->n) * sizeof *str);
+		da->str = str;
+		da->n = n;
+	}
+
+	char *const p = malloc(len + 1);
+	if (p == NULL)
+		return -1;
+
+	memcpy(p, s, len);
+	p[len] = 0;
+	free(da->str[id]);
+	da->str[id] = p;
+	return 0;
+}
+
+static inline char const *dict_get(dict_array const *da, uint32_t id)
+{
+	return id && id < da->n? da->str[id]: NULL;
+}
+
+static void dict_free(dict_array *da)
+{
+	for (size_t i = 0; i < da->n; ++i)
+		free(da->str[i]);
+	free(da->str);
+}
+
+static char *dict_dup(dict_array const *da, uint32_t id)
+{
+	char const *const s = dict_get(da, id);
+	return s? strdup(s): NULL;
+}
+
+static void free_msg(store_msg *m)
+{
+	stats_info *const info = &m->info;
+	free(info->content_type);
+	free(info->content_encoding);
+	free(info->date);
+	free(info->message_id);
+	free(info->from);
+	free(info->subject);
+	free(info->envelope_sender);
+	free(info->vbr_result_resp);
+	free(info->dmarc_record);
+	free(info->dmarc_rua);
+	free(info->ino_mtime_pid);
+	for (domain_prescreen *dps = info->domain_head; dps;)
+	{
+		domain_prescreen *const next = dps->next;
+		free(dps->vbr_mv);
+		free(dps);
+		dps = next;
+	}
+	memset(m, 0, sizeof *m);
+}
+
+static unsigned decode_msg(unsigned char const *m, dict_array const *da,
+	store_msg *msg, char *ipbuf)
+// return the number of domains that follow
+{
+	memset(msg, 0, sizeof *msg);
+	stats_info *const info = &msg->info;
+
+	msg->time = get_u32(m);
+	uint32_t const flags = get_u32(m + 56);
+	if (flags & MSG_HAS_IP)
+	{
+		unsigned char const *const a = m + 20;
+		static unsigned char const mapped[12] =
+			{0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+		if (memcmp(a, mapped, sizeof mapped) == 0)
+			msg->ip = inet_ntop(AF_INET, a + 12, ipbuf, INET6_ADDRSTRLEN);
+		else
+			msg->ip = inet_ntop(AF_INET6, a, ipbuf, INET6_ADDRSTRLEN);
+	}
+	if (flags & MSG_HAS_ID)
+	{
+		char buf[64];
+		unsigned long long const ino =
+			get_u32(m + 8) | (unsigned long long)get_u32(m + 12) << 32;
+		sprintf(buf, "%llX.%lX.%lX", ino,
+			(unsigned long)get_u32(m + 4), (unsigned long)get_u32(m + 16));
+		info->ino_mtime_pid = strdup(buf);
+	}
+
+	msg->user = dict_get(da, get_u32(m + 36));
+	info->dmarc_record = dict_dup(da, get_u32(m + 40));
+	info->dmarc_rua = dict_dup(da, get_u32(m + 44));
+	info->dmarc_ri = get_u32(m + 48);
+	info->original_ri = get_u32(m + 52);
+
+	int bit = 0;
+#define X(N) info->N = (flags >> bit++) & 1;
+	MSG_FLAGS
+#undef X
+
+	info->rcpt_count = get_u32(m + 60);
+	info->complaint_flag = get_u32(m + 64);
+	info->received_count = get_u16(m + 68);
+	info->signatures_count = get_u16(m + 70);
+	info->skipped_body = get_u32(m + 72);
+	info->dmarc_dispo = m[76];
+	info->dmarc_reason = m[77];
+	info->scope = save_unauthenticated_dmarc; // already screened
+	return get_u16(m + 78);
+}
+
+static domain_prescreen *decode_dom(unsigned char const *d,
+	dict_array const *da)
+{
+	char const *const name = dict_get(da, get_u32(d));
+	if (name == NULL)
+		return NULL;
+
+	size_t const len = strlen(name) + 1;
+	domain_prescreen *const dps = calloc(1, sizeof *dps + len);
+	if (dps == NULL)
+		return NULL;
+
+	memcpy(dps->name, name, len);
+	dps->vbr_mv = dict_dup(da, get_u32(d + 4));
+
+	uint32_t const flags = get_u32(d + 8);
+	int bit = 0;
+#define X(N) dps->u.f.N = (flags >> bit++) & 1;
+	DOM_FLAGS
+#undef X
+
+	dps->reputation = (int32_t)get_u32(d + 12);
+	dps->dkim_order = get_u16(d + 16);
+	dps->nsigs = dps->dkim_order > 0;
+	dps->spf = d[18];
+	dps->dkim = d[19];
+	return dps;
+}
+
+static int scan_segment(char const *path, time_t from, time_t to,
+	store_msg_cb cb, void *cb_arg, logfun_t log)
+/*
+* Pass the messages of a segment appended in [from, to) to cb.  Stop if cb
+* returns non-zero, and return that value.  return -1 on error.
+*/
+{
+	int const fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st))
+	{
+		(*log)(LOG_ERR, "cannot open %s: %s", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	unsigned char head[HEADER_SIZE];
+	time_t start = 0, length = 0;
+	size_t const size = st.st_size;
+	size_t off = 0;
+	if (size >= HEADER_SIZE &&
+		pread(fd, head, HEADER_SIZE, 0) == HEADER_SIZE)
+			off = check_header(head, size, &start, &length);
+	if (off == 0)
+	{
+		(*log)(LOG_ERR, "%s is not a stats segment", path);
+		close(fd);
+		return -1;
+	}
+
+	if (start + length <= from || start >= to) // not in this period
+	{
+		close(fd);
+		return 0;
+	}
+
+	unsigned char *const buf = read_file(fd, 0, size);
+	close(fd);
+	if (buf == NULL)
+	{
+		(*log)(LOG_ERR, "cannot read %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	dict_array da;
+	memset(&da, 0, sizeof da);
+	store_msg msg;
+	memset(&msg, 0, sizeof msg);
+	char ipbuf[INET6_ADDRSTRLEN];
+	domain_prescreen **tail = NULL;
+	unsigned pending = 0;
+	int skip = 0, rtc = 0;
+
+	unsigned type;
+	size_t len, psize;
+	while (rtc == 0 &&
+		(len = parse_entry(buf + off, size - off, &type, &psize)) > 0)
+	{
+		unsigned char const *const p = buf + off + 4;
+		off += len;
+		switch (type)
+		{
+			case ENTRY_DICT:
+				if (psize >= 4 &&
+					dict_set(&da, get_u32(p), p + 4, psize - 4))
+						rtc = -1;
+				continue;
+
+			case ENTRY_MSG:
+				if (psize < MSG_SIZE)
+					continue;
+				free_msg(&msg);
+				skip = get_u32(p) < from || get_u32(p) >= to;
+				if (skip)
+				{
+					pending = get_u16(p + 78);
+					tail = NULL;
+					continue;
+				}
+				pending = decode_msg(p, &da, &msg, ipbuf);
+				tail = &msg.info.domain_head;
+				break;
+
+			case ENTRY_DOM:
+				if (pending == 0 || psize < DOM_SIZE)
+					continue;
+				pending -= 1;
+				if (skip)
+					continue;
+				if ((*tail = decode_dom(p, &da)) != NULL)
+					tail = &(*tail)->next;
+				break;
+
+			default:
+				continue;
+		}
+
+		if (pending == 0 && !skip && tail != NULL)
+		{
+			rtc = (*cb)(&msg, cb_arg);
+			free_msg(&msg);
+			tail = NULL;
+		}
+	}
+
+	if (rtc < 0)
+		(*log)(LOG_ALERT, "MEMORY FAULT");
+
+	free_msg(&msg);
+	dict_free(&da);
+	free(buf);
+	return rtc;
+}
+
+static int cmp_name(void const *a, void const *b)
+{
+	return strcmp(*(char *const*)a, *(char *const*)b);
+}
+
+int store_scan(char const *dir, time_t from, time_t to,
+	store_msg_cb cb, void *cb_arg, logfun_t log)
+/*
+* Pass the messages appended in [from, to) to cb, segment by segment in
+* name order.  The strings and domains of the store_msg are freed after cb
+* returns, unless it sets them to NULL.  Stop if cb returns non-zero.
+* return the value returned by cb, or 0; -1 if the directory is unreadable.
+*/
+{
+	assert(dir);
+	assert(cb);
+
+	DIR *d = opendir(dir);
+	if (d == NULL)
+	{
+		(*log)(LOG_ERR, "cannot open stats store %s: %s",
+			dir, strerror(errno));
+		return -1;
+	}
+
+	char **names = NULL;
+	size_t n = 0, alloc = 0;
+	struct dirent *de;
+	while ((de = readdir(d)) != NULL)
+	{
+		if (!is_segment_name(de->d_name))
+			continue;
+
+		if (n >= alloc)
+		{
+			char **const nn = realloc(names, (alloc += 64) * sizeof *nn);
+			if (nn == NULL)
+				break;
+			names = nn;
+		}
+		if ((names[n] = strdup(de->d_name)) != NULL)
+			++n;
+	}
+	closedir(d);
+
+	if (n)
+		qsort(names, n, sizeof *names, cmp_name);
+
+	int rtc = 0;
+	for (size_t i = 0; i < n; ++i)
+	{
+		char *const path = rtc == 0? dir_file(dir, names[i]): NULL;
+		if (path)
+		{
+			int const rc = scan_segment(path, from, to, cb, cb_arg, log);
+			if (rc > 0)
+				rtc = rc;
+			free(path);
+		}
+		free(names[i]);
+	}
+	free(names);
+	return rtc;
+}
+
+static char const *dispo_name(stats_info const *info)
+{
+	return info->dmarc_dispo == 0? "none":
+		info->dmarc_dispo == 1? "quarantine": "reject";
+}
+
+static char const *dmarc_dkim_name(stats_info const *info)
+{
+	return info->dmarc_found && info->dkim_any?
+		info->dmarc_dkim? "pass": "fail": "none";
+}
+
+static char const *dmarc_spf_name(stats_info const *info)
+{
+	return info->dmarc_found && info->spf_any?
+		info->dmarc_spf? "pass": "fail": "none";
+}
+
+static char const *reason_name(stats_info const *info)
+{
+	switch (info->dmarc_reason)
+	{
+		default:
+		case dmarc_reason_none: return "none";
+		case dmarc_reason_forwarded: return "forwarded";
+		case dmarc_reason_sampled_out: return "sampled_out";
+		case dmarc_reason_trusted_forwarder: return "trusted_forwarder";
+		case dmarc_reason_mailing_list: return "mailing_list";
+		case dmarc_reason_local_policy: return "local_policy";
+		case dmarc_reason_other: return "other";
+	}
+}
+
+static int dump_msg(store_msg *msg, void *vout)
+{
+	FILE *const out = vout;
+	stats_info const *const info = &msg->info;
+
+	fprintf(out, "%ld %s %s", (long)msg->time, info->outgoing? "out": "in",
+		msg->ip? msg->ip: "-");
+	if (info->outgoing)
+		fprintf(out, " user=%s rcpt=%u",
+			msg->user? msg->user: "-", info->rcpt_count);
+	else
+	{
+		fprintf(out, " received=%u sigs=%u",
+			info->received_count, info->signatures_count);
+		if (info->dmarc_found)
+			fprintf(out, " dmarc=%s/%s/%s/%s ri=%u", dispo_name(info),
+				dmarc_dkim_name(info), dmarc_spf_name(info),
+				reason_name(info), info->dmarc_ri);
+		if (info->reject)
+			fputs(" reject", out);
+		if (info->drop)
+			fputs(" drop", out);
+	}
+
+	for (domain_prescreen const *dps = info->domain_head; dps; dps = dps->next)
+	{
+		// same tokens as the auth column of msg_ref
+		char auth[80];
+		auth[0] = 0;
+		if (dps->u.f.is_from) strcat(auth, ",author");
+		if (dps->u.f.is_helo) strcat(auth, ",spf_helo");
+		if (dps->u.f.is_mfrom) strcat(auth, ",spf");
+		if (dps->nsigs) strcat(auth, ",dkim");
+		if (dps->u.f.is_org_domain) strcat(auth, ",org");
+		if (dps->u.f.is_dmarc) strcat(auth, ",dmarc");
+		if (dps->u.f.is_aligned) strcat(auth, ",aligned");
+		if (dps->u.f.vbr_is_ok) strcat(auth, ",vbr");
+		if (dps->u.f.is_reputed) strcat(auth, ",rep");
+		if (dps->u.f.is_reputed_signer) strcat(auth, ",rep_s");
+		if (dps->u.f.is_dnswl) strcat(auth, ",dnswl");
+		if (info->outgoing)
+			fprintf(out, " %s", dps->name);
+		else
+			fprintf(out, " %s:%s/%s/%s", dps->name, auth[0]? auth + 1: "-",
+				get_spf_result(dps->spf), get_dkim_result(dps->dkim));
+	}
+	fputc('\n', out);
+	return 0;
+}
+
+int store_dump(char const *dir, time_t from, time_t to, FILE *out,
+	logfun_t log)
+/*
+* Print one line per message.
+*/
+{
+	return store_scan(dir, from, to, &dump_msg, out, log);
+}
+
+/*
+* DMARC aggregate reports
+*/
+
+typedef struct last_report
+{
+	char *domain;
+	time_t last;
+} last_report;
+
+typedef struct last_report_list
+{
+	last_report *lr;
+	size_t n;
+} last_report_list;
+
+static void free_last_report(last_report_list *list)
+{
+	for (size_t i = 0; i < list->n; ++i)
+		free(list->lr[i].domain);
+	free(list->lr);
+	memset(list, 0, sizeof *list);
+}
+
+static last_report *find_last_report(last_report_list const *list,
+	char const *domain)
+{
+	for (size_t i = 0; i < list->n; ++i)
+		if (strcasecmp(list->lr[i].domain, domain) == 0)
+			return &list->lr[i];
+	return NULL;
+}
+
+static int add_last_report(last_report_list *list, char const *domain,
+	time_t last)
+{
+	last_report *lr = find_last_report(list, domain);
+	if (lr == NULL)
+	{
+		char *const d = strdup(domain);
+		lr = realloc(list->lr, (list->n + 1) * sizeof *lr);
+		if (d == NULL || lr == NULL)
+		{
+			free(d);
+			if (lr)
+				list->lr = lr;
+			return -1;
+		}
+		list->lr = lr;
+		lr += list->n++;
+		lr->domain = d;
+	}
+	lr->last = last;
+	return 0;
+}
+
+static int read_last_report(char const *dir, last_report_list *list,
+	logfun_t log)
+/*
+* The last_report file has a line for each domain reported:  the domain
+* name and the end of the period of its last report.
+*/
+{
+	memset(list, 0, sizeof *list);
+	char *const path = dir_file(dir, STORE_LAST_REPORT);
+	if (path == NULL)
+		return -1;
+
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL)
+	{
+		int const rtc = errno == ENOENT? 0: -1;
+		if (rtc)
+			(*log)(LOG_ERR, "cannot read %s: %s", path, strerror(errno));
+		free(path);
+		return rtc;
+	}
+
+	char line[512];
+	int rtc = 0;
+	while (rtc == 0 && fgets(line, sizeof line, fp))
+	{
+		char domain[256];
+		long last;
+		if (sscanf(line, "%255s %ld", domain, &last) == 2)
+			rtc = add_last_report(list, domain, last);
+	}
+	fclose(fp);
+	free(path);
+	return rtc;
+}
+
+static int write_last_report(char const *dir, last_report_list const *list,
+	logfun_t log)
+{
+	char *const path = dir_file(dir, STORE_LAST_REPORT),
+		*const tmp = dir_file(dir, STORE_LAST_REPORT ".tmp");
+	int rtc = -1;
+	FILE *fp;
+	if (path && tmp && (fp = fopen(tmp, "w")) != NULL)
+	{
+		for (size_t i = 0; i < list->n; ++i)
+			fprintf(fp, "%s %ld\n", list->lr[i].domain, (long)list->lr[i].last);
+		if (fclose(fp) == 0 && rename(tmp, path) == 0)
+			rtc = 0;
+	}
+	if (rtc)
+		(*log)(LOG_ERR, "cannot write %s: %s",
+			path? path: STORE_LAST_REPORT, strerror(errno));
+	free(path);
+	free(tmp);
+	return rtc;
+}
+
+int store_set_dmarc_agg(char const *dir, dmarc_agg_record *dar, logfun_t log)
+/*
+* Record period_end as the last report of the domain.
+*/
+{
+	assert(dir);
+	assert(dar);
+	assert(dar->domain);
+
+	int const lock = lock_store(dir, log);
+	if (lock < 0)
+		return -1;
+
+	last_report_list list;
+	int rtc = read_last_report(dir, &list, log);
+	if (rtc == 0 &&
+		(rtc = add_last_report(&list, dar->domain, dar->period_end)) == 0)
+			rtc = write_last_report(dir, &list, log);
+	free_last_report(&list);
+	close(lock);
+	return rtc;
+}
+
+static domain_prescreen const *dmarc_domain(stats_info const *info)
+{
+	for (domain_prescreen const *dps = info->domain_head; dps; dps = dps->next)
+		if (dps->u.f.is_dmarc)
+			return dps;
+	return NULL;
+}
+
+typedef struct agg_domain
+{
+	char *domain, *rua, *record;
+	time_t last_recv;
+	uint32_t ri;
+} agg_domain;
+
+typedef struct agg_domain_list
+{
+	agg_domain *ad;
+	size_t n, alloc;
+	int bad;
+} agg_domain_list;
+
+static int agg_domain_msg(store_msg *msg, void *vlist)
+// collect the most recent DMARC values of each domain wanting reports
+{
+	agg_domain_list *const list = vlist;
+	stats_info *const info = &msg->info;
+	domain_prescreen const *dps;
+	if (info->outgoing || !info->dmarc_found || info->dmarc_ri == 0 ||
+		(dps = dmarc_domain(info)) == NULL)
+			return 0;
+
+	// sorted array
+	size_t lo = 0, hi = list->n;
+	while (lo < hi)
+	{
+		size_t const mid = (lo + hi) / 2;
+		int const c = strcasecmp(list->ad[mid].domain, dps->name);
+		if (c == 0)
+			lo = hi = mid;
+		else if (c < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	agg_domain *ad = lo < list->n? &list->ad[lo]: NULL;
+	if (ad == NULL || strcasecmp(ad->domain, dps->name) != 0)
+	{
+		if (list->n >= list->alloc)
+		{
+			ad = realloc(list->ad, (list->alloc += 64) * sizeof *ad);
+			if (ad == NULL)
+			{
+				list->bad = 1;
+				return -1;
+			}
+			list->ad = ad;
+		}
+		ad = &list->ad[lo];
+		memmove(ad + 1, ad, (list->n - lo) * sizeof *ad);
+		memset(ad, 0, sizeof *ad);
+		list->n += 1;
+		if ((ad->domain = strdup(dps->name)) == NULL)
+		{
+			list->bad = 1;
+			return -1;
+		}
+	}
+
+	if (msg->time >= ad->last_recv)
+	{
+		ad->last_recv = msg->time;
+		ad->ri = info->dmarc_ri;
+		free(ad->rua);
+		ad->rua = info->dmarc_rua;
+		info->dmarc_rua = NULL;
+		free(ad->record);
+		ad->record = info->dmarc_record;
+		info->dmarc_record = NULL;
+	}
+	return 0;
+}
+
+int store_run_dmarc_agg_domain(char const *dir, time_t period_end,
+	db_query_cb cb, void *cb_arg, logfun_t log)
+/*
+* Pass cb the same fields as db_sql_dmarc_agg_domain:  domain_ref (the
+* domain name itself), domain, last_report, dmarc_ri, dmarc_rua, dmarc_rec.
+* As in the example query, select the domains which had messages in the
+* last 24 hours, after their last report, and whose report is due.
+*/
+{
+	assert(dir);
+	assert(cb);
+
+	last_report_list reported;
+	if (read_last_report(dir, &reported, log))
+		return -1;
+
+	agg_domain_list list;
+	memset(&list, 0, sizeof list);
+	int rtc = store_scan(dir, period_end - 86400, period_end,
+		&agg_domain_msg, &list, log);
+	if (list.bad)
+		(*log)(LOG_ALERT, "MEMORY FAULT");
+	if (rtc == 0)
+		for (size_t i = 0; i < list.n; ++i)
+		{
+			agg_domain const *const ad = &list.ad[i];
+			last_report const *const lr = find_last_report(&reported, ad->domain);
+			time_t const last = lr? lr->last: 0;
+			if (last > period_end - (time_t)ad->ri || ad->last_recv <= last)
+				continue;
+
+			char last_buf[32], ri_buf[32];
+			sprintf(last_buf, "%ld", (long)last);
+			sprintf(ri_buf, "%u", ad->ri);
+			char const *field[6] =
+				{ad->domain, ad->domain, last_buf, ri_buf, ad->rua, ad->record};
+			if ((*cb)(6, field, cb_arg))
+				break;
+		}
+
+	for (size_t i = 0; i < list.n; ++i)
+	{
+		free(list.ad[i].domain);
+		free(list.ad[i].rua);
+		free(list.ad[i].record);
+	}
+	free(list.ad);
+	free_last_report(&reported);
+	return rtc;
+}
+
+#define KEY_SEP '\x1f'
+#define KEY_NULL '\x1e'
+
+typedef struct agg_rows
+{
+	char const *domain;
+	char **key;
+	size_t n, alloc;
+	int bad;
+} agg_rows;
+
+static void key_add(st_buf *b, char const *s)
+{
+	size_t const len = s? strlen(s): 1;
+	unsigned char *const p = st_room(b, len + 1);
+	if (p)
+	{
+		if (s)
+			memcpy(p, s, len);
+		else
+			p[0] = KEY_NULL;
+		p[len] = KEY_SEP;
+	}
+}
+
+static int cmp_dkim_order(void const *a, void const *b)
+{
+	domain_prescreen const *const da = *(domain_prescreen const *const*)a,
+		*const db = *(domain_prescreen const *const*)b;
+	return (da->dkim_order > db->dkim_order) - (da->dkim_order < db->dkim_order);
+}
+
+static int agg_record_msg(store_msg *msg, void *vrows)
+/*
+* Make a key of the fields of db_sql_dmarc_agg_record, but count, for each
+* message whose DMARC domain is the one being reported.
+*/
+{
+	agg_rows *const rows = vrows;
+	stats_info const *const info = &msg->info;
+	domain_prescreen const *dps;
+	if (info->outgoing || (dps = dmarc_domain(info)) == NULL ||
+		strcasecmp(dps->name, rows->domain) != 0)
+			return 0;
+
+	domain_prescreen const *author = NULL, *mfrom = NULL, *helo = NULL;
+	domain_prescreen const *dkim[16];
+	size_t ndkim = 0;
+	for (dps = info->domain_head; dps; dps = dps->next)
+	{
+		if (dps->u.f.is_from && author == NULL)
+			author = dps;
+		if (dps->u.f.is_mfrom && mfrom == NULL)
+			mfrom = dps;
+		if (dps->u.f.is_helo && helo == NULL)
+			helo = dps;
+		if (dps->dkim_order && ndkim < sizeof dkim/sizeof dkim[0])
+			dkim[ndkim++] = dps;
+	}
+	if (ndkim > 1)
+		qsort(dkim, ndkim, sizeof dkim[0], cmp_dkim_order);
+
+	st_buf b;
+	memset(&b, 0, sizeof b);
+	key_add(&b, msg->ip);
+	key_add(&b, dispo_name(info));
+	key_add(&b, dmarc_dkim_name(info));
+	key_add(&b, dmarc_spf_name(info));
+	key_add(&b, reason_name(info));
+	key_add(&b, author? author->name: NULL);
+	key_add(&b, mfrom? mfrom->name: NULL);
+	key_add(&b, mfrom? get_spf_result(mfrom->spf): NULL);
+	key_add(&b, helo? helo->name: NULL);
+	key_add(&b, helo? get_spf_result(helo->spf): NULL);
+	for (size_t i = 0; i < ndkim; ++i)
+	{
+		key_add(&b, dkim[i]->name);
+		key_add(&b, get_dkim_result(dkim[i]->dkim));
+	}
+
+	unsigned char *const end = st_room(&b, 1);
+	if (end)
+		end[-1] = 0; // replace the last separator
+	if (rows->n >= rows->alloc)
+	{
+		char **const key = realloc(rows->key, (rows->alloc += 256) * sizeof *key);
+		if (key == NULL)
+			b.bad = 1;
+		else
+			rows->key = key;
+	}
+	if (b.bad)
+	{
+		free(b.p);
+		rows->bad = 1;
+		return -1;
+	}
+
+	rows->key[rows->n++] = (char*)b.p;
+	return 0;
+}
+
+static int cmp_key(void const *a, void const *b)
+{
+	return strcmp(*(char *const*)a, *(char *const*)b);
+}
+
+int store_run_dmarc_agg_record(char const *dir, dmarc_agg_record *dar,
+	db_query_cb cb, void *cb_arg, logfun_t log)
+/*
+* Pass cb the rows of db_sql_dmarc_agg_record:  ip, count, dispo, dmarc_dkim,
+* dmarc_spf, reason, author domain, spf domain and result, helo domain and
+* result, and pairs of dkim domain and result, in signature order.
+*/
+{
+	assert(dir);
+	assert(dar);
+	assert(dar->domain);
+	assert(cb);
+
+	agg_rows rows;
+	memset(&rows, 0, sizeof rows);
+	rows.domain = dar->domain;
+	int rtc = store_scan(dir, dar->period_start, dar->period_end,
+		&agg_record_msg, &rows, log);
+	if (rows.bad)
+	{
+		(*log)(LOG_ALERT, "MEMORY FAULT");
+		rtc = -1;
+	}
+
+	if (rows.n)
+		qsort(rows.key, rows.n, sizeof rows.key[0], cmp_key);
+
+	for (size_t i = 0; rtc == 0 && i < rows.n;)
+	{
+		size_t j = i + 1;
+		while (j < rows.n && strcmp(rows.key[i], rows.key[j]) == 0)
+			++j;
+
+		char count[32];
+		sprintf(count, "%zu", j - i);
+
+		char const *field[11 + 2*16];
+		int nfield = 0;
+		for (char *p = rows.key[i]; p && nfield < (int)(sizeof field/sizeof field[0]);)
+		{
+			char *const sep = strchr(p, KEY_SEP);
+			if (sep)
+				*sep = 0;
+			field[nfield++] = p[0] == KEY_NULL? NULL: p;
+			if (nfield == 1)
+				field[nfield++] = count;
+			p = sep? sep + 1: NULL;
+		}
+
+		if ((*cb)(nfield, field, cb_arg))
+			break;
+
+		i = j;
+	}
+
+	for (size_t i = 0; i < rows.n; ++i)
+		free(rows.key[i]);
+	free(rows.key);
+	return rtc;
+}
+
+#if STORE_TEST_MAIN
+static void printlog(int severity, char const *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	putchar('\n');
+	(void)severity;
+}
+
+static domain_prescreen *test_domain(char const *name, char const *auth,
+	spf_result spf, dkim_result dkim, size_t dkim_order,
+	domain_prescreen *next)
+{
+	domain_prescreen *const dps = calloc(1, sizeof *dps + strlen(name) + 1);
+	strcpy(dps->name, name);
+	dps->u.f.is_from = strstr(auth, "author") != NULL;
+	dps->u.f.is_dmarc = strstr(auth, "dmarc") != NULL;
+	dps->u.f.is_aligned = strstr(auth, "aligned") != NULL;
+	dps->u.f.is_mfrom = strstr(auth, "mfrom") != NULL;
+	dps->u.f.is_helo = strstr(auth, "helo") != NULL;
+	dps->u.f.spf_pass = spf == spf_pass;
+	dps->u.f.sig_is_ok = dkim == dkim_pass;
+	dps->nsigs = dkim_order > 0;
+	dps->dkim_order = dkim_order;
+	dps->spf = spf;
+	dps->dkim = dkim;
+	dps->next = next;
+	return dps;
+}
+
+static void test_free(domain_prescreen *dps)
+{
+	while (dps)
+	{
+		domain_prescreen *const next = dps->next;
+		free(dps);
+		dps = next;
+	}
+}
+
+static void test_in(char const *dir, char const *ip, int dkim_ok, int dispo)
+{
+	stats_info info;
+	memset(&info, 0, sizeof info);
+	info.ino_mtime_pid = "1A2B.5E2F3C4D.3039";
+	info.received_count = 2;
+	info.signatures_count = 1;
+	info.scope = save_unauthenticated_from;
+	info.dkim_any = info.spf_any = 1;
+	info.dmarc_found = 1;
+	info.dmarc_dkim = dkim_ok;
+	info.dmarc_spf = 1;
+	info.dmarc_dispo = dispo;
+	info.dmarc_ri = 86400;
+	info.dmarc_rua = "mailto:dmarc@example.com";
+	info.dmarc_record = "adkim=r; aspf=r; p=none; pct=100";
+	info.domain_head = test_domain("example.com", "author,dmarc,aligned",
+		spf_none, dkim_ok? dkim_pass: dkim_fail, 1,
+		test_domain("bounce.example.com", "mfrom",
+			spf_pass, dkim_none, 0,
+		test_domain("unauthenticated.example", "helo",
+			spf_none, dkim_none, 0, NULL)));
+	store_append(dir, 3600, &info, ip, NULL, &printlog);
+	test_free(info.domain_head);
+}
+
+static void test_out(char const *dir)
+{
+	stats_info info;
+	memset(&info, 0, sizeof info);
+	info.outgoing = 1;
+	info.rcpt_count = 3;
+	info.domain_head = test_domain("a.example", "", spf_none, dkim_none, 0,
+		test_domain("b.example", "", spf_none, dkim_none, 0, NULL));
+	store_append(dir, 3600, &info, "192.0.2.25", "user@example.org", &printlog);
+	test_free(info.domain_head);
+}
+
+static int print_fields(int nfield, char const *field[], void *arg)
+{
+	fputs((char const*)arg, stdout);
+	for (int i = 0; i < nfield; ++i)
+		printf(" %s", field[i]? field[i]: "NULL");
+	putchar('\n');
+	return 0;
+}
+
+static int print_records(int nfield, char const *field[], void *arg)
+{
+	print_fields(nfield, field, "domain:");
+
+	dmarc_agg_record dar;
+	memset(&dar, 0, sizeof dar);
+	dar.domain = field[1];
+	dar.period_end = *(time_t*)arg;
+	dar.period_start = dar.period_end - 86400;
+	store_run_dmarc_agg_record(".", &dar, &print_fields, "row:", &printlog);
+	store_set_dmarc_agg(".", &dar, &printlog);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2 || chdir(argv[1]))
+	{
+		printf("Usage:\n\t%s empty-directory\n", argv[0]);
+		return 1;
+	}
+
+	store_init(&printlog);
+	time_t const day = 1000080000; // a multiple of 86400
+
+	// two children write in the same segment, sharing the dictionary
+	for (int i = 0; i < 2; ++i)
+	{
+		pid_t const pid = fork();
+		if (pid == 0)
+		{
+			test_time = day + 600 + 10*i;
+			test_in(".", "192.0.2.1", 1, 0);
+			test_time += 1;
+			test_in(".", i? "2001:db8::1": "192.0.2.1", i == 0, i);
+			_exit(0);
+		}
+		waitpid(pid, NULL, 0);
+	}
+
+	test_time = day + 3600 + 5;
+	test_out(".");
+	test_in(".", "192.0.2.1", 1, 0);
+	store_report(".", &printlog);
+
+	// forget the dictionary, it is reloaded from the segment
+	munmap(cache, sizeof *cache);
+	cache = NULL;
+	store_init(&printlog);
+	test_time += 1;
+	test_in(".", "192.0.2.1", 1, 0);
+	store_report(".", &printlog);
+
+	store_dump(".", 0, day + 86400, stdout, &printlog);
+	time_t period_end = day + 7200;
+	store_run_dmarc_agg_domain(".", period_end, &print_records, &period_end,
+		&printlog);
+	store_run_dmarc_agg_domain(".", period_end, &print_fields, "again:",
+		&printlog);
+	return 0;
+}
+#endif // STORE_TEST_MAIN
@@ -0,0 +1,45 @@
+/*
+** store.h - written in milano by vesely on 19oct2026
+** append-only segment files of stats, for hosts without a database
+*/
+
+#if !defined STORE_H_INCLUDED
+#include <stdio.h>
+#include <time.h>
+
+#include "database.h"
+#include "parm.h"
+
+#define STORE_DEFAULT_SEGMENT 3600
+
+// filter
+int store_init(logfun_t log);
+int store_append(char const *dir, int segment, stats_info const *info,
+	char const *ip, char const *user, logfun_t log);
+void store_report(char const *dir, logfun_t log);
+
+// readers
+typedef struct store_msg
+{
+	time_t time;       // when it was appended
+	char const *ip;    // NULL if not known
+	char const *user;  // outgoing only, NULL if not known
+	stats_info info;   // malloc'ed strings and domains, can be picked
+} store_msg;
+typedef int (*store_msg_cb)(store_msg*, void*);
+
+int store_scan(char const *dir, time_t from, time_t to,
+	store_msg_cb cb, void *cb_arg, logfun_t log);
+int store_dump(char const *dir, time_t from, time_t to, FILE *out,
+	logfun_t log);
+
+// zaggregate
+int store_run_dmarc_agg_domain(char const *dir, time_t period_end,
+	db_query_cb cb, void *cb_arg, logfun_t log);
+int store_run_dmarc_agg_record(char const *dir, dmarc_agg_record *dar,
+	db_query_cb cb, void *cb_arg, logfun_t log);
+int store_set_dmarc_agg(char const *dir, dmarc_agg_record *dar,
+	logfun_t log);
+
+#define STORE_H_INCLUDED
+#endif
@@ -39,6 +39,7 @@ the resulting work.
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <sys/types.h>
 #include "util.h"
 #include <assert.h>
 
@@ -83,8 +84,9 @@ char *skip_comment(char const *s)
 					return (char*)s;
 				break;
 
-			case '\\': // quoted pair, backslash cannot be last char
-				++s;    // since there must be a newline anyway
+			case '\\': // quoted pair
+				if (*++s == 0)
+					return NULL;
 				break;
 
 			default:
@@ -116,13 +118,697 @@ char *skip_cfws(char const *s)
 	return (char*)s;
 }
 
+static char const *a_r_scan(char const *p, int joint, a_r_span *sp, int *delim)
+/*
+* Find the next token starting at p, set its span and the delimiter that
+* ends it: ';', '=', ' ', or 0 at the end of the string.  Return the point
+* where to continue scanning, NULL on unterminated quote, escape or comment.
+*/
+{
+	assert(p && sp && delim);
+
+	if ((p = skip_cfws(p)) == NULL)
+		return NULL;
+
+	char const *const start = p, *end = NULL;
+	int quot = 0, escape = 0, plain = 1, ch;
+
+	while ((ch = *(unsigned char const*)p++) != 0)
+	{
+		if (escape)
+		{
+			escape = 0;
+			continue;
+		}
+
+		if (quot)
+		{
+			if (ch == '\\')
+				escape = 1;
+			else if (ch == '"')
+				quot = 0;
+			continue;
+		}
+
+		switch (ch)
+		{
+			case '\\':
+				escape = 1;
+				plain = 0;
+				continue;
+
+			case '"':
+				quot = 1;
+				plain = 0;
+				continue;
+
+			case '(':
+				if ((p = skip_comment(p - 1)) == NULL)
+					return NULL;
+				assert(*p == ')');
+				++p;
+				plain = 0;
+				continue;
+
+			case ';':
+			case '=':
+				end = p - 1;
+				break;
+
+			default:
+				if (!isspace(ch))
+					continue;
+				{
+					char const *next = skip_cfws(p);
+					int const ch2 = next? *(unsigned char const*)next: 0;
+
+					/*
+					* If a joint is admitted, CFWS can be placed around it
+					*/
+					if (joint && ch2 == joint &&
+						(next = skip_cfws(next + 1)) != NULL)
+					{
+						p = next;
+						plain = 0;
+						continue;
+					}
+
+					/*
+					* If the next value is a delimiter, use it.
+					* Otherwise space or zero is the delimiter.
+					*/
+					end = p - 1;
+					if (ch2 == ';' || ch2 == '=')
+					{
+						ch = ch2;
+						p = next + 1;
+					}
+					else
+						ch = ch2? ' ': 0;
+				}
+				break;
+		}
+		break;
+	}
+
+	if (escape || quot)
+		return NULL;
+
+	if (end == NULL) // at the terminating 0
+		end = p - 1;
+
+	sp->p = start;
+	sp->len = end - start;
+	sp->plain = plain;
+	*delim = ch;
+	return p;
+}
+
+static int span_char(char const **pp, char const *e, int *quot)
+// next character of a non-plain span, -1 at the end
+{
+	char const *p = *pp;
+	int ch = -1;
+	while (p < e)
+	{
+		ch = *(unsigned char const*)p++;
+		if (ch == '\\')
+			ch = *(unsigned char const*)p++;
+		else if (ch == '"')
+		{
+			*quot = !*quot;
+			ch = -1;
+			continue;
+		}
+		else if (*quot == 0 && (ch == '(' || isspace(ch)))
+		{
+			if (ch == '(')
+				p = skip_comment(p - 1) + 1;
+			ch = -1;
+			continue;
+		}
+		break;
+	}
+	*pp = p;
+	return ch;
+}
+
+int a_r_span_is(a_r_span const *sp, char const *s)
+// case insensitive comparison, return 1 if equal
+{
+	assert(sp && s);
+
+	if (sp->p == NULL)
+		return 0;
+
+	if (sp->plain)
+		return strincmp(sp->p, s, sp->len) == 0 && s[sp->len] == 0;
+
+	char const *p = sp->p, *const e = p + sp->len;
+	int quot = 0, ch;
+	while ((ch = span_char(&p, e, &quot)) >= 0)
+	{
+		int const d = *(unsigned char const*)s++;
+		if (d == 0 || (ch != d && tolower(ch) != tolower(d)))
+			return 0;
+	}
+	return *s == 0;
+}
+
+size_t a_r_span_copy(a_r_span const *sp, char *buf, size_t size)
+/*
+* Copy the token to buf, unquoted, 0-terminated, truncated if needed.
+* Return the length of the token, which is >= size if truncated.
+*/
+{
+	assert(sp && buf && size > 0);
+
+	size_t n = 0;
+	if (sp->p == NULL)
+		;
+	else if (sp->plain)
+	{
+		n = sp->len;
+		memcpy(buf, sp->p, n < size? n: size - 1);
+	}
+	else
+	{
+		char const *p = sp->p, *const e = p + sp->len;
+		int quot = 0, ch;
+		while ((ch = span_char(&p, e, &quot)) >= 0)
+		{
+			if (n + 1 < size)
+				buf[n] = ch;
+			++n;
+		}
+	}
+
+	buf[n < size? n: size - 1] = 0;
+	return n;
+}
+
+int
+a_r_parse(char const *a_r, int (*cb)(void*, int, name_val*, size_t), void *cbv)
+/*
+* Parse a_r, which should start with the authserv-id, and call back cb with
+* arguments:
+*
+* 1 (void*) the cbv given on entry,
+* 2 (int) -1 for authserv-id, 0, 1, ... for "resinfo" stanzas, rtc for last call
+* 3 (name_val*) an array of name=value pairs, and
+* 4 (size_t) the number of elements in the array.
+*
+* The value is null for authserv-id.  The array itself is null on the last call.
+* Spans point into a_r, which is neither copied nor modified.
+*/
+{
+	assert(a_r);
+	assert(cb);
+
+	name_val resinfo[16];
+	int rtc = 0;
+
+	enum a_r_state {
+		a_r_server,
+		a_r_method,
+		a_r_name,
+		a_r_value
+	} state = a_r_server;
+
+	// it just happens that the elements that expect an '=' have a joint
+	// to be considered.
+	static const int joint[] = {
+		'/', // a_r_server,
+		'/', // a_r_method,
+		'.', // a_r_name,
+		'@'  //a_r_value
+	};
+
+	int count = 0, delim = 0;
+	size_t n = 0;
+	char const *p = a_r;
+
+	do
+	{
+		a_r_span r;
+		if ((p = a_r_scan(p, joint[state], &r, &delim)) == NULL)
+		{
+			rtc = -1;
+			break;
+		}
+
+		switch(state)
+		{
+			case a_r_server:
+				if (delim == ';')
+				{
+					resinfo[0].name = r;
+					memset(&resinfo[0].value, 0, sizeof resinfo[0].value);
+					rtc = (*cb)(cbv, -1, resinfo, 1);
+					state = a_r_method;
+				}
+				break;
+
+			case a_r_method:
+				n = 0;
+				if (count == 0 && a_r_span_is(&r, "none"))
+					break;
+
+				/* else thru */
+
+			case a_r_name:
+				resinfo[n].name = r;
+				state = a_r_value;
+				if (delim != '=')
+					rtc = -2;
+				break;
+
+			case a_r_value:
+				resinfo[n].value = r;
+				++n;
+
+				if (delim == ' ')
+					state = a_r_name;
+
+				else if (delim == ';' || delim == 0)
+				{
+					state = a_r_method;
+					rtc = (*cb)(cbv, count, resinfo, n);
+					++count;
+				}
+				else
+					rtc = -3;
+				break;
+
+			default:
+				assert(0);
+				break;
+		}
+	} while (rtc == 0 && delim != 0 &&
+		n < sizeof resinfo / sizeof resinfo[0]);
+
+	if (rtc == 0 && delim != 0) rtc = -4;
+	rtc = (*cb)(cbv, rtc, NULL, 0); // last call
+
+	return rtc;
+}
+
+/*
+* header block scanner:  read the whole header into a contiguous buffer,
+* and index its fields in one pass.  Offsets refer to hb->buf.
+*/
+#define HDR_CHUNK 1024
+#define HDR_FIELD_ALLOC 64
+#define HDR_FIELD_MAX 5000 // a field with its continuation lines, as VB_LINE_MAX
+#define HDR_MAX (1024*1024)
+
+void hdr_block_clean(hdr_block *hb)
+{
+	assert(hb);
+	free(hb->buf);
+	free(hb->field);
+	free(hb->crlf);
+	memset(hb, 0, sizeof *hb);
+}
+
+static int hdr_scan(hdr_block *hb, size_t have, int eof)
+/*
+* Scan complete lines from hb->scan up to have.  A line is complete when
+* the character after its \n is known, since a following space or tab
+* folds it.  Return 1 at the end of the header, 0 if more data is needed,
+* -1 on memory fault, -2 if the last line is unterminated at eof, -3 if a
+* field is longer than HDR_FIELD_MAX.
+*/
+{
+	char *const buf = hb->buf;
+	size_t pos = hb->scan;
+
+	while (pos < have)
+	{
+		hdr_field *f;
+		if (hb->open)
+			f = &hb->field[hb->nfields - 1];
+		else
+		{
+			if (buf[pos] == '\n') // empty line
+			{
+				hb->len = pos + 1;
+				return 1;
+			}
+
+			if (hb->nfields >= hb->field_alloc)
+			{
+				size_t const n = hb->field_alloc? 2*hb->field_alloc: HDR_FIELD_ALLOC;
+				hdr_field *const nf = realloc(hb->field, n * sizeof *nf);
+				if (nf == NULL)
+					return -1;
+				hb->field = nf;
+				hb->field_alloc = n;
+			}
+			f = &hb->field[hb->nfields++];
+			f->start = pos;
+			f->colon = f->end = 0;
+			f->folds = 0;
+			hb->open = 1;
+		}
+
+		char const *const nl = memchr(buf + pos, '\n', have - pos);
+		if (nl == NULL)
+			break;
+
+		size_t const eol = nl - buf;
+		if (eol + 1 >= have && !eof)
+			break;
+
+		if (f->colon == 0 && pos == f->start)
+		{
+			char const *const colon = memchr(buf + pos, ':', eol - pos);
+			f->colon = colon? (size_t)(colon - buf): eol;
+		}
+
+		pos = eol + 1;
+		if (pos < have && buf[pos] != '\n' &&
+			isspace(*(unsigned char*)&buf[pos])) // folded
+		{
+			f->folds += 1;
+			continue;
+		}
+
+		if (eol - f->start > HDR_FIELD_MAX)
+			return -3;
+
+		f->end = eol;
+		hb->open = 0;
+	}
+
+	hb->scan = pos;
+	if (hb->open && have - hb->field[hb->nfields - 1].start > HDR_FIELD_MAX)
+		return -3;
+
+	if (!eof)
+		return 0;
+
+	if (hb->open || have == 0)
+		return -2;
+
+	hb->len = have; // no body
+	return 1;
+}
+
+int hdr_block_read(hdr_block *hb, FILE *fp)
+/*
+* Read the header from the current position of fp, and leave fp at the
+* start of the body.  Return 0 on success, -1 on memory or I/O error,
+* -2 if the header is empty or its last line unterminated, -3 if the header
+* is longer than HDR_MAX or has a field longer than HDR_FIELD_MAX.
+*/
+{
+	assert(hb && fp);
+
+	off_t const origin = ftello(fp);
+	size_t have = 0;
+	int rtc = 0;
+
+	hb->len = hb->scan = hb->nfields = 0;
+	hb->open = 0;
+	while (rtc == 0)
+	{
+		if (have >= HDR_MAX)
+			return -3;
+
+		if (hb->alloc < have + HDR_CHUNK + 1)
+		{
+			size_t const n = hb->alloc? 2*hb->alloc: 2*HDR_CHUNK;
+			char *const nb = realloc(hb->buf, n);
+			if (nb == NULL)
+				return -1;
+			hb->buf = nb;
+			hb->alloc = n;
+		}
+
+		size_t const in = fread(hb->buf + have, 1, HDR_CHUNK, fp);
+		have += in;
+		hb->buf[have] = 0;
+		if (in < HDR_CHUNK && ferror(fp))
+			return -1;
+
+		rtc = hdr_scan(hb, have, in < HDR_CHUNK);
+	}
+
+	if (rtc < 0)
+		return rtc;
+
+	if (hb->len < have)
+	{
+		if (origin < 0 || fseeko(fp, origin + (off_t)hb->len, SEEK_SET))
+			return -1;
+		hb->buf[hb->len] = 0;
+	}
+
+	return 0;
+}
+
+char *hdr_field_crlf(hdr_block *hb, size_t i, size_t *len)
+/*
+* Copy field i in a buffer owned by hb, with folding newlines turned
+* into CRLF, trailing \n and 0-terminated.  Set *len to the length not
+* counting the trailing \n.  Return NULL on memory fault.
+*/
+{
+	assert(hb && i < hb->nfields && len);
+
+	hdr_field const *const f = &hb->field[i];
+	size_t const need = f->end - f->start + f->folds + 2;
+	if (hb->crlf_alloc < need)
+	{
+		size_t n = hb->crlf_alloc? hb->crlf_alloc: 1024;
+		while (n < need)
+			n *= 2;
+		char *const nb = realloc(hb->crlf, n);
+		if (nb == NULL)
+			return NULL;
+		hb->crlf = nb;
+		hb->crlf_alloc = n;
+	}
+
+	char const *s = hb->buf + f->start;
+	char *d = hb->crlf;
+	size_t folds = f->folds;
+	if (folds == 0)
+	{
+		memcpy(d, s, need - 1);
+		d += need - 1;
+	}
+	else
+	{
+		char const *const end = hb->buf + f->end;
+		while (folds > 0)
+		{
+			char const *const nl = memchr(s, '\n', end - s);
+			assert(nl);
+			memcpy(d, s, nl - s);
+			d += nl - s;
+			*d++ = '\r';
+			*d++ = '\n';
+			s = nl + 1;
+			--folds;
+		}
+		memcpy(d, s, end + 1 - s);
+		d += end + 1 - s;
+	}
+
+	*d = 0;
+	*len = d - hb->crlf - 1;
+	return hb->crlf;
+}
+
+/*
+* field name map:  open addressing, hashed on length and case-folded
+* first and last characters, which tell most field names apart.
+*/
+struct hfield_map
+{
+	size_t mask;
+	hfield_entry entry[];
+};
+
+static hfield_entry const hfield_builtin[] =
+{
+	{"Authentication-Results", 22, hf_authentication_results, 0},
+	{"Old-Authentication-Results", 26, hf_old_authentication_results, 0},
+	{"Received", 8, hf_received, 0},
+	{"Received-SPF", 12, hf_received_spf, 0},
+	{"VBR-Info", 8, hf_vbr_info, 0},
+	{"DKIM-Signature", 14, hf_dkim_signature, 0},
+	{"From", 4, hf_from, 0},
+	{"To", 2, hf_to, 0},
+	{"Reply-To", 8, hf_reply_to, 0},
+	{"Cc", 2, hf_cc, 0},
+	{"Subject", 7, hf_subject, 0},
+	{"Date", 4, hf_date, 0},
+	{"Message-Id", 10, hf_message_id, 0},
+	{"Content-Type", 12, hf_content_type, 0},
+	{"Content-Transfer-Encoding", 25, hf_content_transfer_encoding, 0},
+	{"Precedence", 10, hf_precedence, 0},
+	{"List-Id", 7, hf_list_id, 0},
+	{"List-Post", 9, hf_list_post, 0},
+	{"List-Unsubscribe", 16, hf_list_unsubscribe, 0},
+	{"Mailing-List", 12, hf_mailing_list, 0}
+};
+#define HFIELD_BUILTIN (sizeof hfield_builtin / sizeof hfield_builtin[0])
+
+static hfield_entry const hfield_none = {NULL, 0, hf_other, 0};
+
+static inline size_t hfield_hash(char const *name, size_t len)
+{
+	return len * 31 + tolower(*(unsigned char const*)name) * 7 +
+		tolower(((unsigned char const*)name)[len - 1]);
+}
+
+static hfield_entry *hfield_slot(hfield_map const *map,
+	char const *name, size_t len)
+{
+	size_t i = hfield_hash(name, len);
+	for (;; ++i)
+	{
+		hfield_entry *const e = (hfield_entry*)&map->entry[i & map->mask];
+		if (e->name == NULL ||
+			(e->len == len && strincmp(e->name, name, len) == 0))
+				return e;
+	}
+}
+
+hfield_map *hfield_map_new(size_t extra)
+// room for the built-in names plus extra configured ones, load <= 1/4
+{
+	size_t n = 64;
+	while (n < 4 * (HFIELD_BUILTIN + extra))
+		n *= 2;
+
+	hfield_map *const map = calloc(1, sizeof *map + n * sizeof map->entry[0]);
+	if (map)
+	{
+		map->mask = n - 1;
+		for (size_t i = 0; i < HFIELD_BUILTIN; ++i)
+			*hfield_slot(map, hfield_builtin[i].name, hfield_builtin[i].len) =
+				hfield_builtin[i];
+	}
+	return map;
+}
+
+int hfield_map_add(hfield_map *map, char const *name, unsigned flags)
+// add flags to name; return -1 if the map is full or the name too long
+{
+	assert(map && name);
+
+	size_t const len = strlen(name);
+	if (len == 0 || len > 998)
+		return -1;
+
+	hfield_entry *const e = hfield_slot(map, name, len);
+	if (e->name == NULL)
+	{
+		size_t used = 0;
+		for (size_t i = 0; i <= map->mask; ++i)
+			if (map->entry[i].name)
+				++used;
+		if (2 * (used + 1) > map->mask)
+			return -1;
+
+		e->name = name;
+		e->len = len;
+		e->id = hf_other;
+	}
+	e->flags |= flags;
+	return 0;
+}
+
+void hfield_map_free(hfield_map *map)
+{
+	free(map);
+}
+
+hfield_entry const *hfield_lookup(hfield_map const *map,
+	char const *name, size_t len)
+// name need not be 0-terminated, trailing spaces are ignored
+{
+	while (len > 0 && isspace(((unsigned char const*)name)[len - 1]))
+		--len;
+	if (map == NULL || len == 0)
+		return &hfield_none;
+
+	hfield_entry const *const e = hfield_slot(map, name, len);
+	return e->name? e: &hfield_none;
+}
+
+hfield_entry const *hdr_field_lookup(hfield_map const *map,
+	hdr_block const *hb, size_t i)
+{
+	assert(hb && i < hb->nfields);
+
+	hdr_field const *const f = &hb->field[i];
+	if (f->colon >= f->end)
+		return &hfield_none;
+
+	return hfield_lookup(map, hb->buf + f->start, f->colon - f->start);
+}
+
+#if defined TEST_MAIN
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <time.h>
+
+static int verbose = 0;
+
+static int my_cb(void *v, int step, name_val* nv, size_t nv_count)
+{
+	FILE *fp = v? v: stdout;
+
+	if (verbose)
+		fprintf(fp, "%3zu value%s at %d\n", nv_count, nv_count > 1? "s": "", step);
+
+	if (nv == NULL)
+		return step;
+
+	char name[1024], value[1024];
+	if (step < 0)
+	{
+		a_r_span_copy(&nv[0].name, name, sizeof name);
+		fprintf(fp, "%s;\n", name);
+	}
+	else
+	{
+		for (size_t i = 0; i < nv_count; ++i)
+		{
+			a_r_span_copy(&nv[i].name, name, sizeof name);
+			a_r_span_copy(&nv[i].value, value, sizeof value);
+			fprintf(fp, " %s=%s", name, value);
+		}
+		fputc('\n', fp);
+	}
+
+	return 0;
+}
+
+/*
+* The former tokenizer, which copied the field and wrote 0-terminated
+* tokens in place, kept as a reference for corpus, fuzz and throughput.
+*/
+typedef struct legacy_nv
+{
+	char const *name;
+	char const *value;
+} legacy_nv;
+
 typedef struct token
 {
 	char *p, *q;
 	int end_delimiter;
 } token;
 
-static char* a_r_scan(token *tok, int joint)
+static char* legacy_a_r_scan(token *tok, int joint)
 /*
 * Tokenize the string as a sequence of 0-terminated words and return the type.
 * On first call, p points to the input string to be parsed and q == NULL.
@@ -238,8 +924,9 @@ static char* a_r_scan(token *tok, int joint)
 	return entry;
 }
 
-int
-a_r_parse(char const *a_r, int (*cb)(void*, int, name_val*, size_t), void *cbv)
+static int
+legacy_a_r_parse(char const *a_r, int (*cb)(void*, int, legacy_nv*, size_t),
+	void *cbv)
 /*
 * Parse a_r, which should start with the authserv-id, and call back cb with
 * arguments:
@@ -256,7 +943,7 @@ a_r_parse(char const *a_r, int (*cb)(void*, int, name_val*, size_t), void *cbv)
 	assert(cb);
 
 	char *s = strdup(a_r);
-	name_val resinfo[16];
+	legacy_nv resinfo[16];
 	int rtc = 0;
 
 	if (s == NULL) return -1;
@@ -285,7 +972,7 @@ a_r_parse(char const *a_r, int (*cb)(void*, int, name_val*, size_t), void *cbv)
 
 	do
 	{
-		char *r = a_r_scan(&tok, joint[state]);
+		char *r = legacy_a_r_scan(&tok, joint[state]);
 		if (r == NULL)
 		{
 			rtc = -1;
@@ -349,40 +1036,408 @@ a_r_parse(char const *a_r, int (*cb)(void*, int, name_val*, size_t), void *cbv)
 	return rtc;
 }
 
-#if defined TEST_MAIN
-#include <stdio.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <unistd.h>
-
-static int verbose = 0;
-
-static int my_cb(void *v, int step, name_val* nv, size_t nv_count)
+static int legacy_cb(void *v, int step, legacy_nv* nv, size_t nv_count)
 {
-	assert(v == NULL);
+	FILE *fp = v;
 
 	if (verbose)
-		printf("%3zu value%s at %d\n", nv_count, nv_count > 1? "s": "", step);
+		fprintf(fp, "%3zu value%s at %d\n", nv_count, nv_count > 1? "s": "", step);
 
 	if (nv == NULL)
 		return step;
 
 	if (step < 0)
-		printf("%s;\n", nv[0].name);
+		fprintf(fp, "%s;\n", nv[0].name);
 	else
 	{
 		for (size_t i = 0; i < nv_count; ++i)
-			printf(" %s=%s", nv[i].name, nv[i].value);
-		putchar('\n');
+			fprintf(fp, " %s=%s", nv[i].name, nv[i].value);
+		fputc('\n', fp);
+	}
+
+	return 0;
+}
+
+static int null_cb(void *v, int step, name_val* nv, size_t nv_count)
+// what a reader does: look at the tokens
+{
+	size_t *sum = v;
+	if (nv)
+		for (size_t i = 0; i < nv_count; ++i)
+			*sum += 1 + a_r_span_is(&nv[i].value, "pass");
+	return nv? 0: step;
+}
+
+static int null_legacy_cb(void *v, int step, legacy_nv* nv, size_t nv_count)
+{
+	size_t *sum = v;
+	if (nv)
+		for (size_t i = 0; i < nv_count; ++i)
+			*sum += 1 + (nv[i].value && stricmp(nv[i].value, "pass") == 0);
+	return nv? 0: step;
+}
+
+typedef struct corpus
+{
+	char **line;
+	size_t count;
+	size_t bytes;
+} corpus;
+
+static void corpus_free(corpus *c)
+{
+	for (size_t i = 0; i < c->count; ++i)
+		free(c->line[i]);
+	free(c->line);
+}
+
+static int corpus_read(char const *fname, corpus *c)
+// one A-R per line, empty lines and lines starting with '#' are skipped
+{
+	memset(c, 0, sizeof *c);
+	FILE *fp = fopen(fname, "r");
+	if (fp == NULL)
+	{
+		perror(fname);
+		return -1;
+	}
+
+	char buf[4096];
+	size_t alloc = 0;
+	int rtc = 0;
+	while (fgets(buf, sizeof buf, fp))
+	{
+		char *eol = strchr(buf, '\n');
+		if (eol)
+			*eol = 0;
+		if (buf[0] == 0 || buf[0] == '#')
+			continue;
+
+		if (c->count >= alloc)
+		{
+			alloc = 2*alloc + 64;
+			char **line = realloc(c->line, alloc * sizeof *line);
+			if (line == NULL)
+			{
+				rtc = -1;
+				break;
+			}
+			c->line = line;
+		}
+		if ((c->line[c->count] = strdup(buf)) == NULL)
+		{
+			rtc = -1;
+			break;
+		}
+		c->bytes += strlen(buf);
+		c->count += 1;
+	}
+	fclose(fp);
+	if (rtc)
+		corpus_free(c);
+	return rtc;
+}
+
+static int compare_legacy(char const *a_r, int print)
+// parse with both tokenizers, return 1 if results differ
+{
+	char *out, *legacy_out;
+	size_t size, legacy_size;
+	FILE *fp = open_memstream(&out, &size);
+	FILE *lfp = open_memstream(&legacy_out, &legacy_size);
+	if (fp == NULL || lfp == NULL)
+	{
+		perror("open_memstream");
+		exit(1);
+	}
+
+	int const rtc = a_r_parse(a_r, &my_cb, fp);
+	int const legacy_rtc = legacy_a_r_parse(a_r, &legacy_cb, lfp);
+	fclose(fp);
+	fclose(lfp);
+
+	int const differ = rtc != legacy_rtc || size != legacy_size ||
+		memcmp(out, legacy_out, size) != 0;
+	if (print || differ)
+	{
+		if (differ)
+			printf("MISMATCH on: %s\n--- legacy rtc=%d\n%s", a_r,
+				legacy_rtc, legacy_out);
+		printf("%srtc=%d\n", out, rtc);
+	}
+	free(out);
+	free(legacy_out);
+	return differ;
+}
+
+static int run_corpus(corpus const *c)
+{
+	int differ = 0;
+	for (size_t i = 0; i < c->count; ++i)
+		differ += compare_legacy(c->line[i], 1);
+	return differ != 0;
+}
+
+static int run_fuzz(corpus const *c, unsigned seed, int rounds)
+/*
+* Mutate corpus lines using characters that matter to the tokenizer, and
+* check that the two tokenizers agree.  Print the mutations that differ.
+*/
+{
+	static const char alphabet[] = " \t();=\\\"/.@ab";
+	char buf[4200];
+	int differ = 0;
+
+	if (c->count == 0)
+		return 1;
+
+	srand(seed);
+	for (int r = 0; r < rounds; ++r)
+	{
+		char const *const src = c->line[rand() % c->count];
+		size_t len = strlen(src);
+		if (len >= sizeof buf - 64)
+			continue;
+
+		memcpy(buf, src, len + 1);
+		for (int m = 1 + rand() % 4; m > 0; --m)
+		{
+			size_t const pos = len? rand() % len: 0;
+			int const ch = alphabet[rand() % (sizeof alphabet - 1)];
+			switch (rand() % 3)
+			{
+				case 0: // replace
+					if (len)
+					{
+						buf[pos] = ch;
+						break;
+					}
+					/* else thru */
+				case 1: // insert
+					memmove(&buf[pos + 1], &buf[pos], len - pos + 1);
+					buf[pos] = ch;
+					++len;
+					break;
+				default: // delete
+					if (len)
+					{
+						memmove(&buf[pos], &buf[pos + 1], len - pos);
+						--len;
+					}
+					break;
+			}
+		}
+		differ += compare_legacy(buf, verbose > 0);
+	}
+
+	printf("%d mutations, %d mismatches\n", rounds, differ);
+	return differ != 0;
+}
+
+static int throughput(corpus const *c, int rounds)
+{
+	size_t sum_l = 0, sum_s = 0;
+	clock_t const t0 = clock();
+	for (int r = 0; r < rounds; ++r)
+		for (size_t i = 0; i < c->count; ++i)
+			legacy_a_r_parse(c->line[i], &null_legacy_cb, &sum_l);
+	clock_t const t1 = clock();
+	for (int r = 0; r < rounds; ++r)
+		for (size_t i = 0; i < c->count; ++i)
+			a_r_parse(c->line[i], &null_cb, &sum_s);
+	clock_t const t2 = clock();
+
+	double const mb = (double)c->bytes * rounds / 1000000.0;
+	double const sec_l = (double)(t1 - t0) / CLOCKS_PER_SEC,
+		sec_s = (double)(t2 - t1) / CLOCKS_PER_SEC;
+	printf("%zu fields, %zu bytes, %d rounds\n", c->count, c->bytes, rounds);
+	printf("legacy: %8.2f MB/s %8.3f us/field\n",
+		sec_l > 0? mb / sec_l: 0.0, 1000000.0 * sec_l / rounds / c->count);
+	printf("spans:  %8.2f MB/s %8.3f us/field\n",
+		sec_s > 0? mb / sec_s: 0.0, 1000000.0 * sec_s / rounds / c->count);
+	if (sum_l != sum_s)
+	{
+		printf("MISMATCH: %zu != %zu\n", sum_l, sum_s);
+		return 1;
+	}
+	return 0;
+}
+
+static int print_index(FILE *fp)
+{
+	hdr_block hb;
+	memset(&hb, 0, sizeof hb);
+	hfield_map *map = hfield_map_new(0);
+	int rtc = map? hdr_block_read(&hb, fp): -1;
+	if (rtc == 0)
+	{
+		for (size_t i = 0; i < hb.nfields; ++i)
+		{
+			hdr_field const *const f = &hb.field[i];
+			size_t len;
+			if (hdr_field_crlf(&hb, i, &len) == NULL)
+			{
+				rtc = -1;
+				break;
+			}
+			printf("%zu: %.*s%s folds=%zu len=%zu id=%d\n", i,
+				(int)(f->colon - f->start), hb.buf + f->start,
+				f->colon < f->end? "": " (no colon)", f->folds, len,
+				hdr_field_lookup(map, &hb, i)->id);
+		}
+
+		char line[80];
+		printf("header %zu bytes, body: %s", hb.len,
+			fgets(line, sizeof line, fp)? line: "EOF\n");
+	}
+	else
+		printf("hdr_block_read returned %d\n", rtc);
+
+	hdr_block_clean(&hb);
+	hfield_map_free(map);
+	return rtc != 0;
+}
+
+/*
+* Benchmark: a mailing list message with many Received fields, read by
+* the vb_fgets/fgetc loop and hdrval() chain formerly used in zdkimfilter,
+* and by the scanner and field name map.
+*/
+#include "vb_fgets.h"
+
+static size_t bench_match(char const *start)
+// the chain of hdrval() calls formerly used in zdkimfilter
+{
+	for (size_t n = 0; n < HFIELD_BUILTIN; ++n)
+		if (hdrval(start, hfield_builtin[n].name))
+			return hfield_builtin[n].id;
+	return 0;
+}
+
+static size_t bench_legacy(FILE *fp, var_buf *vb)
+{
+	size_t keep = 0, sum = 0;
+	for (;;)
+	{
+		char *p = vb_fgets(vb, keep, fp);
+		char *eol = p? strchr(p, '\n'): NULL;
+		if (eol == NULL)
+			return 0;
+
+		int const next = eol > p? fgetc(fp): '\n';
+		int const cont = next != EOF && next != '\n';
+		char *const start = vb->buf;
+		if (cont && isspace(next))
+		{
+			*eol++ = '\r';
+			*eol = '\n';
+			*++eol = next;
+			keep = eol + 1 - start;
+			continue;
+		}
+
+		sum += bench_match(start) + (eol - start);
+		if (!cont)
+			break;
+
+		start[0] = next;
+		keep = 1;
+	}
+	return sum;
+}
+
+static size_t bench_scanner(FILE *fp, hdr_block *hb, hfield_map const *map)
+{
+	size_t sum = 0;
+	if (hdr_block_read(hb, fp))
+		return 0;
+
+	for (size_t i = 0; i < hb->nfields; ++i)
+	{
+		size_t len;
+		char *start = hdr_field_crlf(hb, i, &len);
+		if (start == NULL)
+			return 0;
+		sum += hdr_field_lookup(map, hb, i)->id + len;
+	}
+	return sum;
+}
+
+static int benchmark(int received, int rounds)
+{
+	FILE *fp = tmpfile();
+	if (fp == NULL)
+	{
+		perror("tmpfile");
+		return 1;
+	}
+
+	for (int i = 0; i < received; ++i)
+		fprintf(fp, "Received: from list%d.example.org (list%d.example.org"
+			" [192.0.2.%d])\n\tby mx%d.example.com with ESMTP id %08x\n"
+			"\tfor <user@example.com>; Mon, 19 Oct 2026 10:%02d:00 +0200\n",
+			i, i, i % 256, i, i * 7919, i % 60);
+	fputs("DKIM-Signature: v=1; a=rsa-sha256; c=relaxed/relaxed;\n"
+		" d=example.org; s=x1; h=from:to:subject:date;\n"
+		" bh=47DEQpj8HBSa+/TImW+5JCeuQeRkm5NMpJWZG3hSuFU=;\n"
+		" b=dGhpcyBpcyBub3QgYSByZWFsIHNpZ25hdHVyZQ==\n"
+		"From: List <list@example.org>\n"
+		"To: user@example.com\n"
+		"Subject: benchmark\n"
+		"Date: Mon, 19 Oct 2026 10:00:00 +0200\n"
+		"\n", fp);
+	for (int i = 0; i < 50; ++i)
+		fputs("The quick brown fox jumps over the lazy dog.\n", fp);
+
+	var_buf vb;
+	hdr_block hb;
+	memset(&hb, 0, sizeof hb);
+	hfield_map *map = hfield_map_new(0);
+	if (map == NULL || vb_init(&vb))
+	{
+		hfield_map_free(map);
+		fclose(fp);
+		return 1;
 	}
 
+	size_t sum_l = 0, sum_s = 0;
+	clock_t const t0 = clock();
+	for (int r = 0; r < rounds; ++r)
+	{
+		rewind(fp);
+		sum_l += bench_legacy(fp, &vb);
+	}
+	clock_t const t1 = clock();
+	for (int r = 0; r < rounds; ++r)
+	{
+		rewind(fp);
+		sum_s += bench_scanner(fp, &hb, map);
+	}
+	clock_t const t2 = clock();
+
+	double const us = 1000000.0 / CLOCKS_PER_SEC / rounds;
+	printf("%d Received fields, %zu fields, %d rounds\n",
+		received, hb.nfields, rounds);
+	printf("vb_fgets: %8.2f us/message\n", (t1 - t0) * us);
+	printf("scanner:  %8.2f us/message\n", (t2 - t1) * us);
+
+	vb_clean(&vb);
+	hdr_block_clean(&hb);
+	hfield_map_free(map);
+	fclose(fp);
+	if (sum_l != sum_s || sum_s == 0)
+	{
+		printf("MISMATCH: %zu != %zu\n", sum_l, sum_s);
+		return 1;
+	}
 	return 0;
 }
 
 int main(int argc, char *argv[])
 {
 	char *fname = NULL;
-	int i, errs = 0, rtc = 1;
+	int i, errs = 0, rtc = 1, index = 0, bench = 0, corpus_mode = 0,
+		fuzz = 0, rounds = 0;
 
 	for (i = 1; i < argc; ++i)
 	{
@@ -399,6 +1454,31 @@ int main(int argc, char *argv[])
 						++verbose;
 						break;
 
+					case 'i':
+						index = 1;
+						break;
+
+					case 'b':
+						if (i + 1 < argc && (bench = atoi(argv[i + 1])) > 0)
+							++i;
+						else
+							bench = 150;
+						break;
+
+					case 'c':
+						corpus_mode = 1;
+						break;
+
+					case 'f':
+					case 't':
+						corpus_mode = 1;
+						fuzz = ch == 'f';
+						if (i + 1 < argc && (rounds = atoi(argv[i + 1])) > 0)
+							++i;
+						else
+							rounds = fuzz? 100000: 2000;
+						break;
+
 					default:
 						fprintf(stderr, "Invalid arg[%d]: %s\n", i, argv[i]);
 						++errs;
@@ -415,11 +1495,38 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (errs == 0 && bench)
+		return benchmark(bench, fname? atoi(fname): 2000);
+
+	if (errs == 0 && fname == NULL)
+	{
+		fprintf(stderr, "Usage: TESTutil [-v] [-i] a_r-or-header-file\n"
+			"       TESTutil -b [received] [rounds]\n"
+			"       TESTutil -c|-f [mutations]|-t [rounds] a_r-corpus\n");
+		++errs;
+	}
+
+	if (errs == 0 && corpus_mode)
+	{
+		corpus c;
+		if (corpus_read(fname, &c))
+			return 1;
+		rtc = rounds == 0? run_corpus(&c):
+			fuzz? run_fuzz(&c, 1, rounds): throughput(&c, rounds);
+		corpus_free(&c);
+		return rtc;
+	}
+
 	if (errs == 0)
 	{
 		FILE *fp = fopen(fname, "r");
 		if (fp == NULL)
 			perror(fname);
+		else if (index)
+		{
+			rtc = print_index(fp);
+			fclose(fp);
+		}
 		else
 		{
 			struct stat st;
@@ -429,9 +1536,6 @@ int main(int argc, char *argv[])
 				(buf = malloc(st.st_size + 1)) != NULL &&
 				fread(buf, st.st_size, 1, fp) == 1)
 			{
-				token tok;
-				memset(&tok, 0, sizeof tok);
-				tok.p = buf;
 				buf[st.st_size] = 0;
 				if (verbose)
 					printf("scanning %s", buf);
@@ -33,6 +33,7 @@ the resulting work.
 #if !defined UTIL_H_INCLUDED
 #include <ctype.h>
 #include <stddef.h>
+#include <stdio.h>
 
 // define static functions "inline" to avoid "warning... defined but not used"
 static inline int stricmp(const char *a, const char *b)
@@ -60,13 +61,87 @@ char *hdrval(const char *a, const char *b);
 char *skip_comment(char const *s);
 char *skip_cfws(char const *s);
 
+/*
+* A-R tokens point into the parsed string, which is not modified.  If plain,
+* the token is just len bytes at p; otherwise it contains quotes, escapes,
+* comments, or CFWS around a joint, which a_r_span_is/copy take care of.
+*/
+typedef struct a_r_span
+{
+	char const *p;
+	size_t len;
+	int plain;
+} a_r_span;
+
 typedef struct name_val
 {
-	char const *name;
-	char const *value;
+	a_r_span name;
+	a_r_span value;
 } name_val;
 int
 a_r_parse(char const *a_r, int (*cb)(void*, int, name_val*, size_t), void *cbv);
+int a_r_span_is(a_r_span const *sp, char const *s);
+size_t a_r_span_copy(a_r_span const *sp, char *buf, size_t size);
+
+typedef struct hdr_field
+{
+	size_t start; // offset of the field name
+	size_t colon; // offset of the colon, or end if missing
+	size_t end;   // offset of the terminating \n
+	size_t folds; // number of continuation lines
+} hdr_field;
+
+typedef struct hdr_block
+{
+	char *buf;         // header text, 0-terminated after the empty line
+	size_t len;        // header length, including the empty line if any
+	size_t alloc;
+	hdr_field *field;  // field index
+	size_t nfields, field_alloc;
+	size_t scan;       // scanner state
+	int open;
+	char *crlf;        // see hdr_field_crlf()
+	size_t crlf_alloc;
+} hdr_block;
+
+/*
+* header field names dispatch:  built-in names map to a fixed id,
+* configured names add flags, possibly to a built-in entry.
+*/
+typedef enum hfield_id
+{
+	hf_other,
+	hf_authentication_results, hf_old_authentication_results,
+	hf_received, hf_received_spf, hf_vbr_info, hf_dkim_signature,
+	hf_from, hf_to, hf_reply_to, hf_cc, hf_subject, hf_date, hf_message_id,
+	hf_content_type, hf_content_transfer_encoding, hf_precedence,
+	hf_list_id, hf_list_post, hf_list_unsubscribe, hf_mailing_list
+} hfield_id;
+
+#define HF_SIGN       1 // sign_hfields
+#define HF_SKIP       2 // skip_hfields
+#define HF_KEY_CHOICE 4 // key_choice_header
+#define HF_ACTION     8 // action_header
+
+typedef struct hfield_entry
+{
+	char const *name;
+	unsigned short len;
+	unsigned char id, flags;
+} hfield_entry;
+
+typedef struct hfield_map hfield_map;
+hfield_map *hfield_map_new(size_t extra);
+int hfield_map_add(hfield_map *map, char const *name, unsigned flags);
+void hfield_map_free(hfield_map *map);
+hfield_entry const *hfield_lookup(hfield_map const *map,
+	char const *name, size_t len);
+
+void hdr_block_clean(hdr_block *hb);
+int hdr_block_read(hdr_block *hb, FILE *fp);
+char *hdr_field_crlf(hdr_block *hb, size_t i, size_t *len);
+hfield_entry const *hdr_field_lookup(hfield_map const *map,
+	hdr_block const *hb, size_t i);
 
 #define UTIL_H_INCLUDED
 #endif
@@ -58,12 +58,11 @@ the resulting work.
 #include <unistd.h>
 
 #include "database.h"
+#include "store.h"
 #include "myadsp.h"
 #include "cstring.h"
 #include <assert.h>
 
-#if HAVE_OPENDBX
-
 static logfun_t do_log = &stderrlog;
 
 // display time
@@ -1431,7 +1430,10 @@ static int domain_select(int nfield, char const *field[], void* vzag)
 		p = e;
 	}
 	etag(&dom.xml); // policy_published
-	int rtc = db_run_dmarc_agg_record(zag->dwa, &dar, &record_select, &dom.xml);
+	int rtc = zag->z.stats_store?
+		store_run_dmarc_agg_record(zag->z.stats_store,
+			&dar, &record_select, &dom.xml, do_log):
+		db_run_dmarc_agg_record(zag->dwa, &dar, &record_select, &dom.xml);
 	etag(&dom.xml); // feedback - end of report
 	if (rtc == 0)
 		rtc = xml_flush(&dom.xml, 1);
@@ -1573,7 +1575,12 @@ static int domain_select(int nfield, char const *field[], void* vzag)
 	if (report_considered_sent)
 	{
 		if (!zag->no_set_dmarc_agg)
-			db_set_dmarc_agg(zag->dwa, &dar);
+		{
+			if (zag->z.stats_store)
+				store_set_dmarc_agg(zag->z.stats_store, &dar, do_log);
+			else
+				db_set_dmarc_agg(zag->dwa, &dar);
+		}
 		zag->n_dom_out += 1;
 	}	
 
@@ -1721,8 +1728,7 @@ int main(int argc, char *argv[])
 	if (do_args(argc, argv, &zag))
 		return 1;
 
-	if ((zag.dwa = db_init()) == NULL)
-		return 1;
+	zag.dwa = db_init(); // NULL without OpenDBX
 
 	void *parm_target[PARM_TARGET_SIZE];
 	parm_target[parm_t_id] = &zag.z;
@@ -1745,6 +1751,14 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	if (zag.dwa == NULL && zag.z.stats_store == NULL)
+	{
+		(*do_log)(LOG_ERR, "no database and no stats_store in %s",
+			zag.config_file);
+		clear_parm(parm_target);
+		return 1;
+	}
+
 	// adjust verbosity
 	if (zag.verbose == 0 && zag.z.verbose > 9)
 		zag.verbose = zag.z.verbose - 9;
@@ -1765,8 +1779,9 @@ int main(int argc, char *argv[])
 
 	// run
 	init_signal();
-	if ((rtc = db_zag_wrapup(zag.dwa, NULL)) == 0 &&
-		(rtc = db_connect(zag.dwa)) == 0)
+	if (zag.z.stats_store ||
+		((rtc = db_zag_wrapup(zag.dwa, NULL)) == 0 &&
+		(rtc = db_connect(zag.dwa)) == 0))
 	{
 		// round down period to honored_report_interval multiples
 		time(&zag.period_end);
@@ -1779,8 +1794,11 @@ int main(int argc, char *argv[])
 			free(p);
 		}
 
-		rtc = db_run_dmarc_agg_domain(zag.dwa,
-			zag.period_end, zag.period, &domain_select, &zag);
+		rtc = zag.z.stats_store?
+			store_run_dmarc_agg_domain(zag.z.stats_store,
+				zag.period_end, &domain_select, &zag, do_log):
+			db_run_dmarc_agg_domain(zag.dwa,
+				zag.period_end, zag.period, &domain_select, &zag);
 		if (zag.z.verbose >= 1)
 			(*do_log)(rtc == 0? LOG_INFO: LOG_ERR,
 				"%zu domain(s) selected, %d good, %d bad, %zu report(s) committed",
@@ -1791,11 +1809,3 @@ int main(int argc, char *argv[])
 	db_clear(zag.dwa);
 	return rtc != 0;
 }
-
-#else // HAVE_OPENDBX
-int main()
-{
-	puts("This program does nothing!\nPlease install OpenDBX then reconfigure");
-	return 0;
-}
-#endif
@@ -56,12 +56,21 @@ the resulting work.
 #include "myvbr.h"
 #include "myreputation.h"
 #include "myadsp.h"
+#include "mydns.h"
+#include "mykey.h"
+#include "mysig.h"
+#include "myverify.h"
 #include "redact.h"
-#include "vb_fgets.h"
 #include "parm.h"
 #include "database.h"
+#include "dbwriter.h"
+#include "spool.h"
+#include "snapshot.h"
+#include "myrate.h"
+#include "store.h"
 #include "filecopy.h"
 #include "util.h"
+#include "arena.h"
 #include "publicsuffix.h"
 #include "spf_result_string.h"
 #include <assert.h>
@@ -83,7 +92,7 @@ static inline char *my_basename(char const *name) // neither GNU nor POSIX...
 	return (char*)name;
 }
 
-static char *strdup_normalize(char const *s, int stop_at)
+static char *strdup_normalize(arena *a, char const *s, int stop_at)
 {
 	char *copy;
 
@@ -104,7 +113,7 @@ static char *strdup_normalize(char const *s, int stop_at)
 		assert(t > s);
 
 		// duplicate normalizing spaces
-		char *d = copy = malloc(t - s + 1);
+		char *d = copy = arena_alloc(a, t - s + 1);
 		if (d)
 		{
 			int spaces = 0;
@@ -125,7 +134,7 @@ static char *strdup_normalize(char const *s, int stop_at)
 			*d = 0;
 		}
 	}
-	else copy = strdup("");
+	else copy = arena_strdup(a, "");
 
 	return copy;
 }
@@ -135,12 +144,7 @@ static void clean_stats_info_content(stats_info *stats)
 {
 	if (stats)
 	{
-		free(stats->content_type);
-		free(stats->content_encoding);
-		free(stats->date);
-		free(stats->message_id);
-		free(stats->from);
-		free(stats->subject);
+		// content_type ... subject are in dyn.mem
 		free(stats->envelope_sender);
 		free(stats->vbr_result_resp);
 		// don't free(stats->ino_mtime_pid); it is in dyn.info
@@ -186,11 +190,14 @@ typedef struct per_message_parm
 	char *authserv_id;
 	char *action_header;
 	stats_info *stats;
-	var_buf vb;
+	hdr_block hb;
+	arena mem; // reset on each message
 	fl_msg_info info;
 	int rtc;
+	unsigned rcpt_count;
 	char db_connected;
 	char special; // never block outgoing messages to postmaster@domain only.
+	char check_user; // run db_sql_check_user after storing stats
 } per_message_parm;
 
 typedef enum split_filter
@@ -204,6 +211,7 @@ typedef struct dkimfl_parm
 	fl_parm *fl;
 	db_work_area *dwa;
 	publicsuffix_trie *pst;
+	hfield_map *hfm;
 
 	char const *config_fname; // static (either default or argv)
 	char const *prog_name; //static, from argv[0]
@@ -282,6 +290,18 @@ static void config_wrapup(dkimfl_parm *parm)
 		parm->z.dns_timeout = 0;
 	}
 
+	if (parm->z.dns_breaker_failures < 0)
+		parm->z.dns_breaker_failures = 0;
+
+	if (parm->z.dns_breaker_cooldown < 0)
+		parm->z.dns_breaker_cooldown = 0;
+
+	if (parm->z.key_cache_ttl < 0)
+		parm->z.key_cache_ttl = 0;
+
+	if (parm->z.verify_cache_ttl < 0)
+		parm->z.verify_cache_ttl = 0;
+
 	if (parm->z.dnswl_octet_index > 3)
 		parm->z.dnswl_octet_index = 3;
 
@@ -357,6 +377,8 @@ static void some_cleanup(dkimfl_parm *parm) // parent
 	}
 	free(parm->blocklist.data);
 	publicsuffix_done(parm->pst);
+	hfield_map_free(parm->hfm);
+	arena_clean(&parm->dyn.mem);
 }
 
 static int parm_config(dkimfl_parm *parm, char const *fname, int no_db)
@@ -413,6 +435,8 @@ static int parm_config(dkimfl_parm *parm, char const *fname, int no_db)
 			{
 				parm->use_dwa_after_sign = out > 0;
 				parm->use_dwa_verifying = in > 0;
+				db_set_redact(parm->dwa, &redacted,
+					parm->z.redact_received_auth);
 			}
 		}
 	}
@@ -459,18 +483,9 @@ static void check_split(dkimfl_parm *parm)
 
 // functions common for both incoming and outgoing msgs
 
-static void clear_prescreen(domain_prescreen* dps)
-{
-	while (dps != NULL)
-	{
-		domain_prescreen* const next = dps->next;
-		free(dps);
-		dps = next;
-	}
-}
-
 static domain_prescreen*
-get_prescreen(domain_prescreen** dps_head, char const *domain)
+get_prescreen(arena *a, domain_prescreen** dps_head, char const *domain)
+// prescreens are in dyn.mem, and need not be freed
 {
 	assert(dps_head);
 	assert(domain);
@@ -492,7 +507,7 @@ get_prescreen(domain_prescreen** dps_head, char const *domain)
 
 	size_t const len = sizeof(domain_prescreen);
 	size_t const len2 = strlen(domain) + 1;
-	domain_prescreen *new_dps = malloc(len + len2);
+	domain_prescreen *new_dps = arena_alloc(a, len + len2);
 	if (new_dps)
 	{
 		memset(new_dps, 0, len);
@@ -512,65 +527,74 @@ static void clean_stats(dkimfl_parm *parm)
 
 	if (parm->dyn.stats)
 	{
-		clear_prescreen(parm->dyn.stats->domain_head);
-		parm->dyn.stats->domain_head = NULL;
 		clean_stats_info_content(parm->dyn.stats);
-		free(parm->dyn.stats);
-		parm->dyn.stats = NULL;
+		parm->dyn.stats = NULL; // in dyn.mem
 	}
 }
 
-static void collect_stats(dkimfl_parm *parm, char const *start)
+static void collect_stats(dkimfl_parm *parm, int id, char const *s)
+// s is the field value
 {
 	assert(parm);
 	assert(parm->dyn.stats);
 
 	char **target = NULL;
-	char const *s;
 	int stop_at = 0;
-	if ((s = hdrval(start, "Content-Type")) != NULL)
-	{
-		target = &parm->dyn.stats->content_type;
-		stop_at = ';';
-	}
-	else if ((s = hdrval(start, "Content-Transfer-Encoding")) != NULL)
-		target = &parm->dyn.stats->content_encoding;
-	else if ((s = hdrval(start, "Date")) != NULL)
-		target = &parm->dyn.stats->date;
-	else if ((s = hdrval(start, "Message-Id")) != NULL)
-		target = &parm->dyn.stats->message_id;
-	else if ((s = hdrval(start, "From")) != NULL)
-		target = &parm->dyn.stats->from;
-	else if ((s = hdrval(start, "Subject")) != NULL)
-		target = &parm->dyn.stats->subject;
+	switch (id)
+	{
+		case hf_content_type:
+			target = &parm->dyn.stats->content_type;
+			stop_at = ';';
+			break;
+
+		case hf_content_transfer_encoding:
+			target = &parm->dyn.stats->content_encoding;
+			break;
+
+		case hf_date:
+			target = &parm->dyn.stats->date;
+			break;
+
+		case hf_message_id:
+			target = &parm->dyn.stats->message_id;
+			break;
+
+		case hf_from:
+			target = &parm->dyn.stats->from;
+			break;
+
+		case hf_subject:
+			target = &parm->dyn.stats->subject;
+			break;
+
+		case hf_precedence:
+		{
+			while (isspace(*(unsigned char const*)s))
+				++s;
+			size_t len;
+			int ch;
+			if (strincmp(s, "list", 4) == 0 &&
+				((len = strlen(s)) <= 4 ||
+					(ch = ((unsigned char const*)s)[5]) == ';' || isspace(ch)))
+						parm->dyn.stats->mailing_list = 1;
+			break;
+		}
+
+		case hf_list_id:
+		case hf_list_post:
+		case hf_list_unsubscribe:
+		case hf_mailing_list:
+			parm->dyn.stats->mailing_list = 1;
+			break;
+
+		default:
+			break;
+	}
 
 	if (target && *target == NULL &&
-		(*target = strdup_normalize(s, stop_at)) == NULL)
+		(*target = strdup_normalize(&parm->dyn.mem, s, stop_at)) == NULL)
 		// memory faults are silently ignored for stats
 			clean_stats(parm);
-
-	else if ((s = hdrval(start, "Precedence")) != NULL)
-	{
-		while (isspace(*(unsigned char const*)s))
-			++s;
-		size_t len;
-		int ch;
-		if (strincmp(s, "list", 4) == 0 &&
-			((len = strlen(s)) <= 4 ||
-				(ch = ((unsigned char const*)s)[5]) == ';' || isspace(ch)))
-					parm->dyn.stats->mailing_list = 1;
-	}
-	
-	else if (strincmp(start, "List-", 5) == 0)
-	{
-		if (hdrval(start, "List-Id") ||
-			hdrval(start, "List-Post") ||
-			hdrval(start, "List-Unsubscribe"))
-				parm->dyn.stats->mailing_list = 1;
-	}
-	
-	else if (hdrval(start, "Mailing-List"))
-		parm->dyn.stats->mailing_list = 1;
 }
 
 // outgoing
@@ -707,6 +731,37 @@ static int default_key_choice(dkimfl_parm *parm, int type)
 	return rc;
 }
 
+static int read_header(dkimfl_parm *parm, FILE *fp)
+// read and index the header, leave fp at the start of the body;
+// return parm->dyn.rtc = -1 for unrecoverable error, 0 otherwise
+{
+	assert(parm && fp);
+
+	int const rtc = hdr_block_read(&parm->dyn.hb, fp);
+	if (rtc == -3)
+	{
+		hdr_block const *const hb = &parm->dyn.hb;
+		if (parm->z.verbose)
+			fl_report(LOG_ALERT,
+				"id=%s: header too long (%.20s...)",
+				parm->dyn.info.id, hb->nfields?
+					hb->buf + hb->field[hb->nfields - 1].start: hb->buf);
+		return parm->dyn.rtc = -1;
+	}
+
+	if (rtc)
+	{
+		if (parm->z.verbose)
+			fl_report(LOG_ALERT,
+				"id=%s: cannot read header: %s",
+				parm->dyn.info.id,
+				rtc == -2? "unterminated or empty": strerror(errno));
+		return parm->dyn.rtc = -1;
+	}
+
+	return 0;
+}
+
 static int read_key_choice(dkimfl_parm *parm)
 {
 	assert(parm);
@@ -803,37 +858,24 @@ static int read_key_choice(dkimfl_parm *parm)
 	{
 		FILE* fp = fl_get_file(parm->fl);
 		assert(fp);
-		var_buf *vb = &parm->dyn.vb;
+		hdr_block *const hb = &parm->dyn.hb;
 
-		while (rtc == 0)
-		{
-			char *p = vb_fgets(vb, keep, fp);
-			char *eol = p? strchr(p, '\n'): NULL;
-
-			if (eol == NULL)
-			{
-				if (parm->z.verbose)
-					fl_report(LOG_ALERT,
-						"id=%s: header too long (%.20s...)",
-						parm->dyn.info.id, vb_what(vb, fp));
-				rtc = parm->dyn.rtc = -1;
-				break;
-			}
+		if (read_header(parm, fp))
+			rtc = -1;
 
-			int const next = eol > p? fgetc(fp): '\n';
-			int const cont = next != EOF && next != '\n';
-			char *const start = vb->buf;
-			if (cont && isspace(next)) // wrapped
-			{
-				*++eol = next;
-				keep = eol + 1 - start;
+		for (size_t f = 0; rtc == 0 && f < hb->nfields && count > 0; ++f)
+		{
+			if ((hdr_field_lookup(parm->hfm, hb, f)->flags & HF_KEY_CHOICE) == 0)
 				continue;
-			}
 
 			/*
 			* full 0-terminated header field, including trailing \n, is in buffer;
 			* if it is a choice header, check if it leads to a signing key.
 			*/
+			char *const start = hb->buf + hb->field[f].start;
+			char *const next = hb->buf + hb->field[f].end + 1;
+			char const save = *next;
+			*next = 0;
 			for (i = 0; i < choice_max; ++i)
 			{
 				char const *const h = choice[i].header;
@@ -877,11 +919,7 @@ static int read_key_choice(dkimfl_parm *parm)
 				}
 			}
 
-			if (!cont || count <= 0) // end of header or found all
-				break;
-
-			start[0] = next;
-			keep = 1;
+			*next = save;
 		}
 		rewind(fp);
 	}
@@ -1107,41 +1145,27 @@ static int sign_headers(dkimfl_parm *parm, DKIM *dkim, replacement **repl)
 {
 	assert(parm);
 
-	size_t keep = 0;
-	var_buf *vb = &parm->dyn.vb;
+	hdr_block *const hb = &parm->dyn.hb;
 	FILE* fp = fl_get_file(parm->fl);
 	assert(fp);
 
-	uint64_t offset = 0;
-	size_t newlines = 0;
+	if (read_header(parm, fp))
+		return parm->dyn.rtc;
+
 	bool search_received = parm->z.redact_received_auth;
-	for (;;)
+	for (size_t f = 0; f < hb->nfields; ++f)
 	{
-		char *p = vb_fgets(vb, keep, fp);
-		char *eol = p? strchr(p, '\n'): NULL;
-
-		if (eol == NULL)
+		size_t keep;
+		char *const start = hdr_field_crlf(hb, f, &keep);
+		if (start == NULL)
 		{
-			if (parm->z.verbose)
-				fl_report(LOG_ALERT,
-					"id=%s: header too long (%.20s...)",
-					parm->dyn.info.id, vb_what(vb, fp));
+			fl_report(LOG_ALERT, "MEMORY FAULT");
 			return parm->dyn.rtc = -1;
 		}
 
-		int const next = eol > p? fgetc(fp): '\n';
-		int const cont = next != EOF && next != '\n';
-		char *const start = vb->buf;
-		keep = eol - start;
-		if (cont && isspace(next)) // wrapped
-		{
-			*eol++ = '\r';
-			*eol++ = '\n';
-			*eol = next;
-			keep += 3;
-			++newlines;
-			continue;
-		}
+		hfield_entry const *const hf = hdr_field_lookup(parm->hfm, hb, f);
+		char *const s = hf->name?
+			start + (hb->field[f].colon - hb->field[f].start) + 1: NULL;
 
 		/*
 		* full field is in buffer, keep bytes excluding trailing \n
@@ -1149,30 +1173,29 @@ static int sign_headers(dkimfl_parm *parm, DKIM *dkim, replacement **repl)
 		*/
 		if (keep)
 		{
-			*eol = 0;
-			if (parm->dyn.stats)
-				collect_stats(parm, start);
+			start[keep] = 0;
+			if (parm->dyn.stats && s)
+				collect_stats(parm, hf->id, s);
 
 			if (dkim)
 			{
-				char *nt = NULL, *s;
+				char *nt = NULL;
 				int rc = 0;
-				if (search_received && (s = hdrval(start, "Received")) != NULL)
+				if (search_received && hf->id == hf_received)
 				{
 					if ((rc = replace_received_auth(parm, &nt, start, s, keep)) > 0)
 						search_received = false;
 				}
-				else if ((s = hdrval(start, "To")) != NULL ||
-					(s = hdrval(start, "Reply-To")) != NULL ||
-					(s = hdrval(start, "From")) != NULL ||
-					(s = hdrval(start, "Cc")) != NULL)
+				else if (hf->id == hf_to || hf->id == hf_reply_to ||
+					hf->id == hf_from || hf->id == hf_cc)
 				{
 					rc = replace_courier_wrap(&nt, start);
 				}
 
 				if (rc > 0)
 				{
-					replacement *new_r = malloc(sizeof (replacement));
+					replacement *new_r =
+						arena_alloc(&parm->dyn.mem, sizeof (replacement));
 					if (new_r)
 					{
 						replacement **r = repl;
@@ -1180,9 +1203,9 @@ static int sign_headers(dkimfl_parm *parm, DKIM *dkim, replacement **repl)
 							r = &(*r)->next;
 						new_r->next = NULL;
 						*r = new_r;
-						new_r->offset = offset;
+						new_r->offset = hb->field[f].start;
 						new_r->new_text = nt;
-						new_r->length = keep - newlines;
+						new_r->length = hb->field[f].end - hb->field[f].start;
 						if (nt)
 							rc = my_dkim_header(parm, dkim, nt, strlen(nt));
 					}
@@ -1199,14 +1222,6 @@ static int sign_headers(dkimfl_parm *parm, DKIM *dkim, replacement **repl)
 					return parm->dyn.rtc = -1;
 			}
 		}
-
-		if (!cont)
-			break;
-
-		offset += keep - newlines + 1;
-		newlines = 0;
-		start[0] = next;
-		keep = 1;
 	}
 	
 	/*
@@ -1352,12 +1367,10 @@ static void recipient_s_domains(dkimfl_parm *parm)
 						dom - rcpt == 11 &&
 						strincmp(rcpt, "postmaster@", 11) == 0;
 
-				domain_prescreen* dps = get_prescreen(&dps_head, dom);
+				domain_prescreen* dps =
+					get_prescreen(&parm->dyn.mem, &dps_head, dom);
 				if (dps == NULL) // memory fault
-				{
-					clear_prescreen(dps_head);
 					return;
-				}
 			}
 		}
 		fl_rcpt_clear(fre);
@@ -1369,13 +1382,12 @@ static void recipient_s_domains(dkimfl_parm *parm)
 			parm->dyn.info.id);
 	else
 	{
+		parm->dyn.rcpt_count = rcpt_count? rcpt_count: 1; // how come?
 		if (parm->dyn.stats)
 		{
 			parm->dyn.stats->domain_head = dps_head;
-			parm->dyn.stats->rcpt_count = rcpt_count? rcpt_count: 1; // how come?
+			parm->dyn.stats->rcpt_count = parm->dyn.rcpt_count;
 		}
-		else
-			clear_prescreen(dps_head);
 		parm->dyn.special = rcpt_count == 1 && special_candidate;
 	}
 }
@@ -1386,6 +1398,46 @@ static inline int user_is_blocked(dkimfl_parm *parm)
 		search_list(&parm->blocklist, parm->dyn.info.authsender);
 }
 
+static void block_user(dkimfl_parm *parm, char *reason);
+
+static int rate_limit_user(dkimfl_parm *parm)
+/*
+* Count the message in the sliding window of its user.  If it exceeds a
+* limit, add the user to blocked_user_list and return 1.  Set check_user if
+* db_sql_check_user is due:  for every message if there are no limits,
+* otherwise every rate_limit_reconcile seconds per user.
+*/
+{
+	assert(parm);
+	assert(parm->dyn.info.authsender);
+
+	int rtc = 0;
+	if (parm->z.rate_limit_interval > 0)
+	{
+		if (parm->dyn.rcpt_count == 0)
+			recipient_s_domains(parm);
+
+		unsigned msgs = 0, rcpts = 0;
+		rtc = rate_limit_count(parm->dyn.info.authsender, parm->dyn.rcpt_count,
+			parm->z.rate_limit_reconcile > 0? parm->z.rate_limit_reconcile:
+				parm->z.rate_limit_interval, &msgs, &rcpts);
+		if (rtc != 0 && (rtc & RATE_OK) == 0)
+		{
+			char reason[128];
+			snprintf(reason, sizeof reason,
+				"rate limit: %u messages, %u recipients in %d secs",
+				msgs + 1, rcpts + parm->dyn.rcpt_count,
+				parm->z.rate_limit_interval);
+			block_user(parm, reason);
+			parm->user_blocked = 1;
+			return 1;
+		}
+	}
+
+	parm->dyn.check_user = rtc == 0 || (rtc & RATE_RECONCILE) != 0;
+	return 0;
+}
+
 static inline int is_postmaster(char const *from)
 {
 	char *addr;
@@ -1426,21 +1478,21 @@ static void sign_message(dkimfl_parm *parm)
 	assert(parm->dyn.selector == NULL);
 	assert(parm->dyn.domain == NULL);
 	
-	if (vb_init(&parm->dyn.vb) ||
-		read_key_choice(parm))
+	if (read_key_choice(parm))
 	{
 		parm->dyn.rtc = -1;
 		return;
 	}
 
 	/*
-	* Reject the message if the user is banned from sending,
-	* but allow (emergency?) messages --special-- that is, the
-	* only recipient is the postmaster at the signing domain.
+	* Reject the message if the user is banned from sending, or exceeds
+	* the rate limit, but allow (emergency?) messages --special-- that is,
+	* the only recipient is the postmaster at the signing domain.
 	*/
-	if (user_is_blocked(parm))
+	if (user_is_blocked(parm) || rate_limit_user(parm))
 	{
-		recipient_s_domains(parm);
+		if (parm->dyn.rcpt_count == 0)
+			recipient_s_domains(parm);
 
 		if (parm->dyn.special)
 		{
@@ -1576,7 +1628,7 @@ static void sign_message(dkimfl_parm *parm)
 			sign_headers(parm, dkim, &repl) == 0 &&
 			copy_body(parm, dkim) == 0)
 		{
-			vb_clean(&parm->dyn.vb);
+			hdr_block_clean(&parm->dyn.hb);
 			status = dkim_eom(dkim, NULL);
 			if (status != DKIM_STAT_OK)
 			{
@@ -1643,7 +1695,6 @@ static void sign_message(dkimfl_parm *parm)
 			{
 				replacement *r = repl->next;
 				free(repl->new_text);
-				free(repl);
 				repl = r;
 			}
 		}
@@ -1663,6 +1714,7 @@ typedef struct verify_parms
 	// not malloc'd or maintained elsewhere
 	dkimfl_parm *parm;
 	char *dkim_domain;
+	char *from_user; // only set if there is no OpenDKIM handle
 
 	char const *policy_type, *policy_result, *policy_comment;
 
@@ -1679,6 +1731,13 @@ typedef struct verify_parms
 	// number of DKIM signing domains, elements of domain_ptr
 	int ndoms;
 
+	// signatures passed from the verify cache or natively, not processed
+	DKIM_SIGINFO *cached_sig[8];
+	unsigned char cached_flags[8];
+	int ncached;
+
+	fast_verify *fv; // native verification, if enabled
+
 	int policy;
 	int presult;
 	int do_adsp, do_dmarc;
@@ -1689,6 +1748,9 @@ typedef struct verify_parms
 	unsigned int domain_flags:1;
 	unsigned int have_spf_pass:1;
 	unsigned int have_trusted_voucher:1;
+	unsigned int from_prefetched:1;
+	unsigned int policy_checked:1;
+	unsigned int early_decision:1;
 
 } verify_parms;
 
@@ -1742,49 +1804,26 @@ static inline char* mv2tv(char *mv, char const **const tv)
 }
 
 static void clean_vh(verify_parms *vh)
+// domain prescreens and domain_ptr are in dyn.mem
 {
-	clear_prescreen(vh->domain_head);
 	vbr_info_clear(vh->vbr);
-	free(vh->domain_ptr);
+	fast_verify_free(vh->fv);
 	free(vh->vbr_result.resp);
 	free(vh->dmarc.rua);
 	if (vh->org_domain_in_dwa == 0)
 		free(vh->org_domain);
+	dns_prefetch_clear();
 }
 
-static int check_db_connected(dkimfl_parm *parm)
+static char *get_client_ip(dkimfl_parm *parm, char *buf, size_t size)
 /*
-* Track db_connected.  Connection is only attempted if dwa was inited.
-* On connection, pass the authenticated user and the client IP, if any.
-*
-* This function must be called before attempting any query.
-*
-* Return -1 on hardfail, 0 otherwise.
+* Copy the client IP, if any, to buf.  Return buf, or NULL if not known.
 */
 {
 	assert(parm);
 	assert(parm->fl);
 
-	db_work_area *const dwa = parm->dwa;
-	if (dwa == NULL || parm->dyn.db_connected)
-		return 0;
-		
-	if (db_connect(dwa) != 0)
-		return -1;
-
-	parm->dyn.db_connected = 1;
-
 	char *s = NULL;
-	if ((s = parm->dyn.info.authsender) != NULL) // outgoing
-	{
-		char *dom = strchr(s, '@');
-		if (dom)
-			*dom = 0;
-		db_set_authenticated_user(dwa, s, dom? dom + 1: NULL);
-		if (dom)
-			*dom = '@';
-	}
-
 	if ((s = parm->dyn.info.frommta) != NULL &&
 		strincmp(s, "dns;", 4) == 0)
 /*
@@ -1808,23 +1847,135 @@ and then conveyed to ctlfile 'f' (COMCTLFILE_FROMMTA).  E.g.
 		if (s && *++s)
 		{
 			char *e = strchr(s, ']');
-			if (e)
+			if (e && (size_t)(e - s) < size)
 			{
-				*e = 0;
-				db_set_client_ip(dwa, s);
-				*e = ']';
+				memcpy(buf, s, e - s);
+				buf[e - s] = 0;
+				return buf;
 			}
 		}
 	}
 	else if (fl_whence(parm->fl) == fl_whence_other && // working stdalone
-		(s = getenv("REMOTE_ADDR")) != NULL)
+		(s = getenv("REMOTE_ADDR")) != NULL && strlen(s) < size)
 	{
-		db_set_client_ip(dwa, s);
+		return strcpy(buf, s);
 	}
 
+	return NULL;
+}
+
+static void set_db_user_and_ip(dkimfl_parm *parm)
+/*
+* Pass the authenticated user and the client IP, if any.
+*/
+{
+	assert(parm);
+
+	db_work_area *const dwa = parm->dwa;
+	assert(dwa);
+
+	char *s = NULL;
+	if ((s = parm->dyn.info.authsender) != NULL) // outgoing
+	{
+		char *dom = strchr(s, '@');
+		if (dom)
+			*dom = 0;
+		db_set_authenticated_user(dwa, s, dom? dom + 1: NULL);
+		if (dom)
+			*dom = '@';
+	}
+
+	char ip[64];
+	if (get_client_ip(parm, ip, sizeof ip))
+		db_set_client_ip(dwa, ip);
+}
+
+static int check_db_connected(dkimfl_parm *parm)
+/*
+* Track db_connected.  Connection is only attempted if dwa was inited.
+* On connection, pass the authenticated user and the client IP, if any.
+*
+* This function must be called before attempting any query.
+*
+* Return -1 on hardfail, 0 otherwise.
+*/
+{
+	assert(parm);
+	assert(parm->fl);
+
+	db_work_area *const dwa = parm->dwa;
+	if (dwa == NULL || parm->dyn.db_connected)
+		return 0;
+		
+	if (db_connect(dwa) != 0)
+		return -1;
+
+	parm->dyn.db_connected = 1;
+	set_db_user_and_ip(parm);
 	return 0;
 }
 
+static int send_to_stats_writer(dkimfl_parm *parm)
+/*
+* Hand the stats to the writer if this child didn't connect, and no reply
+* is needed.  Return 0 if sent.
+*/
+{
+	assert(parm);
+	assert(parm->dwa);
+	assert(parm->dyn.stats);
+
+	if (parm->z.stats_writer_queue <= 0 || parm->dyn.db_connected ||
+		(parm->dyn.stats->outgoing && parm->dyn.check_user &&
+			db_check_user_defined(parm->dwa)))
+		return -1;
+
+	set_db_user_and_ip(parm);
+	return dbw_send(parm->dwa, parm->dyn.stats);
+}
+
+static void spool_stats(dkimfl_parm *parm, char const *rec, size_t len)
+/*
+* Save stats that could not be written, if stats_spool is configured.
+* If rec is NULL, serialize the current stats.
+*/
+{
+	assert(parm);
+	assert(parm->dwa);
+
+	char const *const spool = parm->z.stats_spool;
+	if (spool == NULL)
+		return;
+
+	int rc;
+	if (rec)
+		rc = spool_append(spool, rec, len, &fl_report);
+	else
+	{
+		set_db_user_and_ip(parm);
+		rc = spool_append_stats(spool, parm->dwa, parm->dyn.stats, &fl_report);
+	}
+
+	if (rc == 0 && parm->z.verbose >= 3)
+		fl_report(LOG_INFO, "id=%s: stats spooled", parm->dyn.info.id);
+}
+
+static void store_stats(dkimfl_parm *parm)
+/*
+* Append the stats to the local store.
+*/
+{
+	assert(parm);
+	assert(parm->dyn.stats);
+	assert(parm->z.stats_store);
+
+	char ip[64];
+	if (store_append(parm->z.stats_store, parm->z.stats_store_segment,
+		parm->dyn.stats, get_client_ip(parm, ip, sizeof ip),
+		parm->dyn.info.authsender, &fl_report) == 0 && parm->z.verbose >= 8)
+			fl_report(LOG_DEBUG, "id=%s: stats stored", parm->dyn.info.id);
+}
+
 static inline int change_sign(int old, int newval)
 {
 	return (old <= 0 && newval > 0) || (old > 0 && newval <= 0);
@@ -1845,7 +1996,7 @@ static int domain_flags(verify_parms *vh)
 	if (vh->domain_flags == 0)
 	{
 		char *from = vh->dkim_domain;
-		if (from == NULL)
+		if (from == NULL && dkim)
 			vh->dkim_domain = from = dkim_getdomain(dkim);
 
 		int const vbr_count =
@@ -1857,7 +2008,7 @@ static int domain_flags(verify_parms *vh)
 		db_work_area *const dwa = vh->parm->dwa;
 		if (from)
 		{
-			domain_prescreen *dps = get_prescreen(&vh->domain_head, from);
+			domain_prescreen *dps = get_prescreen(&vh->parm->dyn.mem, &vh->domain_head, from);
 			if (dps)
 				dps->u.f.is_from = dps->u.f.is_aligned = 1;
 			else
@@ -1877,7 +2028,8 @@ static int domain_flags(verify_parms *vh)
 					}
 
 					if (stricmp(from, od) != 0 &&
-						(dps = get_prescreen(&vh->domain_head, od)) == NULL)
+						(dps = get_prescreen(&vh->parm->dyn.mem,
+							&vh->domain_head, od)) == NULL)
 							return vh->parm->dyn.rtc = -1;
 
 					dps->u.f.is_org_domain = dps->u.f.is_aligned = 1;
@@ -1885,7 +2037,15 @@ static int domain_flags(verify_parms *vh)
 			}
 		}
 
-		if (dwa && check_db_connected(vh->parm) < 0)
+		/*
+		* With the stats writer, don't connect just for stats.  With a fresh
+		* snapshot, don't connect for domain flags either.
+		*/
+		int const snap_lookup = dwa && vh->parm->z.domain_flags_snapshot &&
+			snapshot_fresh();
+		int const db_lookup = dwa && !snap_lookup &&
+			(vh->parm->z.stats_writer_queue <= 0 || db_domain_flags_defined(dwa));
+		if (db_lookup && check_db_connected(vh->parm) < 0)
 			return -1;
 
 		for (domain_prescreen *dps = vh->domain_head; dps; dps = dps->next)
@@ -1911,11 +2071,14 @@ static int domain_flags(verify_parms *vh)
 				}
 			}
 
-			if (dwa)
+			if (db_lookup || snap_lookup)
 			{
 				int dmarc, adsp,
-					c = db_get_domain_flags(dwa, dps->name,
-						&dps->whitelisted, &dmarc, &adsp);
+					c = snap_lookup?
+						snapshot_lookup(dps->name,
+							&dps->whitelisted, &dmarc, &adsp):
+						db_get_domain_flags(dwa, dps->name,
+							&dps->whitelisted, &dmarc, &adsp);
 				if (c > 0)
 				{
 					if (dps->whitelisted > 1)
@@ -2021,9 +2184,13 @@ domain_sort(verify_parms *vh, DKIM_SIGINFO** sigs, int nsigs)
 	int ndoms = nsigs;
 	int good = 1;
 
-	domain_prescreen** domain_ptr = calloc(ndoms+1, sizeof(domain_prescreen*));
-	domain_prescreen** sigs_mirror = calloc(nsigs+1, sizeof(domain_prescreen*));
-	DKIM_SIGINFO** sigs_copy = calloc(nsigs+1, sizeof(DKIM_SIGINFO*));
+	arena *const mem = &vh->parm->dyn.mem;
+	domain_prescreen** domain_ptr =
+		arena_calloc(mem, (ndoms+1) * sizeof(domain_prescreen*));
+	domain_prescreen** sigs_mirror =
+		arena_calloc(mem, (nsigs+1) * sizeof(domain_prescreen*));
+	DKIM_SIGINFO** sigs_copy =
+		arena_calloc(mem, (nsigs+1) * sizeof(DKIM_SIGINFO*));
 
 	domain_prescreen **dps_head = &vh->domain_head;
 	if (!(domain_ptr && sigs_mirror && sigs_copy))
@@ -2043,7 +2210,7 @@ domain_sort(verify_parms *vh, DKIM_SIGINFO** sigs, int nsigs)
 			char *const domain = dkim_sig_getdomain(sigs[c]);
 			if (domain)
 			{
-				domain_prescreen *dps = get_prescreen(dps_head, domain);
+				domain_prescreen *dps = get_prescreen(mem, dps_head, domain);
 				if (dps == NULL)
 				{
 					good = 0;
@@ -2063,12 +2230,7 @@ domain_sort(verify_parms *vh, DKIM_SIGINFO** sigs, int nsigs)
 		good = 0;
 
 	if (!good)
-	{
-		free(domain_ptr);
-		free(sigs_mirror);
-		free(sigs_copy);
 		return -1;
-	}
 
 	/*
 	* Sort domain_ptr, based on domain flags.  Use gnome sort, as we
@@ -2123,13 +2285,10 @@ domain_sort(verify_parms *vh, DKIM_SIGINFO** sigs, int nsigs)
 		}
 	}
 
-	free(sigs_mirror);
-	free(sigs_copy);
-
 	vh->ndoms = ndoms;
 	if (ndoms)
 	{
-		vh->domain_ptr = realloc(domain_ptr, ndoms * sizeof(domain_prescreen*));
+		vh->domain_ptr = domain_ptr;
 		if (vh->parm->dyn.stats)
 		{
 			vh->parm->dyn.stats->signatures_count = nsigs;
@@ -2145,10 +2304,7 @@ domain_sort(verify_parms *vh, DKIM_SIGINFO** sigs, int nsigs)
 		}
 	}
 	else
-	{
-		free(domain_ptr);
 		clean_stats(vh->parm);
-	}
 
 	return ndoms;
 }
@@ -2212,8 +2368,100 @@ static int run_vbr_check(verify_parms *vh, domain_prescreen const *const dps)
 	return rc;
 }
 
-static inline dkim_result sig_is_good(DKIM_SIGINFO *const sig)
+static int cached_sig_ndx(verify_parms const *vh, DKIM_SIGINFO const *sig)
+// index in vh->cached_sig, or -1
+{
+	if (vh)
+		for (int i = 0; i < vh->ncached; ++i)
+			if (vh->cached_sig[i] == sig)
+				return i;
+	return -1;
+}
+
+static int get_sig_cache_key(DKIM_SIGINFO *sig, sig_cache_key *k)
+{
+#if HAVE_DKIM_SIG_GETHASHES
+	void *hh, *bh;
+	if (dkim_sig_gethashes(sig, &hh, &k->hhlen, &bh, &k->bhlen) !=
+		DKIM_STAT_OK)
+			return -1;
+	k->hh = hh;
+	k->bh = bh;
+	k->domain = (char const*)dkim_sig_getdomain(sig);
+	k->selector = (char const*)dkim_sig_getselector(sig);
+	k->b = (char const*)dkim_sig_gettagvalue(sig, 0, (u_char*)"b");
+	return 0;
+#else
+	(void)sig; (void)k;
+	return -1;
+#endif
+}
+
+static int sig_from_cache(verify_parms *vh, DKIM_SIGINFO *sig)
+/*
+* If the verify cache has this exact signature, record it in vh and
+* return 1, so that it needs not be processed.  Return 0 otherwise.
+*/
 {
+	sig_cache_key k;
+	unsigned flags;
+	if (vh->parm->z.verify_cache_ttl <= 0 ||
+		vh->ncached >= (int)(sizeof vh->cached_sig/sizeof vh->cached_sig[0]) ||
+		get_sig_cache_key(sig, &k) ||
+		sig_cache_lookup(&k, &flags) == 0)
+			return 0;
+
+	vh->cached_flags[vh->ncached] = flags;
+	vh->cached_sig[vh->ncached++] = sig;
+	if (vh->parm->z.verbose >= 8)
+		fl_report(LOG_DEBUG, "id=%s: cached pass for %s",
+			vh->parm->dyn.info.id, k.domain);
+	return 1;
+}
+
+static void sig_to_cache(verify_parms *vh, DKIM_SIGINFO *sig)
+// store a signature that passed after processing
+{
+	sig_cache_key k;
+	if (vh->parm->z.verify_cache_ttl > 0 &&
+		cached_sig_ndx(vh, sig) < 0 &&
+		get_sig_cache_key(sig, &k) == 0)
+			sig_cache_store(&k,
+				(dkim_sig_getflags(sig) & DKIM_SIGFLAG_TESTKEY)?
+					SIG_CACHE_TESTKEY: 0);
+}
+
+static int sig_from_native(verify_parms *vh, DKIM_SIGINFO *sig)
+/*
+* If native verification passed this signature, record it in vh like a
+* cached one, and return 1.  Return 0 otherwise, including when OpenDKIM
+* already found an error in it.
+*/
+{
+	unsigned flags;
+	if (vh->fv == NULL || cached_sig_ndx(vh, sig) >= 0 ||
+		vh->ncached >= (int)(sizeof vh->cached_sig/sizeof vh->cached_sig[0]) ||
+		dkim_sig_geterror(sig) != DKIM_SIGERROR_UNKNOWN ||
+		fast_verify_passed(vh->fv, (char const*)dkim_sig_getdomain(sig),
+			(char const*)dkim_sig_gettagvalue(sig, 0, (u_char*)"b"),
+			&flags) == 0)
+				return 0;
+
+	vh->cached_flags[vh->ncached] =
+		(flags & FAST_VERIFY_TESTKEY)? SIG_CACHE_TESTKEY: 0;
+	vh->cached_sig[vh->ncached++] = sig;
+	if (vh->parm->z.verbose >= 8)
+		fl_report(LOG_DEBUG, "id=%s: native pass for %s",
+			vh->parm->dyn.info.id, dkim_sig_getdomain(sig));
+	return 1;
+}
+
+static inline dkim_result sig_is_good(verify_parms const *vh,
+	DKIM_SIGINFO *const sig)
+{
+	if (cached_sig_ndx(vh, sig) >= 0)
+		return dkim_pass;
+
 	unsigned int const sig_flags = dkim_sig_getflags(sig);
 	unsigned int const bh = dkim_sig_getbh(sig);
 	DKIM_SIGERROR const rc = dkim_sig_geterror(sig);
@@ -2278,6 +2526,14 @@ static DKIM_STAT dkim_sig_final(DKIM *dkim, DKIM_SIGINFO** sigs, int nsigs)
 
 	int do_more_sigs = 1;
 
+	/*
+	* Record all the signatures that passed natively, including those the
+	* loop below won't reach, as OpenDKIM may not have seen the body.
+	*/
+	if (vh->fv)
+		for (int i = 0; i < nsigs; ++i)
+			sig_from_native(vh, sigs[i]);
+
 	for (int c = 0; c < ndoms; ++c)
 	{
 		domain_prescreen *const dps = domain_ptr[c];
@@ -2292,10 +2548,12 @@ static DKIM_STAT dkim_sig_final(DKIM *dkim, DKIM_SIGINFO** sigs, int nsigs)
 				unsigned int const sig_flags = dkim_sig_getflags(sig);
 				if (do_more_sigs &&
 					(sig_flags & DKIM_SIGFLAG_IGNORE) == 0 &&
-					dkim_sig_process(dkim, sig) == DKIM_STAT_OK &&
-					(dps->dkim = sig_is_good(sig)) == dkim_pass)
+					(cached_sig_ndx(vh, sig) >= 0 || sig_from_cache(vh, sig) ||
+						dkim_sig_process(dkim, sig) == DKIM_STAT_OK) &&
+					(dps->dkim = sig_is_good(vh, sig)) == dkim_pass)
 				{
 					dps->u.f.sig_is_ok = 1;
+					sig_to_cache(vh, sig);
 					if (dps->sigval++ == 0)
 					{
 						dps->first_good = n;
@@ -2341,13 +2599,16 @@ static DKIM_STAT dkim_sig_final(DKIM *dkim, DKIM_SIGINFO** sigs, int nsigs)
 		}
 	}
 
+	// keep dkim_eom from processing what passed already
+	for (int i = 0; i < vh->ncached; ++i)
+		dkim_sig_ignore(vh->cached_sig[i]);
+
 	return DKIM_CBSTAT_CONTINUE;
-	(void)nsigs; // only used in assert
 }
 
 typedef struct a_r_reader_parm
 {
-	char const *authserv_id, *discarded; // only valid during the call
+	a_r_span authserv_id, discarded; // only valid during the call
 	domain_prescreen *dnswl_dps; // output (was dnswl_domain)
 	dkimfl_parm *parm; // input param
 	domain_prescreen **domain_head; // input for get_prescreen
@@ -2359,6 +2620,9 @@ typedef struct a_r_reader_parm
 	} u;
 } a_r_reader_parm;
 
+#define A_R_SPAN_LOG(s) (s).p? (int)(s).len: 18, \
+	(s).p? (s).p: "(null authserv-id)"
+
 static int a_r_reader(void *v, int step, name_val* nv, size_t nv_count)
 {
 	a_r_reader_parm *arp = v;
@@ -2375,14 +2639,14 @@ static int a_r_reader(void *v, int step, name_val* nv, size_t nv_count)
 
 		if (arp->dnswl_dps || arp->u.ip) // found at least one
 		{
-			if (arp->discarded && arp->parm->z.verbose >= 6)
+			if (arp->discarded.p && arp->parm->z.verbose >= 6)
 				fl_report(LOG_INFO,
-					"id=%s: discarded %s and other %d trusted zone(s) in "
-						"Authentication-Results by %s",
+					"id=%s: discarded %.*s and other %d trusted zone(s) in "
+						"Authentication-Results by %.*s",
 					arp->parm->dyn.info.id,
-					arp->discarded,
+					(int)arp->discarded.len, arp->discarded.p,
 					arp->dnswl_count - 2,
-					arp->authserv_id? arp->authserv_id: "(null authserv-id)");
+					A_R_SPAN_LOG(arp->authserv_id));
 		}
 		else if (arp->parm->z.verbose >= 2)
 		/*
@@ -2392,9 +2656,9 @@ static int a_r_reader(void *v, int step, name_val* nv, size_t nv_count)
 		* maybe_attack and dkim_unrename, below.
 		*/
 			fl_report(rtc? LOG_ERR: LOG_NOTICE,
-				"id=%s: Authentication-Results by %s: %s",
+				"id=%s: Authentication-Results by %.*s: %s",
 				arp->parm->dyn.info.id,
-				arp->authserv_id? arp->authserv_id: "(null authserv-id)",
+				A_R_SPAN_LOG(arp->authserv_id),
 				rtc != 0 ? "unparseable data":
 					arp->resinfo_count <= 0? "empty":
 						"please check ALLOW settings");
@@ -2408,18 +2672,19 @@ static int a_r_reader(void *v, int step, name_val* nv, size_t nv_count)
 		arp->resinfo_count += 1;
 
 		if (nv_count > 0 &&
-			stricmp(nv[0].name, "dnswl") == 0 &&
-			stricmp(nv[0].value, "pass") == 0)
+			a_r_span_is(&nv[0].name, "dnswl") &&
+			a_r_span_is(&nv[0].value, "pass"))
 		{
-			char const *dns_zone = NULL, *policy_txt = NULL, *policy_ip = NULL;
+			a_r_span const *dns_zone = NULL, *policy_txt = NULL,
+				*policy_ip = NULL;
 			for (size_t i = 1; i < nv_count; ++i)
 			{
-				if (stricmp(nv[i].name, "dns.zone") == 0)
-					dns_zone = nv[i].value;
-				else if (stricmp(nv[i].name, "policy.txt") == 0)
-					policy_txt = nv[i].value;
-				else if (stricmp(nv[i].name, "policy.ip") == 0)
-					policy_ip = nv[i].value;
+				if (a_r_span_is(&nv[i].name, "dns.zone"))
+					dns_zone = &nv[i].value;
+				else if (a_r_span_is(&nv[i].name, "policy.txt"))
+					policy_txt = &nv[i].value;
+				else if (a_r_span_is(&nv[i].name, "policy.ip"))
+					policy_ip = &nv[i].value;
 			}
 
 			char const **const zone = arp->parm->z.trusted_dnswl;
@@ -2427,7 +2692,7 @@ static int a_r_reader(void *v, int step, name_val* nv, size_t nv_count)
 			{
 				int trusted = 0;
 				for (size_t i = 0; zone[i] != NULL; ++i)
-					if (stricmp(zone[i], dns_zone) == 0)
+					if (a_r_span_is(dns_zone, zone[i]))
 					{
 						trusted = 1;
 						break;
@@ -2439,10 +2704,11 @@ static int a_r_reader(void *v, int step, name_val* nv, size_t nv_count)
 
 					if (policy_txt && arp->dnswl_dps == NULL)
 					{
-						char cp[64]; // domain length
+						char txt[65], cp[64]; // domain length
+						a_r_span_copy(policy_txt, txt, sizeof txt);
 						for (size_t i = 0; i < sizeof cp; ++i)
 						{
-							int const ch = *(unsigned char*)&policy_txt[i];
+							int const ch = *(unsigned char*)&txt[i];
 							if (ch == 0 || isspace(ch))
 							{
 								if (i > 0)
@@ -2450,15 +2716,17 @@ static int a_r_reader(void *v, int step, name_val* nv, size_t nv_count)
 									cp[i] = 0;
 
 									if ((arp->dnswl_dps =
-										get_prescreen(arp->domain_head, cp)) != NULL)
+										get_prescreen(&arp->parm->dyn.mem,
+											arp->domain_head, cp)) != NULL)
 											arp->dnswl_dps->u.f.is_dnswl = 1;
 									else
 										arp->parm->dyn.rtc = -1;
 
 									if (arp->parm->z.verbose >= 6)
 										fl_report(LOG_INFO,
-											"id=%s: domain %s whitelisted by %s",
-											arp->parm->dyn.info.id, cp, dns_zone);
+											"id=%s: domain %s whitelisted by %.*s",
+											arp->parm->dyn.info.id, cp,
+											(int)dns_zone->len, dns_zone->p);
 								}
 								break;
 							}
@@ -2468,14 +2736,17 @@ static int a_r_reader(void *v, int step, name_val* nv, size_t nv_count)
 								break;
 						}
 					}
-					else if (arp->dnswl_dps && arp->discarded == NULL)
-						arp->discarded = dns_zone;
+					else if (arp->dnswl_dps && arp->discarded.p == NULL)
+						arp->discarded = *dns_zone;
 
 					if (policy_ip && arp->u.ip == 0)
 					{
+						char ip[64];
 						size_t n = 0;
-						char const *p = policy_ip;
-						unsigned bad = 0, u = 0;
+						char const *p = ip;
+						unsigned bad =
+							a_r_span_copy(policy_ip, ip, sizeof ip) >= sizeof ip,
+							u = 0;
 
 						for (;;)
 						{
@@ -2498,13 +2769,13 @@ static int a_r_reader(void *v, int step, name_val* nv, size_t nv_count)
 						{
 							if (arp->parm->z.verbose >= 1)
 								fl_report(LOG_CRIT,
-									"Zone %s lookup has invalid IP %s",
-									dns_zone, policy_ip);
+									"Zone %.*s lookup has invalid IP %s",
+									(int)dns_zone->len, dns_zone->p, ip);
 							arp->u.ip = 0;
 						}
 					}
-					else if (arp->dnswl_dps && arp->discarded == NULL)
-						arp->discarded = dns_zone;
+					else if (arp->dnswl_dps && arp->discarded.p == NULL)
+						arp->discarded = *dns_zone;
 				}
 			}
 		}
@@ -2512,6 +2783,150 @@ static int a_r_reader(void *v, int step, name_val* nv, size_t nv_count)
 	return rtc;
 }
 
+static void prefetch_key(char *s)
+/*
+* s is the value of a DKIM-Signature field:  start querying its key.
+* Tags are just scanned here, OpenDKIM parses the field.
+*/
+{
+	char *d = NULL, *sel = NULL;
+	size_t d_len = 0, sel_len = 0;
+	while (*s)
+	{
+		while (isspace(*(unsigned char*)s) || *s == ';')
+			++s;
+		char *const tag = s;
+		while (isalnum(*(unsigned char*)s) || *s == '_')
+			++s;
+		size_t const tag_len = s - tag;
+		while (isspace(*(unsigned char*)s))
+			++s;
+		if (tag_len == 0 || *s != '=')
+			break;
+
+		++s;
+		while (isspace(*(unsigned char*)s))
+			++s;
+		char *const val = s;
+		while (*s && *s != ';')
+			++s;
+		char *e = s;
+		while (e > val && isspace(((unsigned char*)e)[-1]))
+			--e;
+
+		if (tag_len == 1 && *tag == 'd')
+		{
+			d = val;
+			d_len = e - val;
+		}
+		else if (tag_len == 1 && *tag == 's')
+		{
+			sel = val;
+			sel_len = e - val;
+		}
+	}
+
+	if (d_len && sel_len)
+	{
+		char query[1536];
+		if ((size_t)snprintf(query, sizeof query, "%.*s._domainkey.%.*s",
+			(int)sel_len, sel, (int)d_len, d) < sizeof query)
+				dns_prefetch(query, 16 /* TXT */);
+	}
+}
+
+static void prefetch_from(verify_parms *vh, char *s)
+// s is the value of the From: field:  start querying DMARC records.
+{
+	struct rfc822t *rfcp = rfc822t_alloc_new(s, NULL, NULL);
+	struct rfc822a *rfca = rfcp? rfc822a_alloc(rfcp): NULL;
+	if (rfca)
+	{
+		for (int i = 0; i < rfca->naddrs; ++i)
+			if (rfca->addrs[i].tokens)
+			{
+				char *addr = rfc822_gettok(rfca->addrs[i].tokens);
+				char *domain = addr? strrchr(addr, '@'): NULL;
+				if (domain && *++domain)
+				{
+					publicsuffix_trie const *const pst = vh->parm->pst;
+					char buf[256];
+					char *od = pst? org_domain_buf(pst, domain, buf, sizeof buf):
+						NULL;
+					prefetch_dmarc(domain, od);
+				}
+				free(addr);
+				break;
+			}
+		rfc822a_free(rfca);
+	}
+	if (rfcp)
+		rfc822t_free(rfcp);
+}
+
+static void prefetch_signers(verify_parms *vh, DKIM *dkim)
+// VBR and reputation queries depend on signers, known after dkim_eoh
+{
+	dkimfl_parm *const parm = vh->parm;
+	if (vh->vbr)
+		vbr_prefetch(vh->vbr, &is_trusted_voucher, parm->z.trusted_vouchers);
+
+	char *const reputation_root = parm->z.do_reputation?
+		parm->z.reputation_root: NULL;
+	if (reputation_root && dkim)
+	{
+		char const *const user = dkim_getuser(dkim);
+		char const *const domain = dkim_getdomain(dkim);
+		for (int c = 0; c < vh->ndoms; ++c)
+			if (vh->domain_ptr[c]->nsigs > 0)
+				prefetch_reputation(user, domain, vh->domain_ptr[c]->name,
+					reputation_root);
+	}
+}
+
+static DKIM *verify_open(dkimfl_parm *parm)
+{
+	DKIM_STAT status;
+	DKIM *dkim = dkim_verify(parm->dklib, parm->dyn.info.id, NULL, &status);
+	if (dkim == NULL || status != DKIM_STAT_OK)
+	{
+		char const *err = dkim? dkim_geterror(dkim): NULL;
+		fl_report(LOG_CRIT,
+			"id=%s: cannot init OpenDKIM: %s",
+			parm->dyn.info.id, err? err: "NULL");
+		return NULL;
+	}
+
+	return dkim;
+}
+
+static int has_signature(dkimfl_parm *parm)
+{
+	hdr_block const *const hb = &parm->dyn.hb;
+	for (size_t f = 0; f < hb->nfields; ++f)
+		if (hdr_field_lookup(parm->hfm, hb, f)->id == hf_dkim_signature)
+			return 1;
+
+	return 0;
+}
+
+static int from_address(verify_parms *vh, char const *s)
+// without OpenDKIM, parse the first From: as dkim_getuser/dkim_getdomain
+{
+	char *addr = arena_strdup(&vh->parm->dyn.mem, s), *user, *domain;
+	if (addr == NULL)
+		return -1;
+
+	if (dkim_mail_parse(addr,
+		cast_u_char_parm_array(&user), cast_u_char_parm_array(&domain)) == 0 &&
+		domain && *domain)
+	{
+		vh->from_user = user;
+		vh->dkim_domain = domain;
+	}
+	return 0;
+}
+
 static int verify_headers(verify_parms *vh)
 // return parm->dyn.rtc = -1 for unrecoverable error,
 // parm->dyn.rtc (0) otherwise
@@ -2519,45 +2934,57 @@ static int verify_headers(verify_parms *vh)
 	assert(vh && vh->parm);
 
 	dkimfl_parm *const parm = vh->parm;
-	size_t keep = 0;
-	var_buf *vb = &parm->dyn.vb;
+	hdr_block *const hb = &parm->dyn.hb;
 	FILE* fp = fl_get_file(parm->fl);
 	assert(fp);
-	DKIM *const dkim = vh->step? NULL: vh->dkim_or_file;
-	FILE *const out = vh->step? vh->dkim_or_file: NULL;
+	int const first = vh->step == 0;
+	DKIM *dkim = first? vh->dkim_or_file: NULL;
+	FILE *const out = first? NULL: vh->dkim_or_file;
 
-	int seen_received = 0;
+	int seen_received = 0, seen_from = 0;
 	int const do_vbr = parm->z.trusted_vouchers != NULL;
 
-	for (;;)
+	if (read_header(parm, fp))
 	{
-		char *p = vb_fgets(vb, keep, fp);
-		char *eol = p? strchr(p, '\n'): NULL;
+		if (hb->buf == NULL)
+			clean_stats(parm);
+		return parm->dyn.rtc;
+	}
 
-		if (eol == NULL)
-		{
-			if (parm->z.verbose)
-				fl_report(LOG_ALERT,
-					"id=%s: header too long (%.20s...)",
-					parm->dyn.info.id, vb_what(vb, fp));
-			if (vb->buf == NULL)
-				clean_stats(parm);
+	/*
+	* with verify_unsigned_fast, OpenDKIM is only started for signed messages
+	*/
+	if (first && dkim == NULL && has_signature(parm))
+	{
+		if ((dkim = verify_open(parm)) == NULL)
 			return parm->dyn.rtc = -1;
-		}
+		vh->dkim_or_file = dkim;
+	}
 
-		int const next = eol > p? fgetc(fp): '\n';
-		int const cont = next != EOF && next != '\n';
-		char *const start = vb->buf;
-		if (cont && isspace(next)) // wrapped
+	for (size_t f = 0; f < hb->nfields; ++f)
+	{
+		/*
+		* on the first step, the field is copied with CRLF folds;
+		* on the second, it is processed in place
+		*/
+		char *start, *eol, *next = NULL, save = 0;
+		if (first)
 		{
-			if (dkim)
+			size_t len;
+			if ((start = hdr_field_crlf(hb, f, &len)) == NULL)
 			{
-				*eol++ = '\r';
-				*eol = '\n';
+				fl_report(LOG_ALERT, "MEMORY FAULT");
+				return parm->dyn.rtc = -1;
 			}
-			*++eol = next;
-			keep = eol + 1 - start;
-			continue;
+			eol = start + len;
+		}
+		else
+		{
+			start = hb->buf + hb->field[f].start;
+			eol = hb->buf + hb->field[f].end;
+			next = eol + 1;
+			save = *next;
+			*next = 0;
 		}
 
 		/*
@@ -2566,14 +2993,16 @@ static int verify_headers(verify_parms *vh)
 		*/
 		int zap = 0;
 		size_t dkim_unrename = 0;
-		char *s;
+		hfield_entry const *const hf = hdr_field_lookup(parm->hfm, hb, f);
+		char *s = hf->name?
+			start + (hb->field[f].colon - hb->field[f].start) + 1: NULL;
 
 		// malformed headers can go away...
 		if (!isalpha(*(unsigned char*)start))
 			zap = 1;
 
 		// A-R fields
-		else if ((s = hdrval(start, "Authentication-Results")) != NULL)
+		else if (hf->id == hf_authentication_results)
 		{
 			if (!parm->z.trust_a_r)
 			{
@@ -2605,7 +3034,7 @@ static int verify_headers(verify_parms *vh)
 						if (parm->dyn.authserv_id &&
 							stricmp(authserv_id, parm->dyn.authserv_id) == 0)
 								maybe_attack = zap = 1;
-						if (dkim == NULL && parm->z.verbose >= 2) // log on 2nd pass
+						if (!first && parm->z.verbose >= 2) // log on 2nd pass
 						{
 							if (maybe_attack)
 								fl_report(LOG_NOTICE,
@@ -2622,7 +3051,7 @@ static int verify_headers(verify_parms *vh)
 				}
 			}
 			// acquire trusted results on 1st pass
-			else if (dkim)
+			else if (first)
 			{
 				a_r_reader_parm arp;
 				memset(&arp, 0, sizeof arp);
@@ -2639,12 +3068,12 @@ static int verify_headers(verify_parms *vh)
 		}
 
 		// Only on first step, acquire relevant header info, and unrename
-		else if (dkim)
+		else if (first)
 		{
 			// cache courier's SPF results, get authserv_id, count Received
-			if (strincmp(start, "Received", 8) == 0)
+			if (hf->id == hf_received || hf->id == hf_received_spf)
 			{
-				if ((s = hdrval(start, "Received")) != NULL)
+				if (hf->id == hf_received)
 				{
 					if (parm->dyn.stats)
 						parm->dyn.stats->received_count += 1;
@@ -2682,8 +3111,7 @@ static int verify_headers(verify_parms *vh)
 					}
 				}
 
-				else if (!parm->z.no_spf && vh->received_spf < 3 &&
-					(s = hdrval(start, "Received-SPF")) != NULL)
+				else if (!parm->z.no_spf && vh->received_spf < 3)
 				{
 					++vh->received_spf;
 					while (isspace(*(unsigned char*)s))
@@ -2705,7 +3133,8 @@ static int verify_headers(verify_parms *vh)
 							{
 								*esender = 0;
 								domain_prescreen *dps =
-									get_prescreen(&vh->domain_head, sender);
+									get_prescreen(&parm->dyn.mem,
+										&vh->domain_head, sender);
 								if (dps)
 								{
 									// multiple spf result can race, choose the higher
@@ -2737,7 +3166,7 @@ static int verify_headers(verify_parms *vh)
 			}
 
 			//  collect VBR-Info
-			else if ((s = hdrval(start, "VBR-Info")) != NULL)
+			else if (hf->id == hf_vbr_info)
 			{
 				if (do_vbr)
 				{
@@ -2762,27 +3191,49 @@ static int verify_headers(verify_parms *vh)
 			* a signature by unrenaming seems to be lower than that
 			* of breaking it by not doing so.
 			*/
-			else if ((s = hdrval(start, "Old-Authentication-Results")) != NULL)
+			else if (hf->id == hf_old_authentication_results)
 			{
 				dkim_unrename = 4;
 			}
 
 			// (only if stats enabled)
 			// save stats' content_type and content_encoding, check mailing_list
-			else if (parm->dyn.stats)
-				collect_stats(parm, start);
+			else if (parm->dyn.stats && s)
+				collect_stats(parm, hf->id, s);
+
+			// start lookups early, so that they overlap body processing
+			if (parm->z.dns_prefetch)
+			{
+				if (hf->id == hf_dkim_signature)
+					prefetch_key(s);
+				else if (vh->from_prefetched == 0 && hf->id == hf_from)
+				{
+					vh->from_prefetched = 1;
+					prefetch_from(vh, s);
+				}
+			}
+
+			if (dkim == NULL && seen_from == 0 && hf->id == hf_from)
+			{
+				seen_from = 1;
+				if (from_address(vh, s))
+				{
+					fl_report(LOG_ALERT, "MEMORY FAULT");
+					return parm->dyn.rtc = -1;
+				}
+			}
 
 			// action header
-			if (parm->z.action_header && parm->dyn.action_header == NULL &&
-				(s = hdrval(start, parm->z.action_header)) != NULL &&
-				(parm->dyn.action_header = strdup_normalize(s, 0)) == NULL)
+			if ((hf->flags & HF_ACTION) && parm->dyn.action_header == NULL &&
+				(parm->dyn.action_header =
+					strdup_normalize(&parm->dyn.mem, s, 0)) == NULL)
 			{
 				fl_report(LOG_ALERT, "MEMORY FAULT");
 				return parm->dyn.rtc = -1;
 			}
 		}
 
-		if (!zap)
+		if (!zap && (dkim || out))
 		{
 			int err = 0;
 			DKIM_STAT status;
@@ -2791,6 +3242,12 @@ static int verify_headers(verify_parms *vh)
 			{
 				status = dkim_header(dkim, start + dkim_unrename, len);
 				err = status != DKIM_STAT_OK;
+				if (vh->fv && status == DKIM_STAT_OK &&
+					fast_verify_header(vh->fv, start + dkim_unrename, len))
+				{
+					fast_verify_free(vh->fv); // just go without
+					vh->fv = NULL;
+				}
 				if (err && status == DKIM_STAT_SYNTAX)
 				{
 					err = 0;
@@ -2837,11 +3294,8 @@ static int verify_headers(verify_parms *vh)
 			}			
 		}
 
-		if (!cont)
-			break;
-
-		start[0] = next;
-		keep = 1;
+		if (next)
+			*next = save;
 	}
 	
 	/*
@@ -2849,25 +3303,31 @@ static int verify_headers(verify_parms *vh)
 	* check results thus far.
 	*/
 
-	if (dkim)
+	if (first)
 	{
-		vh->dkim_domain = dkim_getdomain(dkim);
-		dkim_set_user_context(dkim, vh);
-
-		DKIM_STAT status = dkim_eoh(dkim);
-		if (status != DKIM_STAT_OK)
+		if (dkim)
 		{
-			if (parm->z.verbose >= 7 ||
-				parm->z.verbose >= 5 && status != DKIM_STAT_NOSIG)
+			vh->dkim_domain = dkim_getdomain(dkim);
+			dkim_set_user_context(dkim, vh);
+
+			DKIM_STAT status = dkim_eoh(dkim);
+			if (status != DKIM_STAT_OK)
 			{
-				char const *err = dkim_getresultstr(status);
-				fl_report(LOG_INFO,
-					"id=%s: verifying dkim_eoh: %s (stat=%d)",
-					parm->dyn.info.id, err? err: "(NULL)", (int)status);
+				if (parm->z.verbose >= 7 ||
+					parm->z.verbose >= 5 && status != DKIM_STAT_NOSIG)
+				{
+					char const *err = dkim_getresultstr(status);
+					fl_report(LOG_INFO,
+						"id=%s: verifying dkim_eoh: %s (stat=%d)",
+						parm->dyn.info.id, err? err: "(NULL)", (int)status);
+				}
+				// parm->dyn.rtc set by callback
 			}
-			// parm->dyn.rtc set by callback
 		}
 
+		if (parm->z.dns_prefetch && parm->dyn.rtc == 0)
+			prefetch_signers(vh, dkim);
+
 		if (parm->dyn.authserv_id == NULL && parm->z.verbose)
 			fl_report(LOG_ERR,
 				"id=%s: missing courier's Received field",
@@ -2912,10 +3372,13 @@ static int print_signature_resinfo(FILE *fp, domain_prescreen *dps, int nsig,
 
 	sig = sigs[nsig + dps->start_ndx];
 
+	verify_parms const *const vh = dkim_get_user_context(dkim);
+	int const cached = cached_sig_ndx(vh, sig);
 	unsigned int sig_flags;
 	if (sig == NULL ||
-		((sig_flags = dkim_sig_getflags(sig)) & DKIM_SIGFLAG_IGNORE) != 0)
-			return 0;
+		((sig_flags = dkim_sig_getflags(sig)) & DKIM_SIGFLAG_IGNORE) != 0 &&
+			cached < 0)
+				return 0;
 
 	char buf[80], *id = NULL, htype = 0;
 	memset(buf, 0, sizeof buf);
@@ -2948,8 +3411,10 @@ static int print_signature_resinfo(FILE *fp, domain_prescreen *dps, int nsig,
 	if (id == NULL || htype == 0) //useless to report an unidentifiable signature
 		return 0;
 
-	int const is_test = (sig_flags & DKIM_SIGFLAG_TESTKEY) != 0;
-	dkim_result dr = sig_is_good(sig);
+	int const is_test = cached >= 0?
+		(vh->cached_flags[cached] & SIG_CACHE_TESTKEY) != 0:
+		(sig_flags & DKIM_SIGFLAG_TESTKEY) != 0;
+	dkim_result dr = sig_is_good(vh, sig);
 	char const *result = get_dkim_result(dr), *err = NULL;
 
 	if (dr == dkim_neutral || dr == dkim_fail)
@@ -3201,7 +3666,7 @@ static int write_file(verify_parms *vh, FILE *fp, DKIM_STAT status)
 		{
 			method = "dkim-adsp";
 #if HAVE_DKIM_GETUSER
-			char const *const user = dkim_getuser(dkim);
+			char const *const user = dkim? dkim_getuser(dkim): vh->from_user;
 			if (user && vh->dkim_domain)
 				printed = fprintf(fp, ";\n  dkim-adsp=%s header.from=%s@%s",
 					vh->policy_result, user, vh->dkim_domain);
@@ -3360,6 +3825,177 @@ save_file(dkimfl_parm *parm, char const *envelope_sender, char **fname_ptr)
 	return NULL;
 }
 
+static int verify_native(verify_parms *vh)
+/*
+* Hash the body and check the signatures natively.  Return 0 if all of
+* them passed, so that OpenDKIM needs not see the body.  Otherwise rewind
+* the body and return -1, or set parm->dyn.rtc = -1 if that fails.
+*/
+{
+	assert(vh && vh->parm && vh->fv);
+
+	dkimfl_parm *const parm = vh->parm;
+	int const nsigs = fast_verify_eoh(vh->fv);
+	if (nsigs <= 0 ||
+		nsigs > (int)(sizeof vh->cached_sig/sizeof vh->cached_sig[0]))
+			return -1; // cannot record them all
+
+	FILE* fp = fl_get_file(parm->fl);
+	assert(fp);
+	off_t const body = ftello(fp);
+	if (body < 0)
+		return -1;
+
+	char buf[16384];
+	size_t len;
+	while ((len = fread(buf, 1, sizeof buf, fp)) > 0)
+		if (fast_verify_body(vh->fv, buf, len))
+			break;
+
+	int const passed = ferror(fp)? 0:
+		fast_verify_eom(vh->fv, parm->z.min_key_bits, &key_lookup);
+	if (parm->z.verbose >= 8)
+		fl_report(LOG_DEBUG, "id=%s: %d of %d signatures passed natively",
+			parm->dyn.info.id, passed, nsigs);
+	if (passed == nsigs)
+		return 0;
+
+	clearerr(fp);
+	if (fseeko(fp, body, SEEK_SET))
+	{
+		fl_report(LOG_ALERT, "id=%s: cannot rewind body: %s",
+			parm->dyn.info.id, strerror(errno));
+		parm->dyn.rtc = -1;
+	}
+	return -1;
+}
+
+static void policy_lookup(verify_parms *vh)
+/*
+* Look up the DMARC or ADSP record of the author domain, once.
+* Set parm->dyn.rtc = -1 on temporary failure.
+*/
+{
+	assert(vh && vh->parm && vh->dkim_domain);
+
+	dkimfl_parm *const parm = vh->parm;
+	vh->policy_checked = 1;
+
+	if (vh->do_dmarc >= vh->do_adsp)
+	{
+		vh->presult = get_dmarc(vh->dkim_domain, vh->org_domain, &vh->dmarc);
+		if (vh->presult == 0)
+			vh->policy = vh->dmarc.effective_p;
+
+		if (parm->z.verbose >= 7)
+		{
+			char *disp = vh->dkim_domain;
+			if (vh->org_domain && strcmp(vh->dkim_domain, vh->org_domain) != 0)
+			{
+				size_t len = strlen(vh->dkim_domain), le = strlen(vh->org_domain);
+				char *p = len > le? malloc(len + 3): NULL;
+				if (p)
+				{
+					size_t diff = len - le;
+					disp = p;
+					*p++ = '[';
+					memcpy(p, vh->dkim_domain, diff);
+					p += diff;
+					*p++ = ']';
+					memcpy(p, vh->org_domain, le + 1);
+				}
+			}
+			fl_report(LOG_INFO,
+				"DMARC %sabled (%d), policy %s for %s",
+					vh->do_dmarc > 0? "en": "dis", vh->do_dmarc,
+					presult_explain(vh->presult), disp);
+			if (disp != vh->dkim_domain)
+				free(disp);
+		}
+	}
+
+	if (vh->presult != 0 && vh->presult != 3 && vh->do_dmarc <= vh->do_adsp)
+	{
+		vh->presult = my_get_adsp(vh->dkim_domain, &vh->policy);
+
+		if (parm->z.verbose >= 7)
+			fl_report(LOG_INFO,
+				"ADSP %sabled (%d), policy %s for %s",
+					vh->do_adsp > 0? "en": "dis", vh->do_adsp,
+					presult_explain(vh->presult), vh->dkim_domain);
+	}
+
+	if (vh->presult <= -2 &&
+		(vh->do_dmarc > 0 || vh->do_adsp > 0 || parm->z.reject_on_nxdomain))
+	{
+		if (parm->z.verbose >= 3)
+			fl_report(LOG_ERR,
+				"id=%s: temporary author domain verification failure: %s",
+				parm->dyn.info.id,
+				vh->presult == -2? "DNS server": "garbled data");
+		parm->dyn.rtc = -1;
+	}
+}
+
+static int early_policy(verify_parms *vh)
+/*
+* Called after the header pass if reject_on_nxdomain.  A message with no
+* signatures, no SPF pass, and no DNSWL records cannot be whitelisted or
+* vouched for, so a non-existent author domain is rejected before reading
+* the body.  Return 1 if so, with rtc 2 and the skipped body size in stats.
+*/
+{
+	assert(vh && vh->parm);
+
+	dkimfl_parm *const parm = vh->parm;
+	if (parm->dyn.rtc != 0 || vh->ndoms > 0 || vh->dnswl_count > 0 ||
+		vh->dkim_domain == NULL)
+			return 0;
+
+	for (domain_prescreen *dps = vh->domain_head; dps; dps = dps->next)
+		if (dps->u.f.spf_pass)
+			return 0;
+
+	if (vh->domain_flags == 0 && domain_flags(vh) != 0)
+		return 0;
+
+	policy_lookup(vh);
+	if (vh->presult != 3 || parm->dyn.rtc != 0)
+		return 0;
+
+	off_t skipped = 0;
+	FILE *fp = fl_get_file(parm->fl);
+	struct stat st;
+	if (fp && fstat(fileno(fp), &st) == 0)
+	{
+		off_t const body = ftello(fp);
+		if (body >= 0 && st.st_size > body)
+			skipped = st.st_size - body;
+	}
+
+	fl_pass_message(parm->fl, "550 Invalid author domain\n");
+	parm->dyn.rtc = 2;
+	vh->early_decision = 1;
+	vh->policy = ADSP_POLICY_ALL;
+	if (parm->dyn.stats)
+	{
+		parm->dyn.stats->nxdomain = 1;
+		parm->dyn.stats->reject = 1;
+		parm->dyn.stats->dmarc_dispo = 2;
+		parm->dyn.stats->skipped_body = skipped;
+	}
+
+	if (parm->z.verbose >= 3)
+		fl_report(LOG_INFO,
+			"id=%s: invalid domain %s, no VBR and no whitelist",
+			parm->dyn.info.id, vh->dkim_domain);
+	if (parm->z.verbose >= 5)
+		fl_report(LOG_INFO,
+			"id=%s: rejected before body, %lld bytes not hashed",
+			parm->dyn.info.id, (long long)skipped);
+	return 1;
+}
+
 static void verify_message(dkimfl_parm *parm)
 /*
 * add/remove A-R records, set rtc 1 if ok, 2 if rejected, -1 if failed,
@@ -3372,15 +4008,18 @@ static void verify_message(dkimfl_parm *parm)
 	vh.policy = DKIM_POLICY_NONE;
 	vh.do_adsp = parm->z.honor_author_domain != 0;
 	vh.do_dmarc = parm->z.honor_dmarc != 0;
+	if (parm->z.verify_native)
+		vh.fv = fast_verify_new();
 
-	DKIM_STAT status;
-	DKIM *dkim = dkim_verify(parm->dklib, parm->dyn.info.id, NULL, &status);
-	if (dkim == NULL || status != DKIM_STAT_OK)
+	/*
+	* with verify_unsigned_fast, verify_headers() starts OpenDKIM only if
+	* there are signatures; otherwise the body is never read
+	*/
+	DKIM_STAT status = DKIM_STAT_NOSIG;
+	DKIM *dkim = NULL;
+	if (parm->z.verify_unsigned_fast == 0 &&
+		(dkim = verify_open(parm)) == NULL)
 	{
-		char const *err = dkim? dkim_geterror(dkim): NULL;
-		fl_report(LOG_CRIT,
-			"id=%s: cannot init OpenDKIM: %s",
-			parm->dyn.info.id, err? err: "NULL");
 		parm->dyn.rtc = -1;
 		clean_stats(parm);
 		return;
@@ -3389,12 +4028,14 @@ static void verify_message(dkimfl_parm *parm)
 	vh.dkim_or_file = dkim;
 	vh.parm = parm;
 	verify_headers(&vh);
+	dkim = vh.dkim_or_file;
 
 	if (parm->dyn.authserv_id == NULL || parm->dyn.rtc != 0)
 	{
 		clean_stats(parm);
 		clean_vh(&vh);
-		dkim_free(dkim);
+		if (dkim)
+			dkim_free(dkim);
 		if (parm->dyn.rtc == 0)
 			fl_report(LOG_ERR,
 				"id=%s: missing Courier Received: ignoring message",
@@ -3402,10 +4043,21 @@ static void verify_message(dkimfl_parm *parm)
 		return;
 	}
 
-	if (dkim_minbody(dkim) > 0)
-		copy_body(parm, dkim);
+	if (parm->z.reject_on_nxdomain && early_policy(&vh))
+		status = DKIM_STAT_NOSIG; // body not read
+	else if (dkim)
+	{
+		if ((vh.fv == NULL || verify_native(&vh) != 0) &&
+			parm->dyn.rtc == 0 && dkim_minbody(dkim) > 0)
+				copy_body(parm, dkim);
+
+		status = dkim_eom(dkim, NULL);
+	}
 
-	status = dkim_eom(dkim, NULL);
+	// signatures passed from the cache or natively are ignored by OpenDKIM
+	if (vh.ncached > 0 &&
+		(status == DKIM_STAT_NOSIG || status == DKIM_STAT_BADSIG))
+			status = DKIM_STAT_OK;
 
 	switch (status)
 	{
@@ -3415,7 +4067,8 @@ static void verify_message(dkimfl_parm *parm)
 
 		case DKIM_STAT_NOSIG:
 			// none
-			vh.dkim_domain = dkim_getdomain(dkim);
+			if (dkim)
+				vh.dkim_domain = dkim_getdomain(dkim);
 
 		case DKIM_STAT_BADSIG: // should be treated as NOSIG...
 			break;
@@ -3498,7 +4151,8 @@ static void verify_message(dkimfl_parm *parm)
 	/*
 	* pass unauthenticated From: to database
 	*/
-	if (parm->dyn.rtc == 0 && vh.dkim_domain && parm->dyn.stats)
+	if ((parm->dyn.rtc == 0 || vh.early_decision) &&
+		vh.dkim_domain && parm->dyn.stats)
 		if (parm->z.publicsuffix)
 			parm->dyn.stats->scope = save_unauthenticated_dmarc;
 		else if (parm->z.save_from_anyway)
@@ -3507,63 +4161,9 @@ static void verify_message(dkimfl_parm *parm)
 	/*
 	* DMARC/ADSP policy check
 	*/
-	if (parm->dyn.rtc == 0 && vh.dkim_domain != NULL)
-	{
-		if (vh.do_dmarc >= vh.do_adsp)
-		{
-			vh.presult = get_dmarc(vh.dkim_domain, vh.org_domain, &vh.dmarc);
-			if (vh.presult == 0)
-				vh.policy = vh.dmarc.effective_p;
-
-			if (parm->z.verbose >= 7)
-			{
-				char *disp = vh.dkim_domain;
-				if (vh.org_domain && strcmp(vh.dkim_domain, vh.org_domain) != 0)
-				{
-					size_t len = strlen(vh.dkim_domain), le = strlen(vh.org_domain);
-					char *p = len > le? malloc(len + 3): NULL;
-					if (p)
-					{
-						size_t diff = len - le;
-						disp = p;
-						*p++ = '[';
-						memcpy(p, vh.dkim_domain, diff);
-						p += diff;
-						*p++ = ']';
-						memcpy(p, vh.org_domain, le + 1);
-					}
-				}
-				fl_report(LOG_INFO,
-					"DMARC %sabled (%d), policy %s for %s",
-						vh.do_dmarc > 0? "en": "dis", vh.do_dmarc,
-						presult_explain(vh.presult), disp);
-				if (disp != vh.dkim_domain)
-					free(disp);
-			}
-		}
-
-		if (vh.presult != 0 && vh.presult != 3 && vh.do_dmarc <= vh.do_adsp)
-		{
-			vh.presult = my_get_adsp(vh.dkim_domain, &vh.policy);
-
-			if (parm->z.verbose >= 7)
-				fl_report(LOG_INFO,
-					"ADSP %sabled (%d), policy %s for %s",
-						vh.do_adsp > 0? "en": "dis", vh.do_adsp,
-						presult_explain(vh.presult), vh.dkim_domain);
-		}
-
-		if (vh.presult <= -2 &&
-			(vh.do_dmarc > 0 || vh.do_adsp > 0 || parm->z.reject_on_nxdomain))
-		{
-			if (parm->z.verbose >= 3)
-				fl_report(LOG_ERR,
-					"id=%s: temporary author domain verification failure: %s",
-					parm->dyn.info.id,
-					vh.presult == -2? "DNS server": "garbled data");
-			parm->dyn.rtc = -1;
-		}
-	}
+	if (parm->dyn.rtc == 0 && vh.dkim_domain != NULL &&
+		vh.policy_checked == 0)
+			policy_lookup(&vh);
 
 	int from_sig_is_ok = 0, aligned_sig_is_ok = 0, aligned_spf_is_ok = 0;
 	for (domain_prescreen *dps = vh.domain_head; dps; dps = dps->next)
@@ -4090,7 +4690,8 @@ static void verify_message(dkimfl_parm *parm)
 			parm->dyn.rtc = -1;
 			clean_stats(parm);
 			clean_vh(&vh);
-			dkim_free(dkim);
+			if (dkim)
+				dkim_free(dkim);
 			return;
 		}
 		write_file(&vh, fp, status);
@@ -4110,7 +4711,8 @@ static void verify_message(dkimfl_parm *parm)
 		vh.vbr_result.resp = NULL;
 	}
 	clean_vh(&vh);
-	dkim_free(dkim);
+	if (dkim)
+		dkim_free(dkim);
 }
 
 // after filter functions
@@ -4339,13 +4941,39 @@ static void after_filter_stats(fl_parm *fl)
 {
 	dkimfl_parm *parm = get_parm(fl);
 
-	if (parm && parm->dwa && parm->dyn.stats)
+	if (parm && parm->dyn.stats && parm->z.stats_store)
+		store_stats(parm);
+
+	if (parm && parm->dwa && parm->dyn.stats &&
+		(parm->dyn.stats->outgoing?
+			parm->use_dwa_after_sign: parm->use_dwa_verifying))
 	{
-		if (check_db_connected(parm) == 0)
+		if (send_to_stats_writer(parm) == 0)
+		{
+			if (parm->z.verbose >= 8)
+				fl_report(LOG_DEBUG, "id=%s: stats queued", parm->dyn.info.id);
+		}
+		else if (check_db_connected(parm) == 0)
 		{
+			/*
+			* db_set_stats_info takes strings from stats, so serialize
+			* them beforehand, in case they have to be spooled.
+			*/
+			char *rec = NULL;
+			size_t rec_len = 0;
+			if (parm->z.stats_spool &&
+				(rec_len = db_stats_serialize(parm->dwa, parm->dyn.stats,
+					NULL, 0)) > 0 &&
+				(rec = malloc(rec_len)) != NULL)
+					db_stats_serialize(parm->dwa, parm->dyn.stats, rec, rec_len);
+
 			parm->dyn.stats->pst = parm->pst;
 			db_set_stats_info(parm->dwa, parm->dyn.stats);
-			if (parm->dyn.stats->outgoing && !parm->user_blocked)
+			if (rec && db_stats_lost(parm->dwa))
+				spool_stats(parm, rec, rec_len);
+			free(rec);
+
+			if (parm->dyn.stats->outgoing && parm->dyn.check_user)
 			{
 				char *block = db_check_user(parm->dwa);
 				/*
@@ -4363,6 +4991,8 @@ static void after_filter_stats(fl_parm *fl)
 				}
 			}
 		}
+		else
+			spool_stats(parm, NULL, 0);
 		some_dwa_cleanup(parm);
 	}
 	clean_stats(parm);
@@ -4370,10 +5000,10 @@ static void after_filter_stats(fl_parm *fl)
 
 static inline void enable_dwa(dkimfl_parm *parm)
 {
-	if (parm->dwa &&
-		(parm->dyn.stats = malloc(sizeof *parm->dyn.stats)) != NULL)
+	if ((parm->dwa || parm->z.stats_store) &&
+		(parm->dyn.stats =
+			arena_calloc(&parm->dyn.mem, sizeof *parm->dyn.stats)) != NULL)
 	{
-		memset(parm->dyn.stats, 0, sizeof *parm->dyn.stats);
 		parm->dyn.stats->ino_mtime_pid = parm->dyn.info.id;
 	}
 }
@@ -4383,6 +5013,7 @@ static void dkimfilter(fl_parm *fl)
 	static char default_jobid[] = "NULL";
 	dkimfl_parm *parm = get_parm(fl);
 	parm->fl = fl;
+	arena_reset(&parm->dyn.mem);
 
 	fl_get_msg_info(fl, &parm->dyn.info);
 	if (parm->dyn.info.id == NULL)
@@ -4393,23 +5024,18 @@ static void dkimfilter(fl_parm *fl)
 		if (parm->split != split_verify_only &&
 			parm->dyn.info.authsender)
 		{
-			if (parm->use_dwa_after_sign)
+			if (parm->use_dwa_after_sign || parm->z.stats_store)
 				enable_dwa(parm);
 			sign_message(parm);
 		}
 	}
 	else if (parm->split != split_sign_only)
 	{
-		if (vb_init(&parm->dyn.vb))
-			parm->dyn.rtc = -1;
-		else
-		{
-			if (parm->use_dwa_verifying)
-				enable_dwa(parm);
-			verify_message(parm);
-		}
+		if (parm->use_dwa_verifying || parm->z.stats_store)
+			enable_dwa(parm);
+		verify_message(parm);
 	}
-	vb_clean(&parm->dyn.vb);
+	hdr_block_clean(&parm->dyn.hb);
 
 	static char const resp_tempfail[] =
 		"432 Mail filter temporarily unavailable.\n";
@@ -4480,9 +5106,119 @@ static void report_config(fl_parm *fl)
 	print_parm(parm_target);
 }
 
+/*
+* libopendkim key lookup callback, in place of its DNS query, so that keys
+* can be cached across processes.  Temporary errors return TRYAGAIN, which
+* the library reports as DKIM_STAT_CBTRYAGAIN, a temporary failure.
+*/
+static DKIM_CBSTAT my_key_lookup(DKIM *dkim, DKIM_SIGINFO *sig,
+	unsigned char *buf, size_t buflen)
+{
+	char const *const selector = (char const*)dkim_sig_getselector(sig);
+	char const *const domain = (char const*)dkim_sig_getdomain(sig);
+
+	switch (key_lookup(selector, domain, (char*)buf, buflen))
+	{
+		case 0:
+			return DKIM_CBSTAT_CONTINUE;
+
+		case 1:
+		case 3:
+			return DKIM_CBSTAT_NOTFOUND;
+
+		case -2:
+			return DKIM_CBSTAT_TRYAGAIN;
+
+		default:
+			return DKIM_CBSTAT_REJECT;
+	}
+	(void)dkim;
+}
+
+#if HAVE_DKIM_DNS_SET_QUERY_START
+/*
+* libopendkim DNS callbacks, so that key queries go through dns_query(),
+* which uses ZONEFILE, prefetched answers, and zone health.  The answer is
+* obtained at start; waitreply just reports it.
+*/
+static int my_query_start(void *srv, int type, unsigned char *query,
+	unsigned char *buf, size_t buflen, void **qh)
+{
+	int *len = malloc(sizeof *len);
+	if (len == NULL)
+		return DKIM_DNS_ERROR;
+
+	*len = dns_query((char const*)query, type, buf, (int)buflen);
+	*qh = len;
+	return DKIM_DNS_SUCCESS;
+	(void)srv;
+}
+
+static int my_query_waitreply(void *srv, void *qh, struct timeval *to,
+	size_t *bytes, int *error, int *dnssec)
+{
+	int const len = *(int*)qh;
+	if (len < 0) // -1 lost or timed out, -2 breaker open
+		return len == -1? DKIM_DNS_EXPIRED: DKIM_DNS_ERROR;
+
+	if (bytes)
+		*bytes = len;
+	if (error)
+		*error = 0;
+	if (dnssec)
+		*dnssec = DKIM_DNSSEC_UNKNOWN;
+	return DKIM_DNS_SUCCESS;
+	(void)srv, (void)to;
+}
+
+static int my_query_cancel(void *srv, void *qh)
+{
+	free(qh);
+	return DKIM_DNS_SUCCESS;
+	(void)srv;
+}
+
+static int set_dns_callbacks(DKIM_LIB *lib)
+{
+	return
+		dkim_dns_set_query_start(lib, &my_query_start) != DKIM_STAT_OK ||
+		dkim_dns_set_query_waitreply(lib, &my_query_waitreply) !=
+			DKIM_STAT_OK ||
+		dkim_dns_set_query_cancel(lib, &my_query_cancel) != DKIM_STAT_OK;
+}
+
+static int set_zonefile(dkimfl_parm *parm)
+{
+	static char zonefile[] = "ZONEFILE";
+	int bad_line = 0;
+
+	if (access(zonefile, R_OK) != 0)
+		return 0;
+
+	int const nrec = dns_zone_load(zonefile, &bad_line);
+	int const nok = nrec < 0 || set_dns_callbacks(parm->dklib);
+
+	if (nok)
+		fl_report(LOG_ERR, "cannot use \"%s\": %s",
+			zonefile, nrec < 0? strerror(errno): "callbacks not set");
+	else
+	{
+		set_adsp_query_faked('r');
+		if (bad_line)
+			fl_report(LOG_WARNING, "%s: bad record at line %d",
+				zonefile, bad_line);
+		if (parm->z.verbose >= 8)
+			fl_report(LOG_INFO, "DNS queries answered from \"%s\", %d records",
+				zonefile, nrec);
+	}
+	return 1;
+}
+#endif // HAVE_DKIM_DNS_SET_QUERY_START
+
 /*
 * faked DNS lookups by libopendkim, test2 function
 * (for gdb debugging: use --batch-run and then exit+)
+* If a ZONEFILE exists, all queries are answered from it instead of KEYFILE.
 */
 static void set_keyfile(fl_parm *fl)
 {
@@ -4494,10 +5230,16 @@ static void set_keyfile(fl_parm *fl)
 	
 	assert(parm);
 
+#if HAVE_DKIM_DNS_SET_QUERY_START
+	if (set_zonefile(parm))
+		return;
+#endif
+
 	int nok = dkim_options(parm->dklib, DKIM_OP_SETOPT,
 			DKIM_OPTS_QUERYMETHOD, &qtype, sizeof qtype) |
 		dkim_options(parm->dklib, DKIM_OP_SETOPT,
-			DKIM_OPTS_QUERYINFO, keyfile, strlen(keyfile));
+			DKIM_OPTS_QUERYINFO, keyfile, strlen(keyfile)) |
+		dkim_set_key_lookup(parm->dklib, NULL);
 	
 	set_adsp_query_faked('k');
 
@@ -4603,6 +5345,38 @@ static void check_blocked_user_list(fl_parm *fl)
 
 	parm->fl = fl;
 	update_blocked_user_list(parm);
+	dbw_check(parm->dwa, parm->pst, &parm->z, &fl_report);
+	if (parm->z.domain_flags_snapshot)
+		snapshot_map(parm->z.domain_flags_snapshot, &fl_report);
+}
+
+static int init_hfield_map(dkimfl_parm *parm)
+/*
+* fold configured field names into the dispatch map, 0 on success.
+* Wildcards and the special key choice tokens are not names.
+*/
+{
+	char const **const list[3] =
+		{parm->z.sign_hfields, parm->z.skip_hfields, parm->z.key_choice_header};
+	unsigned const flag[3] = {HF_SIGN, HF_SKIP, HF_KEY_CHOICE};
+	size_t extra = 1;
+	for (int i = 0; i < 3; ++i)
+		for (char const **h = list[i]; h && *h; ++h)
+			++extra;
+
+	if ((parm->hfm = hfield_map_new(extra)) == NULL)
+		return 1;
+
+	int rtc = 0;
+	for (int i = 0; i < 3; ++i)
+		for (char const **h = list[i]; h && *h; ++h)
+			if (strchr(*h, '*') == NULL && strcmp(*h, "-") != 0)
+				rtc |= hfield_map_add(parm->hfm, *h, flag[i]);
+
+	if (parm->z.action_header && *parm->z.action_header)
+		rtc |= hfield_map_add(parm->hfm, parm->z.action_header, HF_ACTION);
+
+	return rtc != 0;
 }
 
 static int init_dkim(dkimfl_parm *parm)
@@ -4614,7 +5388,7 @@ static int init_dkim(dkimfl_parm *parm)
 		return 1;
 	}
 
-	int nok = 0;
+	int nok = init_hfield_map(parm);
 	if (!parm->z.no_signlen || !parm->z.report_all_sigs)
 	{
 		unsigned int options = 0;
@@ -4635,6 +5409,57 @@ static int init_dkim(dkimfl_parm *parm)
 		nok |= dkim_options(parm->dklib, DKIM_OP_SETOPT, DKIM_OPTS_TIMEOUT,
 			&parm->z.dns_timeout, sizeof parm->z.dns_timeout) != DKIM_STAT_OK;
 	}
+
+	if (dns_health_init(parm->z.dns_timeout, parm->z.dns_adaptive_timeout,
+		parm->z.dns_breaker_failures, parm->z.dns_breaker_cooldown,
+		&fl_report))
+			fl_report(LOG_ERR, "cannot map DNS health table: %s",
+				strerror(errno));
+#if HAVE_DKIM_DNS_SET_QUERY_START
+	else if (parm->z.dns_adaptive_timeout || parm->z.dns_breaker_failures > 0)
+		nok |= set_dns_callbacks(parm->dklib);
+#endif
+
+	set_dmarc_prefetch(parm->z.dns_prefetch);
+
+	if (key_cache_init(parm->z.key_cache_ttl, &fl_report))
+		fl_report(LOG_ERR, "cannot map key cache: %s", strerror(errno));
+	else if (parm->z.key_cache_ttl > 0)
+		nok |= dkim_set_key_lookup(parm->dklib, &my_key_lookup) !=
+			DKIM_STAT_OK;
+
+#if !defined HAVE_HOGWEED
+	if (parm->z.verify_native)
+	{
+		fl_report(LOG_WARNING,
+			"verify_native needs nettle's hogweed, not available at build time");
+		parm->z.verify_native = 0;
+	}
+#endif
+
+#if !HAVE_DKIM_SIG_GETHASHES
+	if (parm->z.verify_cache_ttl > 0)
+	{
+		fl_report(LOG_WARNING,
+			"verify_cache_ttl needs dkim_sig_gethashes, not in this OpenDKIM");
+		parm->z.verify_cache_ttl = 0;
+	}
+#endif
+	if (sig_cache_init(parm->z.verify_cache_ttl, &fl_report))
+	{
+		fl_report(LOG_ERR, "cannot map verify cache: %s", strerror(errno));
+		parm->z.verify_cache_ttl = 0;
+	}
+
+	if (rate_limit_init(parm->z.rate_limit_interval,
+		parm->z.rate_limit_messages, parm->z.rate_limit_rcpts, &fl_report))
+	{
+		fl_report(LOG_ERR, "cannot map rate limit table: %s", strerror(errno));
+		parm->z.rate_limit_interval = 0;
+	}
+
+	if (parm->z.stats_store)
+		store_init(&fl_report); // else each child reloads the dictionary
 	
 	if (parm->z.tmp)
 	{
@@ -4720,6 +5545,7 @@ static void reload_config(fl_parm *fl)
 	else
 	{
 		dkimfl_parm *old_parm = *parm;
+		dbw_stop(0); // the next one starts on next fork
 		if (old_parm->dklib)
 			dkim_close(old_parm->dklib);
 		some_cleanup(old_parm);
@@ -4729,12 +5555,36 @@ static void reload_config(fl_parm *fl)
 	}
 }
 
+static void report_dns_health(fl_parm *fl)
+/*
+* on sigusr1, log zone health, key cache usage, rate limit counts, stats
+* spool backlog, stats store size, domain flags snapshot age, and database
+* statement counters.
+* The stats writer logs its reference cache usage.
+*/
+{
+	dns_health_report();
+	key_cache_report();
+	sig_cache_report();
+	rate_limit_report();
+	dkimfl_parm *parm = get_parm(fl);
+	if (parm)
+	{
+		spool_report(parm->z.stats_spool, &fl_report);
+		store_report(parm->z.stats_store, &fl_report);
+		snapshot_report(parm->z.domain_flags_snapshot, &fl_report);
+		if (parm->dwa)
+			db_stmt_stats_report(parm->dwa);
+	}
+	dbw_report();
+}
+
 static fl_init_parm functions =
 {
 	dkimfilter,
 	write_pid_file_and_check_split_and_init_pst,
 	check_blocked_user_list,
-	reload_config, NULL, NULL,
+	reload_config, report_dns_health, NULL,
 	report_config, set_keyfile, set_policyfile, set_vbrfile
 };
 
@@ -4820,6 +5670,7 @@ int main(int argc, char *argv[])
 			rtc =
 				fl_main(&functions, &parm,
 					argc, argv, parm->z.all_mode, parm->z.verbose);
+			dbw_stop(1);
 			if (parm)
 				delete_pid_file(parm);
 		}